@@ -0,0 +1,1810 @@
+/*
+** pwol-bench.c - Benchmarks for pwol on synthetic host inventories
+**
+** Copyright (c) 2017-2021 Peter Eriksson <pen@lysator.liu.se>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice,
+**   this list of conditions and the following disclaimer in the documentation
+**   and/or other materials provided with the distribution.
+**
+** * Neither the name of the copyright holder nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * The benchmarks call the pwol internals directly, so pwol.c is
+ * included as is with its main() renamed.
+ */
+#define main pwol_main
+#include "pwol.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+#define DEFAULT_BENCH_SIZES     "1000,100000,1000000"
+#define DEFAULT_BENCH_TIMEOUT   120
+#define DEFAULT_BENCH_LOOKUPS   10000
+#define DEFAULT_BENCH_GATEWAYS  16
+#define DEFAULT_BENCH_GROUPS    64
+
+#define MAX_BENCH_SIZES         16
+#define BENCH_SELECTS           1000
+
+#define DEFAULT_MICRO_INPUTS    1000000
+#define DEFAULT_MICRO_ROUNDS    100
+
+/* Timed inputs, few enough to stay in the cache so the functions are measured and not memory */
+#define MICRO_TIMED_INPUTS      10000
+
+#define DEFAULT_ENGINE_REQUESTS 1000000
+#define DEFAULT_ENGINE_RATE     100000
+
+#define ENGINE_COPIES           "3"
+#define ENGINE_DELAY            "10ms"
+#define ENGINE_BATCH            256     /* Requests injected per step */
+#define ENGINE_ADDRESS          "127.0.0.1"
+#define ENGINE_PORT             "10007"
+
+
+typedef struct inventory {
+  unsigned long hosts;
+  unsigned long gateways;
+  unsigned long groups;
+  unsigned long ethers;
+} INVENTORY;
+
+
+/* Result of one benchmark stage, passed from the child to the parent */
+typedef struct result {
+  int stage;
+  unsigned long ops;
+  double seconds;
+  long rss_kb;
+  unsigned long bytes;
+} RESULT;
+
+enum {
+  STAGE_PARSE = 0,
+  STAGE_HOST_LOOKUP,
+  STAGE_GROUP_LOOKUP,
+  STAGE_GW_LOOKUP,
+  STAGE_MAC_LOOKUP,
+  STAGE_GROUP_EXPAND,
+  STAGE_GROUP_ITERATE,
+  STAGE_GROUP_SELECT,
+  STAGE_HOST_MATCH,
+  STAGE_EXPORT,
+  STAGE_PLAN_BUILD,
+  STAGES
+};
+
+#define MICRO_FUNCS 7
+
+const char *micro_names[MICRO_FUNCS] = {
+  "str2secret",
+  "str2timespec",
+  "str2mac",
+  "secret2str",
+  "timespec2str",
+  "sockaddr2str",
+  "host_add_mac",
+};
+
+enum {
+  ENGINE_SEND_GROUP = 0,
+  ENGINE_BULK_RELAY,
+  ENGINE_DAEMON,
+  ENGINE_STAGES
+};
+
+const char *engine_names[ENGINE_STAGES] = {
+  "send_group",
+  "bulk_relay",
+  "daemon",
+};
+
+const char *stage_names[STAGES] = {
+  "parse_config",
+  "host_lookup",
+  "group_lookup",
+  "gw_lookup",
+  "mac_lookup",
+  "group_expand",
+  "group_iterate",
+  "group_select",
+  "host_match",
+  "export_all",
+  "plan_build",
+};
+
+
+void
+bench_mac(unsigned long i,
+	  struct ether_addr *ep) {
+  unsigned char *bp = (unsigned char *) ep;
+
+  /* Locally administered unicast addresses */
+  bp[0] = 0x02;
+  bp[1] = 0x00;
+  bp[2] = (i >> 24) & 0xFF;
+  bp[3] = (i >> 16) & 0xFF;
+  bp[4] = (i >> 8) & 0xFF;
+  bp[5] = i & 0xFF;
+}
+
+char *
+bench_mac2str(unsigned long i,
+	      char *buf,
+	      size_t size) {
+  struct ether_addr mac;
+  unsigned char *bp = (unsigned char *) &mac;
+
+
+  bench_mac(i, &mac);
+  snprintf(buf, size, "%02x:%02x:%02x:%02x:%02x:%02x",
+	   bp[0], bp[1], bp[2], bp[3], bp[4], bp[5]);
+  return buf;
+}
+
+
+/*
+ * Write a pwol.conf with gateways, hosts spread over the gateways and
+ * groups, and (optionally) hosts whose MAC comes from an ethers file
+ */
+int
+bench_generate(FILE *fp,
+	       FILE *efp,
+	       const INVENTORY *ip) {
+  char mbuf[32];
+  unsigned long i, j;
+
+
+  fprintf(fp, "; pwol.conf - synthetic inventory: %lu hosts, %lu gateways, %lu groups, %lu ethers\n\n",
+	  ip->hosts, ip->gateways, ip->groups, ip->ethers);
+
+  fprintf(fp, "copies 1\ndelay 0.0s\nport 7\n\n");
+
+  for (i = 0; i < ip->gateways; i++)
+    fprintf(fp, "gateway gw-%lu address 10.%lu.%lu.255\n", i, (i >> 8) & 0xFF, i & 0xFF);
+  fputc('\n', fp);
+
+  for (i = 0; i < ip->hosts; i++) {
+    if (i < ip->ethers) {
+      /* MAC looked up via the host name */
+      fprintf(fp, "host host-%lu", i);
+      if (efp)
+	fprintf(efp, "%s host-%lu\n", bench_mac2str(i, mbuf, sizeof(mbuf)), i);
+    } else
+      fprintf(fp, "host host-%lu mac %s", i, bench_mac2str(i, mbuf, sizeof(mbuf)));
+
+    if (ip->gateways)
+      fprintf(fp, " via gw-%lu", i % ip->gateways);
+    if (i % 10 == 0)
+      fprintf(fp, " secret %lu.%lu.%lu.%lu", (i >> 24) & 0xFF, (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+    fputc('\n', fp);
+  }
+
+  for (j = 0; j < ip->groups; j++) {
+    fprintf(fp, "\n[group-%lu]\n", j);
+    for (i = j; i < ip->hosts; i += ip->groups)
+      fprintf(fp, "host host-%lu\n", i);
+  }
+
+  if (fflush(fp) != 0 || ferror(fp))
+    return -1;
+  if (efp && (fflush(efp) != 0 || ferror(efp)))
+    return -1;
+
+  return 0;
+}
+
+
+double
+bench_now(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+long
+bench_rss(void) {
+  struct rusage ru;
+
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return -1;
+
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+/* Bytes is the memory the stage keeps, if known */
+void
+bench_report_bytes(int fd,
+		   int stage,
+		   unsigned long ops,
+		   double start,
+		   unsigned long bytes) {
+  RESULT r;
+
+
+  memset(&r, 0, sizeof(r));
+  r.stage = stage;
+  r.ops = ops;
+  r.seconds = bench_now() - start;
+  r.rss_kb = bench_rss();
+  r.bytes = bytes;
+
+  if (write(fd, &r, sizeof(r)) != sizeof(r))
+    _exit(1);
+}
+
+void
+bench_report(int fd,
+	     int stage,
+	     unsigned long ops,
+	     double start) {
+  bench_report_bytes(fd, stage, ops, start, 0);
+}
+
+
+/* Random names to look up, prepared before the clock starts */
+char **
+bench_names(const char *prefix,
+	    unsigned long n,
+	    unsigned long count) {
+  char **namev, buf[64];
+  unsigned long i;
+
+
+  namev = calloc(count, sizeof(char *));
+  if (!namev)
+    return NULL;
+
+  for (i = 0; i < count; i++) {
+    snprintf(buf, sizeof(buf), "%s%lu", prefix, n ? (unsigned long) random() % n : 0);
+    namev[i] = strdup(buf);
+    if (!namev[i])
+      return NULL;
+  }
+
+  return namev;
+}
+
+
+/* What pwol sets up before reading the configuration */
+void
+bench_defaults(void) {
+  default_gw = gw_create("default");
+  if (!default_gw) {
+    fprintf(stderr, "%s: Internal error #1458935\n", argv0);
+    _exit(1);
+  }
+  gw_add_address(default_gw, DEFAULT_ADDRESS);
+  gw_add_port(default_gw, DEFAULT_PORT);
+  gw_add_copies(default_gw, DEFAULT_COPIES);
+  gw_add_delay(default_gw, DEFAULT_DELAY);
+  gw_add_secret(default_gw, DEFAULT_SECRET);
+
+  all_group = group_create("all");
+}
+
+
+/* Run all stages on one configuration file, in a child process */
+void
+bench_child(int fd,
+	    const char *path,
+	    const INVENTORY *ip,
+	    unsigned long lookups) {
+  char **namev;
+  struct ether_addr *macv;
+  MACINDEX *mip;
+  HOSTGROUP *hgp;
+  SENDPLAN plan;
+  HOST *hp;
+  volatile unsigned long sink = 0;
+  const char *bad;
+  char buf[64];
+  unsigned long i, n;
+  double t;
+  int nfd, ofd, j;
+
+
+  bench_defaults();
+  srandom(4711);
+
+  t = bench_now();
+  parse_config(path);
+  if (group_resolve(&bad) < 0)
+    _exit(1);
+  bench_report_bytes(fd, STAGE_PARSE, ip->hosts, t, host_table_size());
+
+  namev = bench_names("host-", ip->hosts, lookups);
+  if (!namev)
+    _exit(1);
+  t = bench_now();
+  for (i = 0; i < lookups; i++)
+    if (ip->hosts && !host_lookup(namev[i]))
+      _exit(1);
+  bench_report(fd, STAGE_HOST_LOOKUP, ip->hosts ? lookups : 0, t);
+
+  namev = bench_names("group-", ip->groups, lookups);
+  if (!namev)
+    _exit(1);
+  t = bench_now();
+  for (i = 0; i < lookups; i++)
+    if (ip->groups && !group_lookup(namev[i]))
+      _exit(1);
+  bench_report(fd, STAGE_GROUP_LOOKUP, ip->groups ? lookups : 0, t);
+
+  namev = bench_names("gw-", ip->gateways, lookups);
+  if (!namev)
+    _exit(1);
+  t = bench_now();
+  for (i = 0; i < lookups; i++)
+    if (ip->gateways && !gw_lookup(namev[i]))
+      _exit(1);
+  bench_report(fd, STAGE_GW_LOOKUP, ip->gateways ? lookups : 0, t);
+
+  /* The daemon's MAC index, including the time to build it */
+  macv = calloc(lookups, sizeof(*macv));
+  if (!macv)
+    _exit(1);
+  for (i = 0; i < lookups; i++)
+    bench_mac(ip->hosts > ip->ethers ? ip->ethers + random() % (ip->hosts - ip->ethers) : 0, &macv[i]);
+  t = bench_now();
+  mip = mac_index_build(hosts);
+  if (!mip)
+    _exit(1);
+  for (i = 0; i < lookups; i++)
+    if (ip->hosts > ip->ethers && !mac_index_lookup(mip, &macv[i]))
+      _exit(1);
+  bench_report(fd, STAGE_MAC_LOOKUP, ip->hosts > ip->ethers ? lookups : 0, t);
+
+  /* What sending a group does, minus the sending */
+  n = 0;
+  t = bench_now();
+  for (hgp = hostgroups; hgp; hgp = hgp->next) {
+    if (hgp == all_group)
+      continue;
+    for (j = 0; j < hgp->hc; j++) {
+      if (plan_build(hgp->hv[j], NULL, &plan) == 0)
+	++n;
+    }
+  }
+  bench_report(fd, STAGE_GROUP_EXPAND, n, t);
+
+  /* What the daemon reads of each member when it expands a group */
+  n = 0;
+  t = bench_now();
+  for (hgp = hostgroups; hgp; hgp = hgp->next) {
+    for (j = 0; j < hgp->hc; j++) {
+      hp = hgp->hv[j];
+      sink += hp->mac.ether_addr_octet[5] + host_secret(hp)->size + HOST_OPTS(hp)->copies;
+      ++n;
+    }
+  }
+  bench_report(fd, STAGE_GROUP_ITERATE, n, t);
+
+  /* Set expressions over two groups, or all hosts and a group */
+  n = ip->groups ? (lookups < BENCH_SELECTS ? lookups : BENCH_SELECTS) : 0;
+  for (i = 0; i < n; i++) {
+    j = random() % ip->groups;
+    switch (i % 3) {
+    case 0:
+      snprintf(buf, sizeof(buf), "group-%d+group-%lu", j, (unsigned long) random() % ip->groups);
+      break;
+    case 1:
+      snprintf(buf, sizeof(buf), "all-group-%d", j);
+      break;
+    default:
+      snprintf(buf, sizeof(buf), "all&group-%d", j);
+    }
+    namev[i] = strdup(buf);
+    if (!namev[i])
+      _exit(1);
+  }
+  t = bench_now();
+  for (i = 0; i < n; i++) {
+    hgp = group_select(namev[i]);
+    if (!hgp)
+      _exit(1);
+    sink += hgp->hc;
+    group_release(hgp);
+  }
+  bench_report(fd, STAGE_GROUP_SELECT, n, t);
+
+  /* Name globs and MAC prefixes of a few hundred to a thousand hosts each */
+  n = ip->hosts > 1000 ? (lookups < BENCH_SELECTS ? lookups : BENCH_SELECTS) : 0;
+  for (i = 0; i < n; i++) {
+    if (i % 2)
+      snprintf(buf, sizeof(buf), "host-%lu*", 100 + (unsigned long) random() % 900);
+    else {
+      bench_mac2str(ip->ethers + random() % (ip->hosts - ip->ethers), buf, sizeof(buf));
+      strcpy(buf+15, "*");
+    }
+    namev[i] = strdup(buf);
+    if (!namev[i])
+      _exit(1);
+  }
+  if (host_sort() < 0)
+    _exit(1);
+  t = bench_now();
+  for (i = 0; i < n; i++) {
+    hgp = group_select(namev[i]);
+    if (!hgp)
+      _exit(1);
+    sink += hgp->hc;
+    group_release(hgp);
+  }
+  bench_report(fd, STAGE_HOST_MATCH, n, t);
+
+  nfd = open("/dev/null", O_WRONLY);
+  ofd = dup(1);
+  if (nfd < 0 || ofd < 0)
+    _exit(1);
+  fflush(stdout);
+  dup2(nfd, 1);
+  t = bench_now();
+  export_all();
+  fflush(stdout);
+  bench_report(fd, STAGE_EXPORT, ip->hosts, t);
+  dup2(ofd, 1);
+
+  n = 0;
+  t = bench_now();
+  for (hp = hosts; hp; hp = hp->next)
+    if (plan_build(hp, NULL, &plan) == 0)
+      ++n;
+  bench_report(fd, STAGE_PLAN_BUILD, n, t);
+
+  _exit(0);
+}
+
+
+typedef struct run {
+  unsigned long hosts;
+  RESULT rv[STAGES];
+  int status[STAGES];
+} RUN;
+
+#define STATUS_SKIPPED 0
+#define STATUS_OK      1
+#define STATUS_TIMEOUT 2
+#define STATUS_FAILED  3
+
+const char *status_names[] = { "skipped", "ok", "timeout", "failed" };
+
+
+int
+bench_run(RUN *rp,
+	  const INVENTORY *ip,
+	  unsigned long lookups,
+	  int timeout) {
+  char path[] = "/tmp/pwol-bench-XXXXXX";
+  RESULT r;
+  FILE *fp;
+  pid_t pid;
+  int pfd[2], fd, status, i;
+
+
+  fd = mkstemp(path);
+  if (fd < 0)
+    return -1;
+
+  fp = fdopen(fd, "w");
+  if (!fp || bench_generate(fp, NULL, ip) < 0 || fclose(fp) != 0) {
+    (void) unlink(path);
+    return -1;
+  }
+
+  if (pipe(pfd) < 0) {
+    (void) unlink(path);
+    return -1;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if (pid < 0) {
+    (void) unlink(path);
+    return -1;
+  }
+
+  if (pid == 0) {
+    close(pfd[0]);
+    alarm(timeout);
+    bench_child(pfd[1], path, ip, lookups);
+  }
+
+  close(pfd[1]);
+  memset(rp, 0, sizeof(*rp));
+  rp->hosts = ip->hosts;
+
+  while (read(pfd[0], &r, sizeof(r)) == sizeof(r)) {
+    if (r.stage < 0 || r.stage >= STAGES)
+      continue;
+
+    rp->rv[r.stage] = r;
+    rp->status[r.stage] = STATUS_OK;
+
+    if (f_verbose)
+      fprintf(stderr, "[%lu hosts: %s: %.3fs]\n", ip->hosts, stage_names[r.stage], r.seconds);
+  }
+  close(pfd[0]);
+
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  (void) unlink(path);
+
+  /* The first stage without a result is the one that did not finish */
+  for (i = 0; i < STAGES && rp->status[i] == STATUS_OK; i++)
+    ;
+  if (i < STAGES)
+    rp->status[i] = (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) ? STATUS_TIMEOUT : STATUS_FAILED;
+
+  return 0;
+}
+
+
+void
+bench_print(RUN *runv,
+	    int runc) {
+  RESULT *r;
+  int i, j;
+
+
+  printf("%-10s  %-14s  %10s  %10s  %12s  %12s  %10s  %s\n",
+	 "Hosts", "Stage", "Ops", "Seconds", "ns/op", "Ops/s", "MaxRSS", "Bytes/op");
+  for (i = 0; i < runc; i++) {
+    for (j = 0; j < STAGES; j++) {
+      r = &runv[i].rv[j];
+      if (runv[i].status[j] != STATUS_OK) {
+	printf("%-10lu  %-14s  %s\n", runv[i].hosts, stage_names[j], status_names[runv[i].status[j]]);
+	continue;
+      }
+      printf("%-10lu  %-14s  %10lu  %10.3f  %12.1f  %12.0f  %9ldk",
+	     runv[i].hosts, stage_names[j], r->ops, r->seconds,
+	     r->ops ? r->seconds * 1e9 / r->ops : 0.0,
+	     r->seconds > 0 ? r->ops / r->seconds : 0.0,
+	     r->rss_kb);
+      if (r->bytes && r->ops)
+	printf("  %.1f", (double) r->bytes / r->ops);
+      putchar('\n');
+    }
+  }
+}
+
+int
+bench_save(const char *path,
+	   const char *label,
+	   RUN *runv,
+	   int runc) {
+  const char *ext;
+  RESULT *r;
+  FILE *fp;
+  int i, j, csv, first;
+
+
+  fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (!fp)
+    return -1;
+
+  ext = strrchr(path, '.');
+  csv = (ext && strcmp(ext, ".csv") == 0);
+
+  if (csv)
+    fprintf(fp, "label,version,hosts,stage,status,ops,seconds,ns_per_op,ops_per_sec,rss_kb,bytes\n");
+  else
+    fprintf(fp, "{\n  \"label\": \"%s\",\n  \"version\": \"%s\",\n  \"time\": %ld,\n  \"results\": [",
+	    label, PACKAGE_VERSION, (long) time(NULL));
+
+  first = 1;
+  for (i = 0; i < runc; i++) {
+    for (j = 0; j < STAGES; j++) {
+      r = &runv[i].rv[j];
+      if (csv)
+	fprintf(fp, "%s,%s,%lu,%s,%s,%lu,%.6f,%.1f,%.0f,%ld,%lu\n",
+		label, PACKAGE_VERSION, runv[i].hosts, stage_names[j], status_names[runv[i].status[j]],
+		r->ops, r->seconds,
+		r->ops ? r->seconds * 1e9 / r->ops : 0.0,
+		r->seconds > 0 ? r->ops / r->seconds : 0.0,
+		r->rss_kb, r->bytes);
+      else {
+	fprintf(fp, "%s\n    {\"hosts\": %lu, \"stage\": \"%s\", \"status\": \"%s\", \"ops\": %lu, "
+		"\"seconds\": %.6f, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, \"rss_kb\": %ld, \"bytes\": %lu}",
+		first ? "" : ",", runv[i].hosts, stage_names[j], status_names[runv[i].status[j]],
+		r->ops, r->seconds,
+		r->ops ? r->seconds * 1e9 / r->ops : 0.0,
+		r->seconds > 0 ? r->ops / r->seconds : 0.0,
+		r->rss_kb, r->bytes);
+	first = 0;
+      }
+    }
+  }
+
+  if (!csv)
+    fprintf(fp, "\n  ]\n}\n");
+
+  if (fp == stdout)
+    return fflush(fp);
+
+  return fclose(fp);
+}
+
+/*
+ * Micro-benchmarks of the parsing and formatting primitives. The ref_*
+ * functions are the earlier sscanf/strtok_r/float based versions, kept
+ * to check that the current ones give the same results.
+ */
+
+int
+ref_str2secret(const char *secret,
+	       SECRET *sp) {
+  unsigned int v1, v2, v3, v4, val, i;
+  char *ptr, *cp, *tbuf, *dup;
+
+
+  if (sscanf(secret, "%u.%u.%u.%u", &v1, &v2, &v3, &v4) == 4) {
+    sp->buf[0] = v1;
+    sp->buf[1] = v2;
+    sp->buf[2] = v3;
+    sp->buf[3] = v4;
+    sp->size  = 4;
+    return sp->size;
+  }
+
+  dup = ptr = strdup(secret);
+  if (!ptr)
+    return -1;
+
+  tbuf = ptr;
+  for (i = 0; i < SECRET_MAX_SIZE && (cp = strtok_r(tbuf, ":-", &ptr)) != NULL; i++) {
+    tbuf = NULL;
+
+    if (strlen(cp) > 2 || sscanf(cp, "%x", &val) != 1) {
+      i = 0;
+      break;
+    }
+    sp->buf[i] = val;
+  }
+  free(dup);
+
+  if (i > 1) {
+    sp->size = i;
+    return sp->size;
+  }
+
+  i = strlen(secret);
+  if (i > SECRET_MAX_SIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (i > 0)
+    memcpy(sp->buf, secret, i);
+
+  sp->size = i;
+  return sp->size;
+}
+
+int
+ref_str2timespec(const char *time,
+		 struct timespec *tsp) {
+  float ft;
+  char buf[3];
+
+
+  memset(buf, 0, 3);
+  if (sscanf(time, "%f%c%c", &ft, buf+0, buf+1) < 1)
+    return -1;
+  
+  if (strcmp(buf, "s") == 0 || !*buf) {
+    tsp->tv_sec  = ft;
+    tsp->tv_nsec = (ft-tsp->tv_sec)*1000000000.0;
+  } else if (strcmp(buf, "m") == 0) {
+    tsp->tv_sec  = ft*60;
+    tsp->tv_nsec = (ft-tsp->tv_sec*60)/6.0*100000000.0;;
+  } else if (strcmp(buf, "h") == 0) {
+    tsp->tv_sec  = ft*60*60;
+    tsp->tv_nsec = 0;
+  } else if (strcmp(buf, "d") == 0) {
+    tsp->tv_sec  = ft*60*60*24;
+    tsp->tv_nsec = 0;
+  } else if (strcmp(buf, "ms") == 0) {
+    tsp->tv_sec  = ft/1000.0;
+    tsp->tv_nsec = ft*1000000.0;
+  } else if (strcmp(buf, "us") == 0 || strcmp(buf, "µs") == 0) {
+    tsp->tv_sec  = ft/1000000.0;
+    tsp->tv_nsec = ft*1000.0;
+  } else if (strcmp(buf, "ns") == 0) {
+    tsp->tv_sec  = ft/1000000000.0;
+    tsp->tv_nsec = ft;
+  } else 
+    return -1;
+
+  return tsp->tv_sec;
+}
+
+int
+ref_str2mac(const char *str,
+	    struct ether_addr *ep) {
+  struct ether_addr *rp;
+
+
+  rp = ether_aton(str);
+  if (!rp)
+    return -1;
+
+  *ep = *rp;
+  return 0;
+}
+
+/* Searched the ethers file first, for addresses too */
+int
+ref_host_add_mac(HOST *hp,
+		 const char *mac) {
+  struct ether_addr *ep;
+
+
+#if HAVE_ETHER_HOSTTON
+  if (ether_hostton(mac, &hp->mac) == 0)
+    return 0;
+#endif
+
+  ep = ether_aton(mac);
+  if (ep) {
+    hp->mac = *ep;
+    return 0;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+char *
+ref_secret2str(const SECRET *sp,
+	       char *buf,
+	       size_t size) {
+  size_t i, len;
+
+
+  if (!sp || sp->size == 0 || sp->size > SECRET_MAX_SIZE)
+    return NULL;
+
+  if (sp->size == 4)
+    len = snprintf(buf, size, "%u.%u.%u.%u", sp->buf[0], sp->buf[1], sp->buf[2], sp->buf[3]);
+  else {
+    len = 0;
+    for (i = 0; i < sp->size && len < size; i++)
+      len += snprintf(buf+len, size-len, i+1 < sp->size ? "%02x:" : "%02x", sp->buf[i]);
+  }
+
+  for (i = 0; i < sp->size && isprint(sp->buf[i]); i++)
+    ;
+
+  if (i >= sp->size && len < size)
+    snprintf(buf+len, size-len, " (%.*s)", (int) sp->size, (const char *) sp->buf);
+
+  return buf;
+}
+
+char *
+ref_timespec2str(const struct timespec *tsp,
+		 char *buf,
+		 size_t size) {
+  unsigned int h, m, s, ms, us, ns;
+  float fs, fms, fus;
+
+
+  h = tsp->tv_sec / 3600;
+  m = (tsp->tv_sec - h*3600) / 60;
+  s = tsp->tv_sec - h*3600 - m*60;
+
+  ms = tsp->tv_nsec / 1000000;
+  us = (tsp->tv_nsec - ms * 1000000) / 1000;
+  ns = tsp->tv_nsec - ms * 1000000 - us * 1000;
+
+  fs  = (float) s +  (float) ms / 1000.0;
+  fms = (float) ms + (float) us / 1000.0;
+  fus = (float) us + (float) ns / 1000.0;
+
+  if (h)
+    snprintf(buf, size, "%02u:%02u:%02u", h, m, s);
+  else if (m)
+    snprintf(buf, size, "%um+%gs", m, fs);
+  else if (s)
+    snprintf(buf, size, "%gs", fs);
+  else if (ms)
+    snprintf(buf, size, "%gms", fms);
+  else if (us)
+    snprintf(buf, size, "%gµs", fus);
+  else
+    snprintf(buf, size, "%uns", ns);
+
+  return buf;
+}
+
+char *
+ref_sockaddr2str(const struct sockaddr *sp,
+		 size_t len,
+		 char *buf,
+		 size_t size) {
+  char addr[ADDR_STR_SIZE];
+  char port[32];
+
+
+  if (getnameinfo(sp, len, addr, sizeof(addr), port, sizeof(port), NI_DGRAM|NI_NUMERICHOST|NI_NUMERICSERV) != 0)
+    return NULL;
+
+  if (sp->sa_family == AF_INET6)
+    snprintf(buf, size, "[%s]:%s", addr, port);
+  else
+    snprintf(buf, size, "%s:%s", addr, port);
+
+  return buf;
+}
+
+
+/* Test inputs, including the odd ones sscanf() and ether_aton() take in their own way */
+typedef struct corpus {
+  size_t n;
+  char **secretv;
+  char **macv;
+  char **timev;
+  SECRET *sv;
+  struct timespec *tv;
+  struct sockaddr_storage *av;
+} CORPUS;
+
+const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+char *
+micro_secret(char *buf) {
+  static const char *odd_ipv4[] = { "%ld.%ld.%ld.%ldx", " %ld.%ld.%ld.%ld", "+%ld.%ld.%ld.%ld",
+				     "-%ld.%ld.%ld.%ld", "%ld. %ld.%ld.%ld", "%ld.%ld.%ld.%ld.5",
+				     "%ld.%ld.%ld.%ld:ff", "%ld.%ld.%ld" };
+  static const char *odd_hex[] = { " f", "+f", "-f", "0x", "fg", "f ", "x", "g", "-" };
+  int i, n, len = 0;
+
+
+  switch (random() % 20) {
+  case 0: case 1: case 2: case 3:
+    sprintf(buf, "%ld.%ld.%ld.%ld", random() % 256, random() % 256, random() % 256, random() % 256);
+    break;
+
+  case 4:
+    /* Out of range numbers, or not quite an address */
+    sprintf(buf, odd_ipv4[random() % (sizeof(odd_ipv4)/sizeof(odd_ipv4[0]))],
+	    random() % 100000, random() % 256, random() % 1000, random() % 256);
+    break;
+
+  case 5:
+    /* Hexadecimal bytes with one sscanf("%x") may or may not take */
+    n = 2 + random() % (SECRET_MAX_SIZE-1);
+    for (i = 0; i < n; i++)
+      len += sprintf(buf+len, i == 0 ? "%s%02x" : ":%s%02x", "", (unsigned int) (random() % 256));
+    n = random() % n;
+    memcpy(buf + 3*n, odd_hex[random() % (sizeof(odd_hex)/sizeof(odd_hex[0]))], 2);
+    if (!buf[3*n+1])
+      buf[3*n+1] = '0';
+    break;
+
+  case 6: case 7: case 8: case 9: case 10: case 11:
+    n = 2 + random() % (SECRET_MAX_SIZE-1);
+    for (i = 0; i < n; i++)
+      len += sprintf(buf+len, random() % 2 ? "%s%x" : "%s%02X", i == 0 ? "" : random() % 3 ? ":" : "-",
+		     (unsigned int) (random() % 256));
+    break;
+
+  case 19:
+    /* Too long */
+    n = SECRET_MAX_SIZE + 1 + random() % 16;
+    for (i = 0; i < n; i++)
+      buf[i] = alnum[random() % (sizeof(alnum)-1)];
+    buf[n] = '\0';
+    break;
+
+  default:
+    n = 1 + random() % SECRET_MAX_SIZE;
+    for (i = 0; i < n; i++)
+      buf[i] = alnum[random() % (sizeof(alnum)-1)];
+    buf[n] = '\0';
+  }
+
+  return strdup(buf);
+}
+
+char *
+micro_mac(char *buf) {
+  static const char *after[] = { "x", "5", " x", ":", "-1", "\t" };
+  int i, len = 0;
+
+
+  switch (random() % 10) {
+  case 0:
+    /* Host name */
+    sprintf(buf, "host-%ld", random() % 100000);
+    break;
+
+  case 1:
+    /* Too short */
+    for (i = 0; i < 5; i++)
+      len += sprintf(buf+len, "%s%02lx", i ? ":" : "", random() % 256);
+    break;
+
+  case 2:
+    for (i = 0; i < 6; i++)
+      len += sprintf(buf+len, "%s%02lx", i ? ":" : "", random() % 256);
+    buf[random() % len] = 'g';
+    break;
+
+  case 3:
+    /* Something after the address */
+    for (i = 0; i < 6; i++)
+      len += sprintf(buf+len, random() % 2 ? "%s%lx" : "%s%02lX", i ? ":" : "", random() % 256);
+    strcpy(buf+len, after[random() % (sizeof(after)/sizeof(after[0]))]);
+    break;
+
+  default:
+    for (i = 0; i < 6; i++)
+      len += sprintf(buf+len, random() % 2 ? "%s%lx" : "%s%02lX", i ? ":" : "", random() % 256);
+  }
+
+  return strdup(buf);
+}
+
+char *
+micro_time(char *buf) {
+  static const char *units[] = { "", "s", "m", "h", "d", "ms", "us", "µs", "ns" };
+  const char *unit = units[random() % (sizeof(units)/sizeof(units[0]))];
+  long max;
+
+
+  /* Up to 1000 hours or days, and well beyond a second of the small units */
+  max = (*unit == 'h' || *unit == 'd' ? 1000 :
+	 strcmp(unit, "m") == 0 || strlen(unit) < 2 ? 100000 : 10000000);
+
+  if (random() % 2)
+    sprintf(buf, "%ld%s", random() % max, unit);
+  else
+    sprintf(buf, "%ld.%0*ld%s", random() % max, 1 + (int) (random() % 3), random() % 10, unit);
+
+  return strdup(buf);
+}
+
+/* 
+ * Inputs where str2timespec is meant to differ from the baseline, which
+ * then is not the reference: it mangles the fraction of minutes, leaves
+ * tv_nsec at a second or more for ms and us of a second or more, drops
+ * the fraction of a second of fractional hours and days, and never
+ * matches "µs" as it only reads two bytes of unit. These get their exact
+ * value (as a double) instead.
+ */
+int
+micro_time_intended(const char *str,
+		    struct timespec *tsp) {
+  double v, ns;
+  char *unit;
+
+
+  v = strtod(str, &unit);
+  if (strcmp(unit, "m") == 0)
+    ns = v * 60e9;
+  else if (strcmp(unit, "h") == 0 && strchr(str, '.'))
+    ns = v * 3600e9;
+  else if (strcmp(unit, "d") == 0 && strchr(str, '.'))
+    ns = v * 86400e9;
+  else if (strcmp(unit, "ms") == 0 && v >= 1000)
+    ns = v * 1e6;
+  else if ((strcmp(unit, "us") == 0 && v >= 1000000) || strcmp(unit, "µs") == 0)
+    ns = v * 1e3;
+  else
+    return 0;
+
+  tsp->tv_sec = ns / 1e9;
+  tsp->tv_nsec = ns - tsp->tv_sec * 1e9;
+  return 1;
+}
+
+int
+micro_corpus(CORPUS *cp,
+	     size_t n) {
+  struct sockaddr_in *sin;
+  struct sockaddr_in6 *sin6;
+  char buf[256];
+  size_t i;
+  int j;
+
+
+  cp->n = n;
+  cp->secretv = calloc(n, sizeof(char *));
+  cp->macv = calloc(n, sizeof(char *));
+  cp->timev = calloc(n, sizeof(char *));
+  cp->sv = calloc(n, sizeof(SECRET));
+  cp->tv = calloc(n, sizeof(struct timespec));
+  cp->av = calloc(n, sizeof(struct sockaddr_storage));
+  if (!cp->secretv || !cp->macv || !cp->timev || !cp->sv || !cp->tv || !cp->av)
+    return -1;
+
+  srandom(4711);
+  for (i = 0; i < n; i++) {
+    cp->secretv[i] = micro_secret(buf);
+    cp->macv[i] = micro_mac(buf);
+    cp->timev[i] = micro_time(buf);
+    if (!cp->secretv[i] || !cp->macv[i] || !cp->timev[i])
+      return -1;
+
+    cp->sv[i].size = random() % 3 == 0 ? 4 : 1 + random() % SECRET_MAX_SIZE;
+    for (j = 0; j < cp->sv[i].size; j++)
+      cp->sv[i].buf[j] = random() % 2 ? alnum[random() % (sizeof(alnum)-1)] : random() % 256;
+
+    switch (random() % 4) {
+    case 0:
+      cp->tv[i].tv_sec = random() % 100000;
+      cp->tv[i].tv_nsec = 0;
+      break;
+    case 1:
+      cp->tv[i].tv_sec = random() % 3600;
+      cp->tv[i].tv_nsec = (random() % 1000) * 1000000;
+      break;
+    case 2:
+      cp->tv[i].tv_sec = 0;
+      cp->tv[i].tv_nsec = random() % (random() % 2 ? 1000000 : 1000000000);
+      break;
+    default:
+      cp->tv[i].tv_sec = random() % 60;
+      cp->tv[i].tv_nsec = random() % 1000000000;
+    }
+
+    if (random() % 2) {
+      sin = (struct sockaddr_in *) &cp->av[i];
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(random() % 65536);
+      sin->sin_addr.s_addr = random();
+    } else {
+      sin6 = (struct sockaddr_in6 *) &cp->av[i];
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(random() % 65536);
+      for (j = 0; j < 16; j++)
+	sin6->sin6_addr.s6_addr[j] = random() % 4 ? 0 : random() % 256;
+      if (random() % 8 == 0) {
+	/* IPv4 mapped */
+	memset(sin6->sin6_addr.s6_addr, 0, 10);
+	sin6->sin6_addr.s6_addr[10] = sin6->sin6_addr.s6_addr[11] = 0xFF;
+      }
+    }
+  }
+
+  return 0;
+}
+
+socklen_t
+micro_addrlen(const struct sockaddr_storage *ap) {
+  return ap->ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+
+/* Returns the number of inputs where the current and reference versions differ */
+unsigned long
+micro_check(const CORPUS *cp,
+	    int fn) {
+  char b1[ADDR_STR_SIZE+SECRET_STR_SIZE], b2[ADDR_STR_SIZE+SECRET_STR_SIZE];
+  struct ether_addr e1, e2;
+  struct timespec t1, t2;
+  SECRET s1, s2;
+  HOST h1, h2;
+  unsigned long bad = 0;
+  uint64_t n1, n2, tol;
+  const char *r1, *r2;
+  size_t i;
+  int rc1, rc2;
+
+
+  for (i = 0; i < cp->n; i++) {
+    switch (fn) {
+    case 0:
+      memset(&s1, 0, sizeof(s1));
+      memset(&s2, 0, sizeof(s2));
+      rc1 = str2secret(cp->secretv[i], &s1);
+      rc2 = ref_str2secret(cp->secretv[i], &s2);
+      if (rc1 != rc2 || (rc1 >= 0 && (s1.size != s2.size || memcmp(s1.buf, s2.buf, s1.size) != 0)))
+	goto Differ;
+      break;
+
+    case 1:
+      rc1 = str2timespec(cp->timev[i], &t1);
+      if (micro_time_intended(cp->timev[i], &t2))
+	rc2 = t2.tv_sec;
+      else
+	rc2 = ref_str2timespec(cp->timev[i], &t2);
+      if ((rc1 < 0) != (rc2 < 0))
+	goto Differ;
+      if (rc1 < 0)
+	break;
+
+      /* The reference parses into a float, so allow for its rounding */
+      n1 = timespec2ns(&t1);
+      n2 = timespec2ns(&t2);
+      tol = (n1 >> 22) + 2;
+      if ((n1 > n2 ? n1-n2 : n2-n1) > tol)
+	goto Differ;
+      break;
+
+    case 2:
+      rc1 = str2mac(cp->macv[i], &e1);
+      rc2 = ref_str2mac(cp->macv[i], &e2);
+      if (rc1 != rc2 || (rc1 == 0 && memcmp(&e1, &e2, MAC_SIZE) != 0))
+	goto Differ;
+      break;
+
+    case 3:
+      r1 = secret2str(&cp->sv[i], b1, sizeof(b1));
+      r2 = ref_secret2str(&cp->sv[i], b2, sizeof(b2));
+      if (!r1 != !r2 || (r1 && strcmp(r1, r2) != 0))
+	goto Differ;
+      break;
+
+    case 4:
+      r1 = timespec2str(&cp->tv[i], b1, sizeof(b1));
+      r2 = ref_timespec2str(&cp->tv[i], b2, sizeof(b2));
+      if (!r1 != !r2 || (r1 && strcmp(r1, r2) != 0))
+	goto Differ;
+      break;
+
+    case 5:
+      r1 = sockaddr2str((struct sockaddr *) &cp->av[i], micro_addrlen(&cp->av[i]), b1, sizeof(b1));
+      r2 = ref_sockaddr2str((struct sockaddr *) &cp->av[i], micro_addrlen(&cp->av[i]), b2, sizeof(b2));
+      if (!r1 != !r2 || (r1 && strcmp(r1, r2) != 0))
+	goto Differ;
+      break;
+
+    case 6:
+      /* Searching the ethers file is slow, so check fewer */
+      if (i >= MICRO_TIMED_INPUTS)
+	break;
+      memset(&h1, 0, sizeof(h1));
+      memset(&h2, 0, sizeof(h2));
+      rc1 = host_add_mac(&h1, cp->macv[i]);
+      rc2 = ref_host_add_mac(&h2, cp->macv[i]);
+      if (rc1 != rc2 || memcmp(&h1.mac, &h2.mac, MAC_SIZE) != 0)
+	goto Differ;
+      break;
+    }
+    continue;
+
+  Differ:
+    if (bad++ < 5 && f_verbose)
+      fprintf(stderr, "[%s: Differs for input #%lu]\n", micro_names[fn], (unsigned long) i);
+  }
+
+  return bad;
+}
+
+/* Time one function over the start of the corpus, returns ns per call */
+double
+micro_time_fn(const CORPUS *cp,
+	      int fn,
+	      int ref,
+	      int rounds) {
+  char buf[ADDR_STR_SIZE+SECRET_STR_SIZE];
+  struct ether_addr ea;
+  struct timespec ts;
+  SECRET sec;
+  HOST host;
+  volatile unsigned long sink = 0;
+  double t;
+  size_t i, n;
+  int r;
+
+
+  n = cp->n < MICRO_TIMED_INPUTS ? cp->n : MICRO_TIMED_INPUTS;
+  if (fn == 6 && rounds > 1)
+    rounds = 1;
+
+  t = bench_now();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < n; i++) {
+      switch (fn) {
+      case 0:
+	sink += ref ? ref_str2secret(cp->secretv[i], &sec) : str2secret(cp->secretv[i], &sec);
+	break;
+      case 1:
+	sink += ref ? ref_str2timespec(cp->timev[i], &ts) : str2timespec(cp->timev[i], &ts);
+	break;
+      case 2:
+	sink += ref ? ref_str2mac(cp->macv[i], &ea) : str2mac(cp->macv[i], &ea);
+	break;
+      case 3:
+	sink += (ref ? ref_secret2str(&cp->sv[i], buf, sizeof(buf)) : secret2str(&cp->sv[i], buf, sizeof(buf))) != NULL;
+	break;
+      case 4:
+	sink += (ref ? ref_timespec2str(&cp->tv[i], buf, sizeof(buf)) : timespec2str(&cp->tv[i], buf, sizeof(buf))) != NULL;
+	break;
+      case 5:
+	sink += (ref ?
+		 ref_sockaddr2str((struct sockaddr *) &cp->av[i], micro_addrlen(&cp->av[i]), buf, sizeof(buf)) :
+		 sockaddr2str((struct sockaddr *) &cp->av[i], micro_addrlen(&cp->av[i]), buf, sizeof(buf))) != NULL;
+	break;
+      case 6:
+	sink += ref ? ref_host_add_mac(&host, cp->macv[i]) : host_add_mac(&host, cp->macv[i]);
+	break;
+      }
+    }
+  }
+
+  return (bench_now() - t) * 1e9 / ((double) rounds * n);
+}
+
+int
+micro_run(size_t n,
+	  int rounds,
+	  const char *output,
+	  const char *label) {
+  CORPUS corpus;
+  double tv[MICRO_FUNCS][2];
+  unsigned long badv[MICRO_FUNCS], bad = 0;
+  const char *ext;
+  FILE *fp;
+  int i, csv;
+
+
+  if (micro_corpus(&corpus, n) < 0)
+    return -1;
+
+  printf("%-14s  %10s  %12s  %12s  %8s\n", "Function", "Differ", "Ref ns/op", "ns/op", "Speedup");
+  for (i = 0; i < MICRO_FUNCS; i++) {
+    badv[i] = micro_check(&corpus, i);
+    bad += badv[i];
+    tv[i][1] = micro_time_fn(&corpus, i, 1, rounds);
+    tv[i][0] = micro_time_fn(&corpus, i, 0, rounds);
+    printf("%-14s  %10lu  %12.1f  %12.1f  %7.1fx\n",
+	   micro_names[i], badv[i], tv[i][1], tv[i][0], tv[i][0] > 0 ? tv[i][1] / tv[i][0] : 0.0);
+  }
+
+  if (output) {
+    fp = strcmp(output, "-") == 0 ? stdout : fopen(output, "w");
+    if (!fp)
+      return -1;
+
+    ext = strrchr(output, '.');
+    csv = (ext && strcmp(ext, ".csv") == 0);
+
+    if (csv)
+      fprintf(fp, "label,version,function,inputs,differ,ref_ns_per_op,ns_per_op\n");
+    else
+      fprintf(fp, "{\n  \"label\": \"%s\",\n  \"version\": \"%s\",\n  \"time\": %ld,\n  \"micro\": [",
+	      label, PACKAGE_VERSION, (long) time(NULL));
+
+    for (i = 0; i < MICRO_FUNCS; i++) {
+      if (csv)
+	fprintf(fp, "%s,%s,%s,%lu,%lu,%.1f,%.1f\n", label, PACKAGE_VERSION, micro_names[i],
+		(unsigned long) n, badv[i], tv[i][1], tv[i][0]);
+      else
+	fprintf(fp, "%s\n    {\"function\": \"%s\", \"inputs\": %lu, \"differ\": %lu, "
+		"\"ref_ns_per_op\": %.1f, \"ns_per_op\": %.1f}",
+		i ? "," : "", micro_names[i], (unsigned long) n, badv[i], tv[i][1], tv[i][0]);
+    }
+
+    if (!csv)
+      fprintf(fp, "\n  ]\n}\n");
+
+    if (fp == stdout ? fflush(fp) != 0 : fclose(fp) != 0)
+      return -1;
+  }
+
+  if (bad) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Engine benchmarks: the sending, bulk batching and daemon pipeline
+ * run over the in-memory transport, so they are measured without
+ * system calls and the virtual clock makes the delays free and the
+ * results deterministic.
+ */
+typedef struct engine {
+  unsigned long ops;
+  unsigned long packets;
+  unsigned long expected;
+  double seconds;
+  double virtual;
+} ENGINE;
+
+
+double
+engine_virtual(void) {
+  struct timespec ts;
+
+
+  transport->clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Feed requests to the daemon at rate per virtual second and forward them all */
+int
+engine_daemon(unsigned long n,
+	      unsigned long requests,
+	      unsigned long rate,
+	      ENGINE *ep) {
+  unsigned char buf[WOL_BODY_SIZE];
+  struct addrinfo *aip = proxies->targets->aip;
+  WORKER *wp = &workers[0];
+  FORWARDER *fp = forwarder;
+  struct timespec now, next, step, wait;
+  unsigned long i, k;
+  int fd, j;
+
+
+  fd = transport->socket(aip->ai_family == AF_INET ? PF_INET : PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0)
+    return -1;
+
+  step.tv_sec = 0;
+  step.tv_nsec = ENGINE_BATCH * 1000000000ULL / rate;
+  transport->clock_gettime(CLOCK_MONOTONIC, &next);
+
+  memset(buf, 0xFF, HEADER_SIZE);
+  i = 0;
+  while (1) {
+    transport->clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (i < requests && timespec_cmp(&next, &now) <= 0) {
+      for (k = 0; k < ENGINE_BATCH && i < requests; k++, i++) {
+	bench_mac(random() % n, (struct ether_addr *) (buf+HEADER_SIZE));
+	for (j = 1; j < MAC_COPIES; j++)
+	  memcpy(buf+HEADER_SIZE+j*MAC_SIZE, buf+HEADER_SIZE, MAC_SIZE);
+	if (transport->sendto(fd, buf, sizeof(buf), 0, aip->ai_addr, aip->ai_addrlen) < 0)
+	  return -1;
+      }
+      timespec_add(&next, &step);
+
+      while (daemon_recv(wp, 0) == 0)
+	;
+      if (errno != EAGAIN)
+	return -1;
+    }
+
+    while (forward_poll(fp, &now))
+      ;
+
+    /* Sleep until the next batch or packet is due */
+    if (i < requests)
+      wait = next;
+    else if (fp->tc > 0)
+      wait = fp->tv[0].due;
+    else if (jobqueue_depth(&fp->q) == 0)
+      break;
+    else
+      continue;
+
+    if (fp->tc > 0 && timespec_cmp(&fp->tv[0].due, &wait) < 0)
+      wait = fp->tv[0].due;
+    if (timespec_cmp(&wait, &now) > 0) {
+      timespec_sub(&wait, &now);
+      transport->nanosleep(&wait, NULL);
+    }
+  }
+
+  ep->ops = COUNTER_GET(wp->queued);
+  ep->expected = requests * atoi(ENGINE_COPIES);
+  if (ep->ops != requests) {
+    fprintf(stderr, "%s: daemon: %lu of %lu requests queued\n", argv0, ep->ops, requests);
+    ep->expected = 0;
+  }
+  if (COUNTER_GET(wp->queue_full) || COUNTER_GET(wp->unknown_mac) || COUNTER_GET(fp->send_errors)) {
+    fprintf(stderr, "%s: daemon: %lu dropped, %lu unknown, %lu send errors\n", argv0,
+	    (unsigned long) COUNTER_GET(wp->queue_full), (unsigned long) COUNTER_GET(wp->unknown_mac),
+	    (unsigned long) COUNTER_GET(fp->send_errors));
+    ep->expected = 0;
+  }
+
+  return transport->close(fd);
+}
+
+int
+engine_run(unsigned long n,
+	   unsigned long requests,
+	   unsigned long rate,
+	   const char *output,
+	   const char *label) {
+  char path[] = "/tmp/pwol-engine.XXXXXX";
+  ENGINE ev[ENGINE_STAGES];
+  INVENTORY inv;
+  GATEWAY *gp;
+  TARGET *tp;
+  HOST *hp;
+  const char *ext;
+  unsigned long sent, k, bad = 0;
+  double t, vt;
+  FILE *fp;
+  int i, fd, csv;
+
+
+  memset(ev, 0, sizeof(ev));
+  memset(&inv, 0, sizeof(inv));
+  inv.hosts = n;
+  inv.gateways = DEFAULT_BENCH_GATEWAYS;
+
+  fd = mkstemp(path);
+  if (fd < 0)
+    return -1;
+  fp = fdopen(fd, "w");
+  if (!fp)
+    return -1;
+
+  /* Groups would have to come last, the "all" group has every host anyway */
+  if (bench_generate(fp, NULL, &inv) < 0)
+    return -1;
+  fprintf(fp, "\nproxy engine address %s port %s\n", ENGINE_ADDRESS, ENGINE_PORT);
+  fprintf(fp, "gateway relay address 10.255.0.1 port %s relay yes secret engine\n", ENGINE_PORT);
+  if (fclose(fp) != 0)
+    return -1;
+
+  bench_defaults();
+  srandom(4711);
+  parse_config(path);
+  unlink(path);
+
+  f_copies = ENGINE_COPIES;
+  f_delay = ENGINE_DELAY;
+  proxy_queue = atoi(DEFAULT_PROXY_QUEUE);
+
+  memnet_reset();
+  transport = &transport_mem;
+
+  for (gp = gateways; gp; gp = gp->next) {
+    if (gw_resolve(gp, gp->address ? gp->address : DEFAULT_ADDRESS, gp->port ? gp->port : DEFAULT_PORT, 0) < 0)
+      return -1;
+    for (tp = gp->targets; tp; tp = tp->next) {
+      tp->fd = transport->socket(tp->aip->ai_family == AF_INET ? PF_INET : PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+      if (tp->fd < 0)
+	return -1;
+    }
+  }
+  for (gp = proxies; gp; gp = gp->next)
+    if (gw_resolve(gp, gp->address, gp->port, 1) < 0)
+      return -1;
+
+  /* All hosts one after the other, with the copies and delays of each */
+  sent = memnet.sent;
+  vt = engine_virtual();
+  t = bench_now();
+  if (send_wol("all") < 0)
+    return -1;
+  ev[ENGINE_SEND_GROUP].seconds = bench_now() - t;
+  ev[ENGINE_SEND_GROUP].virtual = engine_virtual() - vt;
+  ev[ENGINE_SEND_GROUP].ops = n;
+  ev[ENGINE_SEND_GROUP].packets = memnet.sent - sent;
+  ev[ENGINE_SEND_GROUP].expected = n * atoi(ENGINE_COPIES);
+
+  /* All hosts packed into bulk requests to a downstream daemon */
+  sent = memnet.sent;
+  f_gateway = "relay";
+  vt = engine_virtual();
+  t = bench_now();
+  for (hp = hosts; hp; hp = hp->next)
+    if (send_wol_host(hp) < 0)
+      return -1;
+  if (bulk_flush_all() < 0)
+    return -1;
+  ev[ENGINE_BULK_RELAY].seconds = bench_now() - t;
+  ev[ENGINE_BULK_RELAY].virtual = engine_virtual() - vt;
+  ev[ENGINE_BULK_RELAY].ops = n;
+  ev[ENGINE_BULK_RELAY].packets = memnet.sent - sent;
+  /* As many MAC entries per request as fit besides the header and tag */
+  k = (BULK_MAX_SIZE - BULK_HEADER_SIZE - BULK_TAG_SIZE) / (1+MAC_SIZE);
+  ev[ENGINE_BULK_RELAY].expected = (n+k-1) / k * atoi(ENGINE_COPIES);
+  f_gateway = NULL;
+
+  /* Received, validated, queued, scheduled and forwarded */
+  if (daemon_setup(proxies, 1) < 0)
+    return -1;
+  sent = memnet.sent;
+  vt = engine_virtual();
+  t = bench_now();
+  if (engine_daemon(n, requests, rate, &ev[ENGINE_DAEMON]) < 0)
+    return -1;
+  ev[ENGINE_DAEMON].seconds = bench_now() - t;
+  ev[ENGINE_DAEMON].virtual = engine_virtual() - vt;
+  ev[ENGINE_DAEMON].packets = memnet.sent - sent;
+
+  printf("%-12s  %10s  %10s  %10s  %10s  %12s  %12s\n",
+	 "Stage", "Ops", "Packets", "Expected", "Virtual s", "Ops/s", "Packets/s");
+  for (i = 0; i < ENGINE_STAGES; i++) {
+    if (ev[i].packets != ev[i].expected)
+      ++bad;
+    printf("%-12s  %10lu  %10lu  %10lu  %10.3f  %12.0f  %12.0f\n",
+	   engine_names[i], ev[i].ops, ev[i].packets, ev[i].expected, ev[i].virtual,
+	   ev[i].seconds > 0 ? ev[i].ops / ev[i].seconds : 0.0,
+	   ev[i].seconds > 0 ? ev[i].packets / ev[i].seconds : 0.0);
+  }
+
+  if (output) {
+    fp = strcmp(output, "-") == 0 ? stdout : fopen(output, "w");
+    if (!fp)
+      return -1;
+
+    ext = strrchr(output, '.');
+    csv = (ext && strcmp(ext, ".csv") == 0);
+
+    if (csv)
+      fprintf(fp, "label,version,stage,hosts,ops,packets,expected,seconds,virtual_seconds\n");
+    else
+      fprintf(fp, "{\n  \"label\": \"%s\",\n  \"version\": \"%s\",\n  \"time\": %ld,\n  \"engine\": [",
+	      label, PACKAGE_VERSION, (long) time(NULL));
+
+    for (i = 0; i < ENGINE_STAGES; i++) {
+      if (csv)
+	fprintf(fp, "%s,%s,%s,%lu,%lu,%lu,%lu,%.6f,%.6f\n", label, PACKAGE_VERSION, engine_names[i],
+		n, ev[i].ops, ev[i].packets, ev[i].expected, ev[i].seconds, ev[i].virtual);
+      else
+	fprintf(fp, "%s\n    {\"stage\": \"%s\", \"hosts\": %lu, \"ops\": %lu, \"packets\": %lu, "
+		"\"expected\": %lu, \"seconds\": %.6f, \"virtual_seconds\": %.6f}",
+		i ? "," : "", engine_names[i], n, ev[i].ops, ev[i].packets, ev[i].expected,
+		ev[i].seconds, ev[i].virtual);
+    }
+
+    if (!csv)
+      fprintf(fp, "\n  ]\n}\n");
+
+    if (fp == stdout ? fflush(fp) != 0 : fclose(fp) != 0)
+      return -1;
+  }
+
+  if (bad) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void
+usage(void) {
+  printf("Usage:\n");
+  printf("  %s gen [<options>]\n", argv0);
+  printf("  %s run [<options>]\n", argv0);
+  printf("  %s micro [<options>]\n", argv0);
+  printf("  %s engine [<options>]\n", argv0);
+  printf("\nOptions:\n");
+  printf("  -h             Display this information\n");
+  printf("  -v             Be verbose\n");
+  printf("  -H <hosts>     Hosts to generate (gen, engine, default 1000)\n");
+  printf("  -n <list>      Host counts to benchmark (run, default %s)\n", DEFAULT_BENCH_SIZES);
+  printf("  -g <count>     Gateways (default %d)\n", DEFAULT_BENCH_GATEWAYS);
+  printf("  -G <count>     Groups (default %d)\n", DEFAULT_BENCH_GROUPS);
+  printf("  -e <count>     Hosts with their MAC in an ethers file (gen, default 0)\n");
+  printf("  -E <path>      Ethers file to write (gen)\n");
+  printf("  -l <count>     Lookups to time (run, default %d)\n", DEFAULT_BENCH_LOOKUPS);
+  printf("  -t <seconds>   Time limit per host count (run, default %d)\n", DEFAULT_BENCH_TIMEOUT);
+  printf("  -L <label>     Label for the results, like a commit id (run)\n");
+  printf("  -c <count>     Inputs to check per function (micro, default %d)\n", DEFAULT_MICRO_INPUTS);
+  printf("  -R <rounds>    Times to go through the inputs (micro, default %d)\n", DEFAULT_MICRO_ROUNDS);
+  printf("  -q <count>     Requests to the daemon (engine, default %d)\n", DEFAULT_ENGINE_REQUESTS);
+  printf("  -r <pps>       Daemon requests per virtual second (engine, default %d)\n", DEFAULT_ENGINE_RATE);
+  printf("  -o <path>      Write results as JSON, or CSV if path ends with .csv (run, micro, engine)\n");
+}
+
+
+int
+main(int argc,
+     char *argv[]) {
+  INVENTORY inv;
+  RUN runv[MAX_BENCH_SIZES];
+  char *sizes = DEFAULT_BENCH_SIZES, *label = "", *output = NULL, *ethers = NULL;
+  char *cp, *lptr;
+  unsigned long lookups = DEFAULT_BENCH_LOOKUPS, inputs = DEFAULT_MICRO_INPUTS;
+  unsigned long requests = DEFAULT_ENGINE_REQUESTS, rate = DEFAULT_ENGINE_RATE;
+  int rounds = DEFAULT_MICRO_ROUNDS;
+  int timeout = DEFAULT_BENCH_TIMEOUT;
+  int i, j, c, runc;
+  FILE *efp = NULL;
+
+
+  argv0 = argv[0];
+
+  memset(&inv, 0, sizeof(inv));
+  inv.hosts = 1000;
+  inv.gateways = DEFAULT_BENCH_GATEWAYS;
+  inv.groups = DEFAULT_BENCH_GROUPS;
+
+  if (argc < 2 || (strcmp(argv[1], "gen") != 0 && strcmp(argv[1], "run") != 0 &&
+		   strcmp(argv[1], "micro") != 0 && strcmp(argv[1], "engine") != 0)) {
+    usage();
+    exit(argc < 2 || strcmp(argv[1], "-h") != 0);
+  }
+
+  for (i = 2; i < argc && argv[i][0] == '-'; i++) {
+    for (j = 1; argv[i][j]; j++)
+      switch (c = argv[i][j]) {
+      case 'h':
+	usage();
+	exit(0);
+
+      case 'v':
+	++f_verbose;
+	break;
+
+      case 'H':
+      case 'n':
+      case 'g':
+      case 'G':
+      case 'e':
+      case 'E':
+      case 'l':
+      case 'c':
+      case 'R':
+      case 't':
+      case 'L':
+      case 'q':
+      case 'r':
+      case 'o':
+	cp = argv[i]+j+1;
+	if (!*cp && i+1 < argc) {
+	  cp = argv[++i];
+	}
+	if (!*cp) {
+	  fprintf(stderr, "%s: -%c: Missing required argument\n", argv0, c);
+	  exit(1);
+	}
+
+	switch (c) {
+	case 'H':
+	  inv.hosts = strtoul(cp, NULL, 10);
+	  break;
+	case 'n':
+	  sizes = cp;
+	  break;
+	case 'g':
+	  inv.gateways = strtoul(cp, NULL, 10);
+	  break;
+	case 'G':
+	  inv.groups = strtoul(cp, NULL, 10);
+	  break;
+	case 'e':
+	  inv.ethers = strtoul(cp, NULL, 10);
+	  break;
+	case 'E':
+	  ethers = cp;
+	  break;
+	case 'l':
+	  lookups = strtoul(cp, NULL, 10);
+	  break;
+	case 'c':
+	  inputs = strtoul(cp, NULL, 10);
+	  break;
+	case 'R':
+	  rounds = atoi(cp);
+	  break;
+	case 't':
+	  timeout = atoi(cp);
+	  break;
+	case 'L':
+	  label = cp;
+	  break;
+	case 'q':
+	  requests = strtoul(cp, NULL, 10);
+	  break;
+	case 'r':
+	  rate = strtoul(cp, NULL, 10);
+	  break;
+	case 'o':
+	  output = cp;
+	  break;
+	}
+	goto NextArg;
+
+      default:
+	fprintf(stderr, "%s: -%c: Invalid switch\n", argv0, c);
+	exit(1);
+      }
+  NextArg:;
+  }
+
+  if (strcmp(argv[1], "gen") == 0) {
+    if (ethers) {
+      efp = fopen(ethers, "w");
+      if (!efp) {
+	fprintf(stderr, "%s: %s: fopen: %s\n", argv0, ethers, strerror(errno));
+	exit(1);
+      }
+    }
+
+    if (bench_generate(stdout, efp, &inv) < 0 || (efp && fclose(efp) != 0)) {
+      fprintf(stderr, "%s: Writing configuration failed: %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+    exit(0);
+  }
+
+  if (strcmp(argv[1], "micro") == 0) {
+    if (inputs < 1 || rounds < 1) {
+      fprintf(stderr, "%s: Invalid number of inputs or rounds\n", argv0);
+      exit(1);
+    }
+
+    if (micro_run(inputs, rounds, output, label) < 0) {
+      fprintf(stderr, "%s: Micro-benchmarks failed: %s\n", argv0,
+	      errno == EINVAL ? "Results differ from the reference versions" : strerror(errno));
+      exit(1);
+    }
+    exit(0);
+  }
+
+  if (strcmp(argv[1], "engine") == 0) {
+    if (inv.hosts < 1 || rate < 1 || rate > 1000000000UL/ENGINE_BATCH) {
+      fprintf(stderr, "%s: Invalid number of hosts or request rate\n", argv0);
+      exit(1);
+    }
+
+    if (engine_run(inv.hosts, requests, rate, output, label) < 0) {
+      fprintf(stderr, "%s: Engine benchmarks failed: %s\n", argv0,
+	      errno == EINVAL ? "Packets sent differ from the expected number" : strerror(errno));
+      exit(1);
+    }
+    exit(0);
+  }
+
+  /* Ethers lookups go to the system's file, so they are left out of runs */
+  inv.ethers = 0;
+
+  runc = 0;
+  for (cp = strtok_r(sizes, ",", &lptr); cp; cp = strtok_r(NULL, ",", &lptr)) {
+    if (runc >= MAX_BENCH_SIZES) {
+      fprintf(stderr, "%s: Too many host counts\n", argv0);
+      exit(1);
+    }
+
+    inv.hosts = strtoul(cp, NULL, 10);
+    if (f_verbose)
+      fprintf(stderr, "[Benchmarking %lu hosts]\n", inv.hosts);
+
+    if (bench_run(&runv[runc], &inv, lookups, timeout) < 0) {
+      fprintf(stderr, "%s: %lu hosts: Benchmark failed: %s\n", argv0, inv.hosts, strerror(errno));
+      exit(1);
+    }
+    ++runc;
+  }
+
+  bench_print(runv, runc);
+
+  if (output && bench_save(output, label, runv, runc) != 0) {
+    fprintf(stderr, "%s: %s: Writing results failed: %s\n", argv0, output, strerror(errno));
+    exit(1);
+  }
+
+  exit(0);
+}
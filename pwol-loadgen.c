@@ -0,0 +1,1135 @@
+/*
+** pwol-loadgen.c - Load generator for the pwol proxy daemon
+**
+** Copyright (c) 2017-2021 Peter Eriksson <pen@lysator.liu.se>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice,
+**   this list of conditions and the following disclaimer in the documentation
+**   and/or other materials provided with the distribution.
+**
+** * Neither the name of the copyright holder nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Sends WoL requests to a local proxy daemon at a given rate, or
+ * replays them from a pcap/pcapng capture, and receives what it
+ * forwards on a sink socket standing in for the downstream network.
+ * Uses the pwol.c definitions, like pwol-bench.
+ */
+#define main pwol_main
+#include "pwol.c"
+#undef main
+
+
+#define DEFAULT_LOADGEN_ADDRESS   "127.0.0.1"
+#define DEFAULT_LOADGEN_SINK      "19999"
+#define DEFAULT_LOADGEN_HOSTS     65536
+#define DEFAULT_LOADGEN_DURATION  10
+#define DEFAULT_LOADGEN_MIX       "80,10,10"
+
+#define LOADGEN_DRAIN             1       /* Seconds to wait for late forwards */
+#define LOADGEN_MAX_SAMPLES       (4*1024*1024)
+#define LOADGEN_MAX_HOSTS         (1 << 24)
+
+/* Made up, locally administered, OUI for the generated hosts */
+#define LOADGEN_MAC0              0x02
+#define LOADGEN_MAC1              0x4C
+#define LOADGEN_MAC2              0x47
+
+#define TRACE_MAX_INTERFACES      32
+#define TRACE_MAX_DIFFS           20
+
+#define PCAPNG_SPB                0x00000003
+
+/* Link types of captures */
+#define LINKTYPE_NULL             0
+#define LINKTYPE_ETHERNET         1
+#define LINKTYPE_RAW              101
+#define LINKTYPE_LINUX_SLL        113
+#define LINKTYPE_IPV4             228
+#define LINKTYPE_IPV6             229
+#define LINKTYPE_LINUX_SLL2       276
+
+
+enum {
+  KIND_VALID = 0,
+  KIND_INVALID,
+  KIND_SECRET,
+  KINDS
+};
+
+const char *kind_names[KINDS] = { "valid", "invalid", "secret" };
+
+
+typedef struct loadgen {
+  struct sockaddr_storage daemon;
+  socklen_t daemon_len;
+  int fd;
+  int sink;
+
+  unsigned long hosts;
+  unsigned long rate;
+  unsigned int duration;
+  unsigned int mix[KINDS];
+  SECRET secret;
+
+  /* Send time of the last forwardable request per host (0 if none) */
+  _Atomic uint64_t *sentv;
+
+  /* Requests sent and packets forwarded per host */
+  unsigned long *reqv;
+  unsigned long *fwdv;
+
+  /* Replay: the MACs in the capture, hashed to their host index */
+  struct ether_addr *macv;
+  long *mhv;
+  size_t mhs;
+
+  unsigned long sent[KINDS];
+  unsigned long send_errors;
+  double send_seconds;
+
+  atomic_int stop;
+  unsigned long received;
+  unsigned long unexpected;
+  uint64_t first_rx, last_rx;
+
+  /* Reservoir of latency samples in ns */
+  uint64_t *samplev;
+  unsigned long samplec;
+  unsigned long seen;
+} LOADGEN;
+
+
+/* A captured UDP payload to replay */
+typedef struct packet {
+  uint64_t ts;
+  const unsigned char *data;
+  size_t len;
+  const struct ether_addr *mac;
+} PACKET;
+
+typedef struct trace {
+  unsigned char *data;
+  size_t size;
+
+  PACKET *pv;
+  size_t pc;
+  size_t ps;
+  long *hv;
+
+  unsigned long captured;
+} TRACE;
+
+
+uint64_t
+loadgen_now(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespec2ns(&ts);
+}
+
+void
+loadgen_mac(unsigned long i,
+	    unsigned char *bp) {
+  bp[0] = LOADGEN_MAC0;
+  bp[1] = LOADGEN_MAC1;
+  bp[2] = LOADGEN_MAC2;
+  bp[3] = (i >> 16) & 0xFF;
+  bp[4] = (i >> 8) & 0xFF;
+  bp[5] = i & 0xFF;
+}
+
+
+/* Host index of a MAC, or -1 */
+long
+loadgen_index(const LOADGEN *lp,
+	      const unsigned char *bp) {
+  size_t i;
+  long h;
+
+
+  if (!lp->macv) {
+    if (bp[0] != LOADGEN_MAC0 || bp[1] != LOADGEN_MAC1 || bp[2] != LOADGEN_MAC2)
+      return -1;
+    h = ((long) bp[3] << 16) | (bp[4] << 8) | bp[5];
+    return h < lp->hosts ? h : -1;
+  }
+
+  for (i = mac_hash((const struct ether_addr *) bp) & (lp->mhs-1); (h = lp->mhv[i]) >= 0; i = (i+1) & (lp->mhs-1))
+    if (memcmp(&lp->macv[h], bp, MAC_SIZE) == 0)
+      return h;
+
+  return -1;
+}
+
+/* Daemon configuration that matches the load generator options */
+void
+loadgen_config(const LOADGEN *lp,
+	       const char *address,
+	       const char *port,
+	       const char *sink,
+	       const char *secret) {
+  unsigned char mac[MAC_SIZE];
+  unsigned long i;
+
+
+  printf("; pwol.conf for pwol-loadgen: %lu hosts\n\n", lp->hosts);
+  printf("copies 1\ndelay 0.0s\n\n");
+  printf("proxy loadgen address %s port %s", address, port);
+  if (secret)
+    printf(" secret %s", secret);
+  printf("\n\n");
+  printf("gateway sink address %s port %s\n\n", address, sink);
+
+  for (i = 0; i < lp->hosts; i++) {
+    loadgen_mac(i, mac);
+    printf("host lg-%lu mac %02x:%02x:%02x:%02x:%02x:%02x via sink\n",
+	   i, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  }
+}
+
+
+/* Build a request of the given kind for host i, returns the size */
+size_t
+loadgen_packet(const LOADGEN *lp,
+	       int kind,
+	       unsigned long i,
+	       unsigned char *buf) {
+  size_t size;
+  int j;
+
+
+  memset(buf, 0xFF, HEADER_SIZE);
+  loadgen_mac(i, buf+HEADER_SIZE);
+  for (j = 1; j < MAC_COPIES; j++)
+    memcpy(buf+HEADER_SIZE+j*MAC_SIZE, buf+HEADER_SIZE, MAC_SIZE);
+  size = WOL_BODY_SIZE;
+
+  switch (kind) {
+  case KIND_SECRET:
+    memcpy(buf+size, lp->secret.buf, lp->secret.size);
+    size += lp->secret.size;
+    break;
+
+  case KIND_INVALID:
+    /* Cycle through the ways a request can be rejected */
+    switch (i % 4) {
+    case 0:
+      size = WOL_BODY_SIZE/2;
+      break;
+    case 1:
+      buf[2] = 0x00;
+      break;
+    case 2:
+      buf[HEADER_SIZE+5*MAC_SIZE] ^= 0x01;
+      break;
+    case 3:
+      /* Unknown MAC */
+      for (j = 0; j < MAC_COPIES; j++)
+	buf[HEADER_SIZE+j*MAC_SIZE] = 0x06;
+      break;
+    }
+    break;
+  }
+
+  return size;
+}
+
+
+/* Receive forwarded packets on the sink and match them with the requests */
+void *
+loadgen_sink(void *arg) {
+  LOADGEN *lp = (LOADGEN *) arg;
+  unsigned char buf[2048];
+  unsigned long i;
+  uint64_t now, t;
+  ssize_t len;
+  long h;
+
+
+  while (!atomic_load(&lp->stop)) {
+    len = recv(lp->sink, buf, sizeof(buf), 0);
+    if (len < 0)
+      continue;
+
+    now = loadgen_now();
+    if (len < WOL_BODY_SIZE || (h = loadgen_index(lp, buf+HEADER_SIZE)) < 0) {
+      ++lp->unexpected;
+      continue;
+    }
+
+    if (!lp->received)
+      lp->first_rx = now;
+    lp->last_rx = now;
+    ++lp->received;
+    ++lp->fwdv[h];
+
+    /* Copies after the first are not timed */
+    t = atomic_exchange(&lp->sentv[h], 0);
+    if (!t)
+      continue;
+
+    /* Keep a uniform sample of all latencies */
+    ++lp->seen;
+    if (lp->samplec < LOADGEN_MAX_SAMPLES)
+      lp->samplev[lp->samplec++] = now - t;
+    else if ((i = random() % lp->seen) < LOADGEN_MAX_SAMPLES)
+      lp->samplev[i] = now - t;
+  }
+
+  return NULL;
+}
+
+
+/* Send requests at the given rate (0 = as fast as possible) for the duration */
+void
+loadgen_send(LOADGEN *lp) {
+  unsigned char buf[WOL_BODY_SIZE+SECRET_MAX_SIZE];
+  struct timespec pause = { 0, 50000 };
+  uint64_t start, now, end, n, total;
+  unsigned long i;
+  unsigned int mixsum, r;
+  size_t size;
+  int kind;
+
+
+  mixsum = lp->mix[KIND_VALID] + lp->mix[KIND_INVALID] + lp->mix[KIND_SECRET];
+  start = loadgen_now();
+  end = start + (uint64_t) lp->duration * 1000000000ULL;
+
+  total = 0;
+  i = 0;
+  while ((now = loadgen_now()) < end) {
+    /* Requests due by now */
+    n = lp->rate ? (now-start) * lp->rate / 1000000000ULL : total+64;
+    if (total >= n) {
+      nanosleep(&pause, NULL);
+      continue;
+    }
+
+    for (; total < n; total++) {
+      r = total % mixsum;
+      kind = (r < lp->mix[KIND_VALID] ? KIND_VALID :
+	      r < lp->mix[KIND_VALID]+lp->mix[KIND_INVALID] ? KIND_INVALID : KIND_SECRET);
+
+      size = loadgen_packet(lp, kind, i, buf);
+      if (kind != KIND_INVALID)
+	atomic_store(&lp->sentv[i], loadgen_now());
+
+      if (sendto(lp->fd, buf, size, 0, (struct sockaddr *) &lp->daemon, lp->daemon_len) < 0) {
+	if (kind != KIND_INVALID)
+	  atomic_store(&lp->sentv[i], 0);
+	++lp->send_errors;
+      } else {
+	++lp->sent[kind];
+	if (kind != KIND_INVALID)
+	  ++lp->reqv[i];
+      }
+
+      if (++i >= lp->hosts)
+	i = 0;
+    }
+  }
+
+  lp->send_seconds = (loadgen_now() - start) / 1e9;
+}
+
+
+/* UDP payload from a captured packet, returns its size or -1 */
+ssize_t
+trace_payload(int linktype,
+	      const unsigned char *bp,
+	      size_t len,
+	      int port,
+	      const unsigned char **pp) {
+  unsigned int proto = 0, hlen, ulen;
+
+
+  switch (linktype) {
+  case LINKTYPE_ETHERNET:
+    if (len < 14)
+      return -1;
+    proto = (bp[12] << 8) | bp[13];
+    bp += 14;
+    len -= 14;
+    /* VLAN tags */
+    while ((proto == 0x8100 || proto == 0x88A8) && len >= 4) {
+      proto = (bp[2] << 8) | bp[3];
+      bp += 4;
+      len -= 4;
+    }
+    break;
+
+  case LINKTYPE_LINUX_SLL:
+    if (len < 16)
+      return -1;
+    proto = (bp[14] << 8) | bp[15];
+    bp += 16;
+    len -= 16;
+    break;
+
+  case LINKTYPE_LINUX_SLL2:
+    if (len < 20)
+      return -1;
+    proto = (bp[0] << 8) | bp[1];
+    bp += 20;
+    len -= 20;
+    break;
+
+  case LINKTYPE_NULL:
+    if (len < 4)
+      return -1;
+    bp += 4;
+    len -= 4;
+    break;
+
+  case LINKTYPE_RAW:
+  case LINKTYPE_IPV4:
+  case LINKTYPE_IPV6:
+    break;
+
+  default:
+    return -1;
+  }
+
+  /* Go by the IP version when the link layer does not tell */
+  if (!proto && len > 0)
+    proto = (bp[0] >> 4) == 4 ? 0x0800 : (bp[0] >> 4) == 6 ? 0x86DD : 0;
+
+  if (proto == 0x0800) {
+    if (len < 20 || (bp[0] >> 4) != 4 || bp[9] != IPPROTO_UDP)
+      return -1;
+    /* Fragments are not reassembled */
+    if (((bp[6] << 8) | bp[7]) & 0x3FFF)
+      return -1;
+    hlen = (bp[0] & 0x0F) * 4;
+  } else if (proto == 0x86DD) {
+    if (len < 40 || (bp[0] >> 4) != 6 || bp[6] != IPPROTO_UDP)
+      return -1;
+    hlen = 40;
+  } else
+    return -1;
+
+  if (len < hlen+8)
+    return -1;
+  bp += hlen;
+  len -= hlen;
+
+  if (port && ((bp[2] << 8) | bp[3]) != port)
+    return -1;
+
+  ulen = (bp[4] << 8) | bp[5];
+  if (ulen < 8 || ulen > len)
+    return -1;
+
+  *pp = bp+8;
+  return ulen-8;
+}
+
+/* Add a captured request, and its MAC if it is a magic packet */
+int
+trace_add(TRACE *rp,
+	  uint64_t ts,
+	  const unsigned char *bp,
+	  size_t len) {
+  PACKET *pp;
+  int i;
+
+
+  if (rp->pc >= rp->ps) {
+    rp->ps = rp->ps ? rp->ps*2 : 1024;
+    rp->pv = realloc(rp->pv, rp->ps * sizeof(PACKET));
+    if (!rp->pv)
+      return -1;
+  }
+
+  pp = &rp->pv[rp->pc++];
+  pp->ts = ts;
+  pp->data = bp;
+  pp->len = len;
+  pp->mac = NULL;
+
+  if (len >= WOL_BODY_SIZE) {
+    for (i = 0; i < HEADER_SIZE && bp[i] == 0xFF; i++)
+      ;
+    if (i == HEADER_SIZE)
+      pp->mac = (const struct ether_addr *) (bp+HEADER_SIZE);
+  }
+
+  return 0;
+}
+
+uint32_t
+get_u32(const unsigned char *p,
+	int swap) {
+  uint32_t v;
+
+
+  memcpy(&v, p, 4);
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+uint16_t
+get_u16(const unsigned char *p,
+	int swap) {
+  uint16_t v;
+
+
+  memcpy(&v, p, 2);
+  return swap ? __builtin_bswap16(v) : v;
+}
+
+/* Load the UDP payloads of a pcap or pcapng file (to the given port, if not 0) */
+int
+trace_load(TRACE *rp,
+	   const char *path,
+	   int port) {
+  const unsigned char *bp, *pl;
+  int linkv[TRACE_MAX_INTERFACES];
+  uint64_t resv[TRACE_MAX_INTERFACES], ts = 0, res;
+  unsigned int linkc = 0, type, size, caplen, iface, code, olen;
+  size_t off, o;
+  ssize_t n;
+  struct stat sb;
+  int fd, swap, linktype, nsec, i;
+
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &sb) < 0 || sb.st_size < 24) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Kept in memory so payloads can be sent straight from it */
+  rp->size = sb.st_size;
+  rp->data = malloc(rp->size);
+  if (!rp->data) {
+    close(fd);
+    return -1;
+  }
+  for (off = 0; off < rp->size; off += n) {
+    n = read(fd, rp->data+off, rp->size-off);
+    if (n <= 0) {
+      close(fd);
+      if (n == 0)
+	errno = EINVAL;
+      return -1;
+    }
+  }
+  close(fd);
+
+  bp = rp->data;
+  if (get_u32(bp, 0) == 0xA1B2C3D4 || get_u32(bp, 0) == 0xA1B23C4D ||
+      get_u32(bp, 1) == 0xA1B2C3D4 || get_u32(bp, 1) == 0xA1B23C4D) {
+    /* Classic pcap */
+    swap = (get_u32(bp, 1) == 0xA1B2C3D4 || get_u32(bp, 1) == 0xA1B23C4D);
+    nsec = (get_u32(bp, swap) == 0xA1B23C4D);
+    linktype = get_u32(bp+20, swap) & 0xFFFF;
+
+    for (off = 24; off+16 <= rp->size; off += 16+caplen) {
+      caplen = get_u32(bp+off+8, swap);
+      if (off+16+caplen > rp->size)
+	break;
+
+      ts = (uint64_t) get_u32(bp+off, swap) * 1000000000ULL +
+	(uint64_t) get_u32(bp+off+4, swap) * (nsec ? 1 : 1000);
+      ++rp->captured;
+
+      n = trace_payload(linktype, bp+off+16, caplen, port, &pl);
+      if (n >= 0 && trace_add(rp, ts, pl, n) < 0)
+	return -1;
+    }
+    return 0;
+  }
+
+  if (get_u32(bp, 0) != PCAPNG_SHB) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  swap = 0;
+  for (off = 0; off+12 <= rp->size; off += size) {
+    type = get_u32(bp+off, swap);
+    if (type == PCAPNG_SHB) {
+      /* Each section may have its own byte order and interfaces */
+      swap = (get_u32(bp+off+8, 0) != PCAPNG_MAGIC);
+      linkc = 0;
+    }
+
+    size = get_u32(bp+off+4, swap);
+    if (size < 12 || off+size > rp->size)
+      break;
+
+    switch (type) {
+    case PCAPNG_IDB:
+      if (linkc >= TRACE_MAX_INTERFACES || size < 20)
+	break;
+
+      linkv[linkc] = get_u16(bp+off+8, swap);
+      resv[linkc] = 1000;
+      for (o = off+16; o+4 <= off+size-4; o += 4 + ((olen+3) & ~3)) {
+	code = get_u16(bp+o, swap);
+	olen = get_u16(bp+o+2, swap);
+	if (code == 0)
+	  break;
+	if (code == PCAPNG_OPT_IF_TSRESOL && olen >= 1) {
+	  /* Units per second, as a power of 10 or (high bit set) of 2 */
+	  res = 1;
+	  for (i = 0; i < (bp[o+4] & 0x7F); i++)
+	    res *= (bp[o+4] & 0x80) ? 2 : 10;
+	  resv[linkc] = res;
+	}
+      }
+      ++linkc;
+      break;
+
+    case PCAPNG_EPB:
+      iface = get_u32(bp+off+8, swap);
+      caplen = get_u32(bp+off+20, swap);
+      if (iface >= linkc || 28+caplen > size)
+	break;
+
+      ts = ((uint64_t) get_u32(bp+off+12, swap) << 32) | get_u32(bp+off+16, swap);
+      ts = resv[iface] >= 1000000000ULL ?
+	ts / (resv[iface] / 1000000000ULL) : ts * (1000000000ULL / resv[iface]);
+      ++rp->captured;
+
+      n = trace_payload(linkv[iface], bp+off+28, caplen, port, &pl);
+      if (n >= 0 && trace_add(rp, ts, pl, n) < 0)
+	return -1;
+      break;
+
+    case PCAPNG_SPB:
+      /* No timestamp, sent right after the previous one */
+      if (linkc < 1)
+	break;
+      caplen = get_u32(bp+off+8, swap);
+      if (caplen > size-16)
+	caplen = size-16;
+      ++rp->captured;
+
+      n = trace_payload(linkv[0], bp+off+12, caplen, port, &pl);
+      if (n >= 0 && trace_add(rp, ts, pl, n) < 0)
+	return -1;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/* Give each MAC in the capture a host index */
+int
+trace_hosts(LOADGEN *lp,
+	    TRACE *rp) {
+  size_t i, j;
+
+
+  for (lp->mhs = 16; lp->mhs < rp->pc*2; lp->mhs <<= 1)
+    ;
+
+  lp->mhv = malloc(lp->mhs * sizeof(long));
+  lp->macv = calloc(rp->pc ? rp->pc : 1, sizeof(struct ether_addr));
+  rp->hv = calloc(rp->pc ? rp->pc : 1, sizeof(long));
+  if (!lp->mhv || !lp->macv || !rp->hv)
+    return -1;
+  for (i = 0; i < lp->mhs; i++)
+    lp->mhv[i] = -1;
+
+  lp->hosts = 0;
+  for (i = 0; i < rp->pc; i++) {
+    rp->hv[i] = -1;
+    if (!rp->pv[i].mac)
+      continue;
+
+    for (j = mac_hash(rp->pv[i].mac) & (lp->mhs-1); lp->mhv[j] >= 0; j = (j+1) & (lp->mhs-1))
+      if (memcmp(&lp->macv[lp->mhv[j]], rp->pv[i].mac, MAC_SIZE) == 0)
+	break;
+
+    if (lp->mhv[j] < 0) {
+      lp->macv[lp->hosts] = *rp->pv[i].mac;
+      lp->mhv[j] = lp->hosts++;
+    }
+    rp->hv[i] = lp->mhv[j];
+  }
+
+  return 0;
+}
+
+/* Send the captured requests with their original spacing divided by speed (0 = as fast as possible) */
+void
+trace_send(LOADGEN *lp,
+	   const TRACE *rp,
+	   double speed) {
+  uint64_t start, now, due;
+  struct timespec ts;
+  size_t i;
+  long h;
+  int kind;
+
+
+  start = loadgen_now();
+  for (i = 0; i < rp->pc; i++) {
+    if (speed > 0) {
+      /* Captures can be out of order, earlier ones are sent at once */
+      due = start;
+      if (rp->pv[i].ts > rp->pv[0].ts)
+	due += (uint64_t) ((rp->pv[i].ts - rp->pv[0].ts) / speed);
+      while ((now = loadgen_now()) < due) {
+	ts.tv_sec = (due-now) / 1000000000ULL;
+	ts.tv_nsec = (due-now) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+      }
+    }
+
+    h = rp->hv[i];
+    kind = h < 0 ? KIND_INVALID : rp->pv[i].len > WOL_BODY_SIZE ? KIND_SECRET : KIND_VALID;
+    if (h >= 0)
+      atomic_store(&lp->sentv[h], loadgen_now());
+
+    if (sendto(lp->fd, rp->pv[i].data, rp->pv[i].len, 0, (struct sockaddr *) &lp->daemon, lp->daemon_len) < 0) {
+      if (h >= 0)
+	atomic_store(&lp->sentv[h], 0);
+      ++lp->send_errors;
+    } else {
+      ++lp->sent[kind];
+      if (h >= 0)
+	++lp->reqv[h];
+    }
+  }
+
+  lp->send_seconds = (loadgen_now() - start) / 1e9;
+}
+
+
+/* Write what was forwarded per MAC: "mac requests forwarded" */
+int
+decisions_save(const LOADGEN *lp,
+	       const char *path) {
+  unsigned char mac[MAC_SIZE];
+  const unsigned char *bp;
+  unsigned long i;
+  FILE *fp;
+
+
+  fp = fopen(path, "w");
+  if (!fp)
+    return -1;
+
+  for (i = 0; i < lp->hosts; i++) {
+    if (!lp->reqv[i] && !lp->fwdv[i])
+      continue;
+
+    if (lp->macv)
+      bp = (const unsigned char *) &lp->macv[i];
+    else {
+      loadgen_mac(i, mac);
+      bp = mac;
+    }
+
+    fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %lu %lu\n",
+	    bp[0], bp[1], bp[2], bp[3], bp[4], bp[5], lp->reqv[i], lp->fwdv[i]);
+  }
+
+  return fclose(fp);
+}
+
+/* Compare with the decisions of an earlier run, returns the number of MACs that differ */
+long
+decisions_compare(const LOADGEN *lp,
+		  const char *path) {
+  char line[128], mbuf[32];
+  unsigned long req, fwd, same = 0, differ = 0, missing = 0, extra = 0, counts = 0;
+  unsigned char *seen;
+  struct ether_addr mac;
+  FILE *fp;
+  long h;
+
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  seen = calloc(lp->hosts ? lp->hosts : 1, 1);
+  if (!seen) {
+    fclose(fp);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%31s %lu %lu", mbuf, &req, &fwd) != 3 || str2mac(mbuf, &mac) < 0)
+      continue;
+
+    h = loadgen_index(lp, (const unsigned char *) &mac);
+    if (h < 0) {
+      /* Expected but not requested in this run */
+      ++missing;
+      continue;
+    }
+    seen[h] = 1;
+
+    if ((fwd > 0) != (lp->fwdv[h] > 0)) {
+      if (differ++ < TRACE_MAX_DIFFS)
+	printf("  %s: %s now (%lu packets), %s before (%lu packets)\n", mbuf,
+	       lp->fwdv[h] ? "forwarded" : "dropped", lp->fwdv[h], fwd ? "forwarded" : "dropped", fwd);
+    } else if (fwd != lp->fwdv[h])
+      ++counts;
+    else
+      ++same;
+  }
+  fclose(fp);
+
+  for (h = 0; h < lp->hosts; h++)
+    if (!seen[h] && (lp->reqv[h] || lp->fwdv[h]))
+      ++extra;
+  free(seen);
+
+  printf("Decisions:  %lu same, %lu differ, %lu forwarded a different number of times, %lu only before, %lu only now\n",
+	 same, differ, counts, missing, extra);
+
+  return differ;
+}
+
+
+int
+u64_cmp(const void *a,
+	const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+double
+percentile(const uint64_t *v,
+	   unsigned long n,
+	   double p) {
+  unsigned long i;
+
+
+  if (!n)
+    return 0.0;
+
+  i = (unsigned long) (p * (n-1) + 0.5);
+  return v[i] / 1000.0;
+}
+
+
+void
+usage(void) {
+  printf("Usage:\n");
+  printf("  %s [<options>]\n", argv0);
+  printf("\nOptions:\n");
+  printf("  -h             Display this information\n");
+  printf("  -v             Be verbose\n");
+  printf("  -C             Print a matching daemon configuration and exit\n");
+  printf("  -a <address>   Daemon and sink address (default %s)\n", DEFAULT_LOADGEN_ADDRESS);
+  printf("  -p <port>      Daemon port (default %s)\n", DEFAULT_PROXY_PORT);
+  printf("  -S <port>      Sink port (default %s)\n", DEFAULT_LOADGEN_SINK);
+  printf("  -H <hosts>     Hosts to spread the requests over (default %d)\n", DEFAULT_LOADGEN_HOSTS);
+  printf("  -r <pps>       Requests per second (default 0, as fast as possible)\n");
+  printf("  -t <seconds>   Duration (default %d)\n", DEFAULT_LOADGEN_DURATION);
+  printf("  -m <v,i,s>     Mix of valid, invalid and secret requests (default %s,\n"
+	 "                 without secret requests unless -s is given)\n", DEFAULT_LOADGEN_MIX);
+  printf("  -s <secret>    Secret for secret requests\n");
+  printf("  -R <file>      Replay the UDP payloads of a pcap or pcapng capture\n");
+  printf("  -x <speed>     Replay speed (default 1, original timing, 0 as fast as possible)\n");
+  printf("  -u <port>      Only replay packets to this UDP port\n");
+  printf("  -O <file>      Save the forwarded packets per MAC\n");
+  printf("  -E <file>      Compare with the forwarded packets of an earlier run\n");
+}
+
+
+int
+main(int argc,
+     char *argv[]) {
+  LOADGEN lg;
+  struct addrinfo hints, *aip;
+  pthread_t tid;
+  char *address = DEFAULT_LOADGEN_ADDRESS, *port = DEFAULT_PROXY_PORT, *sink = DEFAULT_LOADGEN_SINK;
+  char default_mix[] = DEFAULT_LOADGEN_MIX;
+  char *mix = default_mix, *secret = NULL, *cp;
+  char *replay = NULL, *output = NULL, *expect = NULL;
+  unsigned long expected, sent, macs;
+  struct timeval tv;
+  double rx_seconds, speed = 1.0;
+  TRACE rp;
+  long differ = 0;
+  int i, j, c, rc, one = 1, bufsize = 8*1024*1024, f_config = 0, rport = 0;
+
+
+  argv0 = argv[0];
+
+  memset(&lg, 0, sizeof(lg));
+  memset(&rp, 0, sizeof(rp));
+  lg.hosts = DEFAULT_LOADGEN_HOSTS;
+  lg.duration = DEFAULT_LOADGEN_DURATION;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    for (j = 1; argv[i][j]; j++)
+      switch (c = argv[i][j]) {
+      case 'h':
+	usage();
+	exit(0);
+
+      case 'v':
+	++f_verbose;
+	break;
+
+      case 'C':
+	++f_config;
+	break;
+
+      case 'a':
+      case 'p':
+      case 'S':
+      case 'H':
+      case 'r':
+      case 't':
+      case 'm':
+      case 's':
+      case 'R':
+      case 'x':
+      case 'u':
+      case 'O':
+      case 'E':
+	cp = argv[i]+j+1;
+	if (!*cp && i+1 < argc) {
+	  cp = argv[++i];
+	}
+	if (!*cp) {
+	  fprintf(stderr, "%s: -%c: Missing required argument\n", argv0, c);
+	  exit(1);
+	}
+
+	switch (c) {
+	case 'a':
+	  address = cp;
+	  break;
+	case 'p':
+	  port = cp;
+	  break;
+	case 'S':
+	  sink = cp;
+	  break;
+	case 'H':
+	  lg.hosts = strtoul(cp, NULL, 10);
+	  break;
+	case 'r':
+	  lg.rate = strtoul(cp, NULL, 10);
+	  break;
+	case 't':
+	  lg.duration = atoi(cp);
+	  break;
+	case 'm':
+	  mix = cp;
+	  break;
+	case 's':
+	  secret = cp;
+	  break;
+	case 'R':
+	  replay = cp;
+	  break;
+	case 'x':
+	  if (sscanf(cp, "%lf", &speed) != 1 || speed < 0) {
+	    fprintf(stderr, "%s: %s: Invalid speed\n", argv0, cp);
+	    exit(1);
+	  }
+	  break;
+	case 'u':
+	  rport = atoi(cp);
+	  break;
+	case 'O':
+	  output = cp;
+	  break;
+	case 'E':
+	  expect = cp;
+	  break;
+	}
+	goto NextArg;
+
+      default:
+	fprintf(stderr, "%s: -%c: Invalid switch\n", argv0, c);
+	exit(1);
+      }
+  NextArg:;
+  }
+
+  if (lg.hosts < 1 || lg.hosts > LOADGEN_MAX_HOSTS) {
+    fprintf(stderr, "%s: %lu: Invalid number of hosts\n", argv0, lg.hosts);
+    exit(1);
+  }
+
+  if (sscanf(mix, "%u,%u,%u", &lg.mix[KIND_VALID], &lg.mix[KIND_INVALID], &lg.mix[KIND_SECRET]) != 3 ||
+      lg.mix[KIND_VALID] + lg.mix[KIND_INVALID] + lg.mix[KIND_SECRET] == 0) {
+    fprintf(stderr, "%s: %s: Invalid mix\n", argv0, mix);
+    exit(1);
+  }
+
+  if (secret && str2secret(secret, &lg.secret) < 0) {
+    fprintf(stderr, "%s: %s: Invalid secret\n", argv0, secret);
+    exit(1);
+  }
+  if (!secret && lg.mix[KIND_SECRET] && !replay) {
+    /* The default mix just leaves them out */
+    if (mix != default_mix) {
+      fprintf(stderr, "%s: Secret requests need a secret (-s)\n", argv0);
+      exit(1);
+    }
+    lg.mix[KIND_SECRET] = 0;
+  }
+
+  if (f_config) {
+    loadgen_config(&lg, address, port, sink, secret);
+    exit(0);
+  }
+
+  if (replay) {
+    if (trace_load(&rp, replay, rport) < 0) {
+      fprintf(stderr, "%s: %s: Unable to load capture: %s\n", argv0, replay, strerror(errno));
+      exit(1);
+    }
+    if (rp.pc == 0) {
+      fprintf(stderr, "%s: %s: No UDP packets to replay\n", argv0, replay);
+      exit(1);
+    }
+    if (trace_hosts(&lg, &rp) < 0) {
+      fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((rc = getaddrinfo(address, port, &hints, &aip)) != 0) {
+    fprintf(stderr, "%s: %s port %s: %s\n", argv0, address, port, gai_strerror(rc));
+    exit(1);
+  }
+  memcpy(&lg.daemon, aip->ai_addr, aip->ai_addrlen);
+  lg.daemon_len = aip->ai_addrlen;
+  lg.fd = socket(aip->ai_family, SOCK_DGRAM, 0);
+  freeaddrinfo(aip);
+  if (lg.fd < 0) {
+    fprintf(stderr, "%s: socket: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  (void) setsockopt(lg.fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  hints.ai_flags = AI_PASSIVE;
+  if ((rc = getaddrinfo(address, sink, &hints, &aip)) != 0) {
+    fprintf(stderr, "%s: %s port %s: %s\n", argv0, address, sink, gai_strerror(rc));
+    exit(1);
+  }
+  lg.sink = socket(aip->ai_family, SOCK_DGRAM, 0);
+  if (lg.sink < 0) {
+    fprintf(stderr, "%s: socket: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  (void) setsockopt(lg.sink, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  (void) setsockopt(lg.sink, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  if (bind(lg.sink, aip->ai_addr, aip->ai_addrlen) < 0) {
+    fprintf(stderr, "%s: %s port %s: bind: %s\n", argv0, address, sink, strerror(errno));
+    exit(1);
+  }
+  freeaddrinfo(aip);
+
+  /* So the sink thread notices when to stop */
+  tv.tv_sec = 0;
+  tv.tv_usec = 100000;
+  (void) setsockopt(lg.sink, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  lg.sentv = calloc(lg.hosts ? lg.hosts : 1, sizeof(*lg.sentv));
+  lg.reqv = calloc(lg.hosts ? lg.hosts : 1, sizeof(*lg.reqv));
+  lg.fwdv = calloc(lg.hosts ? lg.hosts : 1, sizeof(*lg.fwdv));
+  lg.samplev = calloc(LOADGEN_MAX_SAMPLES, sizeof(*lg.samplev));
+  if (!lg.sentv || !lg.reqv || !lg.fwdv || !lg.samplev) {
+    fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+
+  if ((rc = pthread_create(&tid, NULL, loadgen_sink, &lg)) != 0) {
+    fprintf(stderr, "%s: pthread_create: %s\n", argv0, strerror(rc));
+    exit(1);
+  }
+
+  if (replay) {
+    if (f_verbose)
+      fprintf(stderr, "[Replaying %lu of %lu packets (%lu MACs) from %s to %s port %s at speed %g, sink on port %s]\n",
+	      (unsigned long) rp.pc, rp.captured, lg.hosts, replay, address, port, speed, sink);
+    trace_send(&lg, &rp, speed);
+  } else {
+    if (f_verbose)
+      fprintf(stderr, "[Sending to %s port %s for %us, sink on port %s]\n", address, port, lg.duration, sink);
+    loadgen_send(&lg);
+  }
+
+  sleep(LOADGEN_DRAIN);
+  atomic_store(&lg.stop, 1);
+  pthread_join(tid, NULL);
+
+  sent = lg.sent[KIND_VALID] + lg.sent[KIND_INVALID] + lg.sent[KIND_SECRET];
+  expected = lg.sent[KIND_VALID] + lg.sent[KIND_SECRET];
+  rx_seconds = lg.received > 1 ? (lg.last_rx - lg.first_rx) / 1e9 : 0.0;
+
+  qsort(lg.samplev, lg.samplec, sizeof(uint64_t), u64_cmp);
+
+  printf("Sent:       %lu requests in %.3fs (%.0f pps): %lu valid, %lu invalid, %lu secret, %lu errors\n",
+	 sent, lg.send_seconds, lg.send_seconds > 0 ? sent / lg.send_seconds : 0.0,
+	 lg.sent[KIND_VALID], lg.sent[KIND_INVALID], lg.sent[KIND_SECRET], lg.send_errors);
+  if (replay) {
+    /* The daemon decides what to forward, so count MACs rather than drops */
+    for (macs = 0, i = 0; i < lg.hosts; i++)
+      if (lg.fwdv[i])
+	++macs;
+    printf("Forwarded:  %lu packets (%.0f pps) for %lu of %lu MACs, %lu unexpected\n",
+	   lg.received, rx_seconds > 0 ? lg.received / rx_seconds : 0.0, macs, lg.hosts, lg.unexpected);
+  } else {
+    printf("Forwarded:  %lu of %lu (%.0f pps), %lu unexpected\n",
+	   lg.received, expected, rx_seconds > 0 ? lg.received / rx_seconds : 0.0, lg.unexpected);
+    printf("Drop rate:  %.3f%%\n",
+	   expected ? 100.0 * (expected > lg.received ? expected - lg.received : 0) / expected : 0.0);
+  }
+  printf("Latency:    p50 %.1fus, p99 %.1fus, p999 %.1fus, max %.1fus\n",
+	 percentile(lg.samplev, lg.samplec, 0.50),
+	 percentile(lg.samplev, lg.samplec, 0.99),
+	 percentile(lg.samplev, lg.samplec, 0.999),
+	 lg.samplec ? lg.samplev[lg.samplec-1] / 1000.0 : 0.0);
+
+  if (output && decisions_save(&lg, output) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, output, strerror(errno));
+    exit(1);
+  }
+
+  if (expect && (differ = decisions_compare(&lg, expect)) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, expect, strerror(errno));
+    exit(1);
+  }
+
+  exit(differ > 0 ? 1 : 0);
+}
@@ -30,32 +30,76 @@
 ** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/* CPU_SET() and pthread_setaffinity_np() on Linux */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include "config.h"
 
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#if HAVE_STRINGS_H
+#include <strings.h>
+#endif
 #include <ctype.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <time.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <fnmatch.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+#if HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#endif
 
 #if HAVE_SYSLOG_H
 #include <syslog.h>
 #endif
 
+#if ENABLE_PROBES && HAVE_SYS_SDT_H
+
+/* USDT probes - see pwol-stages.bt */
+#include <sys/sdt.h>
+#define PROBE0(name)             DTRACE_PROBE(pwol, name)
+#define PROBE1(name,a)           DTRACE_PROBE1(pwol, name, a)
+#define PROBE2(name,a,b)         DTRACE_PROBE2(pwol, name, a, b)
+#define PROBE3(name,a,b,c)       DTRACE_PROBE3(pwol, name, a, b, c)
+
+#else
+
+#define PROBE0(name)
+#define PROBE1(name,a)
+#define PROBE2(name,a,b)
+#define PROBE3(name,a,b,c)
+
+#endif
+
 #if HAVE_NETINET_ETHER_H
 
 /* Linux */
@@ -84,6 +128,13 @@
 
 #define DEFAULT_HOSTGROUP_HOSTS 64
 
+/* Host table, allocated in chunks so hosts never move */
+#define HOST_CHUNK_SIZE         4096
+#define HOST_MAX_CHUNKS         4096
+#define HOST_NO_ID              UINT32_MAX
+#define SECRET_CHUNK_SIZE       1024
+#define SECRET_MAX_CHUNKS       (HOST_CHUNK_SIZE*HOST_MAX_CHUNKS/SECRET_CHUNK_SIZE)
+
 #define DEFAULT_ADDRESS         "255.255.255.255"
 #define DEFAULT_PORT            "7"
 #define DEFAULT_COPIES          "1"
@@ -93,6 +144,82 @@
 
 #define DEFAULT_PROXY_ADDRESS   "0.0.0.0"
 #define DEFAULT_PROXY_PORT      "10007"
+#define DEFAULT_PROXY_WORKERS   "1"
+#define DEFAULT_PROXY_QUEUE     "4096"
+#define DEFAULT_LOG_SIZE        "8192"
+
+#define MAX_PROXY_WORKERS       1024
+#define MAX_CPUS                4096
+#define MAX_PROXY_QUEUE         (1024*1024)
+#define MAX_LOG_SIZE            (1024*1024)
+
+/* Give up looking for the next time of a schedule that (almost) never matches */
+#define SCHEDULE_MAX_STEPS      10000
+
+/* Copies learned from the wake history, as a copies value */
+#define COPIES_ADAPTIVE         UINT_MAX
+#define MAX_ADAPTIVE_COPIES     16
+
+#define STATS_MAGIC             "PWOLSTA1"
+#define STATS_INTERVAL          1       /* Seconds between checks by the daemon */
+
+/* Wake verification, probes run concurrently up to a limit */
+#define DEFAULT_VERIFY_TIMEOUT  "60s"
+#define DEFAULT_VERIFY_BACKOFF  "2s"
+#define VERIFY_PROBE_TIMEOUT    1
+#define VERIFY_PROBE_INTERVAL   500000000
+#define VERIFY_MAX_PROBES       256
+
+/* DHCP lease files, checked for new records now and then by the daemon */
+#define LEASES_LINE_SIZE        1024
+#define LEASES_INTERVAL         1
+
+#define LEASES_UNKNOWN          0
+#define LEASES_ISC              1
+#define LEASES_KEA              2
+#define LEASES_DNSMASQ          3
+
+/* Where a host's MAC came from */
+#define LEASED_NO               0
+#define LEASED_MAC              1       /* Configured host, MAC from a lease */
+#define LEASED_HOST             2       /* Only known from a lease */
+
+/* Control socket requests are single lines, idle clients are dropped after a while */
+#define CONTROL_LINE_SIZE       1024
+#define CONTROL_TIMEOUT         10
+#define CONTROL_MAX_HOSTS       4096
+
+/* Metrics clients that do not read them are dropped after this long (seconds) */
+#define METRICS_TIMEOUT         5
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL            0
+#endif
+
+#define CACHE_LINE_SIZE         64
+
+#define COALESCE_WAYS           4
+
+#define SKETCH_ROWS             4
+#define SKETCH_WIDTH            4096
+
+/* In-memory transport */
+#define MEMNET_SOCKETS          64
+#define MEMNET_QUEUE            4096    /* Datagrams queued per bound socket */
+#define MEMNET_MTU              2048
+#define MEMNET_FD_BASE          0x40000000
+
+/* pcapng capture file blocks and options */
+#define CAPTURE_BUFFER_SIZE     (1024*1024)
+
+#define PCAPNG_SHB              0x0A0D0D0A
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_MAGIC            0x1A2B3C4D
+#define PCAPNG_LINKTYPE_RAW     101
+#define PCAPNG_OPT_COMMENT      1
+#define PCAPNG_OPT_SHB_USERAPPL 4
+#define PCAPNG_OPT_IF_TSRESOL   9
 
 #define HEADER_SIZE             6
 #define MAC_SIZE                6
@@ -101,6 +228,62 @@
 
 #define SECRET_MAX_SIZE         64
 
+/*
+ * Bulk request to a downstream pwol daemon: magic, version, type,
+ * entry count (16 bits), sequence number and sender id (64 bits each,
+ * big endian) and the number of relay hops left, followed by MAC and
+ * group name entries and a SipHash-2-4 tag keyed by the listener secret.
+ */
+#define BULK_MAGIC              "PWOL"
+#define BULK_MAGIC_SIZE         4
+#define BULK_VERSION            3
+#define BULK_TYPE_WAKE          1
+#define BULK_SEQ                (BULK_MAGIC_SIZE+2+2)
+#define BULK_SENDER             (BULK_SEQ+8)
+#define BULK_HOPS               (BULK_SENDER+8)
+#define BULK_HEADER_SIZE        (BULK_HOPS+1)
+#define BULK_TAG_SIZE           8
+#define BULK_ENTRY_MAC          1
+#define BULK_ENTRY_GROUP        2
+#define BULK_NAME_MAX           255
+
+/* Fits a 1500 byte MTU with IPv6 and UDP headers, about 200 MACs */
+#define BULK_MAX_SIZE           1432
+
+/* Relays a request may pass through, so relay loops die out */
+#define BULK_MAX_HOPS           8
+
+/* Sequence numbers are sender clock nanoseconds, allowed clock skew */
+#define BULK_MAX_SKEW           60
+
+/* Senders tracked (in sets of REPLAY_WAYS) and sequence numbers kept per sender */
+#define REPLAY_SENDERS          1024
+#define REPLAY_WAYS             8
+#define REPLAY_WINDOW           64
+
+#define PLAN_MSG_SIZE           BULK_MAX_SIZE
+
+/* Pending requests to relays are sent when stdin has been idle this long (ms) */
+#define INPUT_IDLE              50
+#define INPUT_BUF_SIZE          4096
+
+/* Journal of pending daemon wakes, 8 byte aligned records after the header */
+#define JOURNAL_MAGIC           "PWOLJNL1"
+#define JOURNAL_HEADER_SIZE     16
+#define JOURNAL_MIN_SIZE        (1024*1024)
+#define JOURNAL_QUEUE_MAGIC     "PWOLJQ01"
+#define JOURNAL_ADD             1
+#define JOURNAL_DONE            2
+#define JOURNAL_JOB             3
+#define JOURNAL_NAME_SIZE       (BULK_NAME_MAX+1)
+#define JOURNAL_OPTS_SIZE       (CONTROL_LINE_SIZE/2)
+
+/* Buffer sizes for the *2str() formatters */
+#define ADDR_STR_SIZE           128
+#define SECRET_STR_SIZE         (SECRET_MAX_SIZE*4+4)
+#define TIMESPEC_STR_SIZE       32
+#define MAC_STR_SIZE            18
+
 
 #ifndef PACKAGE_VERSION
 #define PACKAGE_VERSION __DATE__ __TIME__
@@ -139,41 +322,127 @@ typedef struct gateway {
   struct timespec delay;
   SECRET secret;
   unsigned int ttl;
+  int relay;
 
   int fd;
 
+  /* Bulk request being filled (client side) */
+  struct sendplan *bulk;
+
   struct gateway *next;
 } GATEWAY;
 
 GATEWAY *gateways = NULL;
 GATEWAY *default_gw = NULL;
 
+/* Proxy daemon listeners */
+GATEWAY *proxies = NULL;
 
-typedef struct host {
-  char *name;
 
-  struct ether_addr mac;
-  GATEWAY *via;
-  
+/* Per host settings that most hosts do not have */
+typedef struct hostopts {
   unsigned int copies;
-  struct timespec delay;
-  SECRET secret;
   unsigned int ttl;
-  
+  struct timespec delay;
+
+  /* Checking that it came up */
+  char *address;
+  char *probe;
+} HOSTOPTS;
+
+/*
+ * Hosts are kept small and next to each other in the host table, the
+ * secret is an index in a table of distinct secrets and the rest is
+ * only allocated for hosts that have it set.
+ */
+typedef struct host {
+  char *name;
+  GATEWAY *via;
+  HOSTOPTS *opts;
   struct host *next;
+
+  /*
+   * The MAC and whether it came from a lease file, in one word that
+   * lease files replace with a single store while the workers and the
+   * forwarder read it (see host_mac).
+   */
+  union {
+    struct {
+      struct ether_addr mac;
+      unsigned char leased;
+    };
+    _Atomic uint64_t macw;
+  };
+  uint32_t id;
+  uint32_t secret;
 } HOST;
 
 HOST *hosts = NULL;
+HOST **hosts_tail = &hosts;
+
+
+typedef struct hosttable {
+  HOST *chunkv[HOST_MAX_CHUNKS];
+  uint32_t n;
+
+  /* Host ids by name, open addressing */
+  uint32_t *namev;
+  size_t names;
+  size_t namec;
+
+  /* Distinct secrets, index 0 is no secret */
+  SECRET *secretv[SECRET_MAX_CHUNKS];
+  uint32_t secretc;
+  uint32_t *shv;
+  size_t shs;
+
+  unsigned long opts;
+
+  /*
+   * Host ids sorted by name and by MAC (of those that have one) for
+   * patterns, built once the configuration is read and then kept up to
+   * date as hosts are added or changed, under the inventory write lock.
+   */
+  uint32_t *byname;
+  uint32_t bynamec;
+  uint32_t *bymac;
+  uint32_t bymacc;
+  uint32_t bysize;
+  int sorted;
+} HOSTTABLE;
+
+HOSTTABLE hosttab;
+
+const HOSTOPTS no_opts;
+const SECRET no_secret;
+
+/* Settings of a host, the defaults if it has none of its own */
+#define HOST_OPTS(hp)           ((hp)->opts ? (const HOSTOPTS *) (hp)->opts : &no_opts)
 
 
 typedef struct hostgroup {
   char *name;
 
   struct timespec delay;
+  GATEWAY *via;
 
   HOST **hv;
   size_t hs;
   size_t hc;
+
+  /* Members by host id */
+  uint64_t *bitv;
+  size_t bitc;
+
+  /* Included groups by name, and the hosts only here through them by host id */
+  char **gv;
+  size_t gc;
+  uint64_t *incv;
+  size_t incc;
+  int flat;
+
+  /* Evaluated from an expression, not in the group list */
+  int expr;
   
   struct hostgroup *next;
 } HOSTGROUP;
@@ -181,6 +450,588 @@ typedef struct hostgroup {
 HOSTGROUP *hostgroups = NULL;
 HOSTGROUP *all_group = NULL;
 
+
+/* Cron style wake schedule for a host or group, or a single one at a given time */
+typedef struct schedule {
+  HOST *hp;
+  HOSTGROUP *hgp;
+  char *spec;
+
+  uint64_t minutes;
+  uint32_t hours;
+  uint32_t mdays;
+  uint32_t months;
+  uint32_t wdays;
+  int any_mday;
+  int any_wday;
+
+  time_t at;
+  time_t due;
+
+  struct schedule *next;
+} SCHEDULE;
+
+SCHEDULE *schedules = NULL;
+
+
+/*
+ * A DHCP lease file (ISC dhcpd, Kea CSV or dnsmasq) that hosts are read
+ * from. Only complete lines are read and the offset after the last one
+ * is kept, so the daemon only reads what was appended since. The state
+ * of a dhcpd lease spanning several lines is kept between reads.
+ */
+typedef struct leasefile {
+  char *path;
+  HOSTGROUP *hgp;
+  GATEWAY *via;
+
+  int format;
+  off_t off;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+
+  /* Kea columns */
+  int mac_col;
+  int name_col;
+
+  /* dhcpd lease or host declaration being read */
+  int in_lease;
+  struct ether_addr mac;
+  char name[256];
+
+  unsigned long added;
+  unsigned long changed;
+  int error;
+
+  struct leasefile *next;
+} LEASEFILE;
+
+LEASEFILE *leasefiles = NULL;
+LEASEFILE **leasefiles_tail = &leasefiles;
+
+/*
+ * Held for writing while lease files add or change hosts in the daemon,
+ * and for reading by threads that look up names or go through groups.
+ * The workers' MAC lookups need no lock.
+ */
+pthread_rwlock_t inventory_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/* 
+ * Wake history of a MAC address, learned by verifying wakes. Kept
+ * sorted by MAC in memory and stored as is (32 bytes each) in the
+ * statistics file.
+ */
+typedef struct macstats {
+  struct ether_addr mac;
+  uint16_t needed;
+  uint32_t attempts;
+  uint32_t successes;
+  uint32_t first_try;
+  uint32_t packets;
+  uint32_t alive_ms;
+  uint32_t reserved;
+} MACSTATS;
+
+MACSTATS *statv = NULL;
+size_t statc = 0;
+size_t stats = 0;
+
+/* As last loaded or saved, to merge with updates by others when saving */
+MACSTATS *statbv = NULL;
+size_t statbc = 0;
+
+/* The file last loaded, the daemon reloads it when replaced or on SIGHUP */
+dev_t stats_dev = 0;
+ino_t stats_ino = 0;
+time_t stats_mtime = 0;
+volatile sig_atomic_t stats_reload = 0;
+
+/* Held for writing while the daemon swaps in a reloaded file */
+pthread_rwlock_t stats_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/*
+ * Open addressing hash of hosts indexed by MAC. The MACs are kept as
+ * 64-bit keys in their own dense array (0 = empty slot), so probing
+ * never has to touch the host records. Lease files may add hosts while
+ * the workers look them up: the host is stored before its key, a host
+ * that changes MAC leaves its old key behind with no host, and a full
+ * index is replaced by a bigger copy (the old one is never freed).
+ */
+typedef struct macindex {
+  _Atomic uint64_t *keyv;
+  HOST *_Atomic *hv;
+  size_t hs;
+  size_t hc;
+} MACINDEX;
+
+MACINDEX *_Atomic mac_index = NULL;
+
+
+/* A fully resolved packet to send for a host */
+typedef struct sendplan {
+  HOST *hp;
+  HOSTGROUP *hgp;
+  const char *name;
+  GATEWAY *gp;
+
+  unsigned int copies;
+  unsigned int ttl;
+  struct timespec delay;
+  SECRET secret;
+
+  unsigned char msg[PLAN_MSG_SIZE];
+  size_t msg_size;
+
+  unsigned int refs;
+  struct timespec received;
+
+  /* Copies every target has got, and the targets that have not got one more yet */
+  unsigned int sent;
+  unsigned int behind;
+
+  /* Journal record id (0 if not journaled), where it is and last compaction seen */
+  uint64_t jid;
+  size_t joff;
+  unsigned int jgen;
+} SENDPLAN;
+
+
+/* Per request option overrides, NULL fields use the host and gateway options */
+typedef struct overrides {
+  char *copies;
+  char *delay;
+  char *secret;
+  char *ttl;
+  char *gateway;
+  char *host_delay;
+} OVERRIDES;
+
+
+/* 
+ * Wake request passed from the receive workers to the forwarder, a host
+ * or a group, with the control socket overrides if it came from there.
+ * Groups are relayed or expanded into hosts by the forwarder.
+ */
+typedef struct job {
+  HOST *hp;
+  HOSTGROUP *hgp;
+  OVERRIDES *op;              /* Control socket overrides (owned by the job), or NULL */
+  unsigned int hops;          /* Relay hops left for a relayed group */
+  struct timespec received;
+  struct timespec delay;
+} JOB;
+
+typedef struct jobslot {
+  atomic_size_t seq;
+  JOB job;
+} JOBSLOT;
+
+/* Bounded lock-free multi-producer queue (Vyukov style) */
+typedef struct jobqueue {
+  JOBSLOT *v;
+  size_t mask;
+
+  /* Journal copies of the queued jobs, one per slot, or NULL */
+  struct jqueued *pv;
+
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+} JOBQUEUE;
+
+
+/* 
+ * Statistics counters are only updated by the thread owning them, so
+ * relaxed load+store is enough and avoids locked instructions
+ */
+typedef _Atomic uint64_t COUNTER;
+
+#define COUNTER_ADD(c,n) atomic_store_explicit(&(c), atomic_load_explicit(&(c), memory_order_relaxed)+(n), memory_order_relaxed)
+#define COUNTER_INC(c)   COUNTER_ADD(c, 1)
+#define COUNTER_GET(c)   atomic_load_explicit(&(c), memory_order_relaxed)
+
+
+/* Log-linear (HDR style) latency histogram in nanoseconds, ~6% precision */
+#define HISTOGRAM_SUB_BITS      4
+#define HISTOGRAM_MAX_BITS      40
+#define HISTOGRAM_BUCKETS       ((HISTOGRAM_MAX_BITS-HISTOGRAM_SUB_BITS+2) << HISTOGRAM_SUB_BITS)
+
+typedef struct histogram {
+  COUNTER v[HISTOGRAM_BUCKETS];
+  COUNTER count;
+  COUNTER sum;
+} HISTOGRAM;
+
+
+/* Lock-free GCRA rate limiter, times in nanoseconds */
+typedef struct ratelimit {
+  _Atomic uint64_t tat;
+  uint64_t interval;
+  uint64_t burst;
+} RATELIMIT;
+
+
+/* 
+ * Count-min sketch of requests per source address for the current and
+ * previous second. Fixed size no matter how many (spoofed) sources.
+ */
+typedef struct sketch {
+  _Atomic uint64_t epoch[2];
+  atomic_uint v[2][SKETCH_ROWS][SKETCH_WIDTH];
+  uint64_t seed;
+  unsigned int limit;
+} SKETCH;
+
+
+/* Last forward time per MAC, set associative and fixed size */
+typedef struct coalesce_slot {
+  struct ether_addr mac;
+  struct timespec last;
+} COALESCE_SLOT;
+
+typedef struct coalesce {
+  COALESCE_SLOT *v;
+  size_t mask;
+  struct timespec window;
+} COALESCE;
+
+
+/*
+ * Bulk request senders seen recently, to drop replayed requests: the
+ * highest sequence number accepted and the REPLAY_WINDOW highest ones
+ * (sequence numbers are clock nanoseconds, too sparse for a bitmap).
+ */
+typedef struct replay_sender {
+  uint64_t id;
+  uint64_t hwm;
+  unsigned int n;
+  uint64_t seqv[REPLAY_WINDOW];
+} REPLAY_SENDER;
+
+typedef struct replay {
+  pthread_mutex_t mtx;
+  REPLAY_SENDER v[REPLAY_SENDERS];
+} REPLAY;
+
+REPLAY *bulk_replay = NULL;
+
+
+/* Line reader that can tell when more input is not coming right away */
+typedef struct input {
+  int fd;
+  int eof;
+  size_t off, len;
+  char buf[INPUT_BUF_SIZE];
+} INPUT;
+
+
+/* Journal record header, the type is stored last so a torn record is never seen */
+typedef struct jrecord {
+  _Atomic uint32_t type;
+  uint32_t size;
+  uint64_t id;
+} JRECORD;
+
+/* Pending wake (JOURNAL_ADD), only the used part of the message is stored */
+typedef struct jwake {
+  JRECORD h;
+  int64_t due;
+  int64_t delay;
+  uint32_t copies;
+  uint32_t sent;
+  uint32_t ttl;
+  uint32_t secret_size;
+  uint32_t msg_size;
+  uint32_t bulk;
+  char gateway[JOURNAL_NAME_SIZE];
+  char name[JOURNAL_NAME_SIZE];
+  unsigned char secret[SECRET_MAX_SIZE];
+  unsigned char msg[PLAN_MSG_SIZE];
+} JWAKE;
+
+/* 
+ * Job not planned yet (JOURNAL_JOB), a host by MAC or a group by name
+ * with the control socket overrides. Groups being expanded record the
+ * number of hosts done so far and when they were started.
+ */
+typedef struct jjob {
+  JRECORD h;
+  int64_t due;
+  uint64_t next;
+  uint32_t hops;
+  uint32_t group;
+  unsigned char mac[8];
+  char name[JOURNAL_NAME_SIZE];
+  char opts[JOURNAL_OPTS_SIZE];
+} JJOB;
+
+/* Job queue slot copy, seq is the queue position+1 while the job is queued and 0 once taken */
+typedef struct jqueued {
+  _Atomic uint64_t seq;
+  JJOB job;
+} JQUEUED;
+
+/* Append-only, memory mapped and only written by the forwarder thread */
+typedef struct journal {
+  char *path;
+  char *tmp;
+  int fd;
+  unsigned char *base;
+  size_t size;
+  size_t off;
+  uint64_t id;
+  unsigned int gen;
+  int failed;
+
+  /* Queued jobs, in a separate file as they are written by many threads */
+  char *qpath;
+  int qfd;
+  JQUEUED *qv;
+  size_t qsize;
+} JOURNAL;
+
+
+typedef struct fwdtimer {
+  struct timespec due;
+  SENDPLAN *pp;
+  TARGET *tp;
+  unsigned int copy;
+  int paced;                  /* This copy was already counted as paced */
+} FWDTIMER;
+
+/* Group being woken by the forwarder, its hosts are planned as there is room */
+typedef struct fwdgroup {
+  HOSTGROUP *hgp;
+  OVERRIDES *op;
+  size_t next;
+  struct timespec received;
+  struct timespec start;
+  struct timespec due;
+  struct timespec step;
+  struct fwdgroup *link;
+
+  uint64_t jid;
+  size_t joff;
+} FWDGROUP;
+
+typedef struct forwarder {
+  pthread_t tid;
+  JOBQUEUE q;
+
+  int pfd[2];
+  atomic_int sleeping;
+
+  /* Min-heap of pending packet copies, ordered by due time */
+  FWDTIMER *tv;
+  size_t ts;
+  size_t tc;
+
+  size_t plans;
+  size_t max_plans;
+
+  FWDGROUP *groups;
+  FWDGROUP *groups_tail;
+
+  COALESCE *cp;
+  RATELIMIT *rlp;
+  JOURNAL *jp;
+
+  _Alignas(CACHE_LINE_SIZE) COUNTER forwarded;
+  COUNTER send_errors;
+  COUNTER plan_errors;
+  COUNTER coalesced;
+  COUNTER paced;
+
+  HISTOGRAM queue_latency;
+  HISTOGRAM forward_latency;
+} FORWARDER;
+
+FORWARDER *forwarder = NULL;
+
+
+typedef struct worker {
+  unsigned int id;
+  int cpu;
+  pthread_t tid;
+
+  struct pollfd *pfdv;
+  GATEWAY **lv;
+  int n;
+
+  _Alignas(CACHE_LINE_SIZE) COUNTER received;
+  COUNTER invalid_header;
+  COUNTER invalid_mac;
+  COUNTER bad_secret;
+  COUNTER unknown_mac;
+  COUNTER source_limited;
+  COUNTER request_limited;
+  COUNTER queued;
+  COUNTER queue_full;
+  COUNTER bulk_requests;
+  COUNTER replayed;
+  COUNTER unknown_group;
+  COUNTER hop_limited;
+} WORKER;
+
+WORKER *workers = NULL;
+unsigned int nworkers = 0;
+
+
+typedef struct metrics {
+  pthread_t tid;
+  int fd;
+} METRICS;
+
+
+/* Local control socket, streamed wake requests from pwol clients */
+typedef struct control {
+  pthread_t tid;
+  int fd;
+
+  /* Hosts not in the configuration, only used by the control thread */
+  HOST *hosts;
+  unsigned int nhosts;
+
+  COUNTER requests;
+  COUNTER errors;
+} CONTROL;
+
+CONTROL *control = NULL;
+
+
+/* Min-heap of schedules ordered by their next due time */
+typedef struct scheduler {
+  pthread_t tid;
+
+  SCHEDULE **sv;
+  size_t sc;
+
+  COUNTER fired;
+  COUNTER queue_full;
+} SCHEDULER;
+
+SCHEDULER *scheduler = NULL;
+
+
+/* Log events, formatted by the log writer thread */
+enum {
+  EV_SEND_HOST,
+  EV_SEND_RELAY,
+  EV_SEND_PACKET,
+  EV_SLEEP,
+  EV_PACKET,
+  EV_RECEIVED,
+  EV_WAITING,
+  EV_READABLE,
+  EV_SOURCE_LIMITED,
+  EV_TOO_SHORT,
+  EV_TOO_LONG,
+  EV_BAD_HEADER,
+  EV_BAD_MAC_COPIES,
+  EV_SECRET,
+  EV_UNKNOWN_MAC,
+  EV_BAD_SECRET,
+  EV_REQUEST_LIMITED,
+  EV_REQUEST,
+  EV_BULK_REQUEST,
+  EV_GROUP_REQUEST,
+  EV_BAD_BULK,
+  EV_REPLAYED,
+  EV_UNKNOWN_GROUP,
+  EV_HOP_LIMIT,
+  EV_QUEUE_FULL,
+  EV_CONTROL_REQUEST,
+  EV_SCHEDULED,
+  EV_CONTROL_ERROR,
+  EV_COALESCED,
+  EV_JOURNAL_REPLAY,
+  EV_JOURNAL_SKIPPED,
+  EV_JOURNAL_NO_GROUP,
+  EV_JOURNAL_ERROR,
+  EV_PLAN_ERROR,
+  EV_SEND_ERROR,
+  EV_LEASES,
+  EV_LEASES_ERROR,
+  EV_STATS,
+  EV_STATS_ERROR,
+};
+
+#define LOG_DATA_SIZE           (WOL_BODY_SIZE+SECRET_MAX_SIZE)
+
+/*
+ * Fixed size binary log record. Names must stay valid until written
+ * (host names are never freed) and anything else is copied into data.
+ */
+typedef struct logrec {
+  struct timespec ts;
+  unsigned short event;
+  unsigned short len;
+  unsigned int worker;
+  long long a;
+  long long b;
+  const char *name;
+  struct ether_addr mac;
+  unsigned char data[LOG_DATA_SIZE];
+} LOGREC;
+
+typedef struct logslot {
+  atomic_size_t seq;
+  LOGREC rec;
+} LOGSLOT;
+
+/* Lock-free multi producer ring drained by a single writer thread */
+typedef struct logger {
+  pthread_t tid;
+  LOGSLOT *v;
+  size_t mask;
+
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+  atomic_int sleeping;
+  _Atomic uint64_t dropped;
+
+  int pfd[2];
+  FILE *fp;
+  int stamp;
+
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+} LOGGER;
+
+LOGGER *logger = NULL;
+char *log_dest = NULL;
+
+unsigned int proxy_workers = 0;
+unsigned int proxy_queue = 0;
+struct timespec proxy_coalesce = { 0, 0 };
+unsigned int proxy_source_limit = 0;
+unsigned int proxy_request_limit = 0;
+unsigned int proxy_forward_limit = 0;
+int proxy_strict = 0;
+char *proxy_metrics = NULL;
+char *control_path = NULL;
+char *proxy_journal = NULL;
+
+char *stats_path = NULL;
+
+char *verify_probe = NULL;
+struct timespec verify_timeout = { 0, 0 };
+struct timespec verify_backoff = { 0, 0 };
+
+/* Client side of the control socket */
+int control_fd = -1;
+FILE *control_fp = NULL;
+char control_opts[CONTROL_LINE_SIZE/2];
+unsigned int control_id = 0;
+unsigned int log_size = 0;
+
+SKETCH *source_sketch = NULL;
+RATELIMIT *request_limit = NULL;
+int *proxy_cpuv = NULL;
+size_t proxy_cpuc = 0;
+
 int f_verbose = 0;
 int f_ignore = 0;
 int f_debug = 0;
@@ -188,6 +1039,8 @@ int f_no = 0;
 int f_export = 0;
 int f_daemon = 0;
 int f_foreground = 0;
+int f_local = 0;
+int f_verify = 0;
 
 
 char *f_copies  = NULL;
@@ -201,9 +1054,12 @@ char *f_gateway = NULL;
 
 char *f_host_delay    = NULL;
 
+char *f_capture = NULL;
+
 char *f_proxy_address = NULL;
 char *f_proxy_port    = NULL;
 char *f_proxy_secret  = NULL;
+char *f_proxy_workers = NULL;
 
 char *
 strdupcat(const char *str,
@@ -274,83 +1130,255 @@ target_free(TARGET *tp) {
 }
 
 
+/* Format an unsigned number at the end of buf, returns where it starts */
 char *
-sockaddr2str(struct sockaddr *sp,
-	     size_t len) {
-  char addr[2048];
-  char port[256];
+utoa_end(unsigned long v,
+	 char *end) {
+  *end = '\0';
+  do {
+    *--end = '0' + v % 10;
+    v /= 10;
+  } while (v);
+
+  return end;
+}
+
+/* Format an address into buf (at least ADDR_STR_SIZE bytes), never allocates */
+char *
+sockaddr2str(const struct sockaddr *sp,
+	     size_t len,
+	     char *buf,
+	     size_t size) {
+  const struct sockaddr_in *sin = (const struct sockaddr_in *) sp;
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sp;
+  char addr[ADDR_STR_SIZE];
+  char port[32], *pp;
+  size_t alen, plen;
 
 
   if (!sp)
     return NULL;
 
-  if (getnameinfo(sp, len, addr, sizeof(addr), port, sizeof(port), NI_DGRAM|NI_NUMERICHOST|NI_NUMERICSERV) != 0)
-    return NULL;
+  /* Common cases without the getnameinfo() overhead, scoped IPv6 addresses need it though */
+  if (sp->sa_family == AF_INET && len >= sizeof(*sin) && inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr))) {
+    pp = utoa_end(ntohs(sin->sin_port), port+sizeof(port)-1);
+  } else if (sp->sa_family == AF_INET6 && len >= sizeof(*sin6) && sin6->sin6_scope_id == 0 &&
+	     inet_ntop(AF_INET6, &sin6->sin6_addr, addr+1, sizeof(addr)-2)) {
+    pp = utoa_end(ntohs(sin6->sin6_port), port+sizeof(port)-1);
+
+    alen = strlen(addr+1);
+    addr[0] = '[';
+    addr[alen+1] = ']';
+    addr[alen+2] = '\0';
+  } else {
+    if (getnameinfo(sp, len, addr, sizeof(addr), port, sizeof(port), NI_DGRAM|NI_NUMERICHOST|NI_NUMERICSERV) != 0)
+      return NULL;
 
-  if (sp->sa_family == AF_INET6)
-    return strdupcat("[", addr, "]:", port, NULL);
+    if (sp->sa_family == AF_INET6)
+      snprintf(buf, size, "[%s]:%s", addr, port);
+    else
+      snprintf(buf, size, "%s:%s", addr, port);
 
-  return strdupcat(addr, ":", port, NULL);
-}
+    return buf;
+  }
 
+  alen = strlen(addr);
+  plen = strlen(pp);
+  if (alen+1+plen+1 > size) {
+    /* Truncated */
+    snprintf(buf, size, "%s:%s", addr, pp);
+    return buf;
+  }
 
-char *
-addrinfo2str(struct addrinfo *aip) {
-  char addr[2048];
-  char port[256];
+  memcpy(buf, addr, alen);
+  buf[alen] = ':';
+  memcpy(buf+alen+1, pp, plen+1);
+  return buf;
+}
 
 
+char *
+addrinfo2str(struct addrinfo *aip,
+	     char *buf,
+	     size_t size) {
   if (!aip)
     return NULL;
 
-  if (getnameinfo(aip->ai_addr, aip->ai_addrlen, addr, sizeof(addr), port, sizeof(port), NI_DGRAM|NI_NUMERICHOST|NI_NUMERICSERV) != 0)
-    return NULL;
+  return sockaddr2str(aip->ai_addr, aip->ai_addrlen, buf, size);
+}
 
-  if (aip->ai_family == AF_INET6)
-    return strdupcat("[", addr, "]:", port, NULL);
 
-  return strdupcat(addr, ":", port, NULL);
+char *
+target2str(TARGET *tp,
+	   char *buf,
+	   size_t size) {
+  return addrinfo2str(tp->aip, buf, size);
 }
 
 
-char *
-target2str(TARGET *tp) {
-  return addrinfo2str(tp->aip);
+int
+str2bool(const char *str,
+	 int *vp) {
+  if (!str)
+    return -1;
+
+  if (strcasecmp(str, "yes") == 0 || strcasecmp(str, "on") == 0 ||
+      strcasecmp(str, "true") == 0 || strcmp(str, "1") == 0) {
+    *vp = 1;
+    return 1;
+  }
+
+  if (strcasecmp(str, "no") == 0 || strcasecmp(str, "off") == 0 ||
+      strcasecmp(str, "false") == 0 || strcmp(str, "0") == 0) {
+    *vp = 0;
+    return 0;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+
+/* Value of a hex digit, or -1 */
+int
+hexval(int c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Parse a dotted IPv4 address (four numbers 0-255) */
+int
+str2ipv4(const char *str,
+	 unsigned char *bp) {
+  unsigned int v;
+  int i, n;
+
+
+  for (i = 0; i < 4; i++) {
+    if (i > 0 && *str++ != '.')
+      return -1;
+
+    v = 0;
+    for (n = 0; n < 3 && *str >= '0' && *str <= '9'; n++)
+      v = v*10 + *str++ - '0';
+    if (n == 0 || v > 255)
+      return -1;
+    bp[i] = v;
+  }
+
+  return *str ? -1 : 0;
+}
+
+/* Parse a MAC address: six groups of one or two hex digits separated by ":" */
+int
+str2mac(const char *str,
+	struct ether_addr *ep) {
+  unsigned char *bp = (unsigned char *) ep;
+  int i, h, l;
+
+
+  for (i = 0; i < MAC_SIZE; i++) {
+    if (i > 0 && *str++ != ':')
+      return -1;
+
+    if ((h = hexval(*str++)) < 0)
+      return -1;
+    if ((l = hexval(*str)) >= 0) {
+      h = (h << 4) | l;
+      ++str;
+    }
+    bp[i] = h;
+  }
+
+  /* Like ether_aton(), anything may follow two digits but one must end the string */
+  return (l < 0 && *str && !isspace((unsigned char) *str)) ? -1 : 0;
 }
 
+/* Parse a MAC prefix like "aa:bb:cc:*", returning the number of bytes or -1 */
+int
+str2macprefix(const char *str,
+	      struct ether_addr *ep) {
+  unsigned char *bp = (unsigned char *) ep;
+  int i, h, l;
+
+
+  for (i = 0; i < MAC_SIZE-1; i++) {
+    if ((h = hexval(*str++)) < 0)
+      return -1;
+    if ((l = hexval(*str)) >= 0) {
+      h = (h << 4) | l;
+      ++str;
+    }
+    bp[i] = h;
+
+    if (*str++ != ':')
+      return -1;
+    if (strcmp(str, "*") == 0)
+      return i+1;
+  }
+
+  return -1;
+}
 
+/* 
+ * Parse a secret: an IPv4 address, a list of hex bytes separated by
+ * ":" or "-", or else the text itself
+ */
 int
 str2secret(const char *secret,
 	   SECRET *sp) {
-  unsigned int v1, v2, v3, v4, val, i;
-  char *ptr, *cp, *tbuf;
+  unsigned int v1, v2, v3, v4, val;
+  const char *cp;
+  char tok[3];
+  int i, h, l;
+  size_t len;
 
 
-  if (sscanf(secret, "%u.%u.%u.%u", &v1, &v2, &v3, &v4) == 4) {
-    /* IPv4 address */
+  if (str2ipv4(secret, sp->buf) == 0) {
+    sp->size = 4;
+    return sp->size;
+  }
+
+  /* Anything else sscanf() took as an address before: signs, white space, large numbers, text after */
+  if (strchr(secret, '.') && sscanf(secret, "%u.%u.%u.%u", &v1, &v2, &v3, &v4) == 4) {
     sp->buf[0] = v1;
     sp->buf[1] = v2;
     sp->buf[2] = v3;
     sp->buf[3] = v4;
-    sp->size  = 4;
+    sp->size = 4;
     return sp->size;
   }
 
-
-  /* List of hexadecimal bytes separated by : or - */
-  ptr = strdup(secret);
-  if (!ptr)
-    return -1;
-
-  tbuf = ptr;
-  for (i = 0; i < SECRET_MAX_SIZE && (cp = strtok_r(tbuf, ":-", &ptr)) != NULL; i++) {
-    tbuf = NULL;
-    
-    if (strlen(cp) > 2 || sscanf(cp, "%x", &val) != 1) {
-      i = 0;
+  /* List of hexadecimal bytes, separators may be repeated like strtok() allows */
+  cp = secret;
+  for (i = 0; i < SECRET_MAX_SIZE; i++) {
+    while (*cp == ':' || *cp == '-')
+      ++cp;
+    if (!*cp)
       break;
+
+    len = strcspn(cp, ":-");
+    if (len > 2)
+      goto Text;
+
+    if ((h = hexval(cp[0])) >= 0 && (len == 1 || (l = hexval(cp[1])) >= 0)) {
+      if (len == 2)
+	h = (h << 4) | l;
+    } else {
+      /* As much of it as sscanf("%x") reads, like before */
+      memcpy(tok, cp, len);
+      tok[len] = '\0';
+      if (sscanf(tok, "%x", &val) != 1)
+	goto Text;
+      h = val & 0xFF;
     }
-    sp->buf[i] = val;
+    sp->buf[i] = h;
+    cp += len;
   }
 
   if (i > 1) {
@@ -358,90 +1386,720 @@ str2secret(const char *secret,
     return sp->size;
   }
 
-  i = strlen(secret);
-  if (i > SECRET_MAX_SIZE) {
+ Text:
+  len = strlen(secret);
+  if (len > SECRET_MAX_SIZE) {
     errno = EINVAL;
     return -1;
   }
 
-  if (i > 0)
-    memcpy(sp->buf, secret, i);
+  if (len > 0)
+    memcpy(sp->buf, secret, len);
 
-  sp->size = i;
+  sp->size = len;
   return sp->size;
 }
 
 
+/* 
+ * Compare a received secret with an expected one in constant time.
+ * Only whether the sizes match can be told from the timing.
+ */
 int
-secret_compare(SECRET *s1, 
-	       SECRET *s2) {
-  int rc;
+secret_verify(const SECRET *expected,
+	      const SECRET *received) {
+  unsigned char diff;
+  int i;
 
 
-  if (!s1 && s2)
-    return 1;
-  if (s1 && !s2)
-    return -1;
+  diff = (expected->size != received->size);
+  for (i = 0; i < SECRET_MAX_SIZE; i++)
+    diff |= (expected->buf[i] ^ received->buf[i]) & -(unsigned char) (i < expected->size);
+
+  return diff ? -1 : 0;
+}
+
+
+#define ROTL64(x,b) (((x) << (b)) | ((x) >> (64-(b))))
+
+#define SIPROUND					\
+  do {							\
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;		\
+    v0 = ROTL64(v0, 32);				\
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;		\
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;		\
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;		\
+    v2 = ROTL64(v2, 32);				\
+  } while (0)
+
+uint64_t
+get_le64(const unsigned char *p) {
+  uint64_t v = 0;
+  int i;
 
-  rc = s1->size - s2->size;
-  if (rc)
-    return rc;
 
-  return memcmp(&s1->buf, &s2->buf, s1->size);
+  for (i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
 }
 
-char *
-secret2str(SECRET *sp) {
-  char *buf;
+void
+put_le64(unsigned char *p,
+	 uint64_t v) {
   int i;
 
 
-  if (!sp || sp->size == 0)
-    return NULL;
+  for (i = 0; i < 8; i++, v >>= 8)
+    p[i] = v & 0xFF;
+}
 
-  /* IPv4 */
-  if (sp->size == 4) {
-    buf = malloc(16);
-    if (!buf)
-      return NULL;
-    snprintf(buf, 16, "%u.%u.%u.%u", sp->buf[0], sp->buf[1], sp->buf[2], sp->buf[3]);
-    goto End;
-  }
-  
-  buf = malloc(sp->size*3);
-  if (!buf)
-    return NULL;
-  for (i = 0; i < sp->size; i++) {
-    snprintf(buf+i*3, 3, "%02x", sp->buf[i]);
-    if (i+1 < sp->size) {
-      buf[i*3+2] = ':';
+uint64_t
+get_be64(const unsigned char *p) {
+  uint64_t v = 0;
+  int i;
+
+
+  for (i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+void
+put_be64(unsigned char *p,
+	 uint64_t v) {
+  int i;
+
+
+  for (i = 7; i >= 0; i--, v >>= 8)
+    p[i] = v & 0xFF;
+}
+
+/* SipHash-2-4 message authentication code */
+uint64_t
+siphash24(const unsigned char key[16],
+	  const void *data,
+	  size_t len) {
+  const unsigned char *bp = (const unsigned char *) data;
+  uint64_t k0 = get_le64(key), k1 = get_le64(key+8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t m;
+  size_t i, left = len & 7;
+
+
+  for (i = 0; i+8 <= len; i += 8) {
+    m = get_le64(bp+i);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  m = (uint64_t) len << 56;
+  while (left-- > 0)
+    m |= (uint64_t) bp[i+left] << (8*left);
+
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+
+  v2 ^= 0xFF;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Derive the bulk request key from a (possibly empty) secret */
+void
+bulk_key(const SECRET *sp,
+	 unsigned char key[16]) {
+  static const unsigned char k0[16] = "pwol bulk key 0";
+  static const unsigned char k1[16] = "pwol bulk key 1";
+
+
+  put_le64(key,   siphash24(k0, sp->buf, sp->size));
+  put_le64(key+8, siphash24(k1, sp->buf, sp->size));
+}
+
+const char hexdigits[] = "0123456789abcdef";
+
+/* Format a secret into buf (at least SECRET_STR_SIZE bytes), never allocates */
+char *
+secret2str(const SECRET *sp,
+	   char *buf,
+	   size_t size) {
+  size_t i, len;
+
+
+  if (!sp || sp->size == 0 || sp->size > SECRET_MAX_SIZE)
+    return NULL;
+
+  if (size < SECRET_STR_SIZE) {
+    errno = ENOSPC;
+    return NULL;
+  }
+
+  /* IPv4 */
+  len = 0;
+  if (sp->size == 4) {
+    for (i = 0; i < 4; i++) {
+      if (i > 0)
+	buf[len++] = '.';
+      if (sp->buf[i] >= 100)
+	buf[len++] = '0' + sp->buf[i] / 100;
+      if (sp->buf[i] >= 10)
+	buf[len++] = '0' + sp->buf[i] / 10 % 10;
+      buf[len++] = '0' + sp->buf[i] % 10;
+    }
+  } else {
+    for (i = 0; i < sp->size; i++) {
+      if (i > 0)
+	buf[len++] = ':';
+      buf[len++] = hexdigits[sp->buf[i] >> 4];
+      buf[len++] = hexdigits[sp->buf[i] & 0x0F];
     }
   }
 
- End:
   for (i = 0; i < sp->size && isprint(sp->buf[i]); i++)
     ;
-  
+
   if (i >= sp->size) {
-    buf = realloc(buf, sp->size*3+3+sp->size);
-    if (!buf)
-      return NULL;
+    buf[len++] = ' ';
+    buf[len++] = '(';
+    memcpy(buf+len, sp->buf, sp->size);
+    len += sp->size;
+    buf[len++] = ')';
+  }
+
+  buf[len] = '\0';
+  return buf;
+}
 
-    memcpy(buf+sp->size*3-1, " (", 2);
-    memcpy(buf+sp->size*3-1+2, sp->buf, sp->size);
-    strcpy(buf+sp->size*3-1+2+sp->size, ")");
+/* Format a MAC like ether_ntoa() into buf (at least MAC_STR_SIZE bytes), thread safe */
+char *
+mac2str(const struct ether_addr *ep,
+	char *buf) {
+  const unsigned char *bp = (const unsigned char *) ep;
+  size_t i, len;
+
+
+  len = 0;
+  for (i = 0; i < MAC_SIZE; i++) {
+    if (i > 0)
+      buf[len++] = ':';
+    if (bp[i] >= 0x10)
+      buf[len++] = hexdigits[bp[i] >> 4];
+    buf[len++] = hexdigits[bp[i] & 0x0F];
   }
-    
+  buf[len] = '\0';
+
   return buf;
 }
 
+uint64_t
+timespec2ns(const struct timespec *tsp) {
+  return (uint64_t) tsp->tv_sec * 1000000000ULL + tsp->tv_nsec;
+}
+
+int
+timespec_cmp(const struct timespec *a,
+	     const struct timespec *b) {
+  if (a->tv_sec != b->tv_sec)
+    return a->tv_sec < b->tv_sec ? -1 : 1;
+  if (a->tv_nsec != b->tv_nsec)
+    return a->tv_nsec < b->tv_nsec ? -1 : 1;
+  return 0;
+}
+
+void
+timespec_add(struct timespec *a,
+	     const struct timespec *b) {
+  a->tv_sec  += b->tv_sec;
+  a->tv_nsec += b->tv_nsec;
+  if (a->tv_nsec >= 1000000000) {
+    a->tv_sec  += 1;
+    a->tv_nsec -= 1000000000;
+  }
+}
+
+void
+timespec_sub(struct timespec *a,
+	     const struct timespec *b) {
+  a->tv_sec  -= b->tv_sec;
+  a->tv_nsec -= b->tv_nsec;
+  if (a->tv_nsec < 0) {
+    a->tv_sec  -= 1;
+    a->tv_nsec += 1000000000;
+  }
+}
+
+
+/*
+ * Transport: the socket and clock calls of the senders and the proxy
+ * daemon pipeline go through this. Besides the kernel there is an
+ * in-memory network with a virtual clock, so the scheduling, batching
+ * and forwarding can be benchmarked and tested without system calls
+ * and without waiting for real time to pass.
+ */
+typedef struct transport {
+  const char *name;
+  int (*socket)(int domain, int type, int protocol);
+  int (*bind)(int fd, const struct sockaddr *sa, socklen_t len);
+  int (*setsockopt)(int fd, int level, int option, const void *value, socklen_t len);
+  ssize_t (*sendto)(int fd, const void *buf, size_t len, int flags, const struct sockaddr *sa, socklen_t salen);
+  ssize_t (*recvfrom)(int fd, void *buf, size_t size, int flags, struct sockaddr *sa, socklen_t *salen);
+  int (*close)(int fd);
+  int (*clock_gettime)(clockid_t id, struct timespec *tp);
+  int (*nanosleep)(const struct timespec *req, struct timespec *rem);
+} TRANSPORT;
+
+
+int
+sys_socket(int domain,
+	   int type,
+	   int protocol) {
+  return socket(domain, type, protocol);
+}
+
+int
+sys_bind(int fd,
+	 const struct sockaddr *sa,
+	 socklen_t len) {
+  return bind(fd, sa, len);
+}
+
+int
+sys_setsockopt(int fd,
+	       int level,
+	       int option,
+	       const void *value,
+	       socklen_t len) {
+  return setsockopt(fd, level, option, value, len);
+}
+
+ssize_t
+sys_sendto(int fd,
+	   const void *buf,
+	   size_t len,
+	   int flags,
+	   const struct sockaddr *sa,
+	   socklen_t salen) {
+  return sendto(fd, buf, len, flags, sa, salen);
+}
+
+ssize_t
+sys_recvfrom(int fd,
+	     void *buf,
+	     size_t size,
+	     int flags,
+	     struct sockaddr *sa,
+	     socklen_t *salen) {
+  return recvfrom(fd, buf, size, flags, sa, salen);
+}
+
+int
+sys_close(int fd) {
+  return close(fd);
+}
+
+int
+sys_clock_gettime(clockid_t id,
+		  struct timespec *tp) {
+  return clock_gettime(id, tp);
+}
+
+int
+sys_nanosleep(const struct timespec *req,
+	      struct timespec *rem) {
+  return nanosleep(req, rem);
+}
+
+TRANSPORT transport_sys = {
+  "kernel",
+  sys_socket,
+  sys_bind,
+  sys_setsockopt,
+  sys_sendto,
+  sys_recvfrom,
+  sys_close,
+  sys_clock_gettime,
+  sys_nanosleep,
+};
+
+
+/*
+ * In-memory network: a datagram sent to the address a memory socket is
+ * bound to is queued for that socket, others are only counted. Sleeping
+ * just moves the virtual clock forward.
+ */
+typedef struct memdgram {
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  size_t len;
+  unsigned char buf[MEMNET_MTU];
+} MEMDGRAM;
+
+typedef struct memsock {
+  int used;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  MEMDGRAM *qv;
+  size_t head;
+  size_t tail;
+} MEMSOCK;
+
+typedef struct memnet {
+  pthread_mutex_t mtx;
+  MEMSOCK sv[MEMNET_SOCKETS];
+  struct timespec now;
+  struct timespec epoch;
+
+  unsigned long sent;
+  unsigned long long bytes;
+  unsigned long delivered;
+  unsigned long dropped;
+} MEMNET;
+
+MEMNET memnet = { PTHREAD_MUTEX_INITIALIZER };
+
+
+MEMSOCK *
+memnet_socket(int fd) {
+  MEMSOCK *sp;
+
+
+  if (fd < MEMNET_FD_BASE || fd >= MEMNET_FD_BASE+MEMNET_SOCKETS)
+    goto Fail;
+
+  sp = &memnet.sv[fd-MEMNET_FD_BASE];
+  if (!sp->used)
+    goto Fail;
+
+  return sp;
+
+ Fail:
+  errno = EBADF;
+  return NULL;
+}
+
+/* The bound socket a datagram to sa goes to, wildcard addresses match any */
+MEMSOCK *
+memnet_lookup(const struct sockaddr *sa) {
+  MEMSOCK *sp;
+  int i;
+
+
+  for (i = 0; i < MEMNET_SOCKETS; i++) {
+    sp = &memnet.sv[i];
+    if (!sp->qv || sp->addr.ss_family != sa->sa_family)
+      continue;
+
+    if (sa->sa_family == AF_INET) {
+      const struct sockaddr_in *a = (const struct sockaddr_in *) &sp->addr;
+      const struct sockaddr_in *b = (const struct sockaddr_in *) sa;
+
+      if (a->sin_port == b->sin_port &&
+	  (a->sin_addr.s_addr == INADDR_ANY || a->sin_addr.s_addr == b->sin_addr.s_addr))
+	return sp;
+    } else if (sa->sa_family == AF_INET6) {
+      const struct sockaddr_in6 *a = (const struct sockaddr_in6 *) &sp->addr;
+      const struct sockaddr_in6 *b = (const struct sockaddr_in6 *) sa;
+
+      if (a->sin6_port == b->sin6_port &&
+	  (IN6_IS_ADDR_UNSPECIFIED(&a->sin6_addr) || IN6_ARE_ADDR_EQUAL(&a->sin6_addr, &b->sin6_addr)))
+	return sp;
+    }
+  }
+
+  return NULL;
+}
+
+int
+mem_socket(int domain,
+	   int type,
+	   int protocol) {
+  int i;
+
+
+  pthread_mutex_lock(&memnet.mtx);
+  for (i = 0; i < MEMNET_SOCKETS && memnet.sv[i].used; i++)
+    ;
+  if (i < MEMNET_SOCKETS) {
+    memset(&memnet.sv[i], 0, sizeof(memnet.sv[i]));
+    memnet.sv[i].used = 1;
+    memnet.sv[i].addr.ss_family = domain == PF_INET6 ? AF_INET6 : AF_INET;
+  }
+  pthread_mutex_unlock(&memnet.mtx);
+
+  if (i == MEMNET_SOCKETS) {
+    errno = EMFILE;
+    return -1;
+  }
+
+  return MEMNET_FD_BASE+i;
+}
+
+int
+mem_bind(int fd,
+	 const struct sockaddr *sa,
+	 socklen_t len) {
+  MEMSOCK *sp;
+  int rc = -1;
+
+
+  pthread_mutex_lock(&memnet.mtx);
+  if ((sp = memnet_socket(fd)) == NULL)
+    goto End;
+
+  if (sp->qv || len > sizeof(sp->addr)) {
+    errno = EINVAL;
+    goto End;
+  }
+  if (memnet_lookup(sa)) {
+    errno = EADDRINUSE;
+    goto End;
+  }
+
+  sp->qv = malloc(MEMNET_QUEUE * sizeof(MEMDGRAM));
+  if (!sp->qv)
+    goto End;
+
+  memcpy(&sp->addr, sa, len);
+  sp->addrlen = len;
+  rc = 0;
+
+ End:
+  pthread_mutex_unlock(&memnet.mtx);
+  return rc;
+}
+
+int
+mem_setsockopt(int fd,
+	       int level,
+	       int option,
+	       const void *value,
+	       socklen_t len) {
+  int rc;
+
+
+  pthread_mutex_lock(&memnet.mtx);
+  rc = memnet_socket(fd) ? 0 : -1;
+  pthread_mutex_unlock(&memnet.mtx);
+  return rc;
+}
+
+ssize_t
+mem_sendto(int fd,
+	   const void *buf,
+	   size_t len,
+	   int flags,
+	   const struct sockaddr *sa,
+	   socklen_t salen) {
+  MEMSOCK *sp, *dp;
+  MEMDGRAM *gp;
+  ssize_t rc = -1;
+
+
+  pthread_mutex_lock(&memnet.mtx);
+  if ((sp = memnet_socket(fd)) == NULL)
+    goto End;
+
+  if (len > MEMNET_MTU) {
+    errno = EMSGSIZE;
+    goto End;
+  }
+
+  rc = len;
+  dp = memnet_lookup(sa);
+  if (!dp) {
+    ++memnet.sent;
+    memnet.bytes += len;
+    goto End;
+  }
+
+  /* Like UDP, datagrams to a full queue are lost */
+  if (dp->tail - dp->head >= MEMNET_QUEUE) {
+    ++memnet.dropped;
+    goto End;
+  }
+
+  gp = &dp->qv[dp->tail++ % MEMNET_QUEUE];
+  memcpy(&gp->from, &sp->addr, sizeof(gp->from));
+  gp->fromlen = sp->qv ? sp->addrlen : sizeof(gp->from);
+  gp->len = len;
+  memcpy(gp->buf, buf, len);
+  ++memnet.delivered;
+
+ End:
+  pthread_mutex_unlock(&memnet.mtx);
+  return rc;
+}
+
+ssize_t
+mem_recvfrom(int fd,
+	     void *buf,
+	     size_t size,
+	     int flags,
+	     struct sockaddr *sa,
+	     socklen_t *salen) {
+  MEMSOCK *sp;
+  MEMDGRAM *gp;
+  ssize_t rc = -1;
+
+
+  pthread_mutex_lock(&memnet.mtx);
+  if ((sp = memnet_socket(fd)) == NULL)
+    goto End;
+
+  if (sp->head == sp->tail) {
+    errno = EAGAIN;
+    goto End;
+  }
+
+  gp = &sp->qv[sp->head++ % MEMNET_QUEUE];
+  rc = gp->len < size ? gp->len : size;
+  memcpy(buf, gp->buf, rc);
+  if (sa && salen) {
+    memcpy(sa, &gp->from, *salen < gp->fromlen ? *salen : gp->fromlen);
+    *salen = gp->fromlen;
+  }
+
+ End:
+  pthread_mutex_unlock(&memnet.mtx);
+  return rc;
+}
+
+int
+mem_close(int fd) {
+  MEMSOCK *sp;
+  int rc = -1;
+
+
+  pthread_mutex_lock(&memnet.mtx);
+  if ((sp = memnet_socket(fd)) != NULL) {
+    free(sp->qv);
+    memset(sp, 0, sizeof(*sp));
+    rc = 0;
+  }
+  pthread_mutex_unlock(&memnet.mtx);
+  return rc;
+}
+
+int
+mem_clock_gettime(clockid_t id,
+		  struct timespec *tp) {
+  pthread_mutex_lock(&memnet.mtx);
+  *tp = memnet.now;
+  if (id == CLOCK_REALTIME)
+    timespec_add(tp, &memnet.epoch);
+  pthread_mutex_unlock(&memnet.mtx);
+  return 0;
+}
+
+int
+mem_nanosleep(const struct timespec *req,
+	      struct timespec *rem) {
+  pthread_mutex_lock(&memnet.mtx);
+  timespec_add(&memnet.now, req);
+  pthread_mutex_unlock(&memnet.mtx);
+
+  if (rem)
+    rem->tv_sec = rem->tv_nsec = 0;
+  return 0;
+}
+
+TRANSPORT transport_mem = {
+  "memory",
+  mem_socket,
+  mem_bind,
+  mem_setsockopt,
+  mem_sendto,
+  mem_recvfrom,
+  mem_close,
+  mem_clock_gettime,
+  mem_nanosleep,
+};
+
+TRANSPORT *transport = &transport_sys;
+
+
+/* Close all memory sockets, clear the counters and start the virtual clock at the real time */
+void
+memnet_reset(void) {
+  struct timespec real;
+  int i;
+
+
+  pthread_mutex_lock(&memnet.mtx);
+  for (i = 0; i < MEMNET_SOCKETS; i++) {
+    free(memnet.sv[i].qv);
+    memset(&memnet.sv[i], 0, sizeof(memnet.sv[i]));
+  }
+
+  memnet.sent = memnet.delivered = memnet.dropped = 0;
+  memnet.bytes = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &memnet.now);
+  clock_gettime(CLOCK_REALTIME, &real);
+  memnet.epoch = real;
+  timespec_sub(&memnet.epoch, &memnet.now);
+  pthread_mutex_unlock(&memnet.mtx);
+}
+
+/* 
+ * Format a number with up to three decimals (trailing zeros removed,
+ * like "%g" does) and a unit at the start of buf
+ */
+size_t
+milli2str(unsigned int whole,
+	  unsigned int milli,
+	  const char *unit,
+	  char *buf) {
+  char tmp[16];
+  const char *cp;
+  size_t len;
+
+
+  cp = utoa_end(whole, tmp+sizeof(tmp)-1);
+  len = strlen(cp);
+  memcpy(buf, cp, len);
+
+  if (milli) {
+    buf[len++] = '.';
+    buf[len++] = '0' + milli / 100;
+    if (milli % 100) {
+      buf[len++] = '0' + milli / 10 % 10;
+      if (milli % 10)
+	buf[len++] = '0' + milli % 10;
+    }
+  }
+
+  while (*unit)
+    buf[len++] = *unit++;
+  buf[len] = '\0';
+  return len;
+}
+
+/* Format a time into buf (at least TIMESPEC_STR_SIZE bytes), never allocates */
 char *
-timespec2str(struct timespec *tsp) {
-  char buf[2048];
+timespec2str(const struct timespec *tsp,
+	     char *buf,
+	     size_t size) {
   unsigned int h, m, s, ms, us, ns;
-  float fs, fms, fus;
+  size_t len;
 
 
+  if (size < TIMESPEC_STR_SIZE) {
+    errno = ENOSPC;
+    return NULL;
+  }
+
   h = tsp->tv_sec / 3600;
   m = (tsp->tv_sec - h*3600) / 60;
   s = tsp->tv_sec - h*3600 - m*60;
@@ -450,62 +2108,158 @@ timespec2str(struct timespec *tsp) {
   us = (tsp->tv_nsec - ms * 1000000) / 1000;
   ns = tsp->tv_nsec - ms * 1000000 - us * 1000;
 
-  fs  = (float) s +  (float) ms / 1000.0;
-  fms = (float) ms + (float) us / 1000.0;
-  fus = (float) us + (float) ns / 1000.0;
-
   if (h)
-    sprintf(buf, "%02u:%02u:%02u", h, m, s);
-  else if (m)
-    sprintf(buf, "%um+%gs", m, fs);
-  else if (s)
-    sprintf(buf, "%gs", fs);
+    snprintf(buf, size, "%02u:%02u:%02u", h, m, s);
+  else if (m) {
+    len = milli2str(m, 0, "m+", buf);
+    milli2str(s, ms, "s", buf+len);
+  } else if (s)
+    milli2str(s, ms, "s", buf);
   else if (ms)
-    sprintf(buf, "%gms", fms);
+    milli2str(ms, us, "ms", buf);
   else if (us)
-    sprintf(buf, "%gµs", fus);
+    milli2str(us, ns, "µs", buf);
   else
-    sprintf(buf, "%uns", ns);
+    milli2str(ns, 0, "ns", buf);
 
-  return strdup(buf);
+  return buf;
 }
 
+/* 
+ * Parse a time like "1.5s", "100ms" or "2" (seconds). Exact, the
+ * fraction is kept to the nanosecond.
+ */
 int
 str2timespec(const char *time,
 	     struct timespec *tsp) {
-  float ft;
-  char buf[3];
+  static const struct {
+    const char *name;
+    uint64_t sec;
+    uint64_t nsec;
+  } units[] = {
+    { "",   1,     0 },
+    { "s",  1,     0 },
+    { "m",  60,    0 },
+    { "h",  3600,  0 },
+    { "d",  86400, 0 },
+    { "ms", 0,     1000000 },
+    { "us", 0,     1000 },
+    { "µs", 0,     1000 },
+    { "ns", 0,     1 },
+  };
+  uint64_t v, frac, scale, ns;
+  int i, digits;
+
+
+  while (isspace((unsigned char) *time))
+    ++time;
+  if (*time == '+')
+    ++time;
+
+  v = 0;
+  digits = 0;
+  while (*time >= '0' && *time <= '9') {
+    v = v*10 + *time++ - '0';
+    if (++digits > 12)
+      goto Invalid;
+  }
 
+  frac = 0;
+  scale = 1;
+  if (*time == '.') {
+    ++time;
+    while (*time >= '0' && *time <= '9') {
+      /* Decimals beyond the 12th are ignored */
+      if (scale < 1000000000000ULL) {
+	frac = frac*10 + *time - '0';
+	scale *= 10;
+      }
+      ++time;
+      ++digits;
+    }
+  }
+  if (!digits)
+    goto Invalid;
 
-  memset(buf, 0, 3);
-  if (sscanf(time, "%f%c%c", &ft, buf+0, buf+1) < 1)
-    return -1;
-  
-  if (strcmp(buf, "s") == 0 || !*buf) {
-    tsp->tv_sec  = ft;
-    tsp->tv_nsec = (ft-tsp->tv_sec)*1000000000.0;
-  } else if (strcmp(buf, "m") == 0) {
-    tsp->tv_sec  = ft*60;
-    tsp->tv_nsec = (ft-tsp->tv_sec*60)/6.0*100000000.0;;
-  } else if (strcmp(buf, "h") == 0) {
-    tsp->tv_sec  = ft*60*60;
-    tsp->tv_nsec = 0;
-  } else if (strcmp(buf, "d") == 0) {
-    tsp->tv_sec  = ft*60*60*24;
-    tsp->tv_nsec = 0;
-  } else if (strcmp(buf, "ms") == 0) {
-    tsp->tv_sec  = ft/1000.0;
-    tsp->tv_nsec = ft*1000000.0;
-  } else if (strcmp(buf, "us") == 0 || strcmp(buf, "µs") == 0) {
-    tsp->tv_sec  = ft/1000000.0;
-    tsp->tv_nsec = ft*1000.0;
-  } else if (strcmp(buf, "ns") == 0) {
-    tsp->tv_sec  = ft/1000000000.0;
-    tsp->tv_nsec = ft;
-  } else 
-    return -1;
+  for (i = 0; i < sizeof(units)/sizeof(units[0]) && strcmp(time, units[i].name) != 0; i++)
+    ;
+  if (i >= sizeof(units)/sizeof(units[0]))
+    goto Invalid;
+
+  if (units[i].sec) {
+    tsp->tv_sec = v * units[i].sec;
+    ns = frac * units[i].sec;
+    tsp->tv_sec += ns / scale;
+    tsp->tv_nsec = (ns % scale) * 1000000000ULL / scale;
+  } else {
+    ns = v * units[i].nsec + frac * units[i].nsec / scale;
+    tsp->tv_sec = ns / 1000000000ULL;
+    tsp->tv_nsec = ns % 1000000000ULL;
+  }
+
+  if (tsp->tv_sec > INT_MAX)
+    goto Invalid;
 
   return tsp->tv_sec;
+
+ Invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+
+/* Parse a CPU list like "0-3,6,8" */
+int
+str2cpus(const char *str,
+	 int **cpuvp,
+	 size_t *cpucp) {
+  int *cpuv = NULL, *nv;
+  size_t cpuc = 0;
+  unsigned long c1, c2;
+  char *end;
+
+
+  while (*str) {
+    if (!isdigit((unsigned char) *str))
+      goto Invalid;
+    c1 = strtoul(str, &end, 10);
+    c2 = c1;
+    if (*end == '-') {
+      if (!isdigit((unsigned char) end[1]))
+	goto Invalid;
+      c2 = strtoul(end+1, &end, 10);
+    }
+    if (c2 < c1 || c2 >= MAX_CPUS || cpuc+c2-c1+1 > MAX_CPUS)
+      goto Invalid;
+    if (*end == ',' && end[1])
+      ++end;
+    else if (*end)
+      goto Invalid;
+    str = end;
+
+    nv = realloc(cpuv, (cpuc+c2-c1+1) * sizeof(int));
+    if (!nv) {
+      free(cpuv);
+      return -1;
+    }
+    cpuv = nv;
+
+    for (; c1 <= c2; c1++)
+      cpuv[cpuc++] = c1;
+  }
+
+  if (cpuc == 0)
+    goto Invalid;
+
+  free(*cpuvp);
+  *cpuvp = cpuv;
+  *cpucp = cpuc;
+  return cpuc;
+
+ Invalid:
+  free(cpuv);
+  errno = EINVAL;
+  return -1;
 }
 
 
@@ -639,885 +2393,8361 @@ gw_create(const char *name) {
   return gp;
 }
 
-int
-gw_add_port(GATEWAY *gp,
-	    const char *port) {
-  if (!port)
-    return -1;
+GATEWAY *
+proxy_create(const char *name) {
+  GATEWAY *gp, **tgp;
 
-  if (gp->port)
-    free(gp->port);
-  
-  gp->port = strdup(port);
-  return 0;
-}
 
-int
-gw_add_delay(GATEWAY *gp,
-	       const char *delay) {
-  if (!delay)
-    return -1;
+  for (tgp = &proxies; (gp = *tgp) != NULL; tgp = &gp->next)
+    if (name && gp->name && strcmp(gp->name, name) == 0)
+      return gp;
 
-  return str2timespec(delay, &gp->delay);
-}
+  gp = malloc(sizeof(*gp));
+  if (!gp)
+    return NULL;
 
-int
-gw_add_copies(GATEWAY *gp,
-	      const char *copies) {
-  if (copies && sscanf(copies, "%u", &gp->copies) == 1)
-    return 0;
+  memset(gp, 0, sizeof(*gp));
+  if (name)
+    gp->name = strdup(name);
+  gp->address = strdup(DEFAULT_PROXY_ADDRESS);
+  gp->port = strdup(DEFAULT_PROXY_PORT);
 
-  return -1;
+  *tgp = gp;
+  return gp;
 }
 
+
 int
-gw_add_ttl(GATEWAY *gp,
-           const char *ttl) {
-  if (ttl && sscanf(ttl, "%u", &gp->ttl) == 1)
-    return 0;
+gw_resolve(GATEWAY *gp,
+	   const char *addr,
+	   const char *port,
+	   int passive) {
+  struct addrinfo hints, *aip, *next;
+  int rc;
 
-  return -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  if (passive)
+    hints.ai_flags = AI_PASSIVE;
+
+  PROBE2(resolve__start, addr, port);
+
+  aip = NULL;
+  rc = getaddrinfo(addr, port, &hints, &aip);
+
+  PROBE2(resolve__done, addr, rc);
+
+  if (rc != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (; aip; aip = next) {
+    next = aip->ai_next;
+    aip->ai_next = NULL;
+    if (!target_add(&gp->targets, aip))
+      return -1;
+  }
+
+  return 0;
 }
 
+
 int
-gw_add_secret(GATEWAY *gp,
-	      const char *secret) {
-  if (!secret)
+gw_add_port(GATEWAY *gp,
+	    const char *port) {
+  if (!port)
     return -1;
+
+  if (gp->port)
+    free(gp->port);
   
-  return str2secret(secret, &gp->secret);
+  gp->port = strdup(port);
+  return 0;
 }
 
+int
+gw_add_delay(GATEWAY *gp,
+	       const char *delay) {
+  if (!delay)
+    return -1;
 
+  return str2timespec(delay, &gp->delay);
+}
 
-HOST *
-host_lookup(const char *name) {
-  HOST *hp;
+/* A number or "adaptive" */
+int
+str2copies(const char *str,
+	   unsigned int *copies) {
+  if (!str)
+    return -1;
 
-  if (!name)
-    return NULL;
-  
-  for (hp = hosts; hp && strcmp(hp->name, name) != 0; hp = hp->next)
-    ;
+  if (strcmp(str, "adaptive") == 0) {
+    *copies = COPIES_ADAPTIVE;
+    return 0;
+  }
 
-  if (!hp)
-    errno = ENXIO;
+  if (sscanf(str, "%u", copies) != 1) {
+    errno = EINVAL;
+    return -1;
+  }
 
-  return hp;
+  return 0;
+}
+
+char *
+copies2str(unsigned int copies,
+	   char *buf,
+	   size_t size) {
+  if (copies == COPIES_ADAPTIVE)
+    snprintf(buf, size, "adaptive");
+  else
+    snprintf(buf, size, "%u", copies);
+
+  return buf;
 }
 
 int
-host_add_mac(HOST *hp,
-	     const char *mac) {
-  struct ether_addr *ep;
+stats_cmp(const void *a,
+	  const void *b) {
+  return memcmp(&((const MACSTATS *) a)->mac, &((const MACSTATS *) b)->mac, MAC_SIZE);
+}
 
+MACSTATS *
+stats_lookup(const struct ether_addr *mac) {
+  MACSTATS key;
 
-  if (!mac)
-    return -1;
 
-#if HAVE_ETHER_HOSTTON
-  if (ether_hostton(mac, &hp->mac) == 0)
-    return 0;
-#endif
+  if (!statc)
+    return NULL;
 
-  ep = ether_aton(mac);
-  if (ep) {
-    hp->mac = *ep;
-    return 0;
-  }
-  
-  errno = EINVAL;
-  return -1;
+  key.mac = *mac;
+  return bsearch(&key, statv, statc, sizeof(MACSTATS), stats_cmp);
 }
 
+/* Packets a host needed lately, or the fallback if it has no history */
+unsigned int
+stats_copies(const struct ether_addr *mac,
+	     unsigned int fallback) {
+  MACSTATS *msp;
+  unsigned int n;
 
-HOST *
-host_create(const char *name) {
-  HOST *hp, **thp;
 
+  pthread_rwlock_rdlock(&stats_lock);
+  msp = stats_lookup(mac);
+  n = msp ? msp->needed : 0;
+  pthread_rwlock_unlock(&stats_lock);
+  if (!n)
+    return fallback;
 
-  if (!name)
-    return NULL;
+  /* Needed is kept in 1/16ths */
+  n = (n+15) / 16;
+  return n > MAX_ADAPTIVE_COPIES ? MAX_ADAPTIVE_COPIES : n;
+}
 
-  hp = host_lookup(name);
-  if (hp)
-    return hp;
+/* Read a statistics file sorted by MAC, a missing one is just empty */
+int
+stats_read(const char *path,
+	   MACSTATS **vp,
+	   size_t *cp,
+	   struct stat *sp) {
+  char magic[8];
+  MACSTATS *v, *nv, ms;
+  size_t c, size;
+  FILE *fp;
 
-  hp = malloc(sizeof(*hp));
-  if (!hp)
-    return NULL;
 
-  memset(hp, 0, sizeof(*hp));
-  hp->name = strdup(name);
+  *vp = NULL;
+  *cp = 0;
+  if (sp)
+    memset(sp, 0, sizeof(*sp));
 
-  /* Try to lookup mac via name in ethers file */
-  (void) host_add_mac(hp, name);
+  fp = fopen(path, "r");
+  if (!fp)
+    return errno == ENOENT ? 0 : -1;
 
-#if 0
-  if (gp) {
-    hp->via    = gp;
+  if (sp && fstat(fileno(fp), sp) < 0)
+    goto Fail;
 
-    hp->copies = gp->copies;
-    hp->delay  = gp->delay;
-    hp->secret = gp->secret;
+  if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, STATS_MAGIC, sizeof(magic)) != 0) {
+    errno = EINVAL;
+    goto Fail;
   }
-#endif
 
-  for (thp = &hosts; *thp; thp = &((*thp)->next))
-    ;
+  v = NULL;
+  c = size = 0;
+  while (fread(&ms, sizeof(ms), 1, fp) == 1) {
+    if (c >= size) {
+      size = size ? size*2 : 256;
+      nv = realloc(v, size * sizeof(MACSTATS));
+      if (!nv) {
+	free(v);
+	goto Fail;
+      }
+      v = nv;
+    }
+    v[c++] = ms;
+  }
 
-  *thp = hp;
-  return hp;
-}
+  fclose(fp);
+  if (c)
+    qsort(v, c, sizeof(MACSTATS), stats_cmp);
+  *vp = v;
+  *cp = c;
+  return 0;
 
+ Fail:
+  fclose(fp);
+  return -1;
+}
 
+/* Use a new statistics table, keeping a copy to merge with when saving */
 int
-group_add_delay(HOSTGROUP *hgp,
-		const char *delay) {
-  if (!delay)
-    return -1;
-  
-  return str2timespec(delay, &hgp->delay);
-}
+stats_set(MACSTATS *v,
+	  size_t c) {
+  MACSTATS *bv, *ov, *obv;
 
 
+  bv = malloc((c ? c : 1) * sizeof(MACSTATS));
+  if (!bv)
+    return -1;
+  if (c)
+    memcpy(bv, v, c * sizeof(MACSTATS));
+
+  pthread_rwlock_wrlock(&stats_lock);
+  ov = statv;
+  obv = statbv;
+  statv = v;
+  statc = stats = c;
+  statbv = bv;
+  statbc = c;
+  pthread_rwlock_unlock(&stats_lock);
+
+  free(ov);
+  free(obv);
+  return 0;
+}
 
+/* Load the statistics file, a missing one is just empty */
 int
-group_add_host(HOSTGROUP *hgp, 
-	       HOST *hp) {
-  int i;
+stats_load(const char *path) {
+  struct stat st;
+  MACSTATS *v;
+  size_t c;
 
 
-  if (!hgp)
+  if (stats_read(path, &v, &c, &st) < 0)
     return -1;
 
-  if (!hp)
+  if (stats_set(v, c) < 0) {
+    free(v);
     return -1;
+  }
 
-  for (i = 0; i < hgp->hc && hp != hgp->hv[i]; i++)
-    ;
+  stats_dev = st.st_dev;
+  stats_ino = st.st_ino;
+  stats_mtime = st.st_mtime;
+  return 0;
+}
 
-  if (i < hgp->hc)
-    return hgp->hc;
+/* 
+ * Write the statistics file, adding what changed here since it was
+ * loaded to what is in it now, so concurrent runs do not lose each
+ * other's wakes. Counters are summed, the moving averages are taken
+ * from the latest wake. The file is locked (via path.lock) while
+ * merging and written to a temporary file that is renamed over it, so
+ * a crash never leaves a partial one.
+ */
+int
+stats_save(const char *path) {
+  MACSTATS *dv, *nv, *msp, *bsp, *dsp;
+  size_t dc, ds, n, i;
+  char *lock, *tmp;
+  FILE *fp;
+  int lfd, fd, err, rc = -1;
 
-  if (hgp->hc >= hgp->hs) {
-    hgp->hs += DEFAULT_HOSTGROUP_HOSTS;
-    hgp->hv = realloc(hgp->hv, hgp->hs * sizeof(HOST *));
-    if (!hgp->hv)
-      return -1;
-  }
 
-  hgp->hv[hgp->hc++] = hp;
-  return hgp->hc;
-}
+  lock = strdupcat(path, ".lock", NULL);
+  tmp = strdupcat(path, ".XXXXXX", NULL);
+  lfd = fd = -1;
+  dv = NULL;
+  if (!lock || !tmp)
+    goto End;
 
+  lfd = open(lock, O_RDWR|O_CREAT, 0644);
+  if (lfd < 0 || flock(lfd, LOCK_EX) < 0)
+    goto End;
 
+  if (stats_read(path, &dv, &dc, NULL) < 0)
+    goto End;
 
-int
-host_add_via(HOST *hp,
-	     const char *via) {
-  HOSTGROUP *hgp;
+  n = ds = dc;
+  for (i = 0; i < statc; i++) {
+    msp = &statv[i];
+    bsp = statbc ? bsearch(msp, statbv, statbc, sizeof(MACSTATS), stats_cmp) : NULL;
+    if (bsp && memcmp(msp, bsp, sizeof(MACSTATS)) == 0)
+      continue;
 
-  if (!via)
-    return -1;
+    /* Only the entries read are sorted, the ones added are all new */
+    dsp = n ? bsearch(msp, dv, n, sizeof(MACSTATS), stats_cmp) : NULL;
+    if (!dsp) {
+      if (dc >= ds) {
+	ds = ds ? ds*2 : 256;
+	nv = realloc(dv, ds * sizeof(MACSTATS));
+	if (!nv)
+	  goto End;
+	dv = nv;
+      }
+      dsp = &dv[dc++];
+      memset(dsp, 0, sizeof(*dsp));
+      dsp->mac = msp->mac;
+    }
 
-  hp->via = gw_lookup(via);
-  if (!hp->via)
-    return -1;
+    dsp->attempts += msp->attempts - (bsp ? bsp->attempts : 0);
+    dsp->successes += msp->successes - (bsp ? bsp->successes : 0);
+    dsp->first_try += msp->first_try - (bsp ? bsp->first_try : 0);
+    dsp->packets += msp->packets - (bsp ? bsp->packets : 0);
+    if (!bsp || msp->needed != bsp->needed)
+      dsp->needed = msp->needed;
+    if (!bsp || msp->alive_ms != bsp->alive_ms)
+      dsp->alive_ms = msp->alive_ms;
+  }
+  if (dc > n)
+    qsort(dv, dc, sizeof(MACSTATS), stats_cmp);
 
-  hgp = group_lookup(hp->via->name);
-  group_add_host(hgp, hp);
+  fd = mkstemp(tmp);
+  if (fd < 0)
+    goto End;
 
-  return 0;
-}
+  fp = fdopen(fd, "w");
+  if (!fp)
+    goto End;
+  fd = -1;
 
-int
-host_add_name(HOST *hp,
-	      const char *name) {
-  if (!name)
-    return -1;
- 
-  if (hp->name)
-    free(hp->name);
+  rc = 0;
+  if (fchmod(fileno(fp), 0644) < 0 ||
+      fwrite(STATS_MAGIC, strlen(STATS_MAGIC), 1, fp) != 1 ||
+      (dc && fwrite(dv, sizeof(MACSTATS), dc, fp) != dc) ||
+      fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+    rc = -1;
 
-  hp->name = strdup(name);
-  return 0;
-}
+  if (fclose(fp) != 0)
+    rc = -1;
 
-int
-host_add_delay(HOST *hp,
-	       const char *delay) {
-  if (!delay)
-    return -1;
+  if (rc == 0 && rename(tmp, path) < 0)
+    rc = -1;
+
+  if (rc < 0)
+    (void) unlink(tmp);
+  else if (stats_set(dv, dc) == 0)
+    dv = NULL;
 
-  return str2timespec(delay, &hp->delay);
+ End:
+  err = errno;
+  if (fd >= 0) {
+    close(fd);
+    (void) unlink(tmp);
+  }
+  if (lfd >= 0)
+    close(lfd);
+  free(dv);
+  free(tmp);
+  free(lock);
+  errno = err;
+  return rc;
 }
 
+/* 
+ * Learn from a verified wake. The packets are those sent until the host
+ * was seen up (copies times the wake and its resends), which is only an
+ * estimate of what it needed since any one of them may have woken it.
+ */
 int
-host_add_copies(HOST *hp,
-		const char *copies) {
-  if (!copies || sscanf(copies, "%u", &hp->copies) != 1)
-    return -1;
+stats_update(const struct ether_addr *mac,
+	     int up,
+	     int first_try,
+	     unsigned int packets,
+	     const struct timespec *alive) {
+  MACSTATS *msp;
+  unsigned int sample;
+  size_t i;
+
+
+  msp = stats_lookup(mac);
+  if (!msp) {
+    if (statc >= stats) {
+      stats = stats ? stats*2 : 256;
+      statv = realloc(statv, stats * sizeof(MACSTATS));
+      if (!statv)
+	return -1;
+    }
+
+    for (i = statc; i > 0 && memcmp(&statv[i-1].mac, mac, MAC_SIZE) > 0; i--)
+      statv[i] = statv[i-1];
+    msp = &statv[i];
+    ++statc;
+
+    memset(msp, 0, sizeof(*msp));
+    msp->mac = *mac;
+  }
+
+  ++msp->attempts;
+  if (!up)
+    return 0;
+
+  ++msp->successes;
+  msp->packets += packets;
+  if (first_try)
+    ++msp->first_try;
+
+  /* 
+   * Moving average of the packets needed. A first try success might
+   * have needed fewer, so count one less to slowly probe for that.
+   */
+  sample = packets;
+  if (first_try && sample > 1)
+    --sample;
+  if (sample > MAX_ADAPTIVE_COPIES)
+    sample = MAX_ADAPTIVE_COPIES;
+
+  if (!msp->needed)
+    msp->needed = sample*16;
+  else
+    msp->needed = ((int) msp->needed*3 + (int) sample*16) / 4;
+
+  if (!msp->alive_ms)
+    msp->alive_ms = timespec2ns(alive) / 1000000;
+  else
+    msp->alive_ms = (msp->alive_ms*3ULL + timespec2ns(alive) / 1000000) / 4;
 
   return 0;
 }
 
+
 int
-host_add_ttl(HOST *hp,
-             const char *ttl) {
-  if (!ttl || sscanf(ttl, "%u", &hp->ttl) != 1)
-    return -1;
+gw_add_copies(GATEWAY *gp,
+	      const char *copies) {
+  return str2copies(copies, &gp->copies);
+}
 
-  return 0;
+int
+gw_add_ttl(GATEWAY *gp,
+           const char *ttl) {
+  if (ttl && sscanf(ttl, "%u", &gp->ttl) == 1)
+    return 0;
+
+  return -1;
 }
 
 int
-host_add_secret(HOST *hp,
-		const char *secret) {
+gw_add_secret(GATEWAY *gp,
+	      const char *secret) {
   if (!secret)
     return -1;
+  
+  return str2secret(secret, &gp->secret);
+}
+
 
-  return str2secret(secret, &hp->secret);
+
+/* Host by id */
+HOST *
+host_get(uint32_t id) {
+  return &hosttab.chunkv[id / HOST_CHUNK_SIZE][id % HOST_CHUNK_SIZE];
 }
 
+/* A new, zeroed, host at the end of the host table */
+HOST *
+host_alloc(void) {
+  uint32_t c = hosttab.n / HOST_CHUNK_SIZE;
+  HOST *hp;
 
 
+  if (c >= HOST_MAX_CHUNKS) {
+    errno = ENOSPC;
+    return NULL;
+  }
 
-void
-gw_print(GATEWAY *gp) {
-  TARGET *tp;
-  unsigned int i;
+  if (!hosttab.chunkv[c]) {
+    hosttab.chunkv[c] = calloc(HOST_CHUNK_SIZE, sizeof(HOST));
+    if (!hosttab.chunkv[c])
+      return NULL;
+  }
 
+  hp = &hosttab.chunkv[c][hosttab.n % HOST_CHUNK_SIZE];
+  hp->id = hosttab.n++;
+  return hp;
+}
 
-  if (f_verbose) {
-    printf("Gateway %s:\n", gp->name);
-    
-    if (gp->copies)
-      printf("  %-10s  %u\n", "Copies", gp->copies);
-    if (gp->delay.tv_sec || gp->delay.tv_nsec)
-      printf("  %-10s  %s\n", "Delay",  timespec2str(&gp->delay));
-    if (gp->ttl)
-      printf("  %-10s  %u\n", "TTL", gp->ttl);
-    if (gp->secret.size > 0)
-      printf("  %-10s  %s\n", "Secret", secret2str(&gp->secret));
-    printf("  Targets:\n");
-    i = 0;
-    for (tp = gp->targets; tp; tp = tp->next) {
-      char *dest = target2str(tp);
-      
-      printf("    %-2u        %s\n", i+1, dest ? dest : "???");
-      if (dest)
-	free(dest);
-      ++i;
-    }
+/* Settings of a host for changing them, allocated when first needed */
+HOSTOPTS *
+host_opts(HOST *hp) {
+  if (!hp->opts) {
+    hp->opts = calloc(1, sizeof(HOSTOPTS));
+    if (hp->opts)
+      ++hosttab.opts;
+  }
 
-  } else {
+  return hp->opts;
+}
 
-    printf("gateway %s", gp->name);
-    if (gp->address && strcmp(gp->address, gp->name) != 0)
-      printf(" address %s", gp->address);
-    if (gp->port && strcmp(gp->port, default_gw->port) != 0)
-      printf(" port %s", gp->port);
-    if (gp->copies && gp->copies != default_gw->copies)
-      printf(" copies %u", gp->copies);
-    if ((gp->delay.tv_sec || gp->delay.tv_nsec) && 
-	!(gp->delay.tv_sec == default_gw->delay.tv_sec && gp->delay.tv_nsec == default_gw->delay.tv_nsec))
-      printf(" delay %s", timespec2str(&gp->delay));
-    if (gp->secret.size > 0 && (gp->secret.size != default_gw->secret.size || memcmp(gp->secret.buf, default_gw->secret.buf, gp->secret.size) != 0))
-      printf(" secret %s", secret2str(&gp->secret));
-    putchar('\n');
+/* FNV-1a */
+uint64_t
+str_hash(const char *str) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+
+
+  while (*str) {
+    h ^= (unsigned char) *str++;
+    h *= 0x100000001B3ULL;
   }
+
+  return h;
 }
 
+int
+host_cmp_name(const void *a,
+	      const void *b) {
+  return strcmp(host_get(*(const uint32_t *) a)->name, host_get(*(const uint32_t *) b)->name);
+}
 
-void
-host_print(HOST *hp) {
-  if (f_verbose) {
-    printf("Host %s:\n", hp->name);
-    
-    printf("  %-10s  %s\n", "MAC", ether_ntoa(&hp->mac));
-    if (hp->via)
-      printf("  %-10s  %s\n", "Gateway", hp->via->name);
-    if (hp->copies)
-      printf("  %-10s  %u\n", "Copies", hp->copies);
-    if (hp->ttl)
-      printf("  %-10s  %u\n", "TTL", hp->ttl);
-    if (hp->delay.tv_sec || hp->delay.tv_nsec)
-      printf("  %-10s  %s\n", "Delay",  timespec2str(&hp->delay));
-    if (hp->secret.size > 0)
-      printf("  %-10s  %s\n", "Secret", secret2str(&hp->secret));
-  } else {
-    printf("host %s", hp->name);
-    printf(" mac %s", ether_ntoa(&hp->mac));
-    if (hp->via && group_lookup(hp->via->name) == NULL)
-      printf(" via %s", hp->via->name);
-    if (hp->copies)
-      printf(" copies %u", hp->copies);
-    if (hp->delay.tv_sec || hp->delay.tv_nsec)
-      printf(" delay %s", timespec2str(&hp->delay));
-    if (hp->secret.size > 0)
-      printf(" secret %s", secret2str(&hp->secret));
-    putchar('\n');
-  }
+int
+host_cmp_mac(const void *a,
+	     const void *b) {
+  return memcmp(&host_get(*(const uint32_t *) a)->mac, &host_get(*(const uint32_t *) b)->mac, MAC_SIZE);
 }
 
-void
-group_print(HOSTGROUP *hgp) {
-  int i;
+/* Sort the host ids by name and by MAC, once all configuration is read */
+int
+host_sort(void) {
+  static const struct ether_addr zero_mac;
+  uint32_t id, *nv, *mv, size;
 
-  if (f_verbose) {
-    printf("Hostgroup %s:\n", hgp->name);
-    if (hgp->delay.tv_sec || hgp->delay.tv_nsec)
-      printf("  %-10s  %s\n", "Delay",  timespec2str(&hgp->delay));
-    if (hgp->hc > 0)
-      printf("  Hosts:\n");
-    for (i = 0; i < hgp->hc; i++)
-      printf("    %2d        %s\n", i+1, hgp->hv[i]->name);
-  } else {
-    printf("[%s]\n", hgp->name);
-    if (hgp->delay.tv_sec || hgp->delay.tv_nsec)
-      printf("delay %s\n", timespec2str(&hgp->delay));
-    for (i = 0; i < hgp->hc; i++) {
-      HOST *hp = hgp->hv[i];
 
-      printf("host %s", hp->name);
+  if (hosttab.sorted)
+    return 0;
 
-#if 0
-      if (!hp->via || (hp->via && strcmp(hp->via->name, hgp->name) == 0)) {
-	if (hp->copies)
-	  printf(" copies %u", hp->copies);
-	if (hp->delay.tv_sec || hp->delay.tv_nsec)
-	  printf(" delay %s", timespec2str(&hp->delay));
-	if (hp->secret.size > 0)
-	  printf(" secret %s", secret2str(&hp->secret));
-      }
-#endif
-      
-      putchar('\n');
-    }
+  size = hosttab.n > 1024 ? hosttab.n : 1024;
+  nv = realloc(hosttab.byname, size * sizeof(uint32_t));
+  if (!nv)
+    return -1;
+  hosttab.byname = nv;
+
+  mv = realloc(hosttab.bymac, size * sizeof(uint32_t));
+  if (!mv)
+    return -1;
+  hosttab.bymac = mv;
+  hosttab.bysize = size;
+
+  /* Hosts without a MAC can not match a MAC prefix */
+  hosttab.bynamec = hosttab.bymacc = 0;
+  for (id = 0; id < hosttab.n; id++) {
+    if (host_get(id)->name)
+      nv[hosttab.bynamec++] = id;
+    if (memcmp(&host_get(id)->mac, &zero_mac, MAC_SIZE) != 0)
+      mv[hosttab.bymacc++] = id;
   }
+
+  qsort(nv, hosttab.bynamec, sizeof(uint32_t), host_cmp_name);
+  qsort(mv, hosttab.bymacc, sizeof(uint32_t), host_cmp_mac);
+  hosttab.sorted = 1;
+  return 0;
 }
- 
- void
-   buf_print(FILE *fp,
-	  void *buf, 
-	  size_t size) {
-  unsigned char *bp = (unsigned char *) buf;
-  int i;
 
-  putc('\t', fp);
-  for (i = 0; i < size; i++) {
-    if (i > 0) {
-      if ((i & 15) == 0) {
-	putc('\n', fp);
-	putc('\t', fp);
-      } else
-	putc(':', fp);
-    }
-    fprintf(fp, "%02X", (unsigned int) bp[i]);
+/* Insert (add) or remove a host in a sorted index, found by its current key */
+int
+host_sort_update(uint32_t *iv,
+		 uint32_t *cp,
+		 HOST *hp,
+		 int (*cmp)(const void *, const void *),
+		 int add) {
+  uint32_t lo, hi, mid, i;
+
+
+  for (lo = 0, hi = *cp; lo < hi; ) {
+    mid = lo + (hi-lo)/2;
+    if (cmp(&iv[mid], &hp->id) < 0)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+
+  if (add) {
+    memmove(iv+lo+1, iv+lo, (*cp-lo) * sizeof(uint32_t));
+    iv[lo] = hp->id;
+    ++*cp;
+    return 0;
   }
-  putc('\n', fp);
-}
 
+  /* Others may share the key */
+  for (i = lo; i < *cp && iv[i] != hp->id && cmp(&iv[i], &hp->id) == 0; i++)
+    ;
+  if (i < *cp && iv[i] == hp->id) {
+    memmove(iv+i, iv+i+1, (*cp-i-1) * sizeof(uint32_t));
+    --*cp;
+  }
+  return 0;
+}
 
+/* Room for one more host in the sorted indexes */
 int
-mac_invalid(struct ether_addr *mac) {
-  int i;
+host_sort_grow(void) {
+  uint32_t *nv, *mv, size;
 
 
-  for (i = 0; i < 6 && mac->ether_addr_octet[i] == 0; i++)
-    ;
+  if (hosttab.bynamec < hosttab.bysize && hosttab.bymacc < hosttab.bysize)
+    return 0;
 
-  /* All 0x00 bytes - no MAC set */
-  if (i == 6) {
-    errno = EFAULT;
+  size = hosttab.bysize*2;
+  nv = realloc(hosttab.byname, size * sizeof(uint32_t));
+  if (!nv)
     return -1;
-  }
+  hosttab.byname = nv;
 
+  mv = realloc(hosttab.bymac, size * sizeof(uint32_t));
+  if (!mv)
+    return -1;
+  hosttab.bymac = mv;
+  hosttab.bysize = size;
   return 0;
 }
 
-
+/* A host in the host table, once the sorted indexes are built */
 int
-send_wol_host(HOST *hp) {
-  int i, j;
-  int rc;
-  char *msg;
-  size_t msg_size;
-  GATEWAY *gp = NULL;
-  SECRET *sp = NULL;
-  TARGET *tp = NULL;
-  struct timespec delay;
-  unsigned int copies;
-  unsigned int ttl;
+host_sorted(const HOST *hp) {
+  return hosttab.sorted && hp->id != HOST_NO_ID && hp->id < hosttab.n && host_get(hp->id) == hp;
+}
 
+/* Add or remove a host by its current name */
+int
+host_sort_name(HOST *hp,
+	       int add) {
+  if (!host_sorted(hp) || !hp->name)
+    return 0;
 
-  if (!hp)
+  if (add && host_sort_grow() < 0)
     return -1;
 
-  if (mac_invalid(&hp->mac)) {
-    errno = EINVAL;
-    return -1;
-  }
+  return host_sort_update(hosttab.byname, &hosttab.bynamec, hp, host_cmp_name, add);
+}
 
-  if (f_gateway) {
-    gp = gw_lookup(f_gateway);
-    if (!gp) {
-      errno = EINVAL;
-      return -1;
-    }
-  } else {
-      gp = hp->via;
-  }
-  if (!gp)
-    gp = default_gw;
-  hp->via = gp;
+/* Add or remove a host by its current MAC, if it has one */
+int
+host_sort_mac(HOST *hp,
+	      int add) {
+  static const struct ether_addr zero_mac;
 
 
-  if (f_copies) {
-    if (host_add_copies(hp, f_copies) < 0) {
-      errno = EINVAL;
-      return -1;
-    }
-  }
-  copies = hp->copies;
-  if (!copies && hp->via)
-    copies = hp->via->copies;
-  if (!copies)
-    copies = 1;
+  if (!host_sorted(hp) || memcmp(&hp->mac, &zero_mac, MAC_SIZE) == 0)
+    return 0;
 
-  if (f_ttl) {
-    if (host_add_ttl(hp, f_ttl) < 0) {
-      errno = EINVAL;
-      return -1;
-    }
-  }
-  ttl = hp->ttl;
-  if (!ttl && hp->via)
-    ttl = hp->via->ttl;
-  if (!ttl)
-    ttl = 0;
+  if (add && host_sort_grow() < 0)
+    return -1;
 
-  if (f_delay) {
-    if (host_add_delay(hp, f_delay) < 0) {
-      errno = EINVAL;
-      return -1;
-    }
-  }
-  delay = hp->delay;
-  if (delay.tv_sec == 0 && delay.tv_nsec == 0 && hp->via)
-    delay = hp->via->delay;
+  return host_sort_update(hosttab.bymac, &hosttab.bymacc, hp, host_cmp_mac, add);
+}
 
-  if (f_secret) {
-    if (host_add_secret(hp, f_secret) < 0) {
-      errno = EINVAL;
+/* Add a host to the name index, keeping it below 50% full */
+int
+host_index_name(HOST *hp) {
+  uint32_t *nv, id;
+  size_t ns, i, j;
+
+
+  if ((hosttab.namec+1)*2 > hosttab.names) {
+    ns = hosttab.names ? hosttab.names*2 : 1024;
+    nv = malloc(ns * sizeof(uint32_t));
+    if (!nv)
       return -1;
-    }
-  }
-  sp = &hp->secret;
-  if (sp->size == 0 && hp->via)
-    sp = &hp->via->secret;
-  
-  msg_size = WOL_BODY_SIZE;
-  if (sp)
-    msg_size += sp->size;
 
-  msg = malloc(msg_size);
-  if (!msg)
-    return -3;
-    
-  memset(msg, 0xFF, MAC_SIZE);
+    for (i = 0; i < ns; i++)
+      nv[i] = HOST_NO_ID;
 
-  for (i = 0; i < MAC_COPIES; i++)
-    memcpy(msg+HEADER_SIZE+i*MAC_SIZE, &hp->mac, MAC_SIZE);
+    for (j = 0; j < hosttab.names; j++) {
+      if ((id = hosttab.namev[j]) == HOST_NO_ID)
+	continue;
 
-  if (sp)
-    memcpy(msg+HEADER_SIZE+i*MAC_SIZE, sp->buf, sp->size);
+      for (i = str_hash(host_get(id)->name) & (ns-1); nv[i] != HOST_NO_ID; i = (i+1) & (ns-1))
+	;
+      nv[i] = id;
+    }
 
-  if (f_debug) {
-    fprintf(stderr, "[%s (%s)", hp->name, ether_ntoa(&hp->mac));
-    if (sp && sp->size)
-      fprintf(stderr, " with secret %s", secret2str(sp));
-    fprintf(stderr, "]\n");
+    free(hosttab.namev);
+    hosttab.namev = nv;
+    hosttab.names = ns;
   }
 
-  if (f_debug > 2) {
-    fprintf(stderr, "UDP Packet:\n");
-    buf_print(stderr, msg, msg_size);
-  }
+  /* A renamed host keeps its old entry, it just never matches again */
+  for (i = str_hash(hp->name) & (hosttab.names-1); hosttab.namev[i] != HOST_NO_ID; i = (i+1) & (hosttab.names-1))
+    ;
+  hosttab.namev[i] = hp->id;
+  ++hosttab.namec;
+  return host_sort_name(hp, 1);
+}
 
-  if (f_verbose && !f_debug) {
-    printf("%s (%s)", hp->name, ether_ntoa(&hp->mac));
-    fflush(stdout);
-  }
+const SECRET *
+secret_get(uint32_t i) {
+  if (i == 0)
+    return &no_secret;
 
-  for (tp = gp->targets; tp; tp = tp->next) {
-    struct addrinfo *aip = tp->aip;
+  return &hosttab.secretv[i / SECRET_CHUNK_SIZE][i % SECRET_CHUNK_SIZE];
+}
 
-    if (!aip)
-      continue;
+uint64_t
+secret_hash(const SECRET *sp) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  size_t i;
 
-    for (j = 0; j < copies; j++) {
-      if (j > 0 && (delay.tv_sec || delay.tv_nsec)) {
-	/* Inter-packet delay */
-	struct timespec t_delay = delay;
-	
-	if (f_debug)
-	  fprintf(stderr, "(Sleeping %s)\n", timespec2str(&delay));
-	
-	while ((rc = nanosleep(&t_delay, &t_delay)) < 0 && errno == EINTR) {
-	  if (f_debug)
-	    fprintf(stderr, "(Sleeping %s more)\n", timespec2str(&delay));
-	}
 
-	if (rc < 0) {
-	  free(msg);
-	  return -1;
-	}
-      }
-      
-      if (f_debug) {
-	char *dest = target2str(tp);
+  for (i = 0; i < sp->size; i++) {
+    h ^= sp->buf[i];
+    h *= 0x100000001B3ULL;
+  }
 
-	fprintf(stderr, "Sending packet %u/%u via %s\n", j+1, copies, dest ? dest : "???");
-	if (dest)
-	  free(dest);
-      }
+  return h ^ sp->size;
+}
 
-      if (!f_no) {
-        if (ttl) {
-          (void) setsockopt(tp->fd, IPPROTO_IP, IP_TTL,
-                            &ttl, sizeof(ttl));
-          (void) setsockopt(tp->fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
-                            &ttl, sizeof(ttl));
-        }
-                     
-	while ((rc = sendto(tp->fd, msg, msg_size, 0, aip->ai_addr, aip->ai_addrlen)) < 0 && errno == EINTR)
-	  ;
-	
-	if (rc < 0) {
-	  free(msg);
-	  return -1;
-	}
-      }
+/* Index of a secret in the secret table, added if not already there */
+int
+secret_intern(const SECRET *sp,
+	      uint32_t *ip) {
+  uint32_t *hv, c, k;
+  size_t hs, i, j;
 
-      if (f_verbose && !f_debug) {
-	putc('.', stdout);
-	fflush(stdout);
-      }
-    }
 
-    if (f_verbose && !f_debug)
-      puts(" Done");
+  if (sp->size == 0) {
+    *ip = 0;
+    return 0;
   }
-  
-  free(msg);
-  return 0;
-}
 
+  /* Slot 0 stays empty for no secret */
+  if (hosttab.secretc == 0)
+    hosttab.secretc = 1;
 
-int
-send_wol(const char *name) {
-  HOSTGROUP *hgp;
-  HOST *hp;
-  int rc, i;
+  if (hosttab.shs && hosttab.shv) {
+    for (i = secret_hash(sp) & (hosttab.shs-1); (k = hosttab.shv[i]) != 0; i = (i+1) & (hosttab.shs-1)) {
+      const SECRET *xp = secret_get(k);
 
-  
-  if ((hgp = group_lookup(name)) != NULL) {
-    for (i = 0; i < hgp->hc; i++) {
-      if (i > 0 && (hgp->delay.tv_sec || hgp->delay.tv_nsec)) {
-	/* Inter-host delay */
-	struct timespec delay = hgp->delay;
-	
-	if (f_debug)
-	  fprintf(stderr, "(Sleeping %s)\n", timespec2str(&delay));
-	
-	while ((rc = nanosleep(&delay, &delay)) < 0 && errno == EINTR) {
-	  if (f_debug)
-	    fprintf(stderr, "(Sleeping %s more)\n", timespec2str(&delay));
-	}
-	
-	if (rc < 0)
-	  return -1;
+      if (xp->size == sp->size && memcmp(xp->buf, sp->buf, sp->size) == 0) {
+	*ip = k;
+	return 0;
       }
-
-      rc = send_wol_host(hgp->hv[i]);
-      if (rc) 
-	return rc;
     }
-    return 0;
   }
-  
-  hp = host_lookup(name);
-  if (!hp) {
-    hp = host_create(name);
-    if (!hp)
+
+  c = hosttab.secretc / SECRET_CHUNK_SIZE;
+  if (c >= SECRET_MAX_CHUNKS) {
+    errno = ENOSPC;
+    return -1;
+  }
+  if (!hosttab.secretv[c]) {
+    hosttab.secretv[c] = calloc(SECRET_CHUNK_SIZE, sizeof(SECRET));
+    if (!hosttab.secretv[c])
       return -1;
-    
-    if (host_add_mac(hp, name) < 0)
+  }
+
+  if (hosttab.secretc*2 >= hosttab.shs) {
+    hs = hosttab.shs ? hosttab.shs*2 : 256;
+    hv = calloc(hs, sizeof(uint32_t));
+    if (!hv)
       return -1;
+
+    for (j = 0; j < hosttab.shs; j++) {
+      if ((k = hosttab.shv[j]) == 0)
+	continue;
+      for (i = secret_hash(secret_get(k)) & (hs-1); hv[i] != 0; i = (i+1) & (hs-1))
+	;
+      hv[i] = k;
+    }
+
+    free(hosttab.shv);
+    hosttab.shv = hv;
+    hosttab.shs = hs;
   }
 
-  return send_wol_host(hp);
+  k = hosttab.secretc++;
+  hosttab.secretv[c][k % SECRET_CHUNK_SIZE] = *sp;
+  for (i = secret_hash(sp) & (hosttab.shs-1); hosttab.shv[i] != 0; i = (i+1) & (hosttab.shs-1))
+    ;
+  hosttab.shv[i] = k;
+
+  *ip = k;
+  return 0;
 }
 
-void
-header(FILE *fp) {
-  fprintf(fp, "[pwol %s (%s %s) - (c) Peter Eriksson <pen@lysator.liu.se>]\n",
-	  version, __DATE__, __TIME__);
+const SECRET *
+host_secret(const HOST *hp) {
+  return secret_get(hp->secret);
 }
 
+/* Bytes used by the host table and indexes, not counting the names */
+size_t
+host_table_size(void) {
+  size_t size, i;
 
-void
-trim(char *buf) {
-  char *cp;
 
+  size = sizeof(hosttab);
+  for (i = 0; i < HOST_MAX_CHUNKS && hosttab.chunkv[i]; i++)
+    size += HOST_CHUNK_SIZE * sizeof(HOST);
+  for (i = 0; i < SECRET_MAX_CHUNKS && hosttab.secretv[i]; i++)
+    size += SECRET_CHUNK_SIZE * sizeof(SECRET);
 
-  /* Remove comments */
-  cp = strchr(buf, ';');
-  if (cp)
-    *cp = '\0';
-  cp = strchr(buf, '#');
+  size += hosttab.names * sizeof(uint32_t);
+  size += hosttab.shs * sizeof(uint32_t);
+  size += hosttab.opts * sizeof(HOSTOPTS);
+  return size;
+}
+
+
+HOST *
+host_lookup(const char *name) {
+  HOST *hp;
+  uint32_t id;
+  size_t i;
+
+
+  if (!name)
+    return NULL;
+
+  if (hosttab.names) {
+    for (i = str_hash(name) & (hosttab.names-1); (id = hosttab.namev[i]) != HOST_NO_ID; i = (i+1) & (hosttab.names-1)) {
+      hp = host_get(id);
+      if (hp->name && strcmp(hp->name, name) == 0)
+	return hp;
+    }
+  }
+
+  errno = ENXIO;
+  return NULL;
+}
+
+/* Give a host a MAC and where it came from, moving it in the sorted index */
+int
+host_set_mac(HOST *hp,
+	     const struct ether_addr *mac,
+	     int leased) {
+  union {
+    struct {
+      struct ether_addr mac;
+      unsigned char leased;
+    };
+    uint64_t w;
+  } u;
+
+
+  if (host_sort_mac(hp, 0) < 0)
+    return -1;
+
+  u.w = 0;
+  u.mac = *mac;
+  u.leased = leased;
+  atomic_store_explicit(&hp->macw, u.w, memory_order_release);
+  return host_sort_mac(hp, 1);
+}
+
+/* A host's MAC read in one go, as a lease file may change it meanwhile */
+struct ether_addr *
+host_mac(HOST *hp,
+	 struct ether_addr *ep) {
+  uint64_t w;
+
+
+  w = atomic_load_explicit(&hp->macw, memory_order_acquire);
+  memcpy(ep, &w, MAC_SIZE);
+  return ep;
+}
+
+/* A MAC address or ethers name, from the configuration so never leased */
+int
+host_add_mac(HOST *hp,
+	     const char *mac) {
+  struct ether_addr ea;
+
+
+  if (!mac)
+    return -1;
+
+  /* Most are addresses, so try that before searching the ethers file */
+  if (str2mac(mac, &ea) == 0)
+    return host_set_mac(hp, &ea, LEASED_NO);
+
+#if HAVE_ETHER_HOSTTON
+  if (ether_hostton(mac, &ea) == 0)
+    return host_set_mac(hp, &ea, LEASED_NO);
+#endif
+
+  errno = EINVAL;
+  return -1;
+}
+
+
+HOST *
+host_create(const char *name) {
+  HOST *hp;
+
+
+  if (!name)
+    return NULL;
+
+  hp = host_lookup(name);
+  if (hp) {
+    /* Configured after all, it only keeps the MAC from the lease */
+    if (hp->leased == LEASED_HOST)
+      hp->leased = LEASED_MAC;
+    return hp;
+  }
+
+  hp = host_alloc();
+  if (!hp)
+    return NULL;
+
+  hp->name = strdup(name);
+  if (!hp->name || host_index_name(hp) < 0)
+    return NULL;
+
+  /* Try to lookup mac via name in ethers file */
+  (void) host_add_mac(hp, name);
+
+#if 0
+  if (gp) {
+    hp->via    = gp;
+
+    hp->copies = gp->copies;
+    hp->delay  = gp->delay;
+    hp->secret = gp->secret;
+  }
+#endif
+
+  *hosts_tail = hp;
+  hosts_tail = &hp->next;
+  return hp;
+}
+
+
+int
+group_add_delay(HOSTGROUP *hgp,
+		const char *delay) {
+  if (!delay)
+    return -1;
+  
+  return str2timespec(delay, &hgp->delay);
+}
+
+int
+group_add_via(HOSTGROUP *hgp,
+	      const char *via) {
+  if (!via)
+    return -1;
+
+  hgp->via = gw_lookup(via);
+  if (!hgp->via)
+    return -1;
+
+  return 0;
+}
+
+/* Relay gateway (downstream pwol daemon) that expands this group, if any */
+GATEWAY *
+group_relay(HOSTGROUP *hgp) {
+  GATEWAY *gp;
+
+
+  /* A downstream daemon only knows the configured groups */
+  if (hgp->expr)
+    return NULL;
+
+  gp = hgp->via;
+  if (!gp)
+    gp = gw_lookup(hgp->name);
+
+  return (gp && gp->relay) ? gp : NULL;
+}
+
+
+/* Cron field like "*", "1-5", "0,30" or "0-59/15" as a bit mask */
+int
+str2cronfield(const char *str,
+	      int min,
+	      int max,
+	      uint64_t *bits) {
+  char *buf, *item, *ptr, *cp;
+  int lo, hi, step, v, n;
+
+
+  buf = strdup(str);
+  if (!buf)
+    return -1;
+
+  *bits = 0;
+  for (item = strtok_r(buf, ",", &ptr); item; item = strtok_r(NULL, ",", &ptr)) {
+    step = 1;
+    cp = strchr(item, '/');
+    if (cp) {
+      *cp++ = '\0';
+      if (sscanf(cp, "%d%n", &step, &n) != 1 || cp[n] || step < 1)
+	goto Fail;
+    }
+
+    if (strcmp(item, "*") == 0) {
+      lo = min;
+      hi = max;
+    } else if (sscanf(item, "%d-%d%n", &lo, &hi, &n) == 2 && !item[n])
+      ;
+    else if (sscanf(item, "%d%n", &lo, &n) == 1 && !item[n])
+      hi = cp ? max : lo;
+    else
+      goto Fail;
+
+    if (lo < min || hi > max || lo > hi)
+      goto Fail;
+
+    for (v = lo; v <= hi; v += step)
+      *bits |= 1ULL << v;
+  }
+
+  free(buf);
+  return *bits ? 0 : -1;
+
+ Fail:
+  free(buf);
+  errno = EINVAL;
+  return -1;
+}
+
+/* "min hour mday month wday", "@daily" and friends, or "at YYYY-MM-DD HH:MM" */
+int
+str2schedule(const char *str,
+	     SCHEDULE *sp) {
+  static const struct {
+    const char *name;
+    const char *spec;
+  } aliases[] = {
+    { "@hourly",   "0 * * * *" },
+    { "@daily",    "0 0 * * *" },
+    { "@midnight", "0 0 * * *" },
+    { "@weekly",   "0 0 * * 0" },
+    { "@monthly",  "0 0 1 * *" },
+    { "@yearly",   "0 0 1 1 *" },
+    { "@annually", "0 0 1 1 *" },
+  };
+  char f[5][64];
+  uint64_t bits;
+  struct tm tm;
+  int i, n;
+
+
+  for (i = 0; i < sizeof(aliases)/sizeof(aliases[0]); i++)
+    if (strcmp(str, aliases[i].name) == 0) {
+      str = aliases[i].spec;
+      break;
+    }
+
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(str, "at %d-%d-%d %d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	     &tm.tm_hour, &tm.tm_min, &n) == 5 && !str[n]) {
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    sp->at = mktime(&tm);
+    if (sp->at == (time_t) -1) {
+      errno = EINVAL;
+      return -1;
+    }
+    return 0;
+  }
+
+  if (sscanf(str, "%63s %63s %63s %63s %63s%n", f[0], f[1], f[2], f[3], f[4], &n) != 5 || str[n]) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (str2cronfield(f[0], 0, 59, &sp->minutes) < 0)
+    return -1;
+  if (str2cronfield(f[1], 0, 23, &bits) < 0)
+    return -1;
+  sp->hours = bits;
+  if (str2cronfield(f[2], 1, 31, &bits) < 0)
+    return -1;
+  sp->mdays = bits;
+  if (str2cronfield(f[3], 1, 12, &bits) < 0)
+    return -1;
+  sp->months = bits;
+  if (str2cronfield(f[4], 0, 7, &bits) < 0)
+    return -1;
+
+  /* Sunday is both 0 and 7 */
+  sp->wdays = (bits | (bits >> 7)) & 0x7F;
+
+  sp->any_mday = (strcmp(f[2], "*") == 0);
+  sp->any_wday = (strcmp(f[4], "*") == 0);
+  return 0;
+}
+
+/* Like cron, if both day fields are restricted either one may match */
+int
+schedule_day(const SCHEDULE *sp,
+	     const struct tm *tp) {
+  int mday = (sp->mdays >> tp->tm_mday) & 1;
+  int wday = (sp->wdays >> tp->tm_wday) & 1;
+
+
+  if (sp->any_mday || sp->any_wday)
+    return mday && wday;
+
+  return mday || wday;
+}
+
+/* First time after 'after' that the schedule fires, (time_t) -1 if never */
+time_t
+schedule_next(const SCHEDULE *sp,
+	      time_t after) {
+  struct tm tm;
+  time_t t;
+  int i;
+
+
+  if (sp->at)
+    return sp->at > after ? sp->at : (time_t) -1;
+
+  localtime_r(&after, &tm);
+  tm.tm_sec = 0;
+  ++tm.tm_min;
+
+  for (i = 0; i < SCHEDULE_MAX_STEPS; i++) {
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+    if (t == (time_t) -1)
+      break;
+    localtime_r(&t, &tm);
+
+    if (!((sp->months >> (tm.tm_mon+1)) & 1)) {
+      ++tm.tm_mon;
+      tm.tm_mday = 1;
+      tm.tm_hour = tm.tm_min = 0;
+    } else if (!schedule_day(sp, &tm)) {
+      ++tm.tm_mday;
+      tm.tm_hour = tm.tm_min = 0;
+    } else if (!((sp->hours >> tm.tm_hour) & 1)) {
+      ++tm.tm_hour;
+      tm.tm_min = 0;
+    } else if (!((sp->minutes >> tm.tm_min) & 1))
+      ++tm.tm_min;
+    else
+      return t;
+  }
+
+  return (time_t) -1;
+}
+
+/* Add a schedule for a host or a group */
+int
+schedule_add(HOST *hp,
+	     HOSTGROUP *hgp,
+	     const char *spec) {
+  SCHEDULE *sp, **ssp;
+
+
+  if (!spec)
+    return -1;
+
+  sp = calloc(1, sizeof(*sp));
+  if (!sp)
+    return -1;
+
+  sp->hp = hp;
+  sp->hgp = hgp;
+  sp->spec = strdup(spec);
+  if (!sp->spec || str2schedule(spec, sp) < 0) {
+    free(sp->spec);
+    free(sp);
+    return -1;
+  }
+
+  /* Catch impossible dates like "0 0 30 2 *" early */
+  if (!sp->at && schedule_next(sp, time(NULL)) == (time_t) -1) {
+    free(sp->spec);
+    free(sp);
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (ssp = &schedules; *ssp; ssp = &(*ssp)->next)
+    ;
+  *ssp = sp;
+  return 0;
+}
+
+
+
+int
+group_add_host(HOSTGROUP *hgp, 
+	       HOST *hp) {
+  size_t w, n;
+
+
+  if (!hgp)
+    return -1;
+
+  if (!hp)
+    return -1;
+
+  /* Hosts outside the host table are not in any group */
+  if (hp->id == HOST_NO_ID)
+    return -1;
+
+  w = hp->id / 64;
+  if (w < hgp->bitc && (hgp->bitv[w] & (1ULL << (hp->id % 64))))
+    return hgp->hc;
+
+  if (w >= hgp->bitc) {
+    for (n = hgp->bitc ? hgp->bitc : 16; n <= w; n *= 2)
+      ;
+    hgp->bitv = realloc(hgp->bitv, n * sizeof(uint64_t));
+    if (!hgp->bitv)
+      return -1;
+    memset(hgp->bitv+hgp->bitc, 0, (n-hgp->bitc) * sizeof(uint64_t));
+    hgp->bitc = n;
+  }
+
+  if (hgp->hc >= hgp->hs) {
+    hgp->hs *= 2;
+    hgp->hv = realloc(hgp->hv, hgp->hs * sizeof(HOST *));
+    if (!hgp->hv)
+      return -1;
+  }
+
+  hgp->bitv[w] |= 1ULL << (hp->id % 64);
+  hgp->hv[hgp->hc++] = hp;
+  return hgp->hc;
+}
+
+/* Add a host from an included group, remembering it is not a member of its own */
+int
+group_include_host(HOSTGROUP *hgp,
+		   HOST *hp) {
+  size_t w, n;
+  int rc;
+
+
+  w = hp->id / 64;
+  if (hp->id == HOST_NO_ID ||
+      (w < hgp->bitc && (hgp->bitv[w] & (1ULL << (hp->id % 64)))))
+    return hgp->hc;
+
+  if (w >= hgp->incc) {
+    for (n = hgp->incc ? hgp->incc : 16; n <= w; n *= 2)
+      ;
+    hgp->incv = realloc(hgp->incv, n * sizeof(uint64_t));
+    if (!hgp->incv)
+      return -1;
+    memset(hgp->incv+hgp->incc, 0, (n-hgp->incc) * sizeof(uint64_t));
+    hgp->incc = n;
+  }
+
+  rc = group_add_host(hgp, hp);
+  if (rc >= 0)
+    hgp->incv[w] |= 1ULL << (hp->id % 64);
+  return rc;
+}
+
+/* Include the hosts of another group, resolved once all configuration is read */
+int
+group_add_group(HOSTGROUP *hgp,
+		const char *name) {
+  char **gv;
+
+
+  if (!hgp || !name)
+    return -1;
+
+  gv = realloc(hgp->gv, (hgp->gc+1) * sizeof(char *));
+  if (!gv)
+    return -1;
+  hgp->gv = gv;
+
+  hgp->gv[hgp->gc] = strdup(name);
+  if (!hgp->gv[hgp->gc])
+    return -1;
+
+  ++hgp->gc;
+  return 0;
+}
+
+/* Add the hosts of included groups, and theirs, with *bad set to the failing reference */
+int
+group_flatten(HOSTGROUP *hgp,
+	      const char **bad) {
+  HOSTGROUP *sgp;
+  size_t i, j;
+
+
+  if (hgp->flat == 2)
+    return 0;
+
+  if (hgp->flat == 1) {
+    *bad = hgp->name;
+    errno = ELOOP;
+    return -1;
+  }
+
+  hgp->flat = 1;
+  for (i = 0; i < hgp->gc; i++) {
+    sgp = group_lookup(hgp->gv[i]);
+    if (!sgp) {
+      *bad = hgp->gv[i];
+      return -1;
+    }
+
+    if (group_flatten(sgp, bad) < 0)
+      return -1;
+
+    for (j = 0; j < sgp->hc; j++)
+      if (group_include_host(hgp, sgp->hv[j]) < 0)
+	return -1;
+  }
+
+  hgp->flat = 2;
+  return 0;
+}
+
+int
+group_resolve(const char **bad) {
+  HOSTGROUP *hgp;
+
+
+  for (hgp = hostgroups; hgp; hgp = hgp->next)
+    if (group_flatten(hgp, bad) < 0)
+      return -1;
+
+  return 0;
+}
+
+
+/* Free a group from group_select(), unless it is a configured one */
+void
+group_release(HOSTGROUP *hgp) {
+  if (!hgp || !hgp->expr)
+    return;
+
+  free(hgp->name);
+  free(hgp->hv);
+  free(hgp->bitv);
+  free(hgp->incv);
+  free(hgp);
+}
+
+/* Index of the lowest bit set */
+int
+group_bit(uint64_t w) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(w);
+#else
+  int b;
+
+
+  for (b = 0; !(w & 1); b++)
+    w >>= 1;
+  return b;
+#endif
+}
+
+/* An empty group for the hosts an expression or pattern selects */
+HOSTGROUP *
+group_new(const char *name) {
+  HOSTGROUP *hgp;
+
+
+  hgp = calloc(1, sizeof(*hgp));
+  if (!hgp)
+    return NULL;
+
+  hgp->expr = 1;
+  hgp->flat = 2;
+  hgp->name = strdup(name);
+  hgp->bitc = (hosttab.n + 63) / 64;
+  hgp->bitv = calloc(hgp->bitc ? hgp->bitc : 1, sizeof(uint64_t));
+  if (!hgp->name || !hgp->bitv) {
+    group_release(hgp);
+    return NULL;
+  }
+
+  return hgp;
+}
+
+/* Fill in the host list from the member bitset, in host id order */
+int
+group_members(HOSTGROUP *hgp) {
+  uint64_t w;
+  size_t i, n;
+
+
+  n = 0;
+  for (i = 0; i < hgp->bitc; i++)
+    for (w = hgp->bitv[i]; w; w &= w-1)
+      ++n;
+
+  hgp->hs = n ? n : 1;
+  hgp->hv = malloc(hgp->hs * sizeof(HOST *));
+  if (!hgp->hv)
+    return -1;
+
+  for (i = 0; i < hgp->bitc; i++)
+    for (w = hgp->bitv[i]; w; w &= w-1)
+      hgp->hv[hgp->hc++] = host_get(i*64 + group_bit(w));
+
+  return 0;
+}
+
+/*
+ * Hosts whose name matches a glob like "render-*", or whose MAC starts
+ * with a prefix like "aa:bb:cc:*". Only the sorted range of names with
+ * the same leading characters as the pattern (or the same MAC prefix)
+ * is checked, so a pattern that starts with a wildcard checks them all.
+ */
+HOSTGROUP *
+group_match(const char *pattern) {
+  struct ether_addr ea;
+  HOSTGROUP *hgp;
+  const char *name;
+  size_t lo, hi, mid;
+  uint32_t id, *iv;
+  int plen, all;
+
+
+  hgp = group_new(pattern);
+  if (!hgp)
+    return NULL;
+
+  plen = str2macprefix(pattern, &ea);
+  if (plen > 0) {
+    iv = hosttab.bymac;
+    for (lo = 0, hi = hosttab.bymacc; lo < hi; ) {
+      mid = lo + (hi-lo)/2;
+      if (memcmp(&host_get(iv[mid])->mac, &ea, plen) < 0)
+	lo = mid+1;
+      else
+	hi = mid;
+    }
+
+    for (; lo < hosttab.bymacc && memcmp(&host_get(id = iv[lo])->mac, &ea, plen) == 0; lo++)
+      hgp->bitv[id / 64] |= 1ULL << (id % 64);
+  } else {
+    iv = hosttab.byname;
+    plen = strcspn(pattern, "*?[\\");
+    for (lo = 0, hi = hosttab.bynamec; lo < hi; ) {
+      mid = lo + (hi-lo)/2;
+      if (strncmp(host_get(iv[mid])->name, pattern, plen) < 0)
+	lo = mid+1;
+      else
+	hi = mid;
+    }
+
+    /* Just a prefix and "*" matches the whole range */
+    all = strcmp(pattern+plen, "*") == 0;
+    for (; lo < hosttab.bynamec && strncmp(name = host_get(id = iv[lo])->name, pattern, plen) == 0; lo++)
+      if (all || fnmatch(pattern, name, 0) == 0)
+	hgp->bitv[id / 64] |= 1ULL << (id % 64);
+  }
+
+  if (group_members(hgp) < 0 || hgp->hc == 0) {
+    group_release(hgp);
+    errno = ENXIO;
+    return NULL;
+  }
+
+  return hgp;
+}
+
+
+/*
+ * Longest group, host name or pattern (matching some host) that starts an
+ * expression and ends at an operator or the end. Patterns give a new group.
+ */
+size_t
+group_operand(const char *expr,
+	      HOSTGROUP **hgpp,
+	      HOST **hpp) {
+  char *buf;
+  size_t len;
+
+
+  *hgpp = NULL;
+  *hpp = NULL;
+
+  buf = strdup(expr);
+  if (!buf)
+    return 0;
+
+  for (len = strlen(buf); len > 0; len--) {
+    if (buf[len] && !strchr("+-&", buf[len]))
+      continue;
+
+    buf[len] = '\0';
+    if ((*hgpp = group_lookup(buf)) != NULL ||
+	(*hpp = host_lookup(buf)) != NULL)
+      break;
+    if (strpbrk(buf, "*?[") && (*hgpp = group_match(buf)) != NULL)
+      break;
+  }
+
+  free(buf);
+  if (len == 0)
+    errno = ENXIO;
+  return len;
+}
+
+/*
+ * Hosts selected by an expression of groups, hosts and patterns like
+ * "A+B" (in either), "A-B" (in A but not B) or "A&B" (in both),
+ * evaluated left to right. The hosts are in the order they were defined.
+ */
+HOSTGROUP *
+group_eval(const char *expr) {
+  HOSTGROUP *hgp, *ogp;
+  HOST *hp;
+  uint64_t w;
+  size_t n, i;
+  int op, first;
+
+
+  hgp = group_new(expr);
+  if (!hgp)
+    return NULL;
+
+  for (op = '+', first = 1; ; op = *expr++, first = 0) {
+    n = group_operand(expr, &ogp, &hp);
+    if (n == 0)
+      goto Fail;
+
+    /* The first group decides the inter-host delay */
+    if (ogp && first)
+      hgp->delay = ogp->delay;
+
+    if (ogp) {
+      for (i = 0; i < hgp->bitc; i++) {
+	w = i < ogp->bitc ? ogp->bitv[i] : 0;
+
+	switch (op) {
+	case '+':
+	  hgp->bitv[i] |= w;
+	  break;
+	case '-':
+	  hgp->bitv[i] &= ~w;
+	  break;
+	case '&':
+	  hgp->bitv[i] &= w;
+	  break;
+	}
+      }
+      group_release(ogp);
+    } else if (hp->id / 64 < hgp->bitc) {
+      /* A single host only touches its own word, but "&" keeps just that */
+      i = hp->id / 64;
+      w = 1ULL << (hp->id % 64);
+
+      switch (op) {
+      case '+':
+	hgp->bitv[i] |= w;
+	break;
+      case '-':
+	hgp->bitv[i] &= ~w;
+	break;
+      case '&':
+	w &= hgp->bitv[i];
+	memset(hgp->bitv, 0, hgp->bitc * sizeof(uint64_t));
+	hgp->bitv[i] = w;
+	break;
+      }
+    } else if (op == '&')
+      memset(hgp->bitv, 0, hgp->bitc * sizeof(uint64_t));
+
+    expr += n;
+    if (!*expr)
+      break;
+  }
+
+  if (group_members(hgp) < 0)
+    goto Fail;
+
+  return hgp;
+
+ Fail:
+  group_release(hgp);
+  return NULL;
+}
+
+/* A configured group, or the hosts an expression or pattern selects if it is not one */
+HOSTGROUP *
+group_select(const char *name) {
+  HOSTGROUP *hgp;
+
+
+  if (!name)
+    return NULL;
+
+  hgp = group_lookup(name);
+  if (hgp || host_lookup(name) || !strpbrk(name, "+-&*?["))
+    return hgp;
+
+  return group_eval(name);
+}
+
+
+
+int
+host_add_via(HOST *hp,
+	     const char *via) {
+  HOSTGROUP *hgp;
+
+  if (!via)
+    return -1;
+
+  hp->via = gw_lookup(via);
+  if (!hp->via)
+    return -1;
+
+  hgp = group_lookup(hp->via->name);
+  group_add_host(hgp, hp);
+
+  return 0;
+}
+
+int
+host_add_name(HOST *hp,
+	      const char *name) {
+  if (!name)
+    return -1;
+ 
+  if (hp->name) {
+    if (host_sort_name(hp, 0) < 0)
+      return -1;
+    free(hp->name);
+  }
+
+  hp->name = strdup(name);
+  if (!hp->name)
+    return -1;
+
+  return hp->id != HOST_NO_ID ? host_index_name(hp) : 0;
+}
+
+/* Probe as "tcp:port", "udp:port" or just a TCP port */
+int
+str2probe(const char *str,
+	  int *type,
+	  const char **port) {
+  if (!str)
+    return -1;
+
+  *type = SOCK_STREAM;
+  if (strncmp(str, "tcp:", 4) == 0)
+    str += 4;
+  else if (strncmp(str, "udp:", 4) == 0) {
+    *type = SOCK_DGRAM;
+    str += 4;
+  }
+
+  if (!*str) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *port = str;
+  return 0;
+}
+
+int
+host_add_address(HOST *hp,
+		 const char *address) {
+  HOSTOPTS *op;
+
+
+  if (!address || (op = host_opts(hp)) == NULL)
+    return -1;
+
+  free(op->address);
+  op->address = strdup(address);
+  return op->address ? 0 : -1;
+}
+
+int
+host_add_probe(HOST *hp,
+	       const char *probe) {
+  const char *port;
+  HOSTOPTS *op;
+  int type;
+
+
+  if (str2probe(probe, &type, &port) < 0 || (op = host_opts(hp)) == NULL)
+    return -1;
+
+  free(op->probe);
+  op->probe = strdup(probe);
+  return op->probe ? 0 : -1;
+}
+
+int
+host_add_delay(HOST *hp,
+	       const char *delay) {
+  struct timespec ts;
+  HOSTOPTS *op;
+
+
+  if (!delay || str2timespec(delay, &ts) < 0 || (op = host_opts(hp)) == NULL)
+    return -1;
+
+  op->delay = ts;
+  return 0;
+}
+
+int
+host_add_copies(HOST *hp,
+		const char *copies) {
+  unsigned int n;
+  HOSTOPTS *op;
+
+
+  if (str2copies(copies, &n) < 0 || (op = host_opts(hp)) == NULL)
+    return -1;
+
+  op->copies = n;
+  return 0;
+}
+
+int
+host_add_ttl(HOST *hp,
+             const char *ttl) {
+  unsigned int n;
+  HOSTOPTS *op;
+
+
+  if (!ttl || sscanf(ttl, "%u", &n) != 1 || (op = host_opts(hp)) == NULL)
+    return -1;
+
+  op->ttl = n;
+  return 0;
+}
+
+int
+host_add_secret(HOST *hp,
+		const char *secret) {
+  SECRET tmp;
+
+
+  if (!secret || str2secret(secret, &tmp) < 0)
+    return -1;
+
+  return secret_intern(&tmp, &hp->secret);
+}
+
+
+
+
+void
+gw_print(GATEWAY *gp) {
+  char abuf[ADDR_STR_SIZE], tbuf[TIMESPEC_STR_SIZE], sbuf[SECRET_STR_SIZE], cbuf[16];
+  TARGET *tp;
+  unsigned int i;
+
+
+  if (f_verbose) {
+    printf("Gateway %s:\n", gp->name);
+    
+    if (gp->copies)
+      printf("  %-10s  %s\n", "Copies", copies2str(gp->copies, cbuf, sizeof(cbuf)));
+    if (gp->delay.tv_sec || gp->delay.tv_nsec)
+      printf("  %-10s  %s\n", "Delay",  timespec2str(&gp->delay, tbuf, sizeof(tbuf)));
+    if (gp->ttl)
+      printf("  %-10s  %u\n", "TTL", gp->ttl);
+    if (gp->secret.size > 0)
+      printf("  %-10s  %s\n", "Secret", secret2str(&gp->secret, sbuf, sizeof(sbuf)));
+    if (gp->relay)
+      printf("  %-10s  %s\n", "Relay", "yes");
+    printf("  Targets:\n");
+    i = 0;
+    for (tp = gp->targets; tp; tp = tp->next) {
+      char *dest = target2str(tp, abuf, sizeof(abuf));
+      
+      printf("    %-2u        %s\n", i+1, dest ? dest : "???");
+      ++i;
+    }
+
+  } else {
+
+    printf("gateway %s", gp->name);
+    if (gp->address && strcmp(gp->address, gp->name) != 0)
+      printf(" address %s", gp->address);
+    if (gp->port && strcmp(gp->port, default_gw->port) != 0)
+      printf(" port %s", gp->port);
+    if (gp->copies && gp->copies != default_gw->copies)
+      printf(" copies %s", copies2str(gp->copies, cbuf, sizeof(cbuf)));
+    if ((gp->delay.tv_sec || gp->delay.tv_nsec) && 
+	!(gp->delay.tv_sec == default_gw->delay.tv_sec && gp->delay.tv_nsec == default_gw->delay.tv_nsec))
+      printf(" delay %s", timespec2str(&gp->delay, tbuf, sizeof(tbuf)));
+    if (gp->secret.size > 0 && (gp->secret.size != default_gw->secret.size || memcmp(gp->secret.buf, default_gw->secret.buf, gp->secret.size) != 0))
+      printf(" secret %s", secret2str(&gp->secret, sbuf, sizeof(sbuf)));
+    if (gp->relay)
+      printf(" relay yes");
+    putchar('\n');
+  }
+}
+
+
+void
+proxy_print(GATEWAY *gp) {
+  char sbuf[SECRET_STR_SIZE];
+
+
+  if (f_verbose) {
+    printf("Proxy %s:\n", gp->name);
+    printf("  %-10s  %s\n", "Address", gp->address);
+    printf("  %-10s  %s\n", "Port", gp->port);
+    if (gp->secret.size > 0)
+      printf("  %-10s  %s\n", "Secret", secret2str(&gp->secret, sbuf, sizeof(sbuf)));
+  } else {
+    printf("proxy %s address %s port %s", gp->name, gp->address, gp->port);
+    if (gp->secret.size > 0)
+      printf(" secret %s", secret2str(&gp->secret, sbuf, sizeof(sbuf)));
+    putchar('\n');
+  }
+}
+
+
+void
+host_print(HOST *hp) {
+  char tbuf[TIMESPEC_STR_SIZE], sbuf[SECRET_STR_SIZE], mbuf[MAC_STR_SIZE], cbuf[16];
+  const HOSTOPTS *ho = HOST_OPTS(hp);
+  const SECRET *hsp = host_secret(hp);
+  const MACSTATS *msp;
+  SCHEDULE *sp;
+
+
+  if (f_verbose) {
+    printf("Host %s:\n", hp->name);
+    
+    printf("  %-10s  %s%s\n", "MAC", mac2str(&hp->mac, mbuf), hp->leased ? " (leased)" : "");
+    if (hp->via)
+      printf("  %-10s  %s\n", "Gateway", hp->via->name);
+    if (ho->copies)
+      printf("  %-10s  %s\n", "Copies", copies2str(ho->copies, cbuf, sizeof(cbuf)));
+    if (ho->ttl)
+      printf("  %-10s  %u\n", "TTL", ho->ttl);
+    if (ho->delay.tv_sec || ho->delay.tv_nsec)
+      printf("  %-10s  %s\n", "Delay",  timespec2str(&ho->delay, tbuf, sizeof(tbuf)));
+    if (hsp->size > 0)
+      printf("  %-10s  %s\n", "Secret", secret2str(hsp, sbuf, sizeof(sbuf)));
+    if (ho->address)
+      printf("  %-10s  %s\n", "Address", ho->address);
+    if (ho->probe)
+      printf("  %-10s  %s\n", "Probe", ho->probe);
+    for (sp = schedules; sp; sp = sp->next)
+      if (sp->hp == hp)
+	printf("  %-10s  %s\n", "Schedule", sp->spec);
+    msp = stats_lookup(&hp->mac);
+    if (msp && msp->successes)
+      printf("  %-10s  %u wakes, %u%% first try, %u%% up, needs %u packets, up in %.1fs\n", "History",
+	     msp->attempts, 100*msp->first_try/msp->attempts, 100*msp->successes/msp->attempts,
+	     stats_copies(&hp->mac, 1), msp->alive_ms/1000.0);
+    else if (msp)
+      printf("  %-10s  %u wakes, never up\n", "History", msp->attempts);
+  } else {
+    printf("host %s", hp->name);
+    /* A MAC from a lease file comes with the leases line */
+    if (!hp->leased)
+      printf(" mac %s", mac2str(&hp->mac, mbuf));
+    if (hp->via && group_lookup(hp->via->name) == NULL)
+      printf(" via %s", hp->via->name);
+    if (ho->copies)
+      printf(" copies %s", copies2str(ho->copies, cbuf, sizeof(cbuf)));
+    if (ho->delay.tv_sec || ho->delay.tv_nsec)
+      printf(" delay %s", timespec2str(&ho->delay, tbuf, sizeof(tbuf)));
+    if (hsp->size > 0)
+      printf(" secret %s", secret2str(hsp, sbuf, sizeof(sbuf)));
+    if (ho->address)
+      printf(" address %s", ho->address);
+    if (ho->probe)
+      printf(" probe %s", ho->probe);
+    putchar('\n');
+
+    /* Schedules take the rest of the line */
+    for (sp = schedules; sp; sp = sp->next)
+      if (sp->hp == hp)
+	printf("host %s schedule %s\n", hp->name, sp->spec);
+  }
+}
+
+void
+group_print(HOSTGROUP *hgp) {
+  char tbuf[TIMESPEC_STR_SIZE];
+  LEASEFILE *lp;
+  SCHEDULE *sp;
+  int i;
+
+
+  if (f_verbose) {
+    printf("Hostgroup %s:\n", hgp->name);
+    if (hgp->delay.tv_sec || hgp->delay.tv_nsec)
+      printf("  %-10s  %s\n", "Delay",  timespec2str(&hgp->delay, tbuf, sizeof(tbuf)));
+    if (hgp->via)
+      printf("  %-10s  %s\n", "Gateway", hgp->via->name);
+    if (group_relay(hgp))
+      printf("  %-10s  %s\n", "Relay", group_relay(hgp)->name);
+    for (sp = schedules; sp; sp = sp->next)
+      if (sp->hgp == hgp)
+	printf("  %-10s  %s\n", "Schedule", sp->spec);
+    for (i = 0; i < hgp->gc; i++)
+      printf("  %-10s  %s\n", "Includes", hgp->gv[i]);
+    for (lp = leasefiles; lp; lp = lp->next)
+      if (lp->hgp == hgp)
+	printf("  %-10s  %s\n", "Leases", lp->path);
+    if (hgp->hc > 0)
+      printf("  Hosts:\n");
+    for (i = 0; i < hgp->hc; i++)
+      printf("    %2d        %s\n", i+1, hgp->hv[i]->name);
+  } else {
+    printf("[%s]\n", hgp->name);
+    if (hgp->delay.tv_sec || hgp->delay.tv_nsec)
+      printf("delay %s\n", timespec2str(&hgp->delay, tbuf, sizeof(tbuf)));
+    if (hgp->via)
+      printf("via %s\n", hgp->via->name);
+    for (sp = schedules; sp; sp = sp->next)
+      if (sp->hgp == hgp)
+	printf("schedule %s\n", sp->spec);
+    for (i = 0; i < hgp->gc; i++)
+      printf("group %s\n", hgp->gv[i]);
+    for (lp = leasefiles; lp; lp = lp->next)
+      if (lp->hgp == hgp)
+	printf("leases %s\n", lp->path);
+    for (i = 0; i < hgp->hc; i++) {
+      HOST *hp = hgp->hv[i];
+
+      /* Hosts from included groups come with the group line */
+      if (hp->id / 64 < hgp->incc && (hgp->incv[hp->id / 64] & (1ULL << (hp->id % 64))))
+	continue;
+
+      /* And hosts only known from a lease file with the leases line */
+      if (hp->leased == LEASED_HOST)
+	continue;
+
+      printf("host %s", hp->name);
+
+#if 0
+      if (!hp->via || (hp->via && strcmp(hp->via->name, hgp->name) == 0)) {
+	if (hp->copies)
+	  printf(" copies %u", hp->copies);
+	if (hp->delay.tv_sec || hp->delay.tv_nsec)
+	  printf(" delay %s", timespec2str(&hp->delay, tbuf, sizeof(tbuf)));
+	if (hp->secret.size > 0)
+	  printf(" secret %s", secret2str(&hp->secret, sbuf, sizeof(sbuf)));
+      }
+#endif
+      
+      putchar('\n');
+    }
+  }
+}
+ 
+ void
+   buf_print(FILE *fp,
+	  void *buf, 
+	  size_t size) {
+  unsigned char *bp = (unsigned char *) buf;
+  int i;
+
+  putc('\t', fp);
+  for (i = 0; i < size; i++) {
+    if (i > 0) {
+      if ((i & 15) == 0) {
+	putc('\n', fp);
+	putc('\t', fp);
+      } else
+	putc(':', fp);
+    }
+    fprintf(fp, "%02X", (unsigned int) bp[i]);
+  }
+  putc('\n', fp);
+}
+
+
+void *
+calloc_aligned(size_t n,
+	       size_t size) {
+  void *p;
+
+
+  if (posix_memalign(&p, CACHE_LINE_SIZE, n*size) != 0)
+    return NULL;
+
+  memset(p, 0, n*size);
+  return p;
+}
+
+
+/*
+ * Queue a log record. Only copies into a preallocated slot, so it is
+ * safe to call from the daemon hot path. Records are dropped (and
+ * counted) if the ring is full or the logger is not running.
+ */
+void
+log_event(unsigned int event,
+	  unsigned int worker,
+	  const char *name,
+	  const struct ether_addr *mac,
+	  long long a,
+	  long long b,
+	  const void *data,
+	  size_t len) {
+  LOGGER *lp = logger;
+  LOGSLOT *sp;
+  LOGREC *rp;
+  size_t pos, seq;
+  intptr_t diff;
+  int saved_errno = errno;
+
+
+  if (!lp)
+    return;
+
+  pos = atomic_load_explicit(&lp->head, memory_order_relaxed);
+  while (1) {
+    sp = &lp->v[pos & lp->mask];
+    seq = atomic_load_explicit(&sp->seq, memory_order_acquire);
+    diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&lp->head, &pos, pos+1,
+						memory_order_relaxed, memory_order_relaxed))
+	break;
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit(&lp->dropped, 1, memory_order_relaxed);
+      return;
+    } else
+      pos = atomic_load_explicit(&lp->head, memory_order_relaxed);
+  }
+
+  rp = &sp->rec;
+  clock_gettime(CLOCK_REALTIME, &rp->ts);
+  rp->event = event;
+  rp->worker = worker;
+  rp->a = a;
+  rp->b = b;
+  rp->name = name;
+  if (mac)
+    rp->mac = *mac;
+  else
+    memset(&rp->mac, 0, sizeof(rp->mac));
+  if (len > LOG_DATA_SIZE)
+    len = LOG_DATA_SIZE;
+  rp->len = len;
+  if (len)
+    memcpy(rp->data, data, len);
+
+  atomic_store_explicit(&sp->seq, pos+1, memory_order_release);
+
+  /* Pairs with the fence in log_run(), like forward_push() */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&lp->sleeping))
+    (void) write(lp->pfd[1], "", 1);
+
+  errno = saved_errno;
+}
+
+
+/* Format the socket address copied into a record, data may be unaligned */
+char *
+log_addr2str(const LOGREC *rp,
+	     char *buf,
+	     size_t size) {
+  struct sockaddr_storage ss;
+  size_t len = rp->len;
+
+
+  if (len > sizeof(ss))
+    len = sizeof(ss);
+  memset(&ss, 0, sizeof(ss));
+  memcpy(&ss, rp->data, len);
+
+  if (!sockaddr2str((struct sockaddr *) &ss, len, buf, size))
+    strcpy(buf, "???");
+  return buf;
+}
+
+/* Format a record into buf, returns the syslog priority */
+int
+log_format(const LOGREC *rp,
+	   char *buf,
+	   size_t size) {
+  static const struct ether_addr no_mac;
+  char xbuf[SECRET_STR_SIZE], mbuf[MAC_STR_SIZE];
+  const char *mac;
+  struct timespec ts;
+  SECRET secret;
+  size_t i, len;
+
+
+  /* Relayed group requests have no MAC */
+  if (memcmp(&rp->mac, &no_mac, sizeof(no_mac)) == 0)
+    mac = "group";
+  else
+    mac = mac2str(&rp->mac, mbuf);
+
+  switch (rp->event) {
+  case EV_SEND_HOST:
+    if (rp->len) {
+      memset(&secret, 0, sizeof(secret));
+      secret.size = rp->len;
+      memcpy(secret.buf, rp->data, rp->len);
+      snprintf(buf, size, "[%s (%s) with secret %s]", rp->name, mac,
+	       secret2str(&secret, xbuf, sizeof(xbuf)));
+    } else
+      snprintf(buf, size, "[%s (%s)]", rp->name, mac);
+    return LOG_DEBUG;
+
+  case EV_SEND_RELAY:
+    snprintf(buf, size, "[Bulk request with %lld entries via relay %s]", rp->a, rp->name);
+    return LOG_DEBUG;
+
+  case EV_SEND_PACKET:
+    log_addr2str(rp, xbuf, sizeof(xbuf));
+    if (rp->name)
+      snprintf(buf, size, "Sending packet %lld/%lld for %s via %s", rp->a, rp->b, rp->name, xbuf);
+    else
+      snprintf(buf, size, "Sending packet %lld/%lld via %s", rp->a, rp->b, xbuf);
+    return LOG_DEBUG;
+
+  case EV_SLEEP:
+    ts.tv_sec = rp->a / 1000000000;
+    ts.tv_nsec = rp->a % 1000000000;
+    snprintf(buf, size, rp->b ? "(Sleeping %s more)" : "(Sleeping %s)",
+	     timespec2str(&ts, xbuf, sizeof(xbuf)));
+    return LOG_DEBUG;
+
+  case EV_PACKET:
+    len = snprintf(buf, size, "UDP Packet (%u bytes):", (unsigned int) rp->len);
+    for (i = 0; i < rp->len && len < size; i++)
+      len += snprintf(buf+len, size-len, (i & 15) == 0 ? "\n\t%02X" : ":%02X", rp->data[i]);
+    return LOG_DEBUG;
+
+  case EV_RECEIVED:
+    log_addr2str(rp, xbuf, sizeof(xbuf));
+    snprintf(buf, size, "[Worker #%u: Message on FD #%lld received from %s]", rp->worker, rp->a, xbuf);
+    return LOG_DEBUG;
+
+  case EV_WAITING:
+    snprintf(buf, size, "(Worker #%u: Waiting for messages on %lld FDs)", rp->worker, rp->a);
+    return LOG_DEBUG;
+
+  case EV_READABLE:
+    snprintf(buf, size, "[Worker #%u: Data available on FD #%lld]", rp->worker, rp->a);
+    return LOG_DEBUG;
+
+  case EV_SOURCE_LIMITED:
+    log_addr2str(rp, xbuf, sizeof(xbuf));
+    snprintf(buf, size, "*** Source rate limit exceeded for %s", xbuf);
+    return LOG_NOTICE;
+
+  case EV_TOO_SHORT:
+    snprintf(buf, size, "*** Invalid WoL message (too short: %lld bytes)", rp->a);
+    return LOG_NOTICE;
+
+  case EV_TOO_LONG:
+    snprintf(buf, size, "*** Invalid WoL message (too long: %lld bytes)", rp->a);
+    return LOG_NOTICE;
+
+  case EV_BAD_HEADER:
+    snprintf(buf, size, "*** Invalid WoL message (invalid header)");
+    return LOG_NOTICE;
+
+  case EV_BAD_MAC_COPIES:
+    snprintf(buf, size, "*** Invalid WoL message (invalid MAC content copies)");
+    return LOG_NOTICE;
+
+  case EV_SECRET:
+    memset(&secret, 0, sizeof(secret));
+    secret.size = rp->len;
+    memcpy(secret.buf, rp->data, rp->len);
+    snprintf(buf, size, "*** Received secret: %s", secret2str(&secret, xbuf, sizeof(xbuf)));
+    return LOG_DEBUG;
+
+  case EV_UNKNOWN_MAC:
+    snprintf(buf, size, "*** Unknown MAC (no such host): %s", mac);
+    return LOG_NOTICE;
+
+  case EV_BAD_SECRET:
+    snprintf(buf, size, "*** Invalid received secret for %s (%s)", rp->name, mac);
+    return LOG_NOTICE;
+
+  case EV_REQUEST_LIMITED:
+    snprintf(buf, size, "*** Request rate limit exceeded, dropping WoL for %s (%s)", rp->name, mac);
+    return LOG_NOTICE;
+
+  case EV_REQUEST:
+    snprintf(buf, size, "Got WoL for host: %s (%s)", rp->name, mac);
+    return LOG_DEBUG;
+
+  case EV_BULK_REQUEST:
+    snprintf(buf, size, "[Bulk request #%llu with %lld entries]", (unsigned long long) rp->b, rp->a);
+    return LOG_DEBUG;
+
+  case EV_GROUP_REQUEST:
+    snprintf(buf, size, "Got WoL for group: %s", rp->name);
+    return LOG_INFO;
+
+  case EV_BAD_BULK:
+    snprintf(buf, size, "*** Invalid bulk request (%s)", rp->name);
+    return LOG_NOTICE;
+
+  case EV_REPLAYED:
+    snprintf(buf, size, "*** Replayed or stale bulk request #%llu dropped", (unsigned long long) rp->b);
+    return LOG_NOTICE;
+
+  case EV_UNKNOWN_GROUP:
+    snprintf(buf, size, "*** Unknown group in relay request: %.*s", (int) rp->len, (const char *) rp->data);
+    return LOG_NOTICE;
+
+  case EV_HOP_LIMIT:
+    if (rp->name)
+      snprintf(buf, size, "*** Hop limit reached, not relaying group %s (relay loop?)", rp->name);
+    else
+      snprintf(buf, size, "*** Hop limit reached, dropping bulk request #%llu (relay loop?)",
+	       (unsigned long long) rp->a);
+    return LOG_WARNING;
+
+  case EV_QUEUE_FULL:
+    snprintf(buf, size, "*** Forward queue full, dropping WoL for %s (%s)", rp->name, mac);
+    return LOG_WARNING;
+
+  case EV_CONTROL_REQUEST:
+    if (rp->b)
+      snprintf(buf, size, "Got WoL for %.*s via control socket (%lld hosts, %lld failed)",
+	       (int) rp->len, (const char *) rp->data, rp->a, rp->b);
+    else
+      snprintf(buf, size, "Got WoL for %.*s via control socket (%lld hosts)",
+	       (int) rp->len, (const char *) rp->data, rp->a);
+    return LOG_INFO;
+
+  case EV_SCHEDULED:
+    snprintf(buf, size, "Scheduled WoL for %s (%lld hosts)", rp->name, rp->a);
+    return LOG_INFO;
+
+  case EV_CONTROL_ERROR:
+    snprintf(buf, size, "*** Control request for %.*s failed: %s",
+	     (int) rp->len, (const char *) rp->data, strerror(rp->a));
+    return LOG_NOTICE;
+
+  case EV_COALESCED:
+    snprintf(buf, size, "[Duplicate WoL for %s (%s) coalesced]", rp->name, mac);
+    return LOG_DEBUG;
+
+  case EV_JOURNAL_REPLAY:
+    snprintf(buf, size, "Resuming %lld pending wakes from journal", rp->a);
+    return LOG_INFO;
+
+  case EV_JOURNAL_SKIPPED:
+    snprintf(buf, size, "*** Dropping pending wake for %s from journal (no gateway %.*s)",
+	     rp->name, (int) rp->len, (const char *) rp->data);
+    return LOG_NOTICE;
+
+  case EV_JOURNAL_NO_GROUP:
+    snprintf(buf, size, "*** Dropping queued wake for %.*s from journal (no such group)",
+	     (int) rp->len, (const char *) rp->data);
+    return LOG_NOTICE;
+
+  case EV_JOURNAL_ERROR:
+    snprintf(buf, size, "*** Journal %s: %s (journaling disabled)", rp->name, strerror(rp->a));
+    return LOG_ERR;
+
+  case EV_PLAN_ERROR:
+    snprintf(buf, size, "*** Unable to forward WoL to %s: %s", rp->name, strerror(rp->a));
+    return LOG_ERR;
+
+  case EV_SEND_ERROR:
+    snprintf(buf, size, "*** Error sending WoL message to %s (%s): %s", rp->name, mac, strerror(rp->a));
+    return LOG_ERR;
+
+  case EV_LEASES:
+    snprintf(buf, size, "Lease file %s: %lld new and %lld changed hosts", rp->name, rp->a, rp->b);
+    return LOG_INFO;
+
+  case EV_LEASES_ERROR:
+    snprintf(buf, size, "*** Lease file %s: %s", rp->name, strerror(rp->a));
+    return LOG_ERR;
+
+  case EV_STATS:
+    snprintf(buf, size, "Statistics file %s: %lld hosts", rp->name, rp->a);
+    return LOG_INFO;
+
+  case EV_STATS_ERROR:
+    snprintf(buf, size, "*** Statistics file %s: %s", rp->name, strerror(rp->a));
+    return LOG_ERR;
+  }
+
+  snprintf(buf, size, "*** Unknown log event #%u", rp->event);
+  return LOG_ERR;
+}
+
+
+void
+log_write(LOGGER *lp,
+	  const struct timespec *ts,
+	  int prio,
+	  char *msg) {
+  char *line, *next;
+  char tbuf[64];
+  struct tm tm;
+
+
+  if (!lp->fp) {
+    /* One syslog message per line */
+    for (line = msg; line; line = next) {
+      next = strchr(line, '\n');
+      if (next)
+	*next++ = '\0';
+      syslog(prio, "%s", line);
+    }
+    return;
+  }
+
+  if (lp->stamp) {
+    localtime_r(&ts->tv_sec, &tm);
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(lp->fp, "%s.%06ld ", tbuf, (long) ts->tv_nsec / 1000);
+  }
+
+  fputs(msg, lp->fp);
+  putc('\n', lp->fp);
+}
+
+/* Single consumer only. Returns the number of records written */
+size_t
+log_drain(LOGGER *lp) {
+  char buf[2048];
+  LOGSLOT *sp;
+  LOGREC *rp;
+  size_t pos, seq, n;
+  int prio;
+
+
+  for (n = 0; ; n++) {
+    pos = atomic_load_explicit(&lp->tail, memory_order_relaxed);
+    sp = &lp->v[pos & lp->mask];
+    seq = atomic_load_explicit(&sp->seq, memory_order_acquire);
+    if ((intptr_t) seq - (intptr_t) (pos+1) < 0)
+      return n;
+
+    rp = &sp->rec;
+    prio = log_format(rp, buf, sizeof(buf));
+    log_write(lp, &rp->ts, prio, buf);
+
+    atomic_store_explicit(&sp->seq, pos+lp->mask+1, memory_order_release);
+    atomic_store_explicit(&lp->tail, pos+1, memory_order_release);
+  }
+}
+
+void *
+log_run(void *arg) {
+  LOGGER *lp = (LOGGER *) arg;
+  struct pollfd pfd;
+  char buf[256];
+  char msg[128];
+  uint64_t dropped, reported = 0;
+  struct timespec now;
+
+
+  pfd.fd = lp->pfd[0];
+  pfd.events = POLLIN;
+
+  while (1) {
+    if (log_drain(lp) > 0) {
+      dropped = atomic_load_explicit(&lp->dropped, memory_order_relaxed);
+      if (dropped != reported) {
+	clock_gettime(CLOCK_REALTIME, &now);
+	snprintf(msg, sizeof(msg), "*** %llu log messages dropped (log ring full)",
+		 (unsigned long long) (dropped - reported));
+	log_write(lp, &now, LOG_WARNING, msg);
+	reported = dropped;
+      }
+
+      if (lp->fp)
+	fflush(lp->fp);
+      fflush(stdout);
+
+      pthread_mutex_lock(&lp->mtx);
+      pthread_cond_broadcast(&lp->cv);
+      pthread_mutex_unlock(&lp->mtx);
+      continue;
+    }
+
+    /* Nothing to do - make sure producers wake us up before waiting */
+    atomic_store(&lp->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&lp->head) == atomic_load(&lp->tail))
+      while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+	;
+    atomic_store(&lp->sleeping, 0);
+
+    if (pfd.revents & POLLIN)
+      (void) read(lp->pfd[0], buf, sizeof(buf));
+  }
+
+  return NULL;
+}
+
+
+/* Wait until everything logged so far has been written */
+void
+log_flush(void) {
+  LOGGER *lp = logger;
+  size_t head;
+
+
+  if (!lp)
+    return;
+
+  head = atomic_load(&lp->head);
+
+  pthread_mutex_lock(&lp->mtx);
+  while ((intptr_t) (atomic_load(&lp->tail) - head) < 0) {
+    (void) write(lp->pfd[1], "", 1);
+    pthread_cond_wait(&lp->cv, &lp->mtx);
+  }
+  pthread_mutex_unlock(&lp->mtx);
+}
+
+
+/*
+ * Start the log writer thread. Dest is "stderr", "syslog" or a file
+ * name. Must be called after forking into the background.
+ */
+int
+log_open(const char *dest,
+	 size_t size) {
+  LOGGER *lp;
+  size_t i, n;
+  int rc;
+
+
+  for (n = 1; n < size; n <<= 1)
+    ;
+
+  lp = calloc_aligned(1, sizeof(LOGGER));
+  if (!lp)
+    return -1;
+
+  lp->v = malloc(n * sizeof(LOGSLOT));
+  if (!lp->v)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    atomic_init(&lp->v[i].seq, i);
+
+  lp->mask = n-1;
+  atomic_init(&lp->head, 0);
+  atomic_init(&lp->tail, 0);
+  atomic_init(&lp->sleeping, 0);
+  atomic_init(&lp->dropped, 0);
+
+  if (strcmp(dest, "syslog") == 0) {
+    openlog("pwol", LOG_PID, LOG_DAEMON);
+    lp->fp = NULL;
+  } else if (strcmp(dest, "stderr") == 0)
+    lp->fp = stderr;
+  else {
+    lp->fp = fopen(dest, "a");
+    if (!lp->fp)
+      return -1;
+    lp->stamp = 1;
+  }
+
+  if (pipe(lp->pfd) < 0)
+    return -1;
+  (void) fcntl(lp->pfd[0], F_SETFL, O_NONBLOCK);
+  (void) fcntl(lp->pfd[1], F_SETFL, O_NONBLOCK);
+
+  pthread_mutex_init(&lp->mtx, NULL);
+  pthread_cond_init(&lp->cv, NULL);
+
+  rc = pthread_create(&lp->tid, NULL, log_run, lp);
+  if (rc) {
+    errno = rc;
+    return -1;
+  }
+
+  logger = lp;
+  atexit(log_flush);
+  return 0;
+}
+
+
+int
+mac_invalid(struct ether_addr *mac) {
+  int i;
+
+
+  for (i = 0; i < 6 && mac->ether_addr_octet[i] == 0; i++)
+    ;
+
+  /* All 0x00 bytes - no MAC set */
+  if (i == 6) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+uint64_t
+mac_key(const struct ether_addr *ep) {
+  const unsigned char *bp = (const unsigned char *) ep;
+  uint64_t v = 0;
+  int i;
+
+
+  for (i = 0; i < MAC_SIZE; i++)
+    v = (v << 8) | bp[i];
+
+  return v;
+}
+
+unsigned long
+mac_hash(const struct ether_addr *ep) {
+  return (unsigned long) ((mac_key(ep) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+
+MACINDEX *
+mac_index_create(size_t n) {
+  MACINDEX *mip;
+
+
+  mip = calloc(1, sizeof(*mip));
+  if (!mip)
+    return NULL;
+
+  /* Keep load factor below 50% */
+  for (mip->hs = 16; mip->hs < n*2; mip->hs <<= 1)
+    ;
+
+  mip->keyv = calloc(mip->hs, sizeof(uint64_t));
+  mip->hv = calloc(mip->hs, sizeof(HOST *));
+  if (!mip->keyv || !mip->hv) {
+    free(mip->keyv);
+    free(mip->hv);
+    free(mip);
+    return NULL;
+  }
+
+  return mip;
+}
+
+/* Add a host unless its MAC already has one, the first host with a MAC wins */
+void
+mac_index_insert(MACINDEX *mip,
+		 HOST *hp) {
+  uint64_t key, k;
+  size_t i;
+
+
+  key = mac_key(&hp->mac);
+  if (!key)
+    return;
+
+  for (i = mac_hash(&hp->mac) & (mip->hs-1);
+       (k = atomic_load_explicit(&mip->keyv[i], memory_order_relaxed)) != 0 && k != key;
+       i = (i+1) & (mip->hs-1))
+    ;
+
+  if (k == key) {
+    if (!atomic_load_explicit(&mip->hv[i], memory_order_relaxed))
+      atomic_store_explicit(&mip->hv[i], hp, memory_order_release);
+    return;
+  }
+
+  atomic_store_explicit(&mip->hv[i], hp, memory_order_relaxed);
+  atomic_store_explicit(&mip->keyv[i], key, memory_order_release);
+  ++mip->hc;
+}
+
+/* Forget a host, before it changes MAC */
+void
+mac_index_remove(MACINDEX *mip,
+		 HOST *hp) {
+  uint64_t key, k;
+  size_t i;
+
+
+  key = mac_key(&hp->mac);
+  if (!key)
+    return;
+
+  for (i = mac_hash(&hp->mac) & (mip->hs-1);
+       (k = atomic_load_explicit(&mip->keyv[i], memory_order_relaxed)) != 0;
+       i = (i+1) & (mip->hs-1))
+    if (k == key) {
+      if (atomic_load_explicit(&mip->hv[i], memory_order_relaxed) == hp)
+	atomic_store_explicit(&mip->hv[i], NULL, memory_order_release);
+      return;
+    }
+}
+
+/* A copy with room for at least n more hosts, without the slots left by MAC changes */
+MACINDEX *
+mac_index_grow(MACINDEX *mip,
+	       size_t n) {
+  MACINDEX *nip;
+  HOST *hp;
+  size_t i;
+
+
+  nip = mac_index_create(mip->hc + n);
+  if (!nip)
+    return NULL;
+
+  for (i = 0; i < mip->hs; i++)
+    if ((hp = atomic_load_explicit(&mip->hv[i], memory_order_relaxed)) != NULL)
+      mac_index_insert(nip, hp);
+
+  return nip;
+}
+
+MACINDEX *
+mac_index_build(HOST *hosts) {
+  MACINDEX *mip;
+  HOST *hp;
+  size_t n;
+
+
+  n = 0;
+  for (hp = hosts; hp; hp = hp->next)
+    ++n;
+
+  mip = mac_index_create(n);
+  if (!mip)
+    return NULL;
+
+  for (hp = hosts; hp; hp = hp->next)
+    if (!mac_invalid(&hp->mac))
+      mac_index_insert(mip, hp);
+
+  return mip;
+}
+
+
+HOST *
+mac_index_lookup(MACINDEX *mip,
+		 const struct ether_addr *ep) {
+  uint64_t key, k;
+  HOST *hp;
+  size_t i;
+
+
+  /* No host has an all zero MAC, and such slots are empty */
+  key = mac_key(ep);
+  if (key) {
+    for (i = mac_hash(ep) & (mip->hs-1);
+	 (k = atomic_load_explicit(&mip->keyv[i], memory_order_acquire)) != 0;
+	 i = (i+1) & (mip->hs-1))
+      if (k == key) {
+	hp = atomic_load_explicit(&mip->hv[i], memory_order_acquire);
+	if (hp)
+	  return hp;
+	break;
+      }
+  }
+
+  errno = ENXIO;
+  return NULL;
+}
+
+
+int plan_build_host(HOST *hp, const OVERRIDES *op, SENDPLAN *pp);
+
+/* Overrides given on the command line */
+void
+overrides_default(OVERRIDES *op) {
+  op->copies     = f_copies;
+  op->delay      = f_delay;
+  op->secret     = f_secret;
+  op->ttl        = f_ttl;
+  op->gateway    = f_gateway;
+  op->host_delay = f_host_delay;
+}
+
+/* Copy overrides into a single allocation, so they can be queued and freed at once */
+OVERRIDES *
+overrides_dup(const OVERRIDES *op) {
+  const char *sv[6];
+  char **dv[6], *bp;
+  OVERRIDES *np;
+  size_t size;
+  int i;
+
+
+  sv[0] = op->copies;
+  sv[1] = op->delay;
+  sv[2] = op->secret;
+  sv[3] = op->ttl;
+  sv[4] = op->gateway;
+  sv[5] = op->host_delay;
+
+  size = sizeof(*np);
+  for (i = 0; i < 6; i++)
+    if (sv[i])
+      size += strlen(sv[i])+1;
+
+  np = malloc(size);
+  if (!np)
+    return NULL;
+
+  dv[0] = &np->copies;
+  dv[1] = &np->delay;
+  dv[2] = &np->secret;
+  dv[3] = &np->ttl;
+  dv[4] = &np->gateway;
+  dv[5] = &np->host_delay;
+
+  bp = (char *) (np+1);
+  for (i = 0; i < 6; i++) {
+    *dv[i] = NULL;
+    if (sv[i]) {
+      *dv[i] = strcpy(bp, sv[i]);
+      bp += strlen(sv[i])+1;
+    }
+  }
+
+  return np;
+}
+
+/* Overrides as " <key> <value>".. pairs, the form control requests carry them in */
+int
+overrides2str(const OVERRIDES *op,
+	      char *buf,
+	      size_t size) {
+  const struct {
+    const char *key;
+    const char *val;
+  } ov[] = {
+    { "copies",     op->copies },
+    { "delay",      op->delay },
+    { "secret",     op->secret },
+    { "ttl",        op->ttl },
+    { "gateway",    op->gateway },
+    { "host-delay", op->host_delay },
+  };
+  size_t i, len;
+
+
+  len = 0;
+  buf[0] = '\0';
+  for (i = 0; i < sizeof(ov)/sizeof(ov[0]); i++) {
+    if (!ov[i].val)
+      continue;
+
+    /* Requests are split on white space */
+    if (!*ov[i].val || strpbrk(ov[i].val, " \t\r\n")) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    len += snprintf(buf+len, size-len, " %s %s", ov[i].key, ov[i].val);
+    if (len >= size) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Parse <key> <value> pairs into op, line is NULL to go on with a line being split by strtok_r() */
+int
+overrides_parse(OVERRIDES *op,
+		char *line,
+		char **lptr) {
+  char *key, *val;
+
+
+  while ((key = strtok_r(line, " \t\r\n", lptr)) != NULL) {
+    line = NULL;
+    val = strtok_r(NULL, " \t\r\n", lptr);
+    if (!val) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    if (strcmp(key, "copies") == 0)
+      op->copies = val;
+    else if (strcmp(key, "delay") == 0)
+      op->delay = val;
+    else if (strcmp(key, "secret") == 0)
+      op->secret = val;
+    else if (strcmp(key, "ttl") == 0)
+      op->ttl = val;
+    else if (strcmp(key, "gateway") == 0)
+      op->gateway = val;
+    else if (strcmp(key, "host-delay") == 0)
+      op->host_delay = val;
+    else {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Gateway to send packets for a host through */
+GATEWAY *
+host_gateway(HOST *hp,
+	     const char *gateway) {
+  if (gateway)
+    return gw_lookup(gateway);
+
+  return hp->via ? hp->via : default_gw;
+}
+
+/* Resolve gateway and overrides (command line ones if NULL) for a host and build the packet to send */
+int
+plan_build(HOST *hp,
+	   const OVERRIDES *op,
+	   SENDPLAN *pp) {
+  int rc;
+
+
+  PROBE1(plan__start, hp ? hp->name : NULL);
+  rc = plan_build_host(hp, op, pp);
+  PROBE2(plan__done, hp ? hp->name : NULL, rc);
+
+  return rc;
+}
+
+int
+plan_build_host(HOST *hp,
+		const OVERRIDES *op,
+		SENDPLAN *pp) {
+  GATEWAY *gp = NULL;
+  const SECRET *sp = NULL;
+  struct ether_addr mac;
+  SECRET secret;
+  OVERRIDES ov;
+  int i;
+
+
+  if (!hp)
+    return -1;
+
+  if (!op) {
+    overrides_default(&ov);
+    op = &ov;
+  }
+
+  if (mac_invalid(host_mac(hp, &mac))) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  gp = host_gateway(hp, op->gateway);
+  if (!gp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pp->hp = hp;
+  pp->hgp = NULL;
+  pp->name = hp->name;
+  pp->gp = gp;
+  pp->sent = 0;
+  pp->jid = 0;
+
+  /* 
+   * Overrides are applied to the plan only so that the host
+   * table can be shared read-only between daemon threads
+   */
+  pp->copies = HOST_OPTS(hp)->copies;
+  if (op->copies && str2copies(op->copies, &pp->copies) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!pp->copies)
+    pp->copies = gp->copies;
+  if (!pp->copies)
+    pp->copies = 1;
+  if (pp->copies == COPIES_ADAPTIVE)
+    pp->copies = stats_copies(&mac, gp->copies != COPIES_ADAPTIVE && gp->copies ? gp->copies : 1);
+
+  pp->ttl = HOST_OPTS(hp)->ttl;
+  if (op->ttl && sscanf(op->ttl, "%u", &pp->ttl) != 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!pp->ttl)
+    pp->ttl = gp->ttl;
+
+  pp->delay = HOST_OPTS(hp)->delay;
+  if (op->delay && str2timespec(op->delay, &pp->delay) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (pp->delay.tv_sec == 0 && pp->delay.tv_nsec == 0)
+    pp->delay = gp->delay;
+
+  sp = host_secret(hp);
+  if (op->secret) {
+    if (str2secret(op->secret, &secret) < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    sp = &secret;
+  }
+  if (sp->size == 0)
+    sp = &gp->secret;
+  pp->secret = *sp;
+
+  memset(pp->msg, 0xFF, HEADER_SIZE);
+
+  for (i = 0; i < MAC_COPIES; i++)
+    memcpy(pp->msg+HEADER_SIZE+i*MAC_SIZE, &mac, MAC_SIZE);
+
+  memcpy(pp->msg+WOL_BODY_SIZE, pp->secret.buf, pp->secret.size);
+  pp->msg_size = WOL_BODY_SIZE+pp->secret.size;
+
+  return 0;
+}
+
+
+/* Start an empty bulk request for a relay gateway */
+int
+bulk_init(SENDPLAN *pp,
+	  GATEWAY *gp,
+	  const OVERRIDES *op) {
+  SECRET secret;
+  OVERRIDES ov;
+
+
+  if (!op) {
+    overrides_default(&ov);
+    op = &ov;
+  }
+
+  pp->hp = NULL;
+  pp->hgp = NULL;
+  pp->name = gp->name;
+  pp->gp = gp;
+  pp->sent = 0;
+  pp->jid = 0;
+
+  /* Copies and delays are for the request itself, the downstream daemon applies its own */
+  pp->copies = 0;
+  if (op->copies && str2copies(op->copies, &pp->copies) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!pp->copies)
+    pp->copies = gp->copies;
+  if (!pp->copies || pp->copies == COPIES_ADAPTIVE)
+    pp->copies = 1;
+
+  pp->ttl = 0;
+  if (op->ttl && sscanf(op->ttl, "%u", &pp->ttl) != 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!pp->ttl)
+    pp->ttl = gp->ttl;
+
+  pp->delay = gp->delay;
+  if (op->delay && str2timespec(op->delay, &pp->delay) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pp->secret = gp->secret;
+  if (op->secret) {
+    if (str2secret(op->secret, &secret) < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pp->secret = secret;
+  }
+
+  memset(pp->msg, 0, BULK_HEADER_SIZE);
+  memcpy(pp->msg, BULK_MAGIC, BULK_MAGIC_SIZE);
+  pp->msg[BULK_MAGIC_SIZE+0] = BULK_VERSION;
+  pp->msg[BULK_MAGIC_SIZE+1] = BULK_TYPE_WAKE;
+  pp->msg[BULK_HOPS] = BULK_MAX_HOPS;
+  pp->msg_size = BULK_HEADER_SIZE;
+  return 0;
+}
+
+unsigned int
+bulk_count(const SENDPLAN *pp) {
+  return (pp->msg[BULK_MAGIC_SIZE+2] << 8) | pp->msg[BULK_MAGIC_SIZE+3];
+}
+
+/* Append a MAC or group entry, fails with ENOBUFS when the request is full */
+int
+bulk_add(SENDPLAN *pp,
+	 int type,
+	 const void *data,
+	 size_t len) {
+  unsigned int n = bulk_count(pp);
+  size_t size;
+
+
+  if (type == BULK_ENTRY_MAC)
+    size = 1+MAC_SIZE;
+  else if (len >= 1 && len <= BULK_NAME_MAX)
+    size = 2+len;
+  else {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (n >= 0xFFFF || pp->msg_size+size+BULK_TAG_SIZE > BULK_MAX_SIZE) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  pp->msg[pp->msg_size++] = type;
+  if (type == BULK_ENTRY_MAC) {
+    memcpy(pp->msg+pp->msg_size, data, MAC_SIZE);
+    pp->msg_size += MAC_SIZE;
+  } else {
+    pp->msg[pp->msg_size++] = len;
+    memcpy(pp->msg+pp->msg_size, data, len);
+    pp->msg_size += len;
+  }
+
+  ++n;
+  pp->msg[BULK_MAGIC_SIZE+2] = n >> 8;
+  pp->msg[BULK_MAGIC_SIZE+3] = n & 0xFF;
+  return 0;
+}
+
+/* Strictly increasing wall clock nanoseconds, so receivers can spot replays */
+uint64_t
+bulk_seq(void) {
+  static _Atomic uint64_t last = 0;
+  struct timespec now;
+  uint64_t seq, old;
+
+
+  transport->clock_gettime(CLOCK_REALTIME, &now);
+  seq = timespec2ns(&now);
+
+  old = atomic_load(&last);
+  do {
+    if (seq <= old)
+      seq = old+1;
+  } while (!atomic_compare_exchange_weak(&last, &old, seq));
+
+  return seq;
+}
+
+/* Random enough id for this process, so receivers can keep sequence numbers apart */
+uint64_t
+bulk_sender(void) {
+  static _Atomic uint64_t id = 0;
+  static const unsigned char zero[16] = { 0 };
+  unsigned char buf[8+8+8+64];
+  struct timespec now;
+  uint64_t v, old = 0;
+
+
+  v = atomic_load(&id);
+  if (v)
+    return v;
+
+  memset(buf, 0, sizeof(buf));
+  transport->clock_gettime(CLOCK_REALTIME, &now);
+  put_be64(buf, timespec2ns(&now));
+  transport->clock_gettime(CLOCK_MONOTONIC, &now);
+  put_be64(buf+8, timespec2ns(&now));
+  put_be64(buf+16, (uint64_t) getpid());
+  (void) gethostname((char *) buf+24, sizeof(buf)-24-1);
+
+  v = siphash24(zero, buf, sizeof(buf));
+  if (!v)
+    v = 1;
+
+  /* Whoever got there first wins */
+  if (!atomic_compare_exchange_strong(&id, &old, v))
+    v = old;
+  return v;
+}
+
+/* Number and sign a filled in request */
+void
+bulk_seal(SENDPLAN *pp) {
+  unsigned char key[16];
+
+
+  put_be64(pp->msg+BULK_SEQ, bulk_seq());
+  put_be64(pp->msg+BULK_SENDER, bulk_sender());
+  bulk_key(&pp->secret, key);
+  put_le64(pp->msg+pp->msg_size, siphash24(key, pp->msg, pp->msg_size));
+  pp->msg_size += BULK_TAG_SIZE;
+}
+
+/* Bulk request asking a downstream pwol daemon to wake a whole group */
+int
+plan_build_group(HOSTGROUP *hgp,
+		 const OVERRIDES *op,
+		 unsigned int hops,
+		 SENDPLAN *pp) {
+  GATEWAY *gp;
+  int rc = -1;
+
+
+  PROBE1(plan__start, hgp->name);
+
+  gp = group_relay(hgp);
+  if (!gp)
+    errno = EINVAL;
+  else if (bulk_init(pp, gp, op) == 0 &&
+	   bulk_add(pp, BULK_ENTRY_GROUP, hgp->name, strlen(hgp->name)) == 0) {
+    pp->hgp = hgp;
+    pp->name = hgp->name;
+    pp->msg[BULK_HOPS] = hops;
+    bulk_seal(pp);
+    rc = 0;
+  }
+
+  PROBE2(plan__done, hgp->name, rc);
+  return rc;
+}
+
+
+/* 
+ * Capture sink: instead of sending, packets are written to a pcapng
+ * file as raw IP/UDP datagrams. The in-memory transport provides the
+ * clock, so delays are not slept but move the virtual time that
+ * timestamps the packets, and the file shows when they would have
+ * been sent while being written as fast as possible.
+ */
+typedef struct capture {
+  int fd;
+  unsigned char *buf;
+  size_t len;
+
+  unsigned long packets;
+  unsigned long long bytes;
+  struct timespec start;
+} CAPTURE;
+
+CAPTURE *capture = NULL;
+
+
+int
+capture_flush(void) {
+  size_t off = 0;
+  ssize_t rc;
+
+
+  while (off < capture->len) {
+    rc = write(capture->fd, capture->buf+off, capture->len-off);
+    if (rc < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    off += rc;
+  }
+
+  capture->len = 0;
+  return 0;
+}
+
+/* Room for a block of the given size in the buffer */
+unsigned char *
+capture_block(size_t size) {
+  unsigned char *bp;
+
+
+  if (capture->len + size > CAPTURE_BUFFER_SIZE && capture_flush() < 0)
+    return NULL;
+
+  bp = capture->buf + capture->len;
+  capture->len += size;
+  memset(bp, 0, size);
+  return bp;
+}
+
+void
+put_u16(unsigned char *p,
+	uint16_t v) {
+  memcpy(p, &v, 2);
+}
+
+void
+put_u32(unsigned char *p,
+	uint32_t v) {
+  memcpy(p, &v, 4);
+}
+
+/* Internet checksum, continuing from sum */
+uint32_t
+ip_sum(uint32_t sum,
+       const unsigned char *p,
+       size_t len) {
+  size_t i;
+
+
+  for (i = 0; i+1 < len; i += 2)
+    sum += (p[i] << 8) | p[i+1];
+  if (i < len)
+    sum += p[i] << 8;
+
+  return sum;
+}
+
+uint16_t
+ip_fold(uint32_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+  return ~sum & 0xFFFF;
+}
+
+int
+capture_open(const char *path) {
+  static const char appl[] = "pwol " PACKAGE_VERSION;
+  unsigned char *bp;
+  size_t size;
+
+
+  capture = calloc(1, sizeof(*capture));
+  if (!capture)
+    return -1;
+
+  capture->buf = malloc(CAPTURE_BUFFER_SIZE);
+  if (!capture->buf)
+    return -1;
+
+  capture->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (capture->fd < 0)
+    return -1;
+
+  /* Section header block, in host byte order, with the writing application */
+  size = 28 + 4 + ((sizeof(appl)-1+3) & ~3) + 4;
+  bp = capture_block(size);
+  put_u32(bp, PCAPNG_SHB);
+  put_u32(bp+4, size);
+  put_u32(bp+8, PCAPNG_MAGIC);
+  put_u16(bp+12, 1);
+  put_u16(bp+14, 0);
+  memset(bp+16, 0xFF, 8);
+  put_u16(bp+24, PCAPNG_OPT_SHB_USERAPPL);
+  put_u16(bp+26, sizeof(appl)-1);
+  memcpy(bp+28, appl, sizeof(appl)-1);
+  put_u32(bp+size-4, size);
+
+  /* Interface description block, raw IP with nanosecond timestamps */
+  size = 20 + 8 + 4;
+  bp = capture_block(size);
+  put_u32(bp, PCAPNG_IDB);
+  put_u32(bp+4, size);
+  put_u16(bp+8, PCAPNG_LINKTYPE_RAW);
+  put_u32(bp+12, 0);
+  put_u16(bp+16, PCAPNG_OPT_IF_TSRESOL);
+  put_u16(bp+18, 1);
+  bp[20] = 9;
+  put_u32(bp+size-4, size);
+
+  memnet_reset();
+  transport = &transport_mem;
+
+  clock_gettime(CLOCK_MONOTONIC, &capture->start);
+  return 0;
+}
+
+int
+capture_close(void) {
+  struct timespec now;
+  double t;
+  int rc;
+
+
+  if (!capture)
+    return 0;
+
+  rc = capture_flush();
+  if (close(capture->fd) < 0)
+    rc = -1;
+
+  if (f_verbose) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_sub(&now, &capture->start);
+    t = now.tv_sec + now.tv_nsec / 1000000000.0;
+    printf("[Captured %lu packets (%llu bytes) in %.3fs, %.0f packets/s]\n",
+	   capture->packets, capture->bytes, t, t > 0 ? capture->packets / t : 0.0);
+  }
+
+  free(capture->buf);
+  free(capture);
+  capture = NULL;
+  transport = &transport_sys;
+  return rc;
+}
+
+/* Sleep on the transport clock (like nanosleep, what is left is updated on EINTR) */
+int
+timespec_sleep(struct timespec *delay) {
+  return transport->nanosleep(delay, delay);
+}
+
+/* Write one copy of a planned packet as an enhanced packet block */
+int
+capture_packet(SENDPLAN *pp,
+	       TARGET *tp) {
+  const struct sockaddr *sa = tp->aip->ai_addr;
+  unsigned char *bp, *ip, *udp;
+  size_t iplen, plen, size, clen;
+  struct timespec now;
+  uint64_t ts;
+  uint32_t sum;
+
+
+  if (sa->sa_family == AF_INET)
+    iplen = 20;
+  else if (sa->sa_family == AF_INET6)
+    iplen = 40;
+  else {
+    errno = EAFNOSUPPORT;
+    return -1;
+  }
+
+  plen = iplen + 8 + pp->msg_size;
+  clen = pp->name ? strlen(pp->name) : 0;
+  if (clen > 0xFFFF)
+    clen = 0xFFFF;
+  size = 28 + ((plen+3) & ~3) + (clen ? 4 + ((clen+3) & ~3) + 4 : 0) + 4;
+
+  bp = capture_block(size);
+  if (!bp)
+    return -1;
+
+  transport->clock_gettime(CLOCK_REALTIME, &now);
+  ts = timespec2ns(&now);
+  put_u32(bp, PCAPNG_EPB);
+  put_u32(bp+4, size);
+  put_u32(bp+8, 0);
+  put_u32(bp+12, ts >> 32);
+  put_u32(bp+16, ts & 0xFFFFFFFF);
+  put_u32(bp+20, plen);
+  put_u32(bp+24, plen);
+
+  /* Network byte order from here, source address and port unknown (zero) */
+  ip = bp+28;
+  udp = ip+iplen;
+  if (sa->sa_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+
+    ip[0] = 0x45;
+    ip[2] = plen >> 8;
+    ip[3] = plen & 0xFF;
+    ip[8] = pp->ttl ? pp->ttl : 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip+16, &sin->sin_addr, 4);
+    sum = ip_fold(ip_sum(0, ip, 20));
+    ip[10] = sum >> 8;
+    ip[11] = sum & 0xFF;
+    memcpy(udp+2, &sin->sin_port, 2);
+  } else {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+    ip[0] = 0x60;
+    ip[4] = (plen-40) >> 8;
+    ip[5] = (plen-40) & 0xFF;
+    ip[6] = IPPROTO_UDP;
+    ip[7] = pp->ttl ? pp->ttl : 64;
+    memcpy(ip+24, &sin6->sin6_addr, 16);
+    memcpy(udp+2, &sin6->sin6_port, 2);
+  }
+
+  udp[4] = (8+pp->msg_size) >> 8;
+  udp[5] = (8+pp->msg_size) & 0xFF;
+  memcpy(udp+8, pp->msg, pp->msg_size);
+
+  if (sa->sa_family == AF_INET6) {
+    /* Mandatory for IPv6: pseudo header (addresses, length, protocol) and datagram */
+    sum = ip_sum(0, ip+8, 32);
+    sum += 8+pp->msg_size;
+    sum += IPPROTO_UDP;
+    sum = ip_fold(ip_sum(sum, udp, 8+pp->msg_size));
+    if (sum == 0)
+      sum = 0xFFFF;
+    udp[6] = sum >> 8;
+    udp[7] = sum & 0xFF;
+  }
+
+  /* The host or group name as a comment */
+  if (clen) {
+    bp += 28 + ((plen+3) & ~3);
+    put_u16(bp, PCAPNG_OPT_COMMENT);
+    put_u16(bp+2, clen);
+    memcpy(bp+4, pp->name, clen);
+  }
+
+  put_u32(capture->buf+capture->len-4, size);
+
+  ++capture->packets;
+  capture->bytes += pp->msg_size;
+  return 0;
+}
+
+
+/* Send one copy of a planned packet to one target */
+int
+plan_send(SENDPLAN *pp,
+	  TARGET *tp) {
+  struct addrinfo *aip = tp->aip;
+  int rc;
+
+
+  if (capture)
+    return capture_packet(pp, tp);
+
+  if (f_no)
+    return 0;
+
+  if (pp->ttl) {
+    (void) transport->setsockopt(tp->fd, IPPROTO_IP, IP_TTL,
+				 &pp->ttl, sizeof(pp->ttl));
+    (void) transport->setsockopt(tp->fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+				 &pp->ttl, sizeof(pp->ttl));
+  }
+
+  PROBE2(send__start, pp->name, pp->msg_size);
+
+  while ((rc = transport->sendto(tp->fd, pp->msg, pp->msg_size, 0, aip->ai_addr, aip->ai_addrlen)) < 0 && errno == EINTR)
+    ;
+
+  PROBE2(send__done, pp->name, rc);
+
+  return rc < 0 ? -1 : 0;
+}
+
+
+/* Send all copies of a planned packet to all targets, sleeping in between */
+int
+send_plan(SENDPLAN *pp) {
+  char mbuf[MAC_STR_SIZE];
+  int j;
+  int rc;
+  TARGET *tp = NULL;
+
+
+  if (f_debug > 2)
+    log_event(EV_PACKET, 0, NULL, NULL, 0, 0, pp->msg, pp->msg_size);
+
+  /* Progress goes straight to stdout, not through the (lossy) log ring */
+  if (f_verbose && !f_debug) {
+    /* The MAC in the packet, a lease file may have changed the host's since */
+    if (pp->hp)
+      printf("%s (%s)", pp->name, mac2str((const struct ether_addr *) (pp->msg+HEADER_SIZE), mbuf));
+    else
+      printf("%s (relay)", pp->name);
+    fflush(stdout);
+  }
+
+  for (tp = pp->gp->targets; tp; tp = tp->next) {
+    if (!tp->aip)
+      continue;
+
+    for (j = 0; j < pp->copies; j++) {
+      if (j > 0 && (pp->delay.tv_sec || pp->delay.tv_nsec)) {
+	/* Inter-packet delay */
+	struct timespec t_delay = pp->delay;
+	
+	if (f_debug)
+	  log_event(EV_SLEEP, 0, NULL, NULL, timespec2ns(&t_delay), 0, NULL, 0);
+	
+	PROBE1(sleep__start, timespec2ns(&t_delay));
+	while ((rc = timespec_sleep(&t_delay)) < 0 && errno == EINTR) {
+	  if (f_debug)
+	    log_event(EV_SLEEP, 0, NULL, NULL, timespec2ns(&t_delay), 1, NULL, 0);
+	}
+	PROBE1(sleep__done, rc);
+
+	if (rc < 0)
+	  goto Fail;
+      }
+      
+      if (f_debug)
+	log_event(EV_SEND_PACKET, 0, NULL, NULL, j+1, pp->copies,
+		  tp->aip->ai_addr, tp->aip->ai_addrlen);
+
+      if (plan_send(pp, tp) < 0)
+	goto Fail;
+
+      if (f_verbose && !f_debug) {
+	putc('.', stdout);
+	fflush(stdout);
+      }
+    }
+
+    if (f_verbose && !f_debug)
+      puts(" Done");
+  }
+  
+  return 0;
+
+ Fail:
+  if (f_verbose && !f_debug)
+    putc('\n', stdout);
+  return -1;
+}
+
+
+/* Sign and send the pending bulk request for a relay gateway */
+int
+bulk_flush(GATEWAY *gp) {
+  SENDPLAN *pp = gp->bulk;
+  int rc;
+
+
+  if (!pp)
+    return 0;
+
+  gp->bulk = NULL;
+
+  bulk_seal(pp);
+  if (f_debug)
+    log_event(EV_SEND_RELAY, 0, gp->name, NULL, bulk_count(pp), 0, NULL, 0);
+
+  rc = send_plan(pp);
+  free(pp);
+  return rc;
+}
+
+int
+bulk_pending(void) {
+  GATEWAY *gp;
+
+
+  for (gp = gateways; gp; gp = gp->next)
+    if (gp->bulk)
+      return 1;
+
+  return 0;
+}
+
+int
+bulk_flush_all(void) {
+  GATEWAY *gp;
+  int rc = 0;
+
+
+  for (gp = gateways; gp; gp = gp->next)
+    if (bulk_flush(gp) < 0)
+      rc = -1;
+
+  return rc;
+}
+
+/* Add a request for a relay gateway, sending the pending one first if full */
+int
+bulk_queue(GATEWAY *gp,
+	   int type,
+	   const void *data,
+	   size_t len) {
+  if (gp->bulk && bulk_add(gp->bulk, type, data, len) == 0)
+    return 0;
+
+  if (gp->bulk) {
+    if (errno != ENOBUFS)
+      return -1;
+    if (bulk_flush(gp) < 0)
+      return -1;
+  }
+
+  gp->bulk = malloc(sizeof(SENDPLAN));
+  if (!gp->bulk)
+    return -1;
+
+  if (bulk_init(gp->bulk, gp, NULL) < 0 || bulk_add(gp->bulk, type, data, len) < 0) {
+    free(gp->bulk);
+    gp->bulk = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int
+send_wol_host(HOST *hp) {
+  struct ether_addr mac;
+  SENDPLAN plan;
+
+
+  if (plan_build(hp, NULL, &plan) < 0)
+    return -1;
+
+  /* The MAC the plan was built with */
+  memcpy(&mac, plan.msg+HEADER_SIZE, MAC_SIZE);
+
+  if (f_debug)
+    log_event(EV_SEND_HOST, 0, hp->name, &mac, 0, 0, plan.secret.buf, plan.secret.size);
+
+  /* Downstream pwol daemons get many hosts packed in one request */
+  if (plan.gp->relay)
+    return bulk_queue(plan.gp, BULK_ENTRY_MAC, &mac, MAC_SIZE);
+
+  return send_plan(&plan);
+}
+
+
+int
+send_wol_group(HOSTGROUP *hgp) {
+  GATEWAY *gp;
+  int rc, i;
+
+
+  if ((gp = group_relay(hgp)) != NULL)
+    return bulk_queue(gp, BULK_ENTRY_GROUP, hgp->name, strlen(hgp->name));
+
+  for (i = 0; i < hgp->hc; i++) {
+    /* No point waiting for hosts that are only packed into a bulk request */
+    gp = host_gateway(hgp->hv[i], f_gateway);
+    if (gp && gp->relay)
+      ;
+    else if (i > 0 && (hgp->delay.tv_sec || hgp->delay.tv_nsec)) {
+      /* Inter-host delay */
+      struct timespec delay = hgp->delay;
+      
+      if (f_debug)
+	log_event(EV_SLEEP, 0, NULL, NULL, timespec2ns(&delay), 0, NULL, 0);
+      
+      PROBE1(sleep__start, timespec2ns(&delay));
+      while ((rc = timespec_sleep(&delay)) < 0 && errno == EINTR) {
+	if (f_debug)
+	  log_event(EV_SLEEP, 0, NULL, NULL, timespec2ns(&delay), 1, NULL, 0);
+      }
+      PROBE1(sleep__done, rc);
+      
+      if (rc < 0)
+	return -1;
+    }
+
+    rc = send_wol_host(hgp->hv[i]);
+    if (rc) 
+      return rc;
+  }
+  return 0;
+}
+
+int
+send_wol(const char *name) {
+  HOSTGROUP *hgp;
+  HOST *hp;
+  int rc;
+
+  
+  if ((hgp = group_select(name)) != NULL) {
+    rc = send_wol_group(hgp);
+    group_release(hgp);
+    return rc;
+  }
+  
+  hp = host_lookup(name);
+  if (!hp) {
+    hp = host_create(name);
+    if (!hp)
+      return -1;
+    
+    if (host_add_mac(hp, name) < 0)
+      return -1;
+  }
+
+  return send_wol_host(hp);
+}
+
+void
+header(FILE *fp) {
+  fprintf(fp, "[pwol %s (%s %s) - (c) Peter Eriksson <pen@lysator.liu.se>]\n",
+	  version, __DATE__, __TIME__);
+}
+
+
+/*
+ * Read a line (or as much of it as fits) without the newline. Returns 1,
+ * 0 at EOF, or -1 with errno ETIMEDOUT if no full line arrived within
+ * timeout milliseconds (-1 to wait forever). A partial line is kept.
+ */
+int
+input_line(INPUT *ip,
+	   char *line,
+	   size_t size,
+	   int timeout) {
+  struct timespec deadline, now, left;
+  struct pollfd pfd;
+  size_t n = 0;
+  ssize_t rc;
+  char *cp;
+  int ms;
+
+
+  if (timeout >= 0) {
+    transport->clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec  += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  for (;;) {
+    if (ip->off < ip->len) {
+      cp = memchr(ip->buf+ip->off, '\n', ip->len-ip->off);
+      if (cp || ip->eof || ip->len-ip->off >= size-1) {
+	n = (cp ? (size_t) (cp-(ip->buf+ip->off)) : ip->len-ip->off);
+	if (n > size-1)
+	  n = size-1;
+	memcpy(line, ip->buf+ip->off, n);
+	line[n] = '\0';
+	ip->off += n;
+	if (cp && ip->buf+ip->off == cp)
+	  ip->off++;
+	return 1;
+      }
+    } else if (ip->eof)
+      return 0;
+
+    /* Keep the partial line, make room for more */
+    if (ip->off > 0) {
+      memmove(ip->buf, ip->buf+ip->off, ip->len-ip->off);
+      ip->len -= ip->off;
+      ip->off = 0;
+    }
+
+    if (timeout >= 0) {
+      transport->clock_gettime(CLOCK_MONOTONIC, &now);
+      ms = 0;
+      if (timespec_cmp(&now, &deadline) < 0) {
+	left = deadline;
+	timespec_sub(&left, &now);
+	ms = (int) ((timespec2ns(&left) + 999999) / 1000000);
+      }
+
+      pfd.fd = ip->fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      rc = poll(&pfd, 1, ms);
+      if (rc < 0) {
+	if (errno == EINTR)
+	  continue;
+	return -1;
+      }
+      if (rc == 0) {
+	errno = ETIMEDOUT;
+	return -1;
+      }
+    }
+
+    rc = read(ip->fd, ip->buf+ip->len, sizeof(ip->buf)-ip->len);
+    if (rc < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    if (rc == 0)
+      ip->eof = 1;
+    ip->len += rc;
+  }
+}
+
+
+void
+trim(char *buf) {
+  char *cp;
+
+
+  /* Remove comments */
+  cp = strchr(buf, ';');
   if (cp)
     *cp = '\0';
+  cp = strchr(buf, '#');
+  if (cp)
+    *cp = '\0';
+
+  for (cp = buf; *cp && isspace(*cp); ++cp)
+    ;
+
+  if (cp > buf)
+    strcpy(buf, cp);
+
+  for (cp = buf+strlen(buf); cp > buf && isspace(cp[-1]); --cp)
+    ;
+  *cp = '\0';
+}
+
+
+/*
+ * The groups including a flattened group only copied the hosts it had
+ * then, so pass a leased host on to them (and to theirs).
+ */
+int
+group_lease_include(HOSTGROUP *hgp,
+		    HOST *hp) {
+  HOSTGROUP *igp;
+  size_t i, hc;
+
+
+  for (igp = hostgroups; igp; igp = igp->next) {
+    if (igp->flat != 2)
+      continue;
+
+    for (i = 0; i < igp->gc && strcmp(igp->gv[i], hgp->name) != 0; i++)
+      ;
+    if (i >= igp->gc)
+      continue;
+
+    hc = igp->hc;
+    if (group_include_host(igp, hp) < 0)
+      return -1;
+    if (igp->hc > hc && group_lease_include(igp, hp) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Add a leased host to a group and the groups including it */
+int
+group_lease_host(HOSTGROUP *hgp,
+		 HOST *hp) {
+  size_t hc;
+
+
+  hc = hgp->hc;
+  if (group_add_host(hgp, hp) < 0)
+    return -1;
+  if (hgp->hc == hc || hgp->flat != 2)
+    return 0;
+
+  return group_lease_include(hgp, hp);
+}
+
+/* Add the host a lease is for, or give it the new MAC */
+int
+leases_host(LEASEFILE *lp,
+	    const char *name,
+	    struct ether_addr *mac) {
+  const unsigned char *cp;
+  MACINDEX *mip;
+  HOST *hp;
+
+
+  if (!*name || mac_invalid(mac))
+    return 0;
+
+  /* Names are used as single words */
+  for (cp = (const unsigned char *) name; *cp; cp++)
+    if (!isgraph(*cp))
+      return 0;
+
+  hp = host_lookup(name);
+  if (hp) {
+    /* A MAC from the configuration wins */
+    if (!hp->leased && !mac_invalid(&hp->mac))
+      return 0;
+    if (memcmp(&hp->mac, mac, MAC_SIZE) == 0)
+      return 0;
+
+    if (mac_index)
+      mac_index_remove(mac_index, hp);
+    if (host_set_mac(hp, mac, hp->leased ? hp->leased : LEASED_MAC) < 0)
+      return -1;
+    ++lp->changed;
+  } else {
+    /* Like host_create(), but the MAC is known already */
+    hp = host_alloc();
+    if (!hp)
+      return -1;
+
+    hp->name = strdup(name);
+    if (!hp->name || host_index_name(hp) < 0 || host_set_mac(hp, mac, LEASED_HOST) < 0)
+      return -1;
+
+    hp->via = lp->via;
+    if (all_group && group_lease_host(all_group, hp) < 0)
+      return -1;
+
+    *hosts_tail = hp;
+    hosts_tail = &hp->next;
+    ++lp->added;
+  }
+
+  if (lp->hgp && group_lease_host(lp->hgp, hp) < 0)
+    return -1;
+
+  /* Only the daemon has a MAC index */
+  mip = mac_index;
+  if (mip) {
+    if ((mip->hc+1)*2 > mip->hs) {
+      mip = mac_index_grow(mip, mip->hc);
+      if (!mip)
+	return -1;
+      mac_index = mip;
+    }
+    mac_index_insert(mip, hp);
+  }
+
+  return 0;
+}
+
+/* dhcpd: "lease <ip> {" or "host <name> {", then statements ending with ";" and a "}" */
+int
+leases_isc(LEASEFILE *lp,
+	   char *line) {
+  char *cp;
+
+
+  if (strncmp(line, "lease ", 6) == 0 || strncmp(line, "host ", 5) == 0) {
+    lp->in_lease = 1;
+    memset(&lp->mac, 0, sizeof(lp->mac));
+    lp->name[0] = '\0';
+    if (line[0] == 'h' && sscanf(line+5, "%255s", lp->name) != 1)
+      lp->name[0] = '\0';
+    return 0;
+  }
+
+  if (!lp->in_lease)
+    return 0;
+
+  if (strcmp(line, "}") == 0) {
+    lp->in_lease = 0;
+    return leases_host(lp, lp->name, &lp->mac);
+  }
+
+  if (strncmp(line, "hardware ethernet ", 18) == 0) {
+    cp = strchr(line, ';');
+    if (cp)
+      *cp = '\0';
+    (void) str2mac(line+18, &lp->mac);
+  } else if (strncmp(line, "client-hostname \"", 17) == 0) {
+    cp = strchr(line+17, '"');
+    if (cp)
+      *cp = '\0';
+    snprintf(lp->name, sizeof(lp->name), "%s", line+17);
+  } else if (strcmp(line, "deleted;") == 0)
+    lp->in_lease = 0;
+
+  return 0;
+}
+
+/* Kea: CSV with a header line naming the columns, the hostname may end with a "." */
+int
+leases_kea(LEASEFILE *lp,
+	   char *line) {
+  struct ether_addr mac;
+  char *mp, *np, *cp;
+  int i;
+
+
+  mp = np = NULL;
+  for (i = 0; line; i++) {
+    cp = strchr(line, ',');
+    if (cp)
+      *cp++ = '\0';
+
+    if (strncmp(line, "address", 8) == 0 && i == 0)
+      lp->mac_col = lp->name_col = -1;
+    else if (lp->mac_col < 0 && strcmp(line, "hwaddr") == 0)
+      lp->mac_col = i;
+    else if (lp->name_col < 0 && strcmp(line, "hostname") == 0)
+      lp->name_col = i;
+    else if (i == lp->mac_col)
+      mp = line;
+    else if (i == lp->name_col)
+      np = line;
+
+    line = cp;
+  }
+
+  if (!mp || !np || str2mac(mp, &mac) < 0)
+    return 0;
+
+  i = strlen(np);
+  if (i > 0 && np[i-1] == '.')
+    np[i-1] = '\0';
+
+  return leases_host(lp, np, &mac);
+}
+
+/* dnsmasq: "<expiry> <mac> <ip> <name> <client-id>", with "*" for no name */
+int
+leases_dnsmasq(LEASEFILE *lp,
+	       char *line) {
+  struct ether_addr mac;
+  char mbuf[32], name[256];
+
+
+  /* DHCPv6 leases have no MAC */
+  if (sscanf(line, "%*s %31s %*s %255s", mbuf, name) != 2 ||
+      strcmp(name, "*") == 0 || str2mac(mbuf, &mac) < 0)
+    return 0;
+
+  return leases_host(lp, name, &mac);
+}
+
+int
+leases_line(LEASEFILE *lp,
+	    char *line) {
+  struct ether_addr mac;
+  char a[32], b[32];
+  char *cp;
+
+
+  while (isspace((unsigned char) *line))
+    ++line;
+  for (cp = line+strlen(line); cp > line && isspace((unsigned char) cp[-1]); --cp)
+    ;
+  *cp = '\0';
+
+  if (!*line || *line == '#')
+    return 0;
+
+  if (lp->format == LEASES_UNKNOWN) {
+    if (strncmp(line, "address,", 8) == 0) {
+      lp->format = LEASES_KEA;
+      lp->mac_col = lp->name_col = -1;
+    } else if (sscanf(line, "%31s %31s", a, b) == 2 &&
+	       (strcmp(a, "duid") == 0 || (strspn(a, "0123456789") == strlen(a) && str2mac(b, &mac) == 0)))
+      lp->format = LEASES_DNSMASQ;
+    else
+      lp->format = LEASES_ISC;
+  }
+
+  switch (lp->format) {
+  case LEASES_KEA:
+    return leases_kea(lp, line);
+  case LEASES_DNSMASQ:
+    return leases_dnsmasq(lp, line);
+  default:
+    return leases_isc(lp, line);
+  }
+}
+
+/*
+ * Read the complete lines added since last time. A file that was replaced
+ * or got shorter (dhcpd and Kea write a new one now and then) is read from
+ * the start again, and so is a dnsmasq file since it is rewritten on every
+ * change. Leases already read just give the same hosts again.
+ */
+int
+leases_read(LEASEFILE *lp) {
+  char buf[LEASES_LINE_SIZE];
+  struct stat st;
+  FILE *fp;
+  size_t len;
+  off_t off;
+  int c, rc;
+
+
+  fp = fopen(lp->path, "r");
+  if (!fp)
+    return -1;
+
+  if (fstat(fileno(fp), &st) < 0) {
+    fclose(fp);
+    return -1;
+  }
+
+  if (st.st_dev != lp->dev || st.st_ino != lp->ino || st.st_size < lp->off ||
+      (lp->format == LEASES_DNSMASQ && (st.st_mtime != lp->mtime || st.st_size != lp->off))) {
+    lp->dev = st.st_dev;
+    lp->ino = st.st_ino;
+    lp->off = 0;
+    lp->format = LEASES_UNKNOWN;
+    lp->in_lease = 0;
+  }
+  lp->mtime = st.st_mtime;
+
+  if (st.st_size == lp->off || fseeko(fp, lp->off, SEEK_SET) < 0) {
+    fclose(fp);
+    return 0;
+  }
+
+  rc = 0;
+  off = lp->off;
+  pthread_rwlock_wrlock(&inventory_lock);
+  while (rc == 0 && fgets(buf, sizeof(buf), fp)) {
+    len = strlen(buf);
+    if (len > 0 && buf[len-1] == '\n') {
+      off += len;
+      rc = leases_line(lp, buf);
+      continue;
+    }
+
+    /* Too long to be anything used, skip the rest of it */
+    while ((c = getc(fp)) != EOF && c != '\n')
+      ++len;
+
+    /* Not completely written yet, read it again next time */
+    if (c == EOF)
+      break;
+    off += len+1;
+  }
+  pthread_rwlock_unlock(&inventory_lock);
+
+  lp->off = off;
+  fclose(fp);
+  return rc;
+}
+
+int
+leases_add(const char *path,
+	   HOSTGROUP *hgp,
+	   GATEWAY *via) {
+  LEASEFILE *lp;
+
+
+  if (!path)
+    return -1;
+
+  lp = calloc(1, sizeof(*lp));
+  if (!lp)
+    return -1;
+
+  lp->path = strdup(path);
+  if (!lp->path)
+    return -1;
+  lp->hgp = hgp;
+  lp->via = via;
+
+  *leasefiles_tail = lp;
+  leasefiles_tail = &lp->next;
+
+  /* The DHCP server may not have created it yet */
+  if (leases_read(lp) < 0 && errno != ENOENT)
+    return -1;
+
+  return 0;
+}
+
+/* Check the lease files for new leases now and then */
+void *
+leases_run(void *arg) {
+  LEASEFILE *lp;
+  unsigned long added, changed;
+  int rc;
+
+
+  (void) arg;
+  while (1) {
+    for (lp = leasefiles; lp; lp = lp->next) {
+      added = lp->added;
+      changed = lp->changed;
+
+      rc = leases_read(lp);
+      if (rc < 0 && errno != ENOENT) {
+	if (errno != lp->error)
+	  log_event(EV_LEASES_ERROR, 0, lp->path, NULL, errno, 0, NULL, 0);
+	lp->error = errno;
+	continue;
+      }
+      lp->error = 0;
+
+      if (lp->added != added || lp->changed != changed)
+	log_event(EV_LEASES, 0, lp->path, NULL, lp->added-added, lp->changed-changed, NULL, 0);
+    }
+
+    sleep(LEASES_INTERVAL);
+  }
+
+  return NULL;
+}
+
+void
+sighup_handler(int sig) {
+  stats_reload = 1;
+}
+
+/* Reload the statistics file when it is replaced (by pwol -w) or on SIGHUP */
+void *
+stats_run(void *arg) {
+  struct stat st;
+
+
+  (void) arg;
+  while (1) {
+    sleep(STATS_INTERVAL);
+
+    if (!stats_reload &&
+	(stat(stats_path, &st) < 0 ||
+	 (st.st_dev == stats_dev && st.st_ino == stats_ino && st.st_mtime == stats_mtime)))
+      continue;
+    stats_reload = 0;
+
+    if (stats_load(stats_path) < 0)
+      log_event(EV_STATS_ERROR, 0, stats_path, NULL, errno, 0, NULL, 0);
+    else
+      log_event(EV_STATS, 0, stats_path, NULL, statc, 0, NULL, 0);
+  }
+
+  return NULL;
+}
+
+
+int
+parse_config(const char *path) {
+  char buf[2048], *bptr, *cptr;
+  FILE *fp;
+  int line = 0;
+  int len, rc = -1;
+
+  GATEWAY *gp = NULL;
+  GATEWAY *group_gp = NULL;
+  HOST *hp = NULL;
+  HOSTGROUP *hgp = NULL;
+
+
+  gp = gw_lookup("default");
+  gw_add_address(gp, DEFAULT_ADDRESS);
+  gw_add_port(gp, DEFAULT_PORT);
+
+  if (f_debug > 1)
+    fprintf(stderr, "[Parsing config: %s]\n", path);
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  PROBE1(config__start, path);
+
+  while (fgets(buf, sizeof(buf), fp)) {
+    char *key, *val;
+
+    ++line;
+
+    trim(buf);
+
+    if (!*buf)
+      continue;
+
+    bptr = buf;
+    hp = NULL;
+
+    while ((key = strtok_r(bptr, " \t", &cptr)) != NULL) {
+      bptr = NULL;
+      val = strtok_r(bptr, " \t", &cptr);
+
+      if (f_debug > 1) 
+	fprintf(stderr, "Got: %s %s\n", key, val ? val : "");
+
+      if (key[0] == '[' && key[len = strlen(key)-1] == ']') {
+	key[len] = '\0';
+	
+	if (f_debug > 2)
+	  fprintf(stderr, "[Switching hostgroup to %s]\n", key+1);
+	
+	hgp = group_create(key+1);
+	if (!hgp) {
+	  fprintf(stderr, "%s: %s#%u: %s: Invalid hostgroup\n", argv0, path, line, key+1);
+	  exit(1);
+	}
+	
+	/* Try to lookup gateway with same name as hostgroup */
+	group_gp = gw_lookup(key+1);
+	continue;
+      }
+
+      rc = 0;
+      if (strcmp(key, "host") == 0) {
+	hp = host_create(val);
+	if (!hp) {
+	  fprintf(stderr, "%s: %s#%u: %s: Invalid host name\n",
+		  argv0, path, line, val);
+	  exit(1);
+	}
+
+	if (hp->via == NULL && group_gp)
+	  hp->via = group_gp;
+
+	if (hgp)
+	  group_add_host(hgp, hp);
+
+	if (all_group)
+	  group_add_host(all_group, hp);
+
+      } else if (strcmp(key, "group") == 0) {
+	if (!hgp || hp || !val)
+	  goto InvalidOpt;
+	rc = group_add_group(hgp, val);
+
+      } else if (strcmp(key, "leases") == 0) {
+	if (hp)
+	  goto InvalidOpt;
+	rc = leases_add(val, hgp, group_gp);
+
+      } else if (strcmp(key, "gateway") == 0) {
+	if (hgp) {
+	  fprintf(stderr, "%s: %s#%u: Can not define gateways in groups\n",
+		  argv0, path, line);
+	  exit(1);
+	}
+	gp = gw_create(val);
+	if (!gp) {
+	  fprintf(stderr, "%s: %s#%u: %s: Invalid gateway name\n",
+		  argv0, path, line, val);
+	  exit(1);
+	}
+	hp = NULL;
+
+      } else if (strcmp(key, "proxy") == 0) {
+	if (hgp) {
+	  fprintf(stderr, "%s: %s#%u: Can not define proxies in groups\n",
+		  argv0, path, line);
+	  exit(1);
+	}
+	gp = proxy_create(val);
+	if (!gp) {
+	  fprintf(stderr, "%s: %s#%u: %s: Invalid proxy name\n",
+		  argv0, path, line, val);
+	  exit(1);
+	}
+	hp = NULL;
+
+      } else if (strcmp(key, "name") == 0) {
+	if (hgp && !hp)
+	  goto InvalidOpt;
+	if (hp)
+	  rc = host_add_name(hp, val);
+	else
+	  rc = gw_add_name(gp, val);
+      } else if (strcmp(key, "mac") == 0) {
+	if (hp)
+	  rc = host_add_mac(hp, val);
+	else
+	  goto InvalidOpt;
+      } else if (strcmp(key, "via") == 0) {
+	if (hp) {
+	  rc = host_add_via(hp, val);
+	}
+	else if (hgp)
+	  rc = group_add_via(hgp, val);
+	else
+	  goto InvalidOpt;
+      } else if (strcmp(key, "schedule") == 0) {
+	/* Takes the rest of the line */
+	if (val && cptr && *cptr) {
+	  val[strlen(val)] = ' ';
+	  cptr += strlen(cptr);
+	}
+	if (hp)
+	  rc = schedule_add(hp, NULL, val);
+	else if (hgp)
+	  rc = schedule_add(NULL, hgp, val);
+	else
+	  goto InvalidOpt;
+      } else if (strcmp(key, "relay") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	rc = str2bool(val, &gp->relay);
+      }	else if (strcmp(key, "copies") == 0) {
+	if (hgp && !hp)
+	  goto InvalidOpt;
+	if (hp)
+	  rc = host_add_copies(hp, val);
+	else
+	  rc = gw_add_copies(gp, val);
+      }	else if (strcmp(key, "ttl") == 0) {
+	if (hgp && !hp)
+	  goto InvalidOpt;
+	if (hp)
+	  rc = host_add_ttl(hp, val);
+	else
+	  rc = gw_add_ttl(gp, val);
+      } else if (strcmp(key, "secret") == 0) {
+	if (hgp && !hp)
+	  goto InvalidOpt;
+	if (hp)
+	  rc = host_add_secret(hp, val);
+	else
+	  rc = gw_add_secret(gp, val);
+      } else if (strcmp(key, "delay") == 0) {
+	if (hgp && !hp)
+	  rc = group_add_delay(hgp, val);
+	else if (hp)
+	  rc = host_add_delay(hp, val);
+	else
+	  rc = gw_add_delay(gp, val);
+      } else if (strcmp(key, "address") == 0) {
+	if (hp)
+	  rc = host_add_address(hp, val);
+	else
+	  rc = gw_add_address(gp, val);
+      } else if (strcmp(key, "port") == 0) {
+	if (hp)
+	  goto InvalidOpt;
+	rc = gw_add_port(gp, val);
+      } else if (strcmp(key, "workers") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (!val || sscanf(val, "%u", &proxy_workers) != 1 ||
+	    proxy_workers < 1 || proxy_workers > MAX_PROXY_WORKERS)
+	  rc = -1;
+      } else if (strcmp(key, "queue-size") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (!val || sscanf(val, "%u", &proxy_queue) != 1 ||
+	    proxy_queue < 1 || proxy_queue > MAX_PROXY_QUEUE)
+	  rc = -1;
+      } else if (strcmp(key, "probe") == 0) {
+	if (hp)
+	  rc = host_add_probe(hp, val);
+	else if (hgp)
+	  goto InvalidOpt;
+	else {
+	  const char *port;
+	  int type;
+
+	  rc = str2probe(val, &type, &port);
+	  if (rc == 0) {
+	    free(verify_probe);
+	    verify_probe = strdup(val);
+	  }
+	}
+      } else if (strcmp(key, "stats") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (val) {
+	  free(stats_path);
+	  stats_path = strdup(val);
+	} else
+	  rc = -1;
+      } else if (strcmp(key, "verify") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	rc = str2bool(val, &f_verify);
+      } else if (strcmp(key, "verify-timeout") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	rc = val ? str2timespec(val, &verify_timeout) : -1;
+      } else if (strcmp(key, "verify-backoff") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	rc = val ? str2timespec(val, &verify_backoff) : -1;
+      } else if (strcmp(key, "log") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (val) {
+	  free(log_dest);
+	  log_dest = strdup(val);
+	} else
+	  rc = -1;
+      } else if (strcmp(key, "log-size") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (!val || sscanf(val, "%u", &log_size) != 1 ||
+	    log_size < 1 || log_size > MAX_LOG_SIZE)
+	  rc = -1;
+      } else if (strcmp(key, "coalesce") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	rc = val ? str2timespec(val, &proxy_coalesce) : -1;
+      } else if (strcmp(key, "source-limit") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (!val || sscanf(val, "%u", &proxy_source_limit) != 1)
+	  rc = -1;
+      } else if (strcmp(key, "request-limit") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (!val || sscanf(val, "%u", &proxy_request_limit) != 1)
+	  rc = -1;
+      } else if (strcmp(key, "forward-limit") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (!val || sscanf(val, "%u", &proxy_forward_limit) != 1)
+	  rc = -1;
+      } else if (strcmp(key, "strict-secrets") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	rc = str2bool(val, &proxy_strict);
+      } else if (strcmp(key, "metrics") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (val) {
+	  free(proxy_metrics);
+	  proxy_metrics = strdup(val);
+	} else
+	  rc = -1;
+      } else if (strcmp(key, "journal") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (val) {
+	  free(proxy_journal);
+	  proxy_journal = strdup(val);
+	} else
+	  rc = -1;
+      } else if (strcmp(key, "control") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	if (val && *val == '/') {
+	  free(control_path);
+	  control_path = strdup(val);
+	} else
+	  rc = -1;
+      } else if (strcmp(key, "cpus") == 0) {
+	if (hp || hgp)
+	  goto InvalidOpt;
+	rc = val ? str2cpus(val, &proxy_cpuv, &proxy_cpuc) : -1;
+      } else {
+      InvalidOpt:
+	fprintf(stderr, "%s: %s#%u: %s: Invalid option\n", argv0, path, line, key);
+	exit(1);
+      }
+
+      if (rc < 0) {
+	fprintf(stderr, "%s: %s#%u: %s: Invalid value for %s (rc=%d)\n", argv0, path, line, val, key, rc);
+	exit(1);
+      }
+    }
+  }
+  
+  fclose(fp);
+
+  PROBE2(config__done, path, line);
+  return 0;
+}
+
+
+void
+export_all(void) {
+  GATEWAY *gp;
+  HOST *hp;
+  HOSTGROUP *hgp;
+  LEASEFILE *lp;
+  int n;
+
+
+  if (!f_verbose) {
+    puts("; pwol configuration");
+    putchar('\n');
+    puts("; Gateways:");
+  }
+  for (gp = gateways; gp; gp = gp->next) {
+
+    if (!gp->name)
+      continue; /* Skip over anonymous gateways */
+
+    gw_print(gp);
+  }
+
+  if (proxies) {
+    putchar('\n');
+    if (!f_verbose) {
+      puts("; Proxies:");
+    }
+    for (gp = proxies; gp; gp = gp->next) {
+      if (gp->name)
+	proxy_print(gp);
+    }
+  }
+
+  putchar('\n');
+  if (!f_verbose) {
+    puts("; Hosts:");
+  }
+  for (hp = hosts; hp; hp = hp->next) {
+    /* Read from the lease files again on import */
+    if (!f_verbose && hp->leased == LEASED_HOST)
+      continue;
+    host_print(hp);
+  }
+
+  for (lp = leasefiles, n = 0; lp; lp = lp->next) {
+    if (lp->hgp)
+      continue;
+
+    if (n++ == 0) {
+      putchar('\n');
+      if (!f_verbose)
+	puts("; Lease files:");
+    }
+    printf(f_verbose ? "Leases %s\n" : "leases %s\n", lp->path);
+  }
+
+  putchar('\n');
+  if (!f_verbose) {
+    puts("; Groups:");
+  }
+  n = 0;
+  for (hgp = hostgroups; hgp; hgp = hgp->next) {
+    if (!f_verbose && strcmp(hgp->name, "all") == 0)
+      continue;
+    
+    /* A group for a lease file with no leases yet still needs its leases line */
+    for (lp = leasefiles; lp && lp->hgp != hgp; lp = lp->next)
+      ;
+    if (hgp->hc == 0 && !lp)
+      continue;
+
+    if (n++ > 0 && !f_verbose)
+      putchar('\n');
+    group_print(hgp);
+  }
+}
+
+
+int
+thread_pin_cpu(pthread_t tid,
+	       int cpu) {
+#if HAVE_PTHREAD_SETAFFINITY_NP && defined(CPU_SET)
+  cpu_set_t cs;
+  int rc;
+
+
+  CPU_ZERO(&cs);
+  CPU_SET(cpu, &cs);
+
+  rc = pthread_setaffinity_np(tid, sizeof(cs), &cs);
+  if (rc) {
+    errno = rc;
+    return -1;
+  }
+
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+int
+jobqueue_init(JOBQUEUE *qp,
+	      size_t size) {
+  size_t i, n;
+
+
+  for (n = 1; n < size; n <<= 1)
+    ;
+
+  qp->v = malloc(n * sizeof(JOBSLOT));
+  if (!qp->v)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    atomic_init(&qp->v[i].seq, i);
+
+  qp->mask = n-1;
+  atomic_init(&qp->head, 0);
+  atomic_init(&qp->tail, 0);
+  return 0;
+}
+
+int64_t journal_time(const struct timespec *mono);
+
+/*
+ * Journal copy of a job, written before the job becomes visible to the
+ * consumer. The slot may still hold an older job that was not done yet,
+ * so it is marked free while being rewritten and a crash meanwhile never
+ * leaves a job mixing the two.
+ */
+void
+jqueued_put(JQUEUED *qp,
+	    const JOB *jp,
+	    const char *opts,
+	    size_t pos) {
+  JJOB *jjp = &qp->job;
+  struct timespec due;
+
+
+  atomic_store_explicit(&qp->seq, 0, memory_order_release);
+  atomic_thread_fence(memory_order_release);
+
+  due = jp->received;
+  timespec_add(&due, &jp->delay);
+  jjp->due = journal_time(&due);
+  jjp->next = 0;
+  jjp->hops = jp->hops;
+  jjp->group = (jp->hgp != NULL);
+
+  jjp->name[0] = '\0';
+  if (jp->hgp && snprintf(jjp->name, sizeof(jjp->name), "%s", jp->hgp->name) >= sizeof(jjp->name))
+    jjp->name[0] = '\0';
+  if (jp->hp)
+    host_mac(jp->hp, (struct ether_addr *) jjp->mac);
+
+  snprintf(jjp->opts, sizeof(jjp->opts), "%s", opts);
+
+  atomic_store_explicit(&qp->seq, (uint64_t) pos+1, memory_order_release);
+}
+
+/* May be called concurrently by multiple producers. Never blocks. */
+int
+jobqueue_push(JOBQUEUE *qp,
+	      const JOB *jp) {
+  char opts[JOURNAL_OPTS_SIZE];
+  JOBSLOT *sp;
+  size_t pos, seq;
+  intptr_t diff;
+
+
+  /* A job that would be replayed without its overrides is refused */
+  opts[0] = '\0';
+  if (qp->pv && jp->op && overrides2str(jp->op, opts, sizeof(opts)) < 0)
+    return -1;
+
+  pos = atomic_load_explicit(&qp->head, memory_order_relaxed);
+  while (1) {
+    sp = &qp->v[pos & qp->mask];
+    seq = atomic_load_explicit(&sp->seq, memory_order_acquire);
+    diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&qp->head, &pos, pos+1,
+						memory_order_relaxed, memory_order_relaxed))
+	break;
+    } else if (diff < 0) {
+      errno = ENOBUFS;
+      return -1;
+    } else
+      pos = atomic_load_explicit(&qp->head, memory_order_relaxed);
+  }
+
+  if (qp->pv)
+    jqueued_put(&qp->pv[pos & qp->mask], jp, opts, pos);
+
+  sp->job = *jp;
+  atomic_store_explicit(&sp->seq, pos+1, memory_order_release);
+  return 0;
+}
+
+/* Single consumer only, call jobqueue_done() with the position once the job is taken care of */
+int
+jobqueue_pop(JOBQUEUE *qp,
+	     JOB *jp,
+	     size_t *posp) {
+  JOBSLOT *sp;
+  size_t pos, seq;
+
+
+  pos = atomic_load_explicit(&qp->tail, memory_order_relaxed);
+  sp = &qp->v[pos & qp->mask];
+  seq = atomic_load_explicit(&sp->seq, memory_order_acquire);
+  if ((intptr_t) seq - (intptr_t) (pos+1) < 0)
+    return 0;
+
+  *jp = sp->job;
+  *posp = pos;
+  atomic_store_explicit(&sp->seq, pos+qp->mask+1, memory_order_release);
+  atomic_store_explicit(&qp->tail, pos+1, memory_order_relaxed);
+  return 1;
+}
+
+/* Drop the journal copy of a job once it has been journaled (or dropped) by the consumer */
+void
+jobqueue_done(JOBQUEUE *qp,
+	      size_t pos) {
+  JQUEUED *rp;
+  uint64_t seq = (uint64_t) pos+1;
+
+
+  if (!qp->pv)
+    return;
+
+  /* The slot may already have been taken by a new job */
+  rp = &qp->pv[pos & qp->mask];
+  (void) atomic_compare_exchange_strong(&rp->seq, &seq, 0);
+}
+
+size_t
+jobqueue_depth(JOBQUEUE *qp) {
+  size_t head = atomic_load_explicit(&qp->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&qp->tail, memory_order_relaxed);
+
+  return head > tail ? head-tail : 0;
+}
+
+
+void
+fwd_timer_push(FORWARDER *fp,
+	       const FWDTIMER *tip) {
+  size_t i, parent;
+
+
+  if (fp->tc >= fp->ts) {
+    fp->ts = fp->ts ? fp->ts*2 : 64;
+    fp->tv = realloc(fp->tv, fp->ts * sizeof(FWDTIMER));
+    if (!fp->tv) {
+      fprintf(stderr, "%s: Internal error #4810237: %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+  }
+
+  for (i = fp->tc++; i > 0; i = parent) {
+    parent = (i-1)/2;
+    if (timespec_cmp(&fp->tv[parent].due, &tip->due) <= 0)
+      break;
+    fp->tv[i] = fp->tv[parent];
+  }
+  fp->tv[i] = *tip;
+}
+
+/* Restore heap order after the root timer has been changed */
+void
+fwd_timer_sift(FORWARDER *fp) {
+  FWDTIMER t = fp->tv[0];
+  size_t i, child;
+
+
+  for (i = 0; (child = 2*i+1) < fp->tc; i = child) {
+    if (child+1 < fp->tc && timespec_cmp(&fp->tv[child+1].due, &fp->tv[child].due) < 0)
+      ++child;
+    if (timespec_cmp(&t.due, &fp->tv[child].due) <= 0)
+      break;
+    fp->tv[i] = fp->tv[child];
+  }
+  fp->tv[i] = t;
+}
+
+void
+fwd_timer_pop(FORWARDER *fp) {
+  if (--fp->tc > 0) {
+    fp->tv[0] = fp->tv[fp->tc];
+    fwd_timer_sift(fp);
+  }
+}
+
+
+int
+forward_push(FORWARDER *fp,
+	     const JOB *jp) {
+  if (jobqueue_push(&fp->q, jp) < 0)
+    return -1;
+
+  /*
+   * Only wake the forwarder up if it is waiting for work. The fence
+   * pairs with the one in forward_run() so that either it sees the job
+   * or this sees it sleeping.
+   */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&fp->sleeping))
+    (void) write(fp->pfd[1], "", 1);
+
+  return 0;
+}
+
+/* Queue a host, the forwarder takes over op (from overrides_dup()) unless this fails */
+int
+forward_enqueue(FORWARDER *fp,
+		HOST *hp,
+		OVERRIDES *op,
+		const struct timespec *received,
+		const struct timespec *delay) {
+  JOB job;
+
+
+  job.hp = hp;
+  job.hgp = NULL;
+  job.op = op;
+  job.hops = 0;
+  job.received = *received;
+  job.delay = *delay;
+
+  return forward_push(fp, &job);
+}
+
+/* 
+ * Queue a whole group as one job, the forwarder relays it or plans its
+ * hosts as there is room. It takes over op (from overrides_dup()) and
+ * releases the group when done, unless this fails.
+ */
+int
+forward_enqueue_group(FORWARDER *fp,
+		      HOSTGROUP *hgp,
+		      OVERRIDES *op,
+		      unsigned int hops,
+		      const struct timespec *received,
+		      const struct timespec *delay) {
+  JOB job;
+
+
+  job.hp = NULL;
+  job.hgp = hgp;
+  job.op = op;
+  job.hops = hops;
+  job.received = *received;
+  job.delay = *delay;
+
+  return forward_push(fp, &job);
+}
+
+
+int
+histogram_index(uint64_t v) {
+  int e;
+
+
+  if (v < (1 << HISTOGRAM_SUB_BITS))
+    return v;
+
+#if defined(__GNUC__)
+  e = 63 - __builtin_clzll(v);
+#else
+  for (e = 0; (v >> e) > 1; e++)
+    ;
+#endif
+  if (e > HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_BUCKETS-1;
+
+  return ((e-HISTOGRAM_SUB_BITS+1) << HISTOGRAM_SUB_BITS) + ((v >> (e-HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS)-1));
+}
+
+/* Smallest value not in the bucket */
+uint64_t
+histogram_limit(int i) {
+  int e, sub;
+
+
+  if (i < (1 << HISTOGRAM_SUB_BITS))
+    return i+1;
+
+  e = (i >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS-1;
+  sub = i & ((1 << HISTOGRAM_SUB_BITS)-1);
+  return (uint64_t) ((1 << HISTOGRAM_SUB_BITS)+sub+1) << (e-HISTOGRAM_SUB_BITS);
+}
+
+/* Single writer only */
+void
+histogram_add(HISTOGRAM *hp,
+	      uint64_t v) {
+  COUNTER_INC(hp->v[histogram_index(v)]);
+  COUNTER_INC(hp->count);
+  COUNTER_ADD(hp->sum, v);
+}
+
+
+RATELIMIT *
+ratelimit_create(unsigned int rate) {
+  RATELIMIT *rlp;
+
+
+  rlp = malloc(sizeof(*rlp));
+  if (!rlp)
+    return NULL;
+
+  /* Allow bursts of up to one second worth of events */
+  rlp->interval = 1000000000ULL / rate;
+  if (!rlp->interval)
+    rlp->interval = 1;
+  rlp->burst = 1000000000ULL - rlp->interval;
+  atomic_init(&rlp->tat, 0);
+  return rlp;
+}
+
+/* 
+ * Returns 0 if an event at 'now' conforms, else -1 and the earliest
+ * time (in ns) when it would
+ */
+int
+ratelimit_check(RATELIMIT *rlp,
+		uint64_t now,
+		uint64_t *next) {
+  uint64_t old, tat, ntat;
+
+
+  old = atomic_load_explicit(&rlp->tat, memory_order_relaxed);
+  do {
+    tat = old < now ? now : old;
+    if (tat - now > rlp->burst) {
+      if (next)
+	*next = tat - rlp->burst;
+      return -1;
+    }
+    ntat = tat + rlp->interval;
+  } while (!atomic_compare_exchange_weak_explicit(&rlp->tat, &old, ntat,
+						  memory_order_relaxed, memory_order_relaxed));
+
+  return 0;
+}
+
+
+SKETCH *
+sketch_create(unsigned int limit) {
+  SKETCH *skp;
+  struct timespec now;
+
+
+  skp = calloc(1, sizeof(*skp));
+  if (!skp)
+    return NULL;
+
+  /* Random seed so sources can not be picked to collide on purpose */
+  clock_gettime(CLOCK_REALTIME, &now);
+  skp->seed = (timespec2ns(&now) ^ ((uint64_t) getpid() << 32)) | 1;
+  skp->limit = limit;
+  return skp;
+}
+
+uint64_t
+sockaddr_hash(const struct sockaddr *sp,
+	      uint64_t seed) {
+  const unsigned char *bp;
+  size_t len, i;
+  uint64_t h = seed;
+
+
+  switch (sp->sa_family) {
+  case AF_INET:
+    bp = (const unsigned char *) &((const struct sockaddr_in *) sp)->sin_addr;
+    len = 4;
+    break;
+  case AF_INET6:
+    /* Hosts are trivially given a whole /64 so count them as one */
+    bp = (const unsigned char *) &((const struct sockaddr_in6 *) sp)->sin6_addr;
+    len = 8;
+    break;
+  default:
+    return h;
+  }
+
+  /* FNV-1a with a random basis */
+  for (i = 0; i < len; i++)
+    h = (h ^ bp[i]) * 0x100000001B3ULL;
+
+  return h;
+}
+
+/* Count n requests from a source, returns -1 if above the limit */
+int
+sketch_check(SKETCH *skp,
+	     const struct sockaddr *sp,
+	     const struct timespec *now,
+	     unsigned int n) {
+  uint64_t h, sec, old;
+  unsigned int cur, prev, c, r;
+  int slot;
+  size_t i;
+
+
+  sec = now->tv_sec;
+  slot = sec & 1;
+
+  old = atomic_load_explicit(&skp->epoch[slot], memory_order_acquire);
+  if (old != sec &&
+      atomic_compare_exchange_strong(&skp->epoch[slot], &old, sec)) {
+    /* New second - recycle the slot. Concurrent updates may be lost, which is fine */
+    for (r = 0; r < SKETCH_ROWS; r++)
+      for (i = 0; i < SKETCH_WIDTH; i++)
+	atomic_store_explicit(&skp->v[slot][r][i], 0, memory_order_relaxed);
+  }
+
+  h = sockaddr_hash(sp, skp->seed);
+
+  cur = prev = UINT_MAX;
+  for (r = 0; r < SKETCH_ROWS; r++) {
+    i = (h >> (r*16)) & (SKETCH_WIDTH-1);
+
+    c = atomic_fetch_add_explicit(&skp->v[slot][r][i], n, memory_order_relaxed)+n;
+    if (c < cur)
+      cur = c;
+
+    c = atomic_load_explicit(&skp->v[slot^1][r][i], memory_order_relaxed);
+    if (c < prev)
+      prev = c;
+  }
+
+  if (atomic_load_explicit(&skp->epoch[slot^1], memory_order_relaxed) != sec-1)
+    prev = 0;
+
+  /* Sliding window estimate over the last second */
+  if ((uint64_t) cur + (uint64_t) prev * (1000000000 - now->tv_nsec) / 1000000000 > skp->limit)
+    return -1;
+
+  return 0;
+}
+
+
+COALESCE *
+coalesce_create(size_t hosts,
+		const struct timespec *window) {
+  COALESCE *cp;
+  size_t n;
+
+
+  cp = malloc(sizeof(*cp));
+  if (!cp)
+    return NULL;
+
+  for (n = COALESCE_WAYS; n < hosts*2; n <<= 1)
+    ;
+
+  cp->v = calloc(n, sizeof(COALESCE_SLOT));
+  if (!cp->v) {
+    free(cp);
+    return NULL;
+  }
+
+  cp->mask = n-1;
+  cp->window = *window;
+  return cp;
+}
+
+/* 
+ * Returns 1 if the MAC was forwarded within the window, else
+ * records it as forwarded now (evicting the oldest entry in its set)
+ */
+int
+coalesce_check(COALESCE *cp,
+	       const struct ether_addr *mac,
+	       const struct timespec *now) {
+  COALESCE_SLOT *set, *sp, *oldest;
+  struct timespec until;
+  int i;
+
+
+  set = &cp->v[mac_hash(mac) & cp->mask & ~(size_t) (COALESCE_WAYS-1)];
+
+  oldest = set;
+  for (i = 0; i < COALESCE_WAYS; i++) {
+    sp = &set[i];
+    if (memcmp(&sp->mac, mac, MAC_SIZE) == 0 && (sp->last.tv_sec || sp->last.tv_nsec)) {
+      until = sp->last;
+      timespec_add(&until, &cp->window);
+      if (timespec_cmp(now, &until) < 0)
+	return 1;
+
+      oldest = sp;
+      break;
+    }
+    if (timespec_cmp(&sp->last, &oldest->last) < 0)
+      oldest = sp;
+  }
+
+  oldest->mac = *mac;
+  oldest->last = *now;
+  return 0;
+}
+
+
+/* Wall clock nanoseconds for a monotonic time, journal times must survive reboots */
+int64_t
+journal_time(const struct timespec *mono) {
+  struct timespec now, real;
+
+
+  transport->clock_gettime(CLOCK_MONOTONIC, &now);
+  transport->clock_gettime(CLOCK_REALTIME, &real);
+
+  return (int64_t) timespec2ns(&real) + ((int64_t) timespec2ns(mono) - (int64_t) timespec2ns(&now));
+}
+
+size_t
+journal_wake_size(size_t msg_size) {
+  return (offsetof(JWAKE, msg)+msg_size+7) & ~(size_t) 7;
+}
+
+/* Create and map a new, empty journal file */
+unsigned char *
+journal_map(const char *path,
+	    const char *magic,
+	    size_t size,
+	    int *fdp) {
+  unsigned char *base;
+  int fd, rc;
+
+
+  fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  if (fd < 0)
+    return NULL;
+
+#if HAVE_POSIX_FALLOCATE
+  /* Running out of disk space behind a mapping means SIGBUS, so allocate it all now */
+  rc = posix_fallocate(fd, 0, size);
+#else
+  rc = ftruncate(fd, size) < 0 ? errno : 0;
+#endif
+  if (rc) {
+    close(fd);
+    (void) unlink(path);
+    errno = rc;
+    return NULL;
+  }
+
+  base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    rc = errno;
+    close(fd);
+    (void) unlink(path);
+    errno = rc;
+    return NULL;
+  }
+
+  memcpy(base, magic, strlen(magic));
+  *fdp = fd;
+  return base;
+}
+
+/* Map an existing journal file read-only, *basep is NULL if there is none */
+int
+journal_load(const char *path,
+	     const char *magic,
+	     unsigned char **basep,
+	     size_t *sizep) {
+  unsigned char *base;
+  struct stat sb;
+  int fd, rc;
+
+
+  *basep = NULL;
+  *sizep = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+
+  if (fstat(fd, &sb) < 0)
+    goto Fail;
+
+  if (sb.st_size < JOURNAL_HEADER_SIZE) {
+    close(fd);
+    return 0;
+  }
+
+  base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED)
+    goto Fail;
+  close(fd);
+
+  if (memcmp(base, magic, strlen(magic)) != 0) {
+    munmap(base, sb.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  *basep = base;
+  *sizep = sb.st_size;
+  return 0;
+
+ Fail:
+  rc = errno;
+  close(fd);
+  errno = rc;
+  return -1;
+}
+
+/* Make a rename in the directory of path durable */
+int
+journal_sync_dir(const char *path) {
+  char *dir, *cp;
+  int fd, rc;
+
+
+  dir = strdup(path);
+  if (!dir)
+    return -1;
+
+  cp = strrchr(dir, '/');
+  if (cp == dir)
+    cp[1] = '\0';
+  else if (cp)
+    *cp = '\0';
+  else
+    strcpy(dir, ".");
+
+  fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd < 0)
+    return -1;
+
+  rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+/*
+ * Replace the journal file with the new one, which must be mapped in
+ * already. This is a checkpoint: the file is synced first, so what it
+ * holds now also survives a power loss and not just a crashed daemon.
+ */
+int
+journal_rename(JOURNAL *jp,
+	       unsigned char *old_base,
+	       size_t old_size,
+	       int old_fd) {
+  if (msync(jp->base, jp->off, MS_SYNC) < 0 || fsync(jp->fd) < 0)
+    return -1;
+
+  if (rename(jp->tmp, jp->path) < 0)
+    return -1;
+  (void) journal_sync_dir(jp->path);
+
+  if (old_base) {
+    munmap(old_base, old_size);
+    close(old_fd);
+  }
+
+  return 0;
+}
+
+/* Append a pending wake, fails with ENOSPC when the journal is full */
+int
+journal_put(JOURNAL *jp,
+	    SENDPLAN *pp,
+	    const struct timespec *due) {
+  JWAKE *wp;
+  size_t msg_size, len;
+  int bulk;
+
+
+  msg_size = pp->msg_size;
+  bulk = (msg_size >= BULK_HEADER_SIZE+BULK_TAG_SIZE &&
+	  memcmp(pp->msg, BULK_MAGIC, BULK_MAGIC_SIZE) == 0);
+
+  /* Bulk requests are signed again when resumed, or they would be dropped as replays */
+  if (bulk)
+    msg_size -= BULK_TAG_SIZE;
+
+  len = journal_wake_size(msg_size);
+  if (jp->off+len > jp->size) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  wp = (JWAKE *) (jp->base+jp->off);
+  wp->h.size = len;
+  wp->h.id = pp->jid;
+  wp->due = journal_time(due);
+  wp->delay = timespec2ns(&pp->delay);
+  wp->copies = pp->copies;
+  wp->sent = pp->sent;
+  wp->ttl = pp->ttl;
+  wp->secret_size = pp->secret.size;
+  wp->msg_size = msg_size;
+  wp->bulk = bulk;
+  snprintf(wp->gateway, sizeof(wp->gateway), "%s", pp->gp->name);
+  snprintf(wp->name, sizeof(wp->name), "%s", pp->name);
+  memcpy(wp->secret, pp->secret.buf, pp->secret.size);
+  memcpy(wp->msg, pp->msg, msg_size);
+
+  atomic_store_explicit(&wp->h.type, JOURNAL_ADD, memory_order_release);
+  pp->joff = jp->off;
+  jp->off += len;
+  return 0;
+}
+
+/* Append a job, its offset is stored in *offp so it can be updated in place */
+int
+journal_put_job(JOURNAL *jp,
+		const JJOB *src,
+		uint64_t id,
+		size_t *offp) {
+  JJOB *jjp;
+
+
+  if (jp->off+sizeof(JJOB) > jp->size) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  jjp = (JJOB *) (jp->base+jp->off);
+  memcpy((char *) jjp + sizeof(JRECORD), (const char *) src + sizeof(JRECORD),
+	 sizeof(JJOB) - sizeof(JRECORD));
+  jjp->h.size = sizeof(JJOB);
+  jjp->h.id = id;
+
+  atomic_store_explicit(&jjp->h.type, JOURNAL_JOB, memory_order_release);
+  if (offp)
+    *offp = jp->off;
+  jp->off += sizeof(JJOB);
+  return 0;
+}
+
+/* Job record for a group being expanded, -1 if it can not be journaled */
+int
+journal_group_job(const FWDGROUP *fgp,
+		  JJOB *jjp) {
+  memset(jjp, 0, sizeof(*jjp));
+  jjp->due = journal_time(&fgp->start);
+  jjp->next = fgp->next;
+  jjp->group = 1;
+
+  if (snprintf(jjp->name, sizeof(jjp->name), "%s", fgp->hgp->name) >= sizeof(jjp->name))
+    return -1;
+  if (fgp->op && overrides2str(fgp->op, jjp->opts, sizeof(jjp->opts)) < 0)
+    return -1;
+
+  return 0;
+}
+
+void
+journal_fail(JOURNAL *jp) {
+  if (jp->failed)
+    return;
+
+  log_event(EV_JOURNAL_ERROR, 0, jp->path, NULL, errno, 0, NULL, 0);
+  jp->failed = 1;
+}
+
+/* Rewrite the journal with only the wakes still pending, with their progress */
+int
+journal_compact(FORWARDER *fp) {
+  JOURNAL *jp = fp->jp;
+  unsigned char *base, *old_base;
+  size_t size, old_size, old_off, i, ng;
+  SENDPLAN *pp;
+  FWDGROUP *fgp;
+  JJOB job;
+  int fd, old_fd, rc;
+
+
+  if (jp->failed)
+    return -1;
+
+  for (ng = 0, fgp = fp->groups; fgp; fgp = fgp->link)
+    ++ng;
+
+  size = JOURNAL_MIN_SIZE;
+  while (size < JOURNAL_HEADER_SIZE + 2 * (fp->tc * sizeof(JWAKE) + ng * sizeof(JJOB)))
+    size *= 2;
+
+  base = journal_map(jp->tmp, JOURNAL_MAGIC, size, &fd);
+  if (!base) {
+    journal_fail(jp);
+    return -1;
+  }
+
+  old_base = jp->base;
+  old_size = jp->size;
+  old_off = jp->off;
+  old_fd = jp->fd;
+
+  jp->base = base;
+  jp->size = size;
+  jp->fd = fd;
+  jp->off = JOURNAL_HEADER_SIZE;
+
+  /* Plans with more than one target have several timers, write them once */
+  ++jp->gen;
+  for (i = 0; i < fp->tc; i++) {
+    pp = fp->tv[i].pp;
+    if (!pp->jid || pp->jgen == jp->gen)
+      continue;
+
+    pp->jgen = jp->gen;
+    (void) journal_put(jp, pp, &fp->tv[i].due);
+  }
+
+  for (fgp = fp->groups; fgp; fgp = fgp->link)
+    if (fgp->jid && journal_group_job(fgp, &job) == 0)
+      (void) journal_put_job(jp, &job, fgp->jid, &fgp->joff);
+
+  if (journal_rename(jp, old_base, old_size, old_fd) < 0) {
+    rc = errno;
+    munmap(base, size);
+    close(fd);
+    (void) unlink(jp->tmp);
+
+    jp->base = old_base;
+    jp->size = old_size;
+    jp->fd = old_fd;
+    jp->off = old_off;
+
+    /* Group offsets point into the new file, but nothing is written any more */
+    errno = rc;
+    journal_fail(jp);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Journal a newly scheduled plan */
+void
+journal_add(FORWARDER *fp,
+	    SENDPLAN *pp,
+	    const struct timespec *due) {
+  JOURNAL *jp = fp->jp;
+
+
+  if (jp->failed)
+    return;
+
+  pp->jid = ++jp->id;
+  pp->jgen = 0;
+
+  /* Compaction picks the plan up from its timers */
+  if (journal_put(jp, pp, due) < 0)
+    (void) journal_compact(fp);
+}
+
+/* Journal a group being expanded, which must be on the forwarder's list already */
+void
+journal_group(FORWARDER *fp,
+	      FWDGROUP *fgp) {
+  JOURNAL *jp = fp->jp;
+  JJOB job;
+
+
+  if (jp->failed || journal_group_job(fgp, &job) < 0)
+    return;
+
+  fgp->jid = ++jp->id;
+
+  /* Compaction picks the group up from the list */
+  if (journal_put_job(jp, &job, fgp->jid, &fgp->joff) < 0)
+    (void) journal_compact(fp);
+}
+
+/* Record how many hosts of a group have been planned */
+void
+journal_progress(JOURNAL *jp,
+		 const FWDGROUP *fgp) {
+  if (jp->failed)
+    return;
+
+  ((JJOB *) (jp->base+fgp->joff))->next = fgp->next;
+}
+
+/* Record how many copies of a plan have been sent, so they are not sent again */
+void
+journal_sent(JOURNAL *jp,
+	     const SENDPLAN *pp) {
+  if (jp->failed)
+    return;
+
+  ((JWAKE *) (jp->base+pp->joff))->sent = pp->sent;
+}
+
+/* Mark a journaled plan or group as finished */
+void
+journal_done(FORWARDER *fp,
+	     uint64_t id) {
+  JOURNAL *jp = fp->jp;
+  JRECORD *rp;
+
+
+  if (jp->failed)
+    return;
+
+  /* Compaction leaves it out as it has no timers left */
+  if (jp->off+sizeof(JRECORD) > jp->size) {
+    (void) journal_compact(fp);
+    return;
+  }
+
+  rp = (JRECORD *) (jp->base+jp->off);
+  rp->size = sizeof(JRECORD);
+  rp->id = id;
+  atomic_store_explicit(&rp->type, JOURNAL_DONE, memory_order_release);
+  jp->off += sizeof(JRECORD);
+}
+
+
+int
+journal_id_cmp(const void *a,
+	       const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Names and options are only used if they are properly terminated */
+int
+journal_job_valid(const JJOB *jjp) {
+  return (jjp->group <= 1 &&
+	  memchr(jjp->name, 0, sizeof(jjp->name)) &&
+	  memchr(jjp->opts, 0, sizeof(jjp->opts)));
+}
+
+/* Next valid record in a journal image, NULL at the end */
+const JRECORD *
+journal_next(const unsigned char *base,
+	     size_t size,
+	     size_t *offp) {
+  const JRECORD *rp;
+  const JWAKE *wp;
+  size_t off = *offp;
+
+
+  if (off+sizeof(JRECORD) > size)
+    return NULL;
+
+  rp = (const JRECORD *) (base+off);
+  if (rp->size < sizeof(JRECORD) || (rp->size & 7) || rp->size > size-off)
+    return NULL;
+
+  switch (rp->type) {
+  case JOURNAL_DONE:
+    break;
+
+  case JOURNAL_ADD:
+    wp = (const JWAKE *) rp;
+    if (rp->size < offsetof(JWAKE, msg) ||
+	wp->msg_size > PLAN_MSG_SIZE || wp->secret_size > SECRET_MAX_SIZE ||
+	rp->size != journal_wake_size(wp->msg_size))
+      return NULL;
+    break;
+
+  case JOURNAL_JOB:
+    if (rp->size != sizeof(JJOB) || !journal_job_valid((const JJOB *) rp))
+      return NULL;
+    break;
+
+  default:
+    return NULL;
+  }
+
+  *offp = off+rp->size;
+  return rp;
+}
+
+/*
+ * Open a journal, carrying the unfinished wakes and jobs of the last run
+ * (also the ones still queued) over into a new file, and create a new
+ * queue file with room for the given number of job queue slots
+ */
+JOURNAL *
+journal_open(const char *path,
+	     size_t slots) {
+  JOURNAL *jp;
+  const JRECORD *rp;
+  const JQUEUED *qp;
+  unsigned char *old = NULL, *qold = NULL, *base;
+  uint64_t *idv = NULL, *nidv;
+  size_t old_size = 0, qold_size = 0, idc = 0, ids = 0, qc = 0, off, size, need;
+  char *qtmp = NULL;
+  int fd, rc;
+
+
+  jp = calloc(1, sizeof(*jp));
+  if (!jp)
+    return NULL;
+  jp->fd = jp->qfd = -1;
+
+  jp->path = strdup(path);
+  jp->tmp = strdupcat(path, ".new", NULL);
+  jp->qpath = strdupcat(path, ".queue", NULL);
+  qtmp = strdupcat(path, ".queue.new", NULL);
+  if (!jp->path || !jp->tmp || !jp->qpath || !qtmp)
+    goto Fail;
+
+  if (journal_load(path, JOURNAL_MAGIC, &old, &old_size) < 0 ||
+      journal_load(jp->qpath, JOURNAL_QUEUE_MAGIC, &qold, &qold_size) < 0)
+    goto Fail;
+
+  /* Finished ids, sorted for lookup */
+  need = JOURNAL_HEADER_SIZE;
+  for (off = JOURNAL_HEADER_SIZE; old && (rp = journal_next(old, old_size, &off)) != NULL; ) {
+    if (rp->id > jp->id)
+      jp->id = rp->id;
+
+    if (rp->type != JOURNAL_DONE) {
+      need += rp->size;
+      continue;
+    }
+
+    if (idc >= ids) {
+      ids = ids ? ids*2 : 1024;
+      nidv = realloc(idv, ids*sizeof(*idv));
+      if (!nidv)
+	goto Fail;
+      idv = nidv;
+    }
+    idv[idc++] = rp->id;
+  }
+
+  if (idc > 0)
+    qsort(idv, idc, sizeof(*idv), journal_id_cmp);
+
+  /* Jobs that were still waiting in the queue */
+  for (off = JOURNAL_HEADER_SIZE; qold && off+sizeof(JQUEUED) <= qold_size; off += sizeof(JQUEUED)) {
+    qp = (const JQUEUED *) (qold+off);
+    if (qp->seq && journal_job_valid(&qp->job)) {
+      need += sizeof(JJOB);
+      ++qc;
+    }
+  }
+
+  size = JOURNAL_MIN_SIZE;
+  while (size < 2 * need)
+    size *= 2;
+
+  base = journal_map(jp->tmp, JOURNAL_MAGIC, size, &fd);
+  if (!base)
+    goto Fail;
+
+  jp->base = base;
+  jp->size = size;
+  jp->fd = fd;
+  jp->off = JOURNAL_HEADER_SIZE;
+
+  for (off = JOURNAL_HEADER_SIZE; old && (rp = journal_next(old, old_size, &off)) != NULL; ) {
+    if (rp->type == JOURNAL_DONE ||
+	(idc > 0 && bsearch(&rp->id, idv, idc, sizeof(*idv), journal_id_cmp)))
+      continue;
+
+    memcpy(jp->base+jp->off, rp, rp->size);
+    jp->off += rp->size;
+  }
+
+  for (off = JOURNAL_HEADER_SIZE; qc > 0 && off+sizeof(JQUEUED) <= qold_size; off += sizeof(JQUEUED)) {
+    qp = (const JQUEUED *) (qold+off);
+    if (qp->seq && journal_job_valid(&qp->job))
+      (void) journal_put_job(jp, &qp->job, ++jp->id, NULL);
+  }
+
+  /* The queued jobs are in the journal now, so the old queue file can go */
+  if (journal_rename(jp, NULL, 0, -1) < 0)
+    goto Fail;
+
+  size = JOURNAL_HEADER_SIZE + slots*sizeof(JQUEUED);
+  base = journal_map(qtmp, JOURNAL_QUEUE_MAGIC, size, &jp->qfd);
+  if (!base)
+    goto Fail;
+  jp->qv = (JQUEUED *) (base+JOURNAL_HEADER_SIZE);
+  jp->qsize = size;
+
+  if (rename(qtmp, jp->qpath) < 0)
+    goto Fail;
+
+  free(qtmp);
+  free(idv);
+  if (old)
+    munmap(old, old_size);
+  if (qold)
+    munmap(qold, qold_size);
+  return jp;
+
+ Fail:
+  rc = errno;
+  if (jp->qv) {
+    munmap((unsigned char *) jp->qv - JOURNAL_HEADER_SIZE, jp->qsize);
+    (void) unlink(qtmp);
+  }
+  if (jp->qfd >= 0)
+    close(jp->qfd);
+  if (jp->base)
+    munmap(jp->base, jp->size);
+  if (jp->fd >= 0) {
+    close(jp->fd);
+    (void) unlink(jp->tmp);
+  }
+  if (old)
+    munmap(old, old_size);
+  if (qold)
+    munmap(qold, qold_size);
+  free(idv);
+  free(qtmp);
+  free(jp->qpath);
+  free(jp->tmp);
+  free(jp->path);
+  free(jp);
+  errno = rc;
+  return NULL;
+}
+
+void forward_schedule(FORWARDER *fp, SENDPLAN *pp, const struct timespec *now,
+		      const struct timespec *received, const struct timespec *delay);
+void forward_start(FORWARDER *fp, const JOB *jp, const struct timespec *now);
+FWDGROUP *forward_group(FORWARDER *fp, HOSTGROUP *hgp, OVERRIDES *op, const struct timespec *now,
+			const struct timespec *received, const struct timespec *delay);
+
+/* Start a job carried over from the last run, with a new journal record */
+void
+journal_replay_job(FORWARDER *fp,
+		   const JJOB *jjp,
+		   const struct timespec *now,
+		   const struct timespec *delay) {
+  char opts[JOURNAL_OPTS_SIZE], buf[MAC_STR_SIZE], *lptr;
+  struct ether_addr mac;
+  OVERRIDES ov, *op = NULL;
+  FWDGROUP *fgp;
+  uint64_t ns;
+  JOB job;
+
+
+  if (jjp->opts[0]) {
+    strcpy(opts, jjp->opts);
+    memset(&ov, 0, sizeof(ov));
+    if (overrides_parse(&ov, opts, &lptr) < 0 || (op = overrides_dup(&ov)) == NULL) {
+      log_event(EV_JOURNAL_ERROR, 0, fp->jp->path, NULL, errno, 0, NULL, 0);
+      return;
+    }
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.op = op;
+  job.hops = jjp->hops;
+  job.received = *now;
+  job.delay = *delay;
+
+  if (jjp->group) {
+    pthread_rwlock_rdlock(&inventory_lock);
+    job.hgp = group_select(jjp->name);
+    pthread_rwlock_unlock(&inventory_lock);
+
+    if (!job.hgp) {
+      log_event(EV_JOURNAL_NO_GROUP, 0, NULL, NULL, 0, 0, jjp->name, strlen(jjp->name));
+      free(op);
+      return;
+    }
+
+    if (group_relay(job.hgp)) {
+      forward_start(fp, &job, now);
+      return;
+    }
+
+    /* Carry on after the hosts that were planned already, at their original pace */
+    fgp = forward_group(fp, job.hgp, op, now, now, delay);
+    if (fgp && jjp->next > 0) {
+      fgp->next = jjp->next;
+      ns = timespec2ns(&fgp->step) * jjp->next;
+      fgp->due.tv_sec += ns / 1000000000;
+      fgp->due.tv_nsec += ns % 1000000000;
+      if (fgp->due.tv_nsec >= 1000000000) {
+	fgp->due.tv_sec += 1;
+	fgp->due.tv_nsec -= 1000000000;
+      }
+      if (fgp->jid)
+	journal_progress(fp->jp, fgp);
+    }
+    return;
+  }
+
+  memcpy(&mac, jjp->mac, MAC_SIZE);
+  job.hp = mac_index_lookup(mac_index, &mac);
+  if (!job.hp) {
+    /* Not configured (from the control socket), plans point to it so it is never freed */
+    job.hp = calloc(1, sizeof(*job.hp));
+    if (!job.hp || !(job.hp->name = strdup(mac2str(&mac, buf)))) {
+      log_event(EV_JOURNAL_ERROR, 0, fp->jp->path, NULL, errno, 0, NULL, 0);
+      free(job.hp);
+      free(op);
+      return;
+    }
+    job.hp->mac = mac;
+    job.hp->id = HOST_NO_ID;
+  }
+
+  forward_start(fp, &job, now);
+}
+
+/* Schedule the wakes and jobs carried over from the last run (forwarder thread only) */
+void
+journal_replay(FORWARDER *fp) {
+  JOURNAL *jp = fp->jp;
+  static const struct timespec no_time;
+  const JRECORD *rp;
+  const JWAKE *wp;
+  struct timespec now, delay;
+  struct ether_addr mac;
+  SENDPLAN *pp;
+  GATEWAY *gp;
+  HOST *hp;
+  HOSTGROUP *hgp;
+  JJOB *jv = NULL;
+  size_t off, jc, i;
+  int64_t real;
+  long long n;
+
+
+  n = jc = 0;
+  for (off = JOURNAL_HEADER_SIZE; (rp = journal_next(jp->base, jp->off, &off)) != NULL; ) {
+    if (rp->type == JOURNAL_ADD)
+      ++n;
+    else if (rp->type == JOURNAL_JOB)
+      ++jc;
+  }
+  if (n+jc == 0)
+    return;
+
+  log_event(EV_JOURNAL_REPLAY, 0, NULL, NULL, n+jc, 0, NULL, 0);
+
+  /* Jobs get new records when started, so take copies before appending anything */
+  if (jc > 0) {
+    jv = malloc(jc * sizeof(*jv));
+    if (!jv) {
+      log_event(EV_JOURNAL_ERROR, 0, jp->path, NULL, errno, 0, NULL, 0);
+      return;
+    }
+
+    jc = 0;
+    for (off = JOURNAL_HEADER_SIZE; (rp = journal_next(jp->base, jp->off, &off)) != NULL; )
+      if (rp->type == JOURNAL_JOB)
+	memcpy(&jv[jc++], rp, sizeof(*jv));
+  }
+
+  transport->clock_gettime(CLOCK_MONOTONIC, &now);
+  real = journal_time(&now);
+
+  /* The plans keep their journal records, so nothing is appended meanwhile */
+  for (off = JOURNAL_HEADER_SIZE; (rp = journal_next(jp->base, jp->off, &off)) != NULL; ) {
+    if (rp->type != JOURNAL_ADD)
+      continue;
+
+    wp = (const JWAKE *) rp;
+    if (wp->sent >= wp->copies)
+      continue;
+
+    hp = NULL;
+    hgp = NULL;
+    if (wp->bulk)
+      hgp = group_lookup(wp->name);
+    else if (wp->msg_size >= WOL_BODY_SIZE) {
+      memcpy(&mac, wp->msg+HEADER_SIZE, MAC_SIZE);
+      hp = mac_index_lookup(mac_index, &mac);
+    }
+
+    gp = memchr(wp->gateway, 0, sizeof(wp->gateway)) ? gw_lookup(wp->gateway) : NULL;
+    if (!gp) {
+      log_event(EV_JOURNAL_SKIPPED, 0, hp ? hp->name : hgp ? hgp->name : NULL, NULL, 0, 0,
+		wp->gateway, strnlen(wp->gateway, sizeof(wp->gateway)));
+      continue;
+    }
+
+    pp = malloc(sizeof(*pp));
+    if (!pp) {
+      log_event(EV_JOURNAL_ERROR, 0, jp->path, NULL, errno, 0, NULL, 0);
+      free(jv);
+      return;
+    }
+
+    pp->hp = hp;
+    pp->hgp = hgp;
+    pp->gp = gp;
+
+    /* Log records may refer to the name, so it must never be freed */
+    if (hp)
+      pp->name = hp->name;
+    else if (hgp)
+      pp->name = hgp->name;
+    else
+      pp->name = strndup(wp->name, sizeof(wp->name)-1);
+
+    pp->copies = wp->copies;
+    pp->sent = wp->sent;
+    pp->ttl = wp->ttl;
+    pp->delay.tv_sec = wp->delay / 1000000000;
+    pp->delay.tv_nsec = wp->delay % 1000000000;
+    pp->secret.size = wp->secret_size;
+    memcpy(pp->secret.buf, wp->secret, wp->secret_size);
+    memcpy(pp->msg, wp->msg, wp->msg_size);
+    pp->msg_size = wp->msg_size;
+    if (wp->bulk)
+      bulk_seal(pp);
+
+    pp->jid = rp->id;
+    pp->joff = (const unsigned char *) rp - jp->base;
+    pp->jgen = 0;
+
+    memset(&delay, 0, sizeof(delay));
+    if (wp->due > real) {
+      delay.tv_sec = (wp->due - real) / 1000000000;
+      delay.tv_nsec = (wp->due - real) % 1000000000;
+    }
+
+    forward_schedule(fp, pp, &now, &no_time, &delay);
+  }
+
+  for (i = 0; i < jc; i++) {
+    memset(&delay, 0, sizeof(delay));
+    if (jv[i].due > real) {
+      delay.tv_sec = (jv[i].due - real) / 1000000000;
+      delay.tv_nsec = (jv[i].due - real) % 1000000000;
+    }
+
+    journal_replay_job(fp, &jv[i], &now, &delay);
+    journal_done(fp, jv[i].h.id);
+  }
+
+  free(jv);
+}
+
+
+/* One timer per target, rescheduled for each copy */
+void
+forward_schedule(FORWARDER *fp,
+		 SENDPLAN *pp,
+		 const struct timespec *now,
+		 const struct timespec *received,
+		 const struct timespec *delay) {
+  FWDTIMER t;
+  TARGET *tp;
+
+
+  pp->received = *received;
+  pp->refs = 0;
+
+  t.due = *now;
+  timespec_add(&t.due, delay);
+  t.pp = pp;
+  t.copy = pp->sent;
+  t.paced = 0;
+  for (tp = pp->gp->targets; tp; tp = tp->next) {
+    if (!tp->aip)
+      continue;
+
+    t.tp = tp;
+    fwd_timer_push(fp, &t);
+    ++pp->refs;
+  }
+
+  if (pp->refs == 0) {
+    free(pp);
+    return;
+  }
+  pp->behind = pp->refs;
+
+  ++fp->plans;
+
+  if (fp->jp && !pp->jid)
+    journal_add(fp, pp, &t.due);
+}
+
+/* Plan and schedule a wake for a single host */
+void
+forward_host(FORWARDER *fp,
+	     HOST *hp,
+	     const OVERRIDES *op,
+	     const struct timespec *now,
+	     const struct timespec *received,
+	     const struct timespec *delay) {
+  struct ether_addr mac;
+  SENDPLAN *pp;
+
+
+  host_mac(hp, &mac);
+  if (fp->cp && coalesce_check(fp->cp, &mac, now)) {
+    if (f_debug)
+      log_event(EV_COALESCED, 0, hp->name, &mac, 0, 0, NULL, 0);
+    COUNTER_INC(fp->coalesced);
+    return;
+  }
+
+  pp = malloc(sizeof(*pp));
+  if (!pp || plan_build(hp, op, pp) < 0) {
+    log_event(EV_PLAN_ERROR, 0, hp->name, &mac, errno, 0, NULL, 0);
+    COUNTER_INC(fp->plan_errors);
+    free(pp);
+    return;
+  }
+
+  forward_schedule(fp, pp, now, received, delay);
+}
+
+void
+forward_group_free(FWDGROUP *fgp) {
+  group_release(fgp->hgp);
+  free(fgp->op);
+  free(fgp);
+}
+
+/* 
+ * Plan the next hosts of the groups being woken while there is room
+ * for more plans. Groups grow when lease files add hosts, so this skips
+ * a round instead of waiting while the lease thread updates them.
+ */
+int
+forward_expand(FORWARDER *fp,
+	       const struct timespec *now) {
+  FWDGROUP *fgp;
+  struct timespec delay;
+  int busy = 0;
+
+
+  if (!fp->groups || fp->plans >= fp->max_plans)
+    return 0;
+
+  if (pthread_rwlock_tryrdlock(&inventory_lock) != 0)
+    return 0;
+
+  while ((fgp = fp->groups) != NULL && fp->plans < fp->max_plans) {
+    if (fgp->next >= fgp->hgp->hc) {
+      fp->groups = fgp->link;
+      if (!fp->groups)
+	fp->groups_tail = NULL;
+      if (fp->jp && fgp->jid)
+	journal_done(fp, fgp->jid);
+      forward_group_free(fgp);
+      continue;
+    }
+
+    /* Hosts are spread out by the group delay, counted from when the group was started */
+    delay = fgp->due;
+    if (timespec_cmp(&delay, now) > 0)
+      timespec_sub(&delay, now);
+    else
+      memset(&delay, 0, sizeof(delay));
+
+    forward_host(fp, fgp->hgp->hv[fgp->next++], fgp->op, now, &fgp->received, &delay);
+    timespec_add(&fgp->due, &fgp->step);
+    if (fp->jp && fgp->jid)
+      journal_progress(fp->jp, fgp);
+    busy = 1;
+  }
+
+  pthread_rwlock_unlock(&inventory_lock);
+  return busy;
+}
+
+/* Start expanding a group, its hosts are planned by forward_expand() */
+FWDGROUP *
+forward_group(FORWARDER *fp,
+	      HOSTGROUP *hgp,
+	      OVERRIDES *op,
+	      const struct timespec *now,
+	      const struct timespec *received,
+	      const struct timespec *delay) {
+  FWDGROUP *fgp;
+
+
+  fgp = malloc(sizeof(*fgp));
+  if (!fgp) {
+    log_event(EV_PLAN_ERROR, 0, hgp->name, NULL, errno, 0, NULL, 0);
+    COUNTER_INC(fp->plan_errors);
+    group_release(hgp);
+    free(op);
+    return NULL;
+  }
+
+  fgp->hgp = hgp;
+  fgp->op = op;
+  fgp->next = 0;
+  fgp->received = *received;
+  fgp->start = *now;
+  timespec_add(&fgp->start, delay);
+  fgp->due = fgp->start;
+  fgp->step = hgp->delay;
+  if (op && op->host_delay)
+    (void) str2timespec(op->host_delay, &fgp->step);
+  fgp->link = NULL;
+  fgp->jid = 0;
+
+  if (fp->groups_tail)
+    fp->groups_tail->link = fgp;
+  else
+    fp->groups = fgp;
+  fp->groups_tail = fgp;
+
+  if (fp->jp)
+    journal_group(fp, fgp);
+  return fgp;
+}
+
+void
+forward_start(FORWARDER *fp,
+	      const JOB *jp,
+	      const struct timespec *now) {
+  SENDPLAN *pp;
+  struct timespec waited;
+
+
+  waited = *now;
+  timespec_sub(&waited, &jp->received);
+  histogram_add(&fp->queue_latency, timespec2ns(&waited));
+
+  if (jp->hgp && group_relay(jp->hgp)) {
+    /* Relay the group on to the next downstream daemon */
+    PROBE2(forward__dequeue, jp->hgp->name, timespec2ns(&jp->received));
+
+    pp = malloc(sizeof(*pp));
+    if (!pp || plan_build_group(jp->hgp, jp->op, jp->hops, pp) < 0) {
+      log_event(EV_PLAN_ERROR, 0, jp->hgp->name, NULL, errno, 0, NULL, 0);
+      COUNTER_INC(fp->plan_errors);
+      free(pp);
+      free(jp->op);
+      return;
+    }
+    free(jp->op);
+
+    forward_schedule(fp, pp, now, &jp->received, &jp->delay);
+    return;
+  }
+
+  if (jp->hgp) {
+    /* Expanded into hosts by forward_expand() */
+    PROBE2(forward__dequeue, jp->hgp->name, timespec2ns(&jp->received));
+    (void) forward_group(fp, jp->hgp, jp->op, now, &jp->received, &jp->delay);
+    return;
+  }
+
+  PROBE2(forward__dequeue, jp->hp->name, timespec2ns(&jp->received));
+  forward_host(fp, jp->hp, jp->op, now, &jp->received, &jp->delay);
+  free(jp->op);
+}
+
+/* Count a copy sent to a target, once all targets have got it the journal is updated */
+void
+forward_sent(FORWARDER *fp,
+	     const FWDTIMER *tip) {
+  SENDPLAN *pp = tip->pp;
+  size_t i;
+
+
+  if (tip->copy != pp->sent+1 || --pp->behind > 0)
+    return;
+
+  /* Other targets may be further ahead when pacing held this one back */
+  pp->sent = tip->copy;
+  pp->behind = 1;
+  if (pp->refs > 1) {
+    pp->sent = pp->copies;
+    pp->behind = 0;
+    for (i = 0; i < fp->tc; i++) {
+      if (fp->tv[i].pp != pp || fp->tv[i].copy > pp->sent)
+	continue;
+      if (fp->tv[i].copy < pp->sent) {
+	pp->sent = fp->tv[i].copy;
+	pp->behind = 0;
+      }
+      ++pp->behind;
+    }
+  }
+
+  if (fp->jp && pp->jid)
+    journal_sent(fp->jp, pp);
+}
+
+void
+forward_fire(FORWARDER *fp) {
+  FWDTIMER *tip = &fp->tv[0];
+  SENDPLAN *pp = tip->pp;
+  struct ether_addr mac;
+
+
+  if (f_debug)
+    log_event(EV_SEND_PACKET, 0, pp->name, NULL, tip->copy+1, pp->copies,
+	      tip->tp->aip->ai_addr, tip->tp->aip->ai_addrlen);
+
+  if (plan_send(pp, tip->tp) < 0) {
+    log_event(EV_SEND_ERROR, 0, pp->name, pp->hp ? host_mac(pp->hp, &mac) : NULL, errno, 0, NULL, 0);
+    COUNTER_INC(fp->send_errors);
+  } else
+    COUNTER_INC(fp->forwarded);
+
+  if (pp->received.tv_sec || pp->received.tv_nsec) {
+    struct timespec now;
+
+    /* Latency until the first packet for a request went out */
+    transport->clock_gettime(CLOCK_MONOTONIC, &now);
+
+    PROBE2(forward__send, pp->name, timespec2ns(&pp->received));
+
+    timespec_sub(&now, &pp->received);
+    histogram_add(&fp->forward_latency, timespec2ns(&now));
+    pp->received.tv_sec = pp->received.tv_nsec = 0;
+  }
+
+  ++tip->copy;
+  forward_sent(fp, tip);
+
+  if (tip->copy < pp->copies) {
+    timespec_add(&tip->due, &pp->delay);
+    tip->paced = 0;
+    fwd_timer_sift(fp);
+    return;
+  }
+
+  fwd_timer_pop(fp);
+  if (--pp->refs == 0) {
+    if (fp->jp && pp->jid)
+      journal_done(fp, pp->jid);
+    free(pp);
+    --fp->plans;
+
+    /* Start over with a small journal once nothing is pending */
+    if (fp->jp && fp->plans == 0 && fp->jp->off > fp->jp->size/2)
+      (void) journal_compact(fp);
+  }
+}
+
+
+volatile sig_atomic_t report_requested = 0;
+
+void
+forward_report(FORWARDER *fp) {
+  char buf[512];
+  uint64_t received, invalid, bad_secret, unknown, limited, queued, queue_full;
+  unsigned int w;
+
+
+  received = invalid = bad_secret = unknown = limited = queued = queue_full = 0;
+  for (w = 0; w < nworkers; w++) {
+    WORKER *wp = &workers[w];
+
+    received   += COUNTER_GET(wp->received);
+    invalid    += COUNTER_GET(wp->invalid_header) + COUNTER_GET(wp->invalid_mac);
+    bad_secret += COUNTER_GET(wp->bad_secret);
+    unknown    += COUNTER_GET(wp->unknown_mac);
+    limited    += COUNTER_GET(wp->source_limited) + COUNTER_GET(wp->request_limited);
+    queued     += COUNTER_GET(wp->queued);
+    queue_full += COUNTER_GET(wp->queue_full);
+  }
+
+  snprintf(buf, sizeof(buf),
+	   "received %llu, invalid %llu, bad secrets %llu, unknown %llu, limited %llu, "
+	   "queued %llu, dropped %llu, queue depth %lu/%lu, coalesced %llu, pending %lu, "
+	   "forwarded %llu, paced %llu, errors %llu",
+	   (unsigned long long) received,
+	   (unsigned long long) invalid,
+	   (unsigned long long) bad_secret,
+	   (unsigned long long) unknown,
+	   (unsigned long long) limited,
+	   (unsigned long long) queued,
+	   (unsigned long long) queue_full,
+	   (unsigned long) jobqueue_depth(&fp->q),
+	   (unsigned long) fp->q.mask+1,
+	   (unsigned long long) COUNTER_GET(fp->coalesced),
+	   (unsigned long) fp->plans,
+	   (unsigned long long) COUNTER_GET(fp->forwarded),
+	   (unsigned long long) COUNTER_GET(fp->paced),
+	   (unsigned long long) (COUNTER_GET(fp->send_errors) + COUNTER_GET(fp->plan_errors)));
+
+  syslog(LOG_INFO, "%s", buf);
+  if (f_foreground)
+    fprintf(stderr, "[%s]\n", buf);
+}
+
+void
+sigusr1_handler(int sig) {
+  report_requested = 1;
+  if (forwarder)
+    (void) write(forwarder->pfd[1], "", 1);
+}
+
+
+/* Send what is due and start the queued jobs, returns 1 if anything was done */
+int
+forward_poll(FORWARDER *fp,
+	     const struct timespec *now) {
+  JOB job;
+  size_t pos;
+  int busy = 0;
+
+
+  while (fp->tc > 0 && timespec_cmp(&fp->tv[0].due, now) <= 0) {
+    uint64_t next;
+
+    if (fp->rlp && ratelimit_check(fp->rlp, timespec2ns(now), &next) < 0) {
+      /* Over the forwarding packet rate - postpone instead of dropping */
+      fp->tv[0].due.tv_sec  = next / 1000000000;
+      fp->tv[0].due.tv_nsec = next % 1000000000;
+      if (!fp->tv[0].paced) {
+	fp->tv[0].paced = 1;
+	COUNTER_INC(fp->paced);
+      }
+      fwd_timer_sift(fp);
+      continue;
+    }
+
+    forward_fire(fp);
+    busy = 1;
+  }
+
+  if (forward_expand(fp, now))
+    busy = 1;
+
+  /* Stop taking new jobs when too many are in flight and let the queue absorb (and drop) them */
+  while (fp->plans < fp->max_plans && jobqueue_pop(&fp->q, &job, &pos)) {
+    forward_start(fp, &job, now);
+    jobqueue_done(&fp->q, pos);
+    busy = 1;
+  }
+
+  return busy;
+}
+
+void *
+forward_run(void *arg) {
+  FORWARDER *fp = (FORWARDER *) arg;
+  struct timespec now, wait;
+  struct pollfd pfd;
+  char buf[256];
+  int busy, timeout;
+
+
+  /* Pick up where the last run left off */
+  if (fp->jp)
+    journal_replay(fp);
+
+  while (1) {
+    transport->clock_gettime(CLOCK_MONOTONIC, &now);
+
+    busy = forward_poll(fp, &now);
+
+    if (report_requested) {
+      report_requested = 0;
+      forward_report(fp);
+    }
+
+    if (busy)
+      continue;
+
+    timeout = -1;
+    if (fp->tc > 0) {
+      wait = fp->tv[0].due;
+      timespec_sub(&wait, &now);
+
+      if (wait.tv_sec == 0 && wait.tv_nsec < 1000000) {
+	/* Sub-millisecond delays are too short for poll() */
+	transport->nanosleep(&wait, NULL);
+	continue;
+      }
+
+      timeout = wait.tv_sec*1000 + (wait.tv_nsec+999999)/1000000;
+    }
+
+    /* Groups left to expand because the inventory was being updated */
+    if (fp->groups && fp->plans < fp->max_plans && (timeout < 0 || timeout > 1))
+      timeout = 1;
+
+    atomic_store(&fp->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (jobqueue_depth(&fp->q) > 0) {
+      atomic_store(&fp->sleeping, 0);
+      continue;
+    }
+
+    pfd.fd = fp->pfd[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout) > 0)
+      (void) read(fp->pfd[0], buf, sizeof(buf));
+
+    atomic_store(&fp->sleeping, 0);
+  }
+
+  return NULL;
+}
+
+
+FORWARDER *
+forward_create(size_t size,
+	       size_t hosts) {
+  FORWARDER *fp;
+
+
+  fp = calloc_aligned(1, sizeof(*fp));
+  if (!fp)
+    return NULL;
+
+  if (jobqueue_init(&fp->q, size) < 0)
+    return NULL;
+
+  fp->max_plans = fp->q.mask+1;
+  atomic_init(&fp->sleeping, 0);
+
+  if (proxy_coalesce.tv_sec || proxy_coalesce.tv_nsec) {
+    fp->cp = coalesce_create(hosts, &proxy_coalesce);
+    if (!fp->cp)
+      return NULL;
+  }
+
+  if (proxy_forward_limit) {
+    fp->rlp = ratelimit_create(proxy_forward_limit);
+    if (!fp->rlp)
+      return NULL;
+  }
+
+  if (proxy_journal) {
+    fp->jp = journal_open(proxy_journal, fp->q.mask+1);
+    if (!fp->jp)
+      return NULL;
+    fp->q.pv = fp->jp->qv;
+  }
+
+  if (pipe(fp->pfd) < 0)
+    return NULL;
+
+  (void) fcntl(fp->pfd[0], F_SETFL, O_NONBLOCK);
+  (void) fcntl(fp->pfd[1], F_SETFL, O_NONBLOCK);
+
+  return fp;
+}
+
+
+void
+metrics_counter(FILE *fp,
+		const char *name,
+		const char *help,
+		size_t offset) {
+  unsigned int w;
+
+
+  fprintf(fp, "# HELP %s %s\n", name, help);
+  fprintf(fp, "# TYPE %s counter\n", name);
+  for (w = 0; w < nworkers; w++)
+    fprintf(fp, "%s{worker=\"%u\"} %llu\n", name, w,
+	    (unsigned long long) COUNTER_GET(*(COUNTER *) ((char *) &workers[w] + offset)));
+}
+
+void
+metrics_histogram(FILE *fp,
+		  const char *name,
+		  const char *help,
+		  HISTOGRAM *hp) {
+  static const double bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+    1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+  };
+  uint64_t cum, limit;
+  size_t b;
+  int i;
+
+
+  fprintf(fp, "# HELP %s %s\n", name, help);
+  fprintf(fp, "# TYPE %s histogram\n", name);
+
+  /* Fine buckets are folded into the first standard bucket that covers them */
+  cum = 0;
+  i = 0;
+  for (b = 0; b < sizeof(bounds)/sizeof(bounds[0]); b++) {
+    limit = (uint64_t) (bounds[b]*1e9);
+    for (; i < HISTOGRAM_BUCKETS && histogram_limit(i) <= limit+1; i++)
+      cum += COUNTER_GET(hp->v[i]);
+    fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", name, bounds[b], (unsigned long long) cum);
+  }
+  fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) COUNTER_GET(hp->count));
+  fprintf(fp, "%s_sum %.9f\n", name, COUNTER_GET(hp->sum) / 1e9);
+  fprintf(fp, "%s_count %llu\n", name, (unsigned long long) COUNTER_GET(hp->count));
+}
+
+void
+metrics_write(FILE *fp) {
+  FORWARDER *fwp = forwarder;
+
+
+  metrics_counter(fp, "pwol_received_total", "Packets received",
+		  offsetof(WORKER, received));
+  metrics_counter(fp, "pwol_invalid_header_total", "Packets with invalid size or header",
+		  offsetof(WORKER, invalid_header));
+  metrics_counter(fp, "pwol_invalid_mac_total", "Packets with inconsistent MAC copies",
+		  offsetof(WORKER, invalid_mac));
+  metrics_counter(fp, "pwol_bad_secret_total", "Requests with missing or invalid secret",
+		  offsetof(WORKER, bad_secret));
+  metrics_counter(fp, "pwol_unknown_mac_total", "Requests for unknown MAC addresses",
+		  offsetof(WORKER, unknown_mac));
+  metrics_counter(fp, "pwol_source_limited_total", "Packets dropped by the per-source limit",
+		  offsetof(WORKER, source_limited));
+  metrics_counter(fp, "pwol_request_limited_total", "Requests dropped by the global request limit",
+		  offsetof(WORKER, request_limited));
+  metrics_counter(fp, "pwol_queued_total", "Requests queued for forwarding",
+		  offsetof(WORKER, queued));
+  metrics_counter(fp, "pwol_queue_full_total", "Requests dropped due to a full forwarding queue",
+		  offsetof(WORKER, queue_full));
+  metrics_counter(fp, "pwol_bulk_requests_total", "Bulk requests received",
+		  offsetof(WORKER, bulk_requests));
+  metrics_counter(fp, "pwol_replayed_total", "Bulk requests dropped as replayed or too old",
+		  offsetof(WORKER, replayed));
+  metrics_counter(fp, "pwol_unknown_group_total", "Group requests for unknown groups",
+		  offsetof(WORKER, unknown_group));
+  metrics_counter(fp, "pwol_hop_limited_total", "Bulk requests and groups not relayed further (hop limit)",
+		  offsetof(WORKER, hop_limited));
+
+  if (!fwp)
+    return;
+
+  fprintf(fp, "# HELP pwol_queue_depth Requests waiting in the forwarding queue\n");
+  fprintf(fp, "# TYPE pwol_queue_depth gauge\n");
+  fprintf(fp, "pwol_queue_depth %lu\n", (unsigned long) jobqueue_depth(&fwp->q));
+  fprintf(fp, "# HELP pwol_queue_size Size of the forwarding queue\n");
+  fprintf(fp, "# TYPE pwol_queue_size gauge\n");
+  fprintf(fp, "pwol_queue_size %lu\n", (unsigned long) fwp->q.mask+1);
+  fprintf(fp, "# HELP pwol_pending_requests Requests with packets left to send\n");
+  fprintf(fp, "# TYPE pwol_pending_requests gauge\n");
+  fprintf(fp, "pwol_pending_requests %lu\n", (unsigned long) fwp->plans);
+
+  fprintf(fp, "# HELP pwol_forwarded_total Packets forwarded\n");
+  fprintf(fp, "# TYPE pwol_forwarded_total counter\n");
+  fprintf(fp, "pwol_forwarded_total %llu\n", (unsigned long long) COUNTER_GET(fwp->forwarded));
+  fprintf(fp, "# HELP pwol_send_errors_total Packets that could not be sent\n");
+  fprintf(fp, "# TYPE pwol_send_errors_total counter\n");
+  fprintf(fp, "pwol_send_errors_total %llu\n", (unsigned long long) COUNTER_GET(fwp->send_errors));
+  fprintf(fp, "# HELP pwol_plan_errors_total Requests that could not be planned for sending\n");
+  fprintf(fp, "# TYPE pwol_plan_errors_total counter\n");
+  fprintf(fp, "pwol_plan_errors_total %llu\n", (unsigned long long) COUNTER_GET(fwp->plan_errors));
+  fprintf(fp, "# HELP pwol_coalesced_total Duplicate requests suppressed\n");
+  fprintf(fp, "# TYPE pwol_coalesced_total counter\n");
+  fprintf(fp, "pwol_coalesced_total %llu\n", (unsigned long long) COUNTER_GET(fwp->coalesced));
+  fprintf(fp, "# HELP pwol_paced_total Packets delayed by the forwarding limit\n");
+  fprintf(fp, "# TYPE pwol_paced_total counter\n");
+  fprintf(fp, "pwol_paced_total %llu\n", (unsigned long long) COUNTER_GET(fwp->paced));
+
+  metrics_histogram(fp, "pwol_queue_latency_seconds",
+		    "Time from receive until picked up by the forwarder", &fwp->queue_latency);
+  metrics_histogram(fp, "pwol_forward_latency_seconds",
+		    "Time from receive until the first packet was forwarded", &fwp->forward_latency);
+
+  if (control) {
+    fprintf(fp, "# HELP pwol_control_requests_total Requests received on the control socket\n");
+    fprintf(fp, "# TYPE pwol_control_requests_total counter\n");
+    fprintf(fp, "pwol_control_requests_total %llu\n", (unsigned long long) COUNTER_GET(control->requests));
+    fprintf(fp, "# HELP pwol_control_errors_total Control socket requests that could not be queued\n");
+    fprintf(fp, "# TYPE pwol_control_errors_total counter\n");
+    fprintf(fp, "pwol_control_errors_total %llu\n", (unsigned long long) COUNTER_GET(control->errors));
+  }
+
+  if (scheduler) {
+    fprintf(fp, "# HELP pwol_scheduled_total Scheduled wakes started\n");
+    fprintf(fp, "# TYPE pwol_scheduled_total counter\n");
+    fprintf(fp, "pwol_scheduled_total %llu\n", (unsigned long long) COUNTER_GET(scheduler->fired));
+    fprintf(fp, "# HELP pwol_scheduled_queue_full_total Scheduled requests dropped due to a full forwarding queue\n");
+    fprintf(fp, "# TYPE pwol_scheduled_queue_full_total counter\n");
+    fprintf(fp, "pwol_scheduled_queue_full_total %llu\n", (unsigned long long) COUNTER_GET(scheduler->queue_full));
+  }
+
+  if (logger) {
+    fprintf(fp, "# HELP pwol_log_dropped_total Log messages dropped due to a full log ring\n");
+    fprintf(fp, "# TYPE pwol_log_dropped_total counter\n");
+    fprintf(fp, "pwol_log_dropped_total %llu\n",
+	    (unsigned long long) atomic_load_explicit(&logger->dropped, memory_order_relaxed));
+  }
+}
+
+
+void *
+metrics_run(void *arg) {
+  METRICS *mp = (METRICS *) arg;
+  struct pollfd pfd;
+  struct timeval tv;
+  char buf[1024];
+  char *out;
+  size_t size, off;
+  ssize_t len;
+  FILE *fp;
+  int fd;
+
+
+  while (1) {
+    fd = accept(mp->fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+	continue;
+      if (f_debug)
+	fprintf(stderr, "*** metrics: accept: %s\n", strerror(errno));
+      sleep(1);
+      continue;
+    }
+
+    /* Clients are served one at a time, so one that never reads must not hold up the rest */
+    tv.tv_sec = METRICS_TIMEOUT;
+    tv.tv_usec = 0;
+    (void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* Answer HTTP requests (for Prometheus) but also plain connects */
+    len = 0;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) > 0)
+      len = read(fd, buf, sizeof(buf)-1);
+
+    /* Formatted in memory, then sent without SIGPIPE if the client has gone */
+    out = NULL;
+    size = 0;
+    fp = open_memstream(&out, &size);
+    if (!fp) {
+      close(fd);
+      continue;
+    }
+
+    if (len >= 4 && memcmp(buf, "GET ", 4) == 0)
+      fputs("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n", fp);
+
+    metrics_write(fp);
+    if (fclose(fp) == 0)
+      for (off = 0; off < size && (len = send(fd, out+off, size-off, MSG_NOSIGNAL)) > 0; off += len)
+	;
+
+    free(out);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+
+/* Metrics socket given as "/path" (Unix), "address:port", "[ipv6]:port" or "port" */
+METRICS *
+metrics_create(const char *spec) {
+  struct addrinfo hints, *aip = NULL;
+  METRICS *mp;
+  char *buf = NULL, *addr, *port, *cp;
+  int one = 1;
+  int rc;
+
+
+  mp = malloc(sizeof(*mp));
+  if (!mp)
+    return NULL;
+  mp->fd = -1;
+
+  if (*spec == '/') {
+    struct sockaddr_un sun;
+    struct stat sb;
+    mode_t omask;
+
+    if (strlen(spec) >= sizeof(sun.sun_path)) {
+      errno = ENAMETOOLONG;
+      goto Fail;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, spec);
+
+    mp->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mp->fd < 0)
+      goto Fail;
+
+    /* Left behind by an earlier daemon, but never remove anything else */
+    if (lstat(spec, &sb) == 0) {
+      if (!S_ISSOCK(sb.st_mode)) {
+	errno = EEXIST;
+	goto Fail;
+      }
+      (void) unlink(spec);
+    }
+
+    /* Only for the owner, like the control socket, as the daemon runs with umask 0 */
+    omask = umask(0177);
+    rc = bind(mp->fd, (struct sockaddr *) &sun, sizeof(sun));
+    (void) umask(omask);
+    if (rc < 0)
+      goto Fail;
+  } else {
+    buf = strdup(spec);
+    if (!buf)
+      goto Fail;
+
+    addr = buf;
+    cp = strrchr(addr, ':');
+    if (cp && (addr[0] != '[' || cp[-1] == ']')) {
+      *cp++ = '\0';
+      port = cp;
+      if (addr[0] == '[') {
+	addr[strlen(addr)-1] = '\0';
+	++addr;
+      }
+    } else {
+      port = addr;
+      addr = "127.0.0.1";
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((rc = getaddrinfo(addr, port, &hints, &aip)) != 0) {
+      aip = NULL;
+      errno = EINVAL;
+      goto Fail;
+    }
+
+    mp->fd = socket(aip->ai_family, SOCK_STREAM, 0);
+    if (mp->fd < 0)
+      goto Fail;
+
+    (void) setsockopt(mp->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(mp->fd, aip->ai_addr, aip->ai_addrlen) < 0)
+      goto Fail;
+
+    freeaddrinfo(aip);
+    aip = NULL;
+    free(buf);
+    buf = NULL;
+  }
+
+  if (listen(mp->fd, 16) < 0)
+    goto Fail;
+
+  rc = pthread_create(&mp->tid, NULL, metrics_run, mp);
+  if (rc) {
+    errno = rc;
+    goto Fail;
+  }
+
+  return mp;
+
+ Fail:
+  rc = errno;
+  if (aip)
+    freeaddrinfo(aip);
+  free(buf);
+  if (mp->fd >= 0)
+    close(mp->fd);
+  free(mp);
+  errno = rc;
+  return NULL;
+}
+
+
+void
+scheduler_sift(SCHEDULER *sdp,
+	       size_t i) {
+  SCHEDULE *sp = sdp->sv[i];
+  size_t child;
+
+
+  for (; (child = 2*i+1) < sdp->sc; i = child) {
+    if (child+1 < sdp->sc && sdp->sv[child+1]->due < sdp->sv[child]->due)
+      ++child;
+    if (sp->due <= sdp->sv[child]->due)
+      break;
+    sdp->sv[i] = sdp->sv[child];
+  }
+  sdp->sv[i] = sp;
+}
+
+/* Queue a scheduled wake for the forwarder, just like a received request */
+void
+scheduler_fire(SCHEDULER *sdp,
+	       SCHEDULE *sp) {
+  struct timespec received, delay;
+  HOSTGROUP *hgp = sp->hgp;
+  struct ether_addr mac;
+
+
+  transport->clock_gettime(CLOCK_MONOTONIC, &received);
+  memset(&delay, 0, sizeof(delay));
+
+  COUNTER_INC(sdp->fired);
+
+  if (sp->hp) {
+    log_event(EV_SCHEDULED, 0, sp->hp->name, NULL, 1, 0, NULL, 0);
+    if (forward_enqueue(forwarder, sp->hp, NULL, &received, &delay) < 0) {
+      COUNTER_INC(sdp->queue_full);
+      log_event(EV_QUEUE_FULL, 0, sp->hp->name, host_mac(sp->hp, &mac), 0, 0, NULL, 0);
+    }
+    return;
+  }
+
+  pthread_rwlock_rdlock(&inventory_lock);
+  log_event(EV_SCHEDULED, 0, hgp->name, NULL, hgp->hc, 0, NULL, 0);
+  pthread_rwlock_unlock(&inventory_lock);
+
+  /* One job for the whole group, the forwarder plans the hosts */
+  if (forward_enqueue_group(forwarder, hgp, NULL, BULK_MAX_HOPS, &received, &delay) < 0) {
+    COUNTER_INC(sdp->queue_full);
+    log_event(EV_QUEUE_FULL, 0, hgp->name, NULL, 0, 0, NULL, 0);
+  }
+}
+
+void *
+scheduler_run(void *arg) {
+  SCHEDULER *sdp = (SCHEDULER *) arg;
+  struct timespec now, wait;
+  SCHEDULE *sp;
+
+
+  while (sdp->sc > 0) {
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    sp = sdp->sv[0];
+    if (sp->due > now.tv_sec) {
+      /* Wake up now and then in case the clock is changed */
+      wait.tv_sec = sp->due - now.tv_sec;
+      wait.tv_nsec = 0;
+      if (wait.tv_sec > 60)
+	wait.tv_sec = 60;
+      else if (now.tv_nsec > 0) {
+	--wait.tv_sec;
+	wait.tv_nsec = 1000000000 - now.tv_nsec;
+      }
+      nanosleep(&wait, NULL);
+      continue;
+    }
+
+    scheduler_fire(sdp, sp);
+
+    sp->due = schedule_next(sp, now.tv_sec);
+    if (sp->due == (time_t) -1)
+      sdp->sv[0] = sdp->sv[--sdp->sc];
+    if (sdp->sc > 0)
+      scheduler_sift(sdp, 0);
+  }
+
+  return NULL;
+}
+
+SCHEDULER *
+scheduler_create(SCHEDULE *list) {
+  SCHEDULER *sdp;
+  SCHEDULE *sp;
+  time_t now;
+  size_t n, i;
+  int rc;
+
+
+  sdp = calloc_aligned(1, sizeof(*sdp));
+  if (!sdp)
+    return NULL;
+
+  n = 0;
+  for (sp = list; sp; sp = sp->next)
+    ++n;
+
+  sdp->sv = calloc(n, sizeof(SCHEDULE *));
+  if (!sdp->sv)
+    return NULL;
+
+  /* Times already passed (at startup) are skipped, not caught up on */
+  now = time(NULL);
+  for (sp = list; sp; sp = sp->next) {
+    sp->due = schedule_next(sp, now);
+    if (sp->due != (time_t) -1)
+      sdp->sv[sdp->sc++] = sp;
+  }
+
+  for (i = sdp->sc/2; i-- > 0; )
+    scheduler_sift(sdp, i);
+
+  rc = pthread_create(&sdp->tid, NULL, scheduler_run, sdp);
+  if (rc) {
+    errno = rc;
+    return NULL;
+  }
+
+  return sdp;
+}
+
+
+/* Host by name or MAC, remembering ones not in the configuration */
+HOST *
+control_host(CONTROL *cp,
+	     const char *name) {
+  HOST tmp, *hp;
+
+
+  hp = host_lookup(name);
+  if (hp)
+    return hp;
+
+  memset(&tmp, 0, sizeof(tmp));
+  if (host_add_mac(&tmp, name) < 0) {
+    errno = ENXIO;
+    return NULL;
+  }
+
+  hp = mac_index_lookup(mac_index, &tmp.mac);
+  if (hp)
+    return hp;
+
+  for (hp = cp->hosts; hp && memcmp(&hp->mac, &tmp.mac, MAC_SIZE) != 0; hp = hp->next)
+    ;
+  if (hp)
+    return hp;
+
+  /* Plans and log records point to hosts, so they are never freed */
+  if (cp->nhosts >= CONTROL_MAX_HOSTS) {
+    errno = ENOSPC;
+    return NULL;
+  }
+
+  hp = malloc(sizeof(*hp));
+  if (!hp)
+    return NULL;
+
+  *hp = tmp;
+  hp->id = HOST_NO_ID;
+  hp->name = strdup(name);
+  if (!hp->name) {
+    free(hp);
+    return NULL;
+  }
+
+  hp->next = cp->hosts;
+  cp->hosts = hp;
+  ++cp->nhosts;
+  return hp;
+}
+
+/* Queue one host, bad overrides are reported now although the forwarder plans it later */
+int
+control_wake_host(HOST *hp,
+		  const OVERRIDES *op,
+		  const struct timespec *received,
+		  const struct timespec *delay) {
+  SENDPLAN *pp;
+  OVERRIDES *ovp;
+  int rc;
+
+
+  pp = malloc(sizeof(*pp));
+  if (!pp)
+    return -1;
+  rc = plan_build(hp, op, pp);
+  free(pp);
+  if (rc < 0)
+    return -1;
+
+  ovp = overrides_dup(op);
+  if (!ovp)
+    return -1;
+
+  if (forward_enqueue(forwarder, hp, ovp, received, delay) < 0) {
+    free(ovp);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* 
+ * Queue a group, returns the number of requests queued and sets
+ * *failed to the number of hosts the overrides can not be used for
+ */
+int
+control_wake_group(HOSTGROUP *hgp,
+		   const OVERRIDES *op,
+		   const struct timespec *received,
+		   int *failed) {
+  struct timespec delay, step;
+  SENDPLAN *pp;
+  OVERRIDES *ovp;
+  size_t i, n;
+  int rc, err = 0;
+
+
+  memset(&delay, 0, sizeof(delay));
+
+  if (group_relay(hgp)) {
+    pp = malloc(sizeof(*pp));
+    if (!pp)
+      return -1;
+    rc = plan_build_group(hgp, op, BULK_MAX_HOPS, pp);
+    free(pp);
+    if (rc < 0)
+      return -1;
+
+    ovp = overrides_dup(op);
+    if (!ovp)
+      return -1;
+
+    if (forward_enqueue_group(forwarder, hgp, ovp, BULK_MAX_HOPS, received, &delay) < 0) {
+      free(ovp);
+      return -1;
+    }
+    return 1;
+  }
+
+  step = hgp->delay;
+  if (op->host_delay && str2timespec(op->host_delay, &step) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Report bad overrides now, the forwarder plans (and skips) the same hosts later */
+  pp = malloc(sizeof(*pp));
+  if (!pp)
+    return -1;
+  for (i = 0; i < hgp->hc; i++)
+    if (plan_build(hgp->hv[i], op, pp) < 0) {
+      err = errno;
+      ++*failed;
+    }
+  free(pp);
+
+  n = hgp->hc - *failed;
+  if (n == 0 && *failed > 0) {
+    errno = err;
+    return -1;
+  }
+
+  ovp = overrides_dup(op);
+  if (!ovp)
+    return -1;
+
+  /* Hosts are planned and spread out by the forwarder as there is room */
+  if (forward_enqueue_group(forwarder, hgp, ovp, BULK_MAX_HOPS, received, &delay) < 0) {
+    free(ovp);
+    return -1;
+  }
+
+  return n;
+}
+
+int
+control_wake(CONTROL *cp,
+	     const char *name,
+	     const OVERRIDES *op,
+	     const struct timespec *received,
+	     int *failed) {
+  struct timespec delay;
+  HOSTGROUP *hgp;
+  HOST *hp;
+  int rc;
+
+
+  *failed = 0;
+
+  pthread_rwlock_rdlock(&inventory_lock);
+  hgp = group_select(name);
+  if (hgp) {
+    /* The forwarder releases queued groups when done with them */
+    rc = control_wake_group(hgp, op, received, failed);
+    if (rc < 0)
+      group_release(hgp);
+  } else {
+    hp = control_host(cp, name);
+    memset(&delay, 0, sizeof(delay));
+    rc = (!hp || control_wake_host(hp, op, received, &delay) < 0) ? -1 : 1;
+  }
+  pthread_rwlock_unlock(&inventory_lock);
+
+  return rc;
+}
+
+/* 
+ * Handle "<id> wake <host|group|mac> [<option> <value>]..", answered
+ * with "<id> ok <count> <failed>" or "<id> error <errno> <reason>" once
+ * queued, failed counting group hosts the overrides do not work for
+ */
+void
+control_request(CONTROL *cp,
+		int fd,
+		char *line) {
+  char res[CONTROL_LINE_SIZE], *id, *cmd, *name, *lptr;
+  struct timespec received;
+  OVERRIDES ov;
+  int n, len, failed = 0;
+
+
+  transport->clock_gettime(CLOCK_MONOTONIC, &received);
+
+  id = strtok_r(line, " \t\r\n", &lptr);
+  if (!id)
+    return;
+
+  COUNTER_INC(cp->requests);
+
+  cmd = strtok_r(NULL, " \t\r\n", &lptr);
+  name = strtok_r(NULL, " \t\r\n", &lptr);
+
+  n = -1;
+  errno = EINVAL;
+  if (!cmd || strcmp(cmd, "wake") != 0 || !name)
+    goto Reply;
+
+  /* The daemon's own command line overrides are the defaults */
+  overrides_default(&ov);
+  if (overrides_parse(&ov, NULL, &lptr) < 0)
+    goto Reply;
+
+  n = control_wake(cp, name, &ov, &received, &failed);
+
+ Reply:
+  if (n < 0) {
+    COUNTER_INC(cp->errors);
+    if (name)
+      log_event(EV_CONTROL_ERROR, 0, NULL, NULL, errno, 0, name, strlen(name));
+    len = snprintf(res, sizeof(res), "%s error %d %s\n", id, errno, strerror(errno));
+  } else {
+    log_event(EV_CONTROL_REQUEST, 0, NULL, NULL, n, failed, name, strlen(name));
+    len = snprintf(res, sizeof(res), "%s ok %d %d\n", id, n, failed);
+  }
+
+  if (len >= sizeof(res))
+    len = sizeof(res)-1;
+  (void) send(fd, res, len, MSG_NOSIGNAL);
+}
+
+
+void *
+control_run(void *arg) {
+  CONTROL *cp = (CONTROL *) arg;
+  char buf[CONTROL_LINE_SIZE];
+  struct timespec deadline, now, left;
+  struct timeval tv;
+  static INPUT in;
+  int fd, ms;
+
+
+  while (1) {
+    fd = accept(cp->fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+	continue;
+      if (f_debug)
+	fprintf(stderr, "*** control: accept: %s\n", strerror(errno));
+      sleep(1);
+      continue;
+    }
+
+    /* 
+     * Clients are served one at a time, so each one gets CONTROL_TIMEOUT
+     * seconds in all. Clients reconnect if they need more.
+     */
+    tv.tv_sec = CONTROL_TIMEOUT;
+    tv.tv_usec = 0;
+    (void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    transport->clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += CONTROL_TIMEOUT;
+
+    memset(&in, 0, sizeof(in));
+    in.fd = fd;
+    for (;;) {
+      transport->clock_gettime(CLOCK_MONOTONIC, &now);
+      if (timespec_cmp(&now, &deadline) >= 0)
+	break;
+      left = deadline;
+      timespec_sub(&left, &now);
+      ms = (int) ((timespec2ns(&left) + 999999) / 1000000);
+      if (input_line(&in, buf, sizeof(buf), ms) <= 0)
+	break;
+      control_request(cp, fd, buf);
+    }
+
+    close(fd);
+  }
+
+  return NULL;
+}
+
+
+/* Unix stream socket only accessible by the owner */
+CONTROL *
+control_create(const char *path) {
+  struct sockaddr_un sun;
+  struct stat sb;
+  CONTROL *cp;
+  mode_t omask;
+  int rc, fd = -1, bound = 0;
+
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  cp = calloc_aligned(1, sizeof(*cp));
+  if (!cp)
+    return NULL;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    goto Fail;
+
+  /* Left behind by an earlier daemon, but never remove anything else */
+  if (lstat(path, &sb) == 0) {
+    if (!S_ISSOCK(sb.st_mode)) {
+      errno = EEXIST;
+      goto Fail;
+    }
+    (void) unlink(path);
+  }
+
+  /* Created with the right mode, so it is never open to others */
+  omask = umask(0177);
+  rc = bind(fd, (struct sockaddr *) &sun, sizeof(sun));
+  (void) umask(omask);
+  if (rc < 0)
+    goto Fail;
+  bound = 1;
+
+  if (listen(fd, 16) < 0)
+    goto Fail;
+
+  cp->fd = fd;
+  rc = pthread_create(&cp->tid, NULL, control_run, cp);
+  if (rc) {
+    errno = rc;
+    goto Fail;
+  }
+
+  return cp;
+
+ Fail:
+  rc = errno;
+  if (bound)
+    (void) unlink(path);
+  if (fd >= 0)
+    close(fd);
+  free(cp);
+  errno = rc;
+  return NULL;
+}
+
+
+/* Connect to a running daemon's control socket, -1 if there is none */
+int
+control_connect(const char *path) {
+  struct sockaddr_un sun;
+  int fd;
+
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Command line overrides as control request options */
+int
+control_options(char *buf,
+		size_t size) {
+  OVERRIDES ov;
+
+
+  overrides_default(&ov);
+  return overrides2str(&ov, buf, size);
+}
+
+/* The daemon hangs up on idle clients, so connect again when needed */
+int
+control_reconnect(void) {
+  if (control_fp)
+    fclose(control_fp);
+  control_fp = NULL;
+
+  control_fd = control_connect(control_path);
+  if (control_fd < 0)
+    return -1;
+
+  control_fp = fdopen(control_fd, "r");
+  if (!control_fp) {
+    close(control_fd);
+    control_fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Ask the daemon to wake a host or group and wait for the answer */
+int
+control_send(const char *name) {
+  char buf[CONTROL_LINE_SIZE];
+  unsigned int id, rid;
+  int len, n, failed, err, tries;
+  ssize_t sent;
+
+
+  id = ++control_id;
+  len = snprintf(buf, sizeof(buf), "%u wake %s%s\n", id, name, control_opts);
+  if (len >= sizeof(buf)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  /* 
+   * Only a request that could not be sent at all (the daemon hung up on
+   * an idle connection) is sent again. Once sent the daemon may have
+   * queued it even if no answer comes, and a resend would wake twice.
+   */
+  for (tries = 0; ; tries++) {
+    sent = control_fp ? send(control_fd, buf, len, MSG_NOSIGNAL) : -1;
+    if (sent == len)
+      break;
+
+    if (sent >= 0 || tries > 0 || control_reconnect() < 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+  }
+
+  if (!fgets(buf, sizeof(buf), control_fp)) {
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  failed = 0;
+  if (sscanf(buf, "%u ok %d %d", &rid, &n, &failed) >= 2 && rid == id) {
+    if (f_verbose) {
+      printf("[%s: %d request%s queued by daemon", name, n, n == 1 ? "" : "s");
+      if (failed > 0)
+	printf(", %d host%s failed", failed, failed == 1 ? "" : "s");
+      puts("]");
+    }
+    return 0;
+  }
+
+  /* Same host, so the daemon's errno means the same thing here */
+  if (sscanf(buf, "%u error %d", &rid, &err) == 2 && rid == id && err > 0) {
+    errno = err;
+    return -1;
+  }
+
+  errno = EPROTO;
+  return -1;
+}
+
+int
+send_request(const char *name) {
+  if (control_fp)
+    return control_send(name);
+
+  return send_wol(name);
+}
+
+
+
+/* A woken host being checked for coming up */
+typedef struct verify {
+  HOST *hp;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int type;
+
+  int fd;
+  int up;
+  unsigned int retries;
+  unsigned int copies;
+  unsigned int packets;
+
+  struct timespec probe_end;
+  struct timespec next_probe;
+  struct timespec next_resend;
+  struct timespec backoff;
+  struct timespec elapsed;
+} VERIFY;
+
+VERIFY *verifyv = NULL;
+size_t verifyc = 0;
+size_t verifys = 0;
+
+/* Configured hosts already added, by host id */
+uint64_t *verify_bitv = NULL;
+size_t verify_bitc = 0;
+
+
+/* Remember a host to check after the wake, if it has a probe */
+int
+verify_add_host(HOST *hp) {
+  struct addrinfo hints, *aip;
+  const char *spec, *port, *addr;
+  SENDPLAN plan;
+  VERIFY *vp;
+  uint64_t *bitv;
+  size_t i, w, n;
+  int type, rc;
+
+
+  spec = HOST_OPTS(hp)->probe ? HOST_OPTS(hp)->probe : verify_probe;
+  if (!spec || str2probe(spec, &type, &port) < 0)
+    return 0;
+
+  if (hp->id != HOST_NO_ID) {
+    w = hp->id / 64;
+    if (w < verify_bitc && (verify_bitv[w] & (UINT64_C(1) << (hp->id % 64))))
+      return 0;
+
+    if (w >= verify_bitc) {
+      for (n = verify_bitc ? verify_bitc : 16; n <= w; n *= 2)
+	;
+      bitv = realloc(verify_bitv, n * sizeof(*bitv));
+      if (!bitv)
+	return -1;
+      memset(bitv+verify_bitc, 0, (n-verify_bitc) * sizeof(*bitv));
+      verify_bitv = bitv;
+      verify_bitc = n;
+    }
+  } else {
+    /* Ad-hoc hosts have no id, but there are only a few of them */
+    for (i = 0; i < verifyc; i++)
+      if (verifyv[i].hp == hp)
+	return 0;
+  }
+
+  if (verifyc >= verifys) {
+    verifys = verifys ? verifys*2 : 64;
+    verifyv = realloc(verifyv, verifys * sizeof(VERIFY));
+    if (!verifyv)
+      return -1;
+  }
+
+  addr = HOST_OPTS(hp)->address ? HOST_OPTS(hp)->address : hp->name;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = type;
+  if ((rc = getaddrinfo(addr, port, &hints, &aip)) != 0) {
+    fprintf(stderr, "%s: %s: %s port %s: Unable to resolve probe address: %s\n",
+	    argv0, hp->name, addr, port, gai_strerror(rc));
+    errno = ENXIO;
+    return -1;
+  }
+
+  if (hp->id != HOST_NO_ID)
+    verify_bitv[hp->id / 64] |= UINT64_C(1) << (hp->id % 64);
+
+  vp = &verifyv[verifyc++];
+  memset(vp, 0, sizeof(*vp));
+  vp->hp = hp;
+  vp->type = type;
+  vp->fd = -1;
+  memcpy(&vp->addr, aip->ai_addr, aip->ai_addrlen);
+  vp->addrlen = aip->ai_addrlen;
+  freeaddrinfo(aip);
+
+  /* Packets sent per wake, to learn how many the host needs */
+  vp->copies = plan_build(hp, NULL, &plan) == 0 ? plan.copies : 1;
+  vp->packets = vp->copies;
+  return 0;
+}
+
+int
+verify_add(const char *name) {
+  HOSTGROUP *hgp;
+  HOST *hp;
+  int i;
+
+
+  hgp = group_select(name);
+  if (hgp) {
+    for (i = 0; i < hgp->hc; i++)
+      if (verify_add_host(hgp->hv[i]) < 0) {
+	group_release(hgp);
+	return -1;
+      }
+    group_release(hgp);
+    return 0;
+  }
+
+  hp = host_lookup(name);
+  return hp ? verify_add_host(hp) : 0;
+}
+
+/* 
+ * Start a non-blocking TCP connect, or send a UDP echo request. A TCP
+ * probe that completes (or is refused) at once leaves no fd open.
+ */
+int
+verify_probe_start(VERIFY *vp,
+		   const struct timespec *now) {
+  int rc;
+
+
+  vp->fd = socket(vp->addr.ss_family, vp->type, 0);
+  if (vp->fd < 0)
+    return -1;
+
+  (void) fcntl(vp->fd, F_SETFL, O_NONBLOCK);
+
+  vp->probe_end = *now;
+  vp->probe_end.tv_sec += VERIFY_PROBE_TIMEOUT;
+
+  rc = connect(vp->fd, (struct sockaddr *) &vp->addr, vp->addrlen);
+  if (rc < 0 && errno != EINPROGRESS && errno != ECONNREFUSED)
+    goto Fail;
+
+  if (vp->type == SOCK_STREAM) {
+    /* A refused connect means the host is up and answering */
+    if (rc == 0 || errno == ECONNREFUSED) {
+      vp->up = 1;
+      close(vp->fd);
+      vp->fd = -1;
+    }
+    return 0;
+  }
+
+  if (send(vp->fd, "pwol", 4, 0) < 0)
+    goto Fail;
+
+  return 0;
+
+ Fail:
+  close(vp->fd);
+  vp->fd = -1;
+  return -1;
+}
+
+/* 
+ * The probe got an answer (or an error). A reset or an ICMP port
+ * unreachable still comes from the host's own network stack, so
+ * a refused probe counts as up too.
+ */
+void
+verify_probe_done(VERIFY *vp) {
+  char buf[64];
+  socklen_t len;
+  int err = 0;
+
+
+  if (vp->type == SOCK_STREAM) {
+    len = sizeof(err);
+    if (getsockopt(vp->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+	(err == 0 || err == ECONNREFUSED))
+      vp->up = 1;
+  } else if (recv(vp->fd, buf, sizeof(buf), 0) >= 0 || errno == ECONNREFUSED)
+    vp->up = 1;
+
+  close(vp->fd);
+  vp->fd = -1;
+}
+
+/* 
+ * Probe all woken hosts concurrently until they are up, resending WoL
+ * packets to the ones that are not with exponential backoff until the
+ * deadline. Returns the number of hosts that failed to come up.
+ */
+unsigned int
+verify_run(void) {
+  struct timespec start, now, deadline, interval;
+  unsigned int pending, active, first, retried, failed, resent, packets;
+  struct pollfd *pfdv;
+  VERIFY **pv, *vp;
+  size_t i, n;
+  int resend;
+
+
+  pfdv = calloc(VERIFY_MAX_PROBES, sizeof(*pfdv));
+  pv = calloc(VERIFY_MAX_PROBES, sizeof(*pv));
+  if (!pfdv || !pv) {
+    fprintf(stderr, "%s: Internal error #2841730: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+
+  interval.tv_sec = 0;
+  interval.tv_nsec = VERIFY_PROBE_INTERVAL;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  deadline = start;
+  timespec_add(&deadline, &verify_timeout);
+
+  for (i = 0; i < verifyc; i++) {
+    vp = &verifyv[i];
+    vp->next_probe = start;
+    vp->backoff = verify_backoff;
+    vp->next_resend = start;
+    timespec_add(&vp->next_resend, &vp->backoff);
+  }
+
+  /* Probes currently open, kept across passes so pv/pfdv never overflow */
+  active = 0;
+
+  pending = verifyc;
+  now = start;
+  while (pending > 0 && timespec_cmp(&now, &deadline) < 0) {
+    resend = 0;
+    n = 0;
+
+    for (i = 0; i < verifyc; i++) {
+      vp = &verifyv[i];
+      if (vp->up)
+	continue;
+
+      if (vp->fd >= 0 && timespec_cmp(&now, &vp->probe_end) >= 0) {
+	/* No answer - try again in a while */
+	close(vp->fd);
+	vp->fd = -1;
+	--active;
+	vp->next_probe = now;
+	timespec_add(&vp->next_probe, &interval);
+      }
+
+      if (vp->fd < 0 && active < VERIFY_MAX_PROBES && timespec_cmp(&now, &vp->next_probe) >= 0) {
+	if (verify_probe_start(vp, &now) < 0) {
+	  vp->next_probe = now;
+	  timespec_add(&vp->next_probe, &interval);
+	} else if (vp->fd >= 0)
+	  ++active;
+      }
+
+      if (vp->up) {
+	vp->elapsed = now;
+	timespec_sub(&vp->elapsed, &start);
+	--pending;
+	continue;
+      }
+
+      if (timespec_cmp(&now, &vp->next_resend) >= 0) {
+	if (f_verbose > 1)
+	  printf("[%s: Not up yet, resending]\n", vp->hp->name);
+
+	if ((control_fp ? control_send(vp->hp->name) : send_wol_host(vp->hp)) < 0)
+	  fprintf(stderr, "%s: %s: Resending WoL packet failed: %s\n", argv0, vp->hp->name, strerror(errno));
+	++vp->retries;
+	vp->packets += vp->copies;
+	++resend;
+
+	/* Exponential backoff */
+	timespec_add(&vp->backoff, &vp->backoff);
+	vp->next_resend = now;
+	timespec_add(&vp->next_resend, &vp->backoff);
+      }
+
+      if (vp->fd >= 0) {
+	pv[n] = vp;
+	pfdv[n].fd = vp->fd;
+	pfdv[n].events = vp->type == SOCK_STREAM ? POLLOUT : POLLIN;
+	pfdv[n].revents = 0;
+	++n;
+      }
+    }
+
+    if (resend && !control_fp)
+      (void) bulk_flush_all();
+
+    if (pending == 0)
+      break;
+
+    if (poll(pfdv, n, 100) > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      for (i = 0; i < n; i++) {
+	if (!pfdv[i].revents)
+	  continue;
+
+	vp = pv[i];
+	verify_probe_done(vp);
+	--active;
+	if (vp->up) {
+	  vp->elapsed = now;
+	  timespec_sub(&vp->elapsed, &start);
+	  --pending;
+	} else {
+	  vp->next_probe = now;
+	  timespec_add(&vp->next_probe, &interval);
+	}
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+
+  first = retried = failed = resent = packets = 0;
+  for (i = 0; i < verifyc; i++) {
+    vp = &verifyv[i];
+    if (vp->fd >= 0)
+      close(vp->fd);
+
+    if (stats_path && stats_update(&vp->hp->mac, vp->up, vp->up && !vp->retries, vp->packets, &vp->elapsed) < 0) {
+      fprintf(stderr, "%s: Internal error #2841731: %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+
+    resent += vp->retries;
+    packets += vp->packets;
+    if (!vp->up)
+      ++failed;
+    else if (vp->retries)
+      ++retried;
+    else
+      ++first;
+
+    if (f_verbose) {
+      char tbuf[TIMESPEC_STR_SIZE];
+
+      if (vp->up)
+	printf("[%s: Up after %s (%u resend%s)]\n", vp->hp->name,
+	       timespec2str(&vp->elapsed, tbuf, sizeof(tbuf)), vp->retries, vp->retries == 1 ? "" : "s");
+      else
+	printf("[%s: Not up after %u resend%s]\n", vp->hp->name, vp->retries, vp->retries == 1 ? "" : "s");
+    }
+  }
+
+  printf("%u host%s verified: %u woken, %u woken after resending, %u failed (%u resends)\n",
+	 (unsigned int) verifyc, verifyc == 1 ? "" : "s", first, retried, failed, resent);
+  printf("%u%% woken on the first try, %u packets sent\n",
+	 verifyc ? (unsigned int) (100*first/verifyc) : 0, packets);
+
+  if (stats_path && stats_save(stats_path) < 0)
+    fprintf(stderr, "%s: %s: Unable to save statistics: %s\n", argv0, stats_path, strerror(errno));
+
+  free(pfdv);
+  free(pv);
+  return failed;
+}
+
+int
+daemon_listen(WORKER *wp,
+	      GATEWAY *proxies,
+	      int reuse) {
+  GATEWAY *gp;
+  TARGET *tp;
+  struct addrinfo *aip;
+  int fd, i;
+
+
+  i = 0;
+  for (gp = proxies; gp; gp = gp->next) {
+    for (tp = gp->targets; tp; tp = tp->next) {
+      aip = tp->aip;
+      fd = transport->socket((aip->ai_family == AF_INET ? PF_INET : PF_INET6), SOCK_DGRAM, IPPROTO_UDP);
+      if (fd < 0)
+	return -1;
+
+#ifdef SO_REUSEPORT
+      if (reuse) {
+	int one = 1;
+
+	/* Let the kernel spread incoming packets over the workers */
+	if (transport->setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+	  return -1;
+      }
+#endif
+
+      if (transport->bind(fd, aip->ai_addr, aip->ai_addrlen) < 0)
+	return -2;
+
+      wp->lv[i] = gp;
+      wp->pfdv[i++].fd = fd;
+    }
+  }
+
+  return 0;
+}
 
-  for (cp = buf; *cp && isspace(*cp); ++cp)
-    ;
 
-  if (cp > buf)
-    strcpy(buf, cp);
+/* 
+ * A request is accepted if it carries the secret of the listener or of
+ * the host. Requests without secret are only rejected in strict mode.
+ */
+int
+daemon_verify(GATEWAY *lp,
+	      HOST *hp,
+	      const SECRET *received) {
+  const SECRET *hsp = host_secret(hp);
+  int ok;
 
-  for (cp = buf+strlen(buf); cp > buf && isspace(cp[-1]); --cp)
-    ;
-  *cp = '\0';
+
+  if (lp->secret.size == 0 && hsp->size == 0)
+    return received->size == 0 ? 0 : -1;
+
+  if (received->size == 0)
+    return proxy_strict ? -1 : 0;
+
+  /* Always check both so the timing does not tell which one matched */
+  ok  = (lp->secret.size > 0 && secret_verify(&lp->secret, received) == 0);
+  ok |= (hsp->size > 0 && secret_verify(hsp, received) == 0);
+
+  return ok ? 0 : -1;
 }
 
 
+REPLAY *
+replay_create(void) {
+  REPLAY *rp;
+
+
+  rp = calloc(1, sizeof(*rp));
+  if (!rp)
+    return NULL;
+
+  pthread_mutex_init(&rp->mtx, NULL);
+  return rp;
+}
+
+/*
+ * Returns -1 if a bulk request is too old or has been seen before.
+ * Only authentic requests get here, so senders can not be made up from
+ * outside. A sender is forgotten once all its sequence numbers are too
+ * old anyway; when a set is full of live senders new ones are refused
+ * rather than forgetting a live one.
+ */
 int
-parse_config(const char *path) {
-  char buf[2048], *bptr, *cptr;
-  FILE *fp;
-  int line = 0;
-  int len, rc = -1;
+replay_check(REPLAY *rp,
+	     uint64_t sender,
+	     uint64_t seq) {
+  REPLAY_SENDER *set, *sp, *free_sp;
+  struct timespec now;
+  uint64_t t, skew, min;
+  unsigned int i, mi;
+  int rc = -1;
+
+
+  transport->clock_gettime(CLOCK_REALTIME, &now);
+  t = timespec2ns(&now);
+  skew = (uint64_t) BULK_MAX_SKEW * 1000000000ULL;
+  if (seq+skew < t || seq > t+skew)
+    return -1;
 
-  GATEWAY *gp = NULL;
-  GATEWAY *group_gp = NULL;
-  HOST *hp = NULL;
-  HOSTGROUP *hgp = NULL;
+  set = &rp->v[(sender % (REPLAY_SENDERS/REPLAY_WAYS)) * REPLAY_WAYS];
 
+  pthread_mutex_lock(&rp->mtx);
+  sp = free_sp = NULL;
+  for (i = 0; i < REPLAY_WAYS; i++) {
+    if (set[i].n > 0 && set[i].id == sender) {
+      sp = &set[i];
+      break;
+    }
+    if (!free_sp && (set[i].n == 0 || set[i].hwm+skew < t))
+      free_sp = &set[i];
+  }
 
-  gp = gw_lookup("default");
-  gw_add_address(gp, DEFAULT_ADDRESS);
-  gw_add_port(gp, DEFAULT_PORT);
+  if (!sp) {
+    if (!free_sp)
+      goto End;
+    sp = free_sp;
+    sp->id = sender;
+    sp->hwm = seq;
+    sp->n = 1;
+    sp->seqv[0] = seq;
+    rc = 0;
+    goto End;
+  }
 
-  if (f_debug > 1)
-    fprintf(stderr, "[Parsing config: %s]\n", path);
+  if (seq > sp->hwm)
+    sp->hwm = seq;
+  else {
+    /* Evicted ones were all below what is kept */
+    min = UINT64_MAX;
+    for (i = 0; i < sp->n; i++) {
+      if (sp->seqv[i] == seq)
+	goto End;
+      if (sp->seqv[i] < min)
+	min = sp->seqv[i];
+    }
+    if (sp->n == REPLAY_WINDOW && seq < min)
+      goto End;
+  }
 
-  fp = fopen(path, "r");
-  if (!fp)
-    return -1;
+  if (sp->n < REPLAY_WINDOW)
+    sp->seqv[sp->n++] = seq;
+  else {
+    for (i = 1, mi = 0; i < REPLAY_WINDOW; i++)
+      if (sp->seqv[i] < sp->seqv[mi])
+	mi = i;
+    sp->seqv[mi] = seq;
+  }
+  rc = 0;
 
-  while (fgets(buf, sizeof(buf), fp)) {
-    char *key, *val;
+ End:
+  pthread_mutex_unlock(&rp->mtx);
+  return rc;
+}
 
-    ++line;
 
-    trim(buf);
+/* 
+ * Queue a group as a single job, the forwarder spreads its hosts out by
+ * the group delay or relays it with one hop less than it came with
+ */
+void
+daemon_wake_group(WORKER *wp,
+		  HOSTGROUP *hgp,
+		  unsigned int hops,
+		  const struct timespec *received) {
+  static const struct timespec no_delay = { 0, 0 };
+  int rc;
 
-    if (!*buf)
-      continue;
 
-    bptr = buf;
-    hp = NULL;
+  log_event(EV_GROUP_REQUEST, wp->id, hgp->name, NULL, 0, 0, NULL, 0);
 
-    while ((key = strtok_r(bptr, " \t", &cptr)) != NULL) {
-      bptr = NULL;
-      val = strtok_r(bptr, " \t", &cptr);
+  if (hops == 0 && group_relay(hgp)) {
+    COUNTER_INC(wp->hop_limited);
+    log_event(EV_HOP_LIMIT, wp->id, hgp->name, NULL, 0, 0, NULL, 0);
+    return;
+  }
 
-      if (f_debug > 1) 
-	fprintf(stderr, "Got: %s %s\n", key, val ? val : "");
+  rc = forward_enqueue_group(forwarder, hgp, NULL, hops, received, &no_delay);
 
-      if (key[0] == '[' && key[len = strlen(key)-1] == ']') {
-	key[len] = '\0';
-	
-	if (f_debug > 2)
-	  fprintf(stderr, "[Switching hostgroup to %s]\n", key+1);
-	
-	hgp = group_create(key+1);
-	if (!hgp) {
-	  fprintf(stderr, "%s: %s#%u: %s: Invalid hostgroup\n", argv0, path, line, key+1);
-	  exit(1);
-	}
-	
-	/* Try to lookup gateway with same name as hostgroup */
-	group_gp = gw_lookup(key+1);
+  PROBE3(daemon__enqueue, wp->id, hgp->name, rc);
+
+  if (rc < 0) {
+    COUNTER_INC(wp->queue_full);
+    log_event(EV_QUEUE_FULL, wp->id, hgp->name, NULL, 0, 0, NULL, 0);
+  } else
+    COUNTER_INC(wp->queued);
+}
+
+/*
+ * The datagram counted once against the source limit, but it may carry
+ * many wakes, so the rest are counted as they come: one per host and
+ * the hosts of a group. Returns -1 if the source is above the limit.
+ */
+int
+daemon_charge_source(WORKER *wp,
+		     const struct sockaddr *peer,
+		     socklen_t peer_len,
+		     const struct timespec *received,
+		     unsigned int n) {
+  if (!source_sketch || n == 0 ||
+      sketch_check(source_sketch, peer, received, n) == 0)
+    return 0;
+
+  COUNTER_INC(wp->source_limited);
+  if (f_debug)
+    log_event(EV_SOURCE_LIMITED, wp->id, NULL, NULL, 0, 0, peer, peer_len);
+  return -1;
+}
+
+/* Bulk request from a pwol client or upstream daemon, fanned out locally */
+int
+daemon_recv_bulk(WORKER *wp,
+		 GATEWAY *lp,
+		 const unsigned char *buf,
+		 size_t len,
+		 const struct sockaddr *peer,
+		 socklen_t peer_len,
+		 const struct timespec *received) {
+  static const struct timespec no_delay = { 0, 0 };
+  unsigned char key[16];
+  char name[BULK_NAME_MAX+1];
+  struct ether_addr mac;
+  unsigned int n, i, hops, charged = 0;
+  uint64_t seq, tag;
+  size_t pos, name_len;
+  HOSTGROUP *hgp;
+  HOST *hp;
+  int rc;
+
+
+  COUNTER_INC(wp->bulk_requests);
+
+  if (len < BULK_HEADER_SIZE+BULK_TAG_SIZE ||
+      buf[BULK_MAGIC_SIZE+0] != BULK_VERSION ||
+      buf[BULK_MAGIC_SIZE+1] != BULK_TYPE_WAKE) {
+    COUNTER_INC(wp->invalid_header);
+    if (f_debug)
+      log_event(EV_BAD_BULK, wp->id, "unsupported size, version or type", NULL, 0, 0, NULL, 0);
+    return 0;
+  }
+
+  /* 
+   * Bulk requests can only be authenticated by the listener secret. There
+   * are no legacy senders, so without a secret they are merely checksummed
+   * and only accepted if strict-secrets is off. Host secrets are not
+   * checked: a single packet with the listener secret (or none, without
+   * strict-secrets) is accepted for any host too, so bulk requests get no
+   * further than single ones.
+   */
+  len -= BULK_TAG_SIZE;
+  bulk_key(&lp->secret, key);
+  tag = get_le64(buf+len);
+  if (siphash24(key, buf, len) != tag || (lp->secret.size == 0 && proxy_strict)) {
+    COUNTER_INC(wp->bad_secret);
+    if (f_debug)
+      log_event(EV_BAD_BULK, wp->id, "invalid tag", NULL, 0, 0, NULL, 0);
+    return 0;
+  }
+
+  seq = get_be64(buf+BULK_SEQ);
+  if (replay_check(bulk_replay, get_be64(buf+BULK_SENDER), seq) < 0) {
+    COUNTER_INC(wp->replayed);
+    if (f_debug)
+      log_event(EV_REPLAYED, wp->id, NULL, NULL, 0, seq, NULL, 0);
+    return 0;
+  }
+
+  /* Relayed around in a loop, or through too many daemons */
+  hops = buf[BULK_HOPS];
+  if (hops == 0) {
+    COUNTER_INC(wp->hop_limited);
+    log_event(EV_HOP_LIMIT, wp->id, NULL, NULL, seq, 0, NULL, 0);
+    return 0;
+  }
+
+  n = (buf[BULK_MAGIC_SIZE+2] << 8) | buf[BULK_MAGIC_SIZE+3];
+  if (f_debug)
+    log_event(EV_BULK_REQUEST, wp->id, NULL, NULL, n, seq, NULL, 0);
+
+  pos = BULK_HEADER_SIZE;
+  for (i = 0; i < n; i++) {
+    if (pos >= len)
+      goto Invalid;
+
+    switch (buf[pos++]) {
+    case BULK_ENTRY_MAC:
+      if (pos+MAC_SIZE > len)
+	goto Invalid;
+      memcpy(&mac, buf+pos, MAC_SIZE);
+      pos += MAC_SIZE;
+
+      hp = mac_index_lookup(mac_index, &mac);
+      if (!hp) {
+	COUNTER_INC(wp->unknown_mac);
+	if (f_debug)
+	  log_event(EV_UNKNOWN_MAC, wp->id, NULL, &mac, 0, 0, NULL, 0);
 	continue;
       }
 
-      rc = 0;
-      if (strcmp(key, "host") == 0) {
-	hp = host_create(val);
-	if (!hp) {
-	  fprintf(stderr, "%s: %s#%u: %s: Invalid host name\n",
-		  argv0, path, line, val);
-	  exit(1);
-	}
+      /* The first one was counted with the datagram */
+      if (daemon_charge_source(wp, peer, peer_len, received, charged++ ? 1 : 0) < 0)
+	return 0;
 
-	if (hp->via == NULL && group_gp)
-	  hp->via = group_gp;
+      if (request_limit && ratelimit_check(request_limit, timespec2ns(received), NULL) < 0) {
+	COUNTER_INC(wp->request_limited);
+	if (f_debug)
+	  log_event(EV_REQUEST_LIMITED, wp->id, hp->name, &mac, 0, 0, NULL, 0);
+	continue;
+      }
 
-	if (hgp)
-	  group_add_host(hgp, hp);
+      if (f_verbose)
+	log_event(EV_REQUEST, wp->id, hp->name, &mac, 0, 0, NULL, 0);
+      rc = forward_enqueue(forwarder, hp, NULL, received, &no_delay);
 
-	if (all_group)
-	  group_add_host(all_group, hp);
+      PROBE3(daemon__enqueue, wp->id, hp->name, rc);
 
-      } else if (strcmp(key, "gateway") == 0) {
-	if (hgp) {
-	  fprintf(stderr, "%s: %s#%u: Can not define gateways in groups\n",
-		  argv0, path, line);
-	  exit(1);
-	}
-	gp = gw_create(val);
-	if (!gp) {
-	  fprintf(stderr, "%s: %s#%u: %s: Invalid gateway name\n",
-		  argv0, path, line, val);
-	  exit(1);
-	}
-	hp = NULL;
+      if (rc < 0) {
+	COUNTER_INC(wp->queue_full);
+	log_event(EV_QUEUE_FULL, wp->id, hp->name, &mac, 0, 0, NULL, 0);
+      } else
+	COUNTER_INC(wp->queued);
+      break;
 
-      } else if (strcmp(key, "name") == 0) {
-	if (hgp && !hp)
-	  goto InvalidOpt;
-	if (hp)
-	  rc = host_add_name(hp, val);
-	else
-	  rc = gw_add_name(gp, val);
-      } else if (strcmp(key, "mac") == 0) {
-	if (hp)
-	  rc = host_add_mac(hp, val);
-	else
-	  goto InvalidOpt;
-      } else if (strcmp(key, "via") == 0) {
-	if (hp) {
-	  rc = host_add_via(hp, val);
-	}
-	else
-	  goto InvalidOpt;
-      }	else if (strcmp(key, "copies") == 0) {
-	if (hgp && !hp)
-	  goto InvalidOpt;
-	if (hp)
-	  rc = host_add_copies(hp, val);
-	else
-	  rc = gw_add_copies(gp, val);
-      }	else if (strcmp(key, "ttl") == 0) {
-	if (hgp && !hp)
-	  goto InvalidOpt;
-	if (hp)
-	  rc = host_add_ttl(hp, val);
-	else
-	  rc = gw_add_ttl(gp, val);
-      } else if (strcmp(key, "secret") == 0) {
-	if (hgp && !hp)
-	  goto InvalidOpt;
-	if (hp)
-	  rc = host_add_secret(hp, val);
-	else
-	  rc = gw_add_secret(gp, val);
-      } else if (strcmp(key, "delay") == 0) {
-	if (hgp && !hp)
-	  rc = group_add_delay(hgp, val);
-	else if (hp)
-	  rc = host_add_delay(hp, val);
-	else
-	  rc = gw_add_delay(gp, val);
-      } else if (strcmp(key, "address") == 0) {
-	if (hp)
-	  goto InvalidOpt;
-	rc = gw_add_address(gp, val);
-      } else if (strcmp(key, "port") == 0) {
-	if (hp)
-	  goto InvalidOpt;
-	rc = gw_add_port(gp, val);
-      } else {
-      InvalidOpt:
-	fprintf(stderr, "%s: %s#%u: %s: Invalid option\n", argv0, path, line, key);
-	exit(1);
+    case BULK_ENTRY_GROUP:
+      if (pos >= len)
+	goto Invalid;
+      name_len = buf[pos++];
+      if (name_len < 1 || pos+name_len > len)
+	goto Invalid;
+      memcpy(name, buf+pos, name_len);
+      name[name_len] = '\0';
+      pos += name_len;
+
+      hgp = group_lookup(name);
+      if (!hgp) {
+	COUNTER_INC(wp->unknown_group);
+	if (f_debug)
+	  log_event(EV_UNKNOWN_GROUP, wp->id, NULL, NULL, 0, 0, name, name_len);
+	continue;
       }
 
-      if (rc < 0) {
-	fprintf(stderr, "%s: %s#%u: %s: Invalid value for %s (rc=%d)\n", argv0, path, line, val, key, rc);
-	exit(1);
+      if (daemon_charge_source(wp, peer, peer_len, received,
+			       hgp->hc > 0 ? hgp->hc - (charged++ ? 0 : 1) : 0) < 0)
+	return 0;
+
+      if (request_limit && ratelimit_check(request_limit, timespec2ns(received), NULL) < 0) {
+	COUNTER_INC(wp->request_limited);
+	if (f_debug)
+	  log_event(EV_REQUEST_LIMITED, wp->id, hgp->name, NULL, 0, 0, NULL, 0);
+	continue;
       }
+
+      daemon_wake_group(wp, hgp, hops-1, received);
+      break;
+
+    default:
+      goto Invalid;
     }
   }
-  
-  fclose(fp);
-  return 0;
-}
 
+  return 0;
+
+ Invalid:
+  /* Authentic but malformed, keep what was queued so far */
+  COUNTER_INC(wp->invalid_header);
+  if (f_debug)
+    log_event(EV_BAD_BULK, wp->id, "malformed entry", NULL, 0, 0, NULL, 0);
+  return 0;
+}
+
+
+int
+daemon_recv(WORKER *wp,
+	    int li) {
+  GATEWAY *gp = wp->lv[li];
+  int fd = wp->pfdv[li].fd;
+  SECRET secret;
+  ssize_t rlen;
+  struct sockaddr_storage peer;
+  socklen_t peer_len;
+  unsigned char buf[2048];
+  size_t secret_size;
+  struct ether_addr *ep;
+  struct timespec received;
+  struct timespec no_delay = { 0, 0 };
+  HOST *hp;
+  int i, rc;
+
+
+  peer_len = sizeof(peer);
+  while ((rlen = transport->recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &peer, &peer_len)) < 0 && errno == EINTR)
+    ;
+  
+  if (rlen < 0)
+    return -1;
+
+  transport->clock_gettime(CLOCK_MONOTONIC, &received);
+  COUNTER_INC(wp->received);
+
+  PROBE2(daemon__receive, wp->id, rlen);
+
+  /* Count everything a source sends, so floods of garbage are limited too */
+  if (source_sketch && sketch_check(source_sketch, (struct sockaddr *) &peer, &received, 1) < 0) {
+    COUNTER_INC(wp->source_limited);
+    if (f_debug)
+      log_event(EV_SOURCE_LIMITED, wp->id, NULL, NULL, 0, 0, &peer, peer_len);
+    return 0;
+  }
+
+  if (f_debug) {
+    log_event(EV_RECEIVED, wp->id, NULL, NULL, fd, 0, &peer, peer_len);
+    log_event(EV_PACKET, wp->id, NULL, NULL, 0, 0, buf, rlen);
+  }
+
+  /* Not a magic packet (starts with FF:FF:...) but a bulk request */
+  if (rlen >= BULK_MAGIC_SIZE && memcmp(buf, BULK_MAGIC, BULK_MAGIC_SIZE) == 0)
+    return daemon_recv_bulk(wp, gp, buf, rlen, (struct sockaddr *) &peer, peer_len, &received);
+
+  if (rlen < WOL_BODY_SIZE) {
+    COUNTER_INC(wp->invalid_header);
+    if (f_debug)
+      log_event(EV_TOO_SHORT, wp->id, NULL, NULL, rlen, 0, NULL, 0);
+    return 0;
+  }
+
+  for (i = 0; i < HEADER_SIZE && buf[i] == 0xFF; i++)
+    ;
+  if (i < HEADER_SIZE) {
+    COUNTER_INC(wp->invalid_header);
+    if (f_debug)
+      log_event(EV_BAD_HEADER, wp->id, NULL, NULL, 0, 0, NULL, 0);
+    return 0;
+  }
+
+  for (i = 1; i < MAC_COPIES && memcmp(buf+HEADER_SIZE, buf+HEADER_SIZE+i*MAC_SIZE, MAC_SIZE) == 0; i++)
+    ;
+  if (i < MAC_COPIES) {
+    COUNTER_INC(wp->invalid_mac);
+    if (f_debug)
+      log_event(EV_BAD_MAC_COPIES, wp->id, NULL, NULL, 0, 0, NULL, 0);
+    return 0;
+  }
+
+  PROBE1(daemon__validate, wp->id);
 
-void
-export_all(void) {
-  GATEWAY *gp;
-  HOST *hp;
-  HOSTGROUP *hgp;
-  int n;
+  secret_size = rlen-WOL_BODY_SIZE;
+  if (secret_size > SECRET_MAX_SIZE) {
+    COUNTER_INC(wp->invalid_header);
+    if (f_debug)
+      log_event(EV_TOO_LONG, wp->id, NULL, NULL, rlen, 0, NULL, 0);
+    return 0;
+  }
 
+  /* Zero padded so it can be compared in constant time */
+  memset(&secret, 0, sizeof(secret));
+  secret.size = secret_size;
+  memcpy(secret.buf, buf+WOL_BODY_SIZE, secret_size);
 
-  if (!f_verbose) {
-    puts("; pwol configuration");
-    putchar('\n');
-    puts("; Gateways:");
-  }
-  for (gp = gateways; gp; gp = gp->next) {
+  if (f_debug && secret_size > 0)
+    log_event(EV_SECRET, wp->id, NULL, NULL, 0, 0, secret.buf, secret.size);
 
-    if (!gp->name)
-      continue; /* Skip over anonymous gateways */
+  ep = (struct ether_addr *) (buf+HEADER_SIZE);
+  hp = mac_index_lookup(mac_index, ep);
 
-    gw_print(gp);
-  }
+  PROBE2(daemon__lookup, wp->id, hp ? hp->name : NULL);
 
-  putchar('\n');
-  if (!f_verbose) {
-    puts("; Hosts:");
+  if (!hp) {
+    COUNTER_INC(wp->unknown_mac);
+    if (f_debug)
+      log_event(EV_UNKNOWN_MAC, wp->id, NULL, ep, 0, 0, NULL, 0);
+    return 0;
   }
-  for (hp = hosts; hp; hp = hp->next) {
-    host_print(hp);
+
+  rc = daemon_verify(gp, hp, &secret);
+
+  PROBE2(daemon__verify, wp->id, rc);
+
+  if (rc < 0) {
+    COUNTER_INC(wp->bad_secret);
+    if (f_debug)
+      log_event(EV_BAD_SECRET, wp->id, hp->name, ep, 0, 0, NULL, 0);
+    return 0;
   }
 
-  putchar('\n');
-  if (!f_verbose) {
-    puts("; Groups:");
+  if (request_limit && ratelimit_check(request_limit, timespec2ns(&received), NULL) < 0) {
+    COUNTER_INC(wp->request_limited);
+    if (f_debug)
+      log_event(EV_REQUEST_LIMITED, wp->id, hp->name, ep, 0, 0, NULL, 0);
+    return 0;
   }
-  n = 0;
-  for (hgp = hostgroups; hgp; hgp = hgp->next) {
-    if (!f_verbose && strcmp(hgp->name, "all") == 0)
-      continue;
-    
-    if (hgp->hc == 0)
-      continue;
 
-    if (n++ > 0 && !f_verbose)
-      putchar('\n');
-    group_print(hgp);
+  if (f_verbose)
+    log_event(EV_REQUEST, wp->id, hp->name, ep, 0, 0, NULL, 0);
+  rc = forward_enqueue(forwarder, hp, NULL, &received, &no_delay);
+
+  PROBE3(daemon__enqueue, wp->id, hp->name, rc);
+
+  if (rc < 0) {
+    COUNTER_INC(wp->queue_full);
+    log_event(EV_QUEUE_FULL, wp->id, hp->name, ep, 0, 0, NULL, 0);
+  } else
+    COUNTER_INC(wp->queued);
+
+  return 0;
+}
+
+
+pthread_mutex_t daemon_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t daemon_cv = PTHREAD_COND_INITIALIZER;
+int daemon_errno = 0;
+
+
+void *
+worker_run(void *arg) {
+  WORKER *wp = (WORKER *) arg;
+  int i, rc;
+
+
+  if (wp->cpu >= 0 && thread_pin_cpu(pthread_self(), wp->cpu) < 0)
+    fprintf(stderr, "%s: Worker #%u: CPU %d: Unable to pin thread: %s\n",
+	    argv0, wp->id, wp->cpu, strerror(errno));
+
+  while (1) {
+    for (i = 0; i < wp->n; i++) {
+      wp->pfdv[i].events = POLLIN;
+      wp->pfdv[i].revents = 0;
+    }
+
+    do {
+      if (f_debug)
+	log_event(EV_WAITING, wp->id, NULL, NULL, wp->n, 0, NULL, 0);
+      rc = poll(&wp->pfdv[0], wp->n, -1);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+      break;
+
+    for (i = 0; i < wp->n; i++) {
+      if (wp->pfdv[i].revents & POLLIN) {
+	if (f_debug)
+	  log_event(EV_READABLE, wp->id, NULL, NULL, wp->pfdv[i].fd, 0, NULL, 0);
+
+	if (daemon_recv(wp, i) < 0)
+	  goto Fail;
+      }
+    }
   }
+
+ Fail:
+  pthread_mutex_lock(&daemon_mtx);
+  if (!daemon_errno)
+    daemon_errno = errno ? errno : EIO;
+  pthread_cond_signal(&daemon_cv);
+  pthread_mutex_unlock(&daemon_mtx);
+  return NULL;
 }
 
 
-int daemon_run(GATEWAY *gp) {
+/* Create the daemon pipeline and bind its sockets, without starting any threads for it */
+int
+daemon_setup(GATEWAY *proxies,
+	     unsigned int nw) {
+  GATEWAY *gp;
   TARGET *tp;
-  struct addrinfo *aip;
-  int n, i;
-  struct pollfd *pfdv;
-  struct ether_addr *ep;
+  WORKER *wv;
   HOST *hp;
+  size_t nh;
+  int n, rc, reuse;
+  unsigned int w;
 
 
   n = 0;
-  for (tp = gp->targets; tp; tp = tp->next)
-    ++n;
+  for (gp = proxies; gp; gp = gp->next)
+    for (tp = gp->targets; tp; tp = tp->next)
+      ++n;
 
   if (n == 0) {
     errno = ENOENT;
@@ -1526,129 +10756,156 @@ int daemon_run(GATEWAY *gp) {
     return -1;
   }
 
-  pfdv = malloc(n * sizeof(struct pollfd *));
-  if (!pfdv)
+  if (nw < 1)
+    nw = 1;
+
+  /* Index hosts by MAC for the workers, lease files add to it in place */
+  mac_index = mac_index_build(hosts);
+  if (!mac_index)
     return -1;
 
-  if (f_debug)
-    fprintf(stderr, "[Creating and binding daemon sockets]\n");
+  nh = 0;
+  for (hp = hosts; hp; hp = hp->next)
+    ++nh;
 
-  i = 0;
-  for (tp = gp->targets; tp; tp = tp->next) {
-    aip = tp->aip;
-    tp->fd = socket((aip->ai_family == AF_INET ? PF_INET : PF_INET6), SOCK_DGRAM, IPPROTO_UDP);
-    if (tp->fd < 0)
-      return -1;
+  forwarder = forward_create(proxy_queue, nh);
+  if (!forwarder)
+    return -1;
 
-    if (bind(tp->fd, aip->ai_addr, aip->ai_addrlen) < 0)
-      return -2;
+  if (proxy_source_limit) {
+    source_sketch = sketch_create(proxy_source_limit);
+    if (!source_sketch)
+      return -1;
+  }
 
-    pfdv[i++].fd = tp->fd;
+  if (proxy_request_limit) {
+    request_limit = ratelimit_create(proxy_request_limit);
+    if (!request_limit)
+      return -1;
   }
 
-  if (f_debug)
-    fprintf(stderr, "[Entering daemon main loop]\n");
-  
-  while (1) {
-    int i, rc;
+  bulk_replay = replay_create();
+  if (!bulk_replay)
+    return -1;
 
+  signal(SIGUSR1, sigusr1_handler);
 
-    for (i = 0; i < n; i++) {
-      pfdv[i].events = POLLIN;
-      pfdv[i].revents = 0;
-    }
+#ifndef SO_REUSEPORT
+  /* Workers sharing one blocking socket would all wake for every datagram */
+  if (nw > 1) {
+    if (f_debug)
+      fprintf(stderr, "[No SO_REUSEPORT - using a single worker instead of %u]\n", nw);
+    nw = 1;
+  }
+#endif
 
-    do {
-      if (f_debug)
-	fprintf(stderr, "(Waiting for messages on %u FDs)\n", n);
-      rc = poll(&pfdv[0], n, -1);
-    } while (rc < 0 && errno == EINTR);
+  /* Cache line aligned so the counters of different workers never share a line */
+  wv = calloc_aligned(nw, sizeof(WORKER));
+  if (!wv)
+    return -1;
 
-    if (rc < 0)
-      return -1;
+  workers = wv;
+  nworkers = nw;
 
-    for (i = 0; i < n; i++) {
-      ssize_t rlen;
-      struct sockaddr_storage peer;
-      socklen_t peer_len;
-      unsigned char buf[2048];
-      size_t secret_size;
+  reuse = 0;
+#ifdef SO_REUSEPORT
+  reuse = (nw > 1);
+#endif
 
+  if (f_debug)
+    fprintf(stderr, "[Creating and binding daemon sockets for %u worker%s]\n",
+	    nw, nw == 1 ? "" : "s");
+
+  for (w = 0; w < nw; w++) {
+    WORKER *wp = &wv[w];
+
+    wp->id = w;
+    wp->n = n;
+    wp->cpu = proxy_cpuc > 0 ? proxy_cpuv[w % proxy_cpuc] : -1;
+    wp->pfdv = calloc(n, sizeof(struct pollfd));
+    wp->lv = calloc(n, sizeof(GATEWAY *));
+    if (!wp->pfdv || !wp->lv)
+      return -1;
 
-      if (pfdv[i].revents & POLLIN) {
-	if (f_debug)
-	  fprintf(stderr, "[Data available on FD #%u]\n", pfdv[i].fd);
+    if ((rc = daemon_listen(wp, proxies, reuse)) < 0)
+      return rc;
+  }
 
-	peer_len = sizeof(peer);
-	while ((rlen = recvfrom(pfdv[i].fd, buf, sizeof(buf), 0, (struct sockaddr *) &peer, &peer_len)) < 0 && errno == EINTR)
-	  ;
-	
-	if (rlen < 0)
-	  return -1;
+  return 0;
+}
 
-	if (f_debug)
-	  fprintf(stderr, "[Message on FD #%u received from %s]\n", pfdv[i].fd, sockaddr2str((struct sockaddr *) &peer, peer_len));
+int
+daemon_run(GATEWAY *proxies,
+	   unsigned int nw) {
+  pthread_t tid;
+  METRICS *mp;
+  int rc;
+  unsigned int w;
 
-	if (f_debug)
-	  buf_print(stderr, buf, rlen);
 
-	if (rlen < WOL_BODY_SIZE) {
-	  if (f_debug)
-	    fprintf(stderr, "*** Invalid WoL message (too short: %d bytes)\n", (int) rlen);
-	  continue;
-	}
+  if ((rc = daemon_setup(proxies, nw)) < 0)
+    return rc;
 
-	for (i = 0; i < HEADER_SIZE && buf[i] == 0xFF; i++)
-	  ;
-	if (i < HEADER_SIZE) {
-	  if (f_debug)
-	    fprintf(stderr, "*** Invalid WoL message (invalid header)\n");
-	  continue;
-	}
+  rc = pthread_create(&forwarder->tid, NULL, forward_run, forwarder);
+  if (rc) {
+    errno = rc;
+    return -1;
+  }
 
-	for (i = 1; i < MAC_COPIES && memcmp(buf+HEADER_SIZE, buf+HEADER_SIZE+i*MAC_SIZE, MAC_SIZE) == 0; i++)
-	  ;
-	if (i < MAC_COPIES) {
-	  if (f_debug)
-	    fprintf(stderr, "*** Invalid WoL message (invalid MAC content copies)\n");
-	  continue;
-	}
+  if (proxy_metrics) {
+    mp = metrics_create(proxy_metrics);
+    if (!mp)
+      return -1;
+  }
+
+  if (control_path) {
+    control = control_create(control_path);
+    if (!control)
+      return -1;
+  }
 
-	secret_size = rlen-WOL_BODY_SIZE;
-	if (secret_size > 0) {
-	  SECRET secret;
+  if (schedules) {
+    scheduler = scheduler_create(schedules);
+    if (!scheduler)
+      return -1;
+  }
 
-	  secret.size = secret_size;
-	  memcpy(secret.buf, buf+WOL_BODY_SIZE, secret_size);
-	  
-	  if (f_debug)
-	    fprintf(stderr, "*** Received secret: %s\n", secret2str(&secret));
-	  
-	  if (secret_compare(&gp->secret, &secret) != 0) {
-	    if (f_debug)
-	      fprintf(stderr, "*** Invalid received secret: %s\n", secret2str(&secret));
-	    continue;
-	  }
-	}
+  if (leasefiles) {
+    rc = pthread_create(&tid, NULL, leases_run, NULL);
+    if (rc) {
+      errno = rc;
+      return -1;
+    }
+  }
 
-	ep = (struct ether_addr *) (buf+HEADER_SIZE);
-	for (hp = hosts; hp && memcmp(ep, &hp->mac, MAC_SIZE) != 0; hp = hp->next)
-	  ;
+  if (stats_path) {
+    signal(SIGHUP, sighup_handler);
+    rc = pthread_create(&tid, NULL, stats_run, NULL);
+    if (rc) {
+      errno = rc;
+      return -1;
+    }
+  }
 
-	if (!hp) {
-	  if (f_debug)
-	    fprintf(stderr, "*** Unknown MAC (no such host): %s\n", ether_ntoa(ep));
-	  continue;
-	}
+  if (f_debug)
+    fprintf(stderr, "[Entering daemon main loop]\n");
 
-	printf("Got WoL for host: %s (%s)\n", hp->name, ether_ntoa(ep));
-	if (send_wol_host(hp) < 0) {
-	  if (f_debug)
-	    fprintf(stderr, "*** Error send WoL message to %s (%s)\n", hp->name, ether_ntoa(ep));
-	}
-      }
+  for (w = 0; w < nworkers; w++) {
+    rc = pthread_create(&workers[w].tid, NULL, worker_run, &workers[w]);
+    if (rc) {
+      errno = rc;
+      return -1;
     }
   }
+
+  /* Wait for the first worker to fail */
+  pthread_mutex_lock(&daemon_mtx);
+  while (!daemon_errno)
+    pthread_cond_wait(&daemon_cv, &daemon_mtx);
+  errno = daemon_errno;
+  pthread_mutex_unlock(&daemon_mtx);
+
+  return -1;
 }
 
 
@@ -1701,9 +10958,10 @@ main(int argc,
 {
   char *home = getenv("HOME");
   char *home_config = strdupcat(home, "/", DEFAULT_USER_CONFIG, NULL);
+  const char *bad;
   char *cp;
   int i, j;
-  GATEWAY *gp, *proxy_gp = NULL;
+  GATEWAY *gp;
   TARGET *tp;
   HOSTGROUP *hgp;
 
@@ -1766,6 +11024,14 @@ main(int argc,
 	++f_foreground;
 	break;
 
+      case 'L':
+	++f_local;
+	break;
+
+      case 'w':
+	f_verify = !f_verify;
+	break;
+
       case 'a':
 	cp = argv[i]+j+1;
 	if (!*cp && i+1 < argc) {
@@ -1819,6 +11085,17 @@ main(int argc,
 	if (cp)
 	  f_copies = strdup(cp);
 	goto NextArg;
+
+      case 'o':
+	cp = argv[i]+j+1;
+	if (!*cp && i+1 < argc) {
+	  cp = argv[++i];
+	}
+	if (cp) {
+	  free(f_capture);
+	  f_capture = strdup(cp);
+	}
+	goto NextArg;
 		
       case 'H':
 	cp = argv[i]+j+1;
@@ -1862,12 +11139,8 @@ main(int argc,
 	if (!*cp && i+1 < argc) {
 	  cp = argv[++i];
 	}
-	if (cp) {
-	  if (!proxy_gp)
-	    proxy_gp = gw_create(NULL);
-	  gw_add_port(proxy_gp, cp);
+	if (cp)
 	  f_proxy_port = strdup(cp);
-	}
 	goto NextArg;
 
       case 'S':
@@ -1879,6 +11152,15 @@ main(int argc,
 	  f_proxy_secret = strdup(cp);
 	goto NextArg;
 
+      case 'W':
+	cp = argv[i]+j+1;
+	if (!*cp && i+1 < argc) {
+	  cp = argv[++i];
+	}
+	if (cp)
+	  f_proxy_workers = strdup(cp);
+	goto NextArg;
+
 
       case 'h':
 	printf("Usage: %s [<options>] [<host|group> [.. <host|group>]]\n",
@@ -1890,6 +11172,7 @@ main(int argc,
 	puts("  -i           Ignore errors");
 	puts("  -n           Toggle \"no\" send mode");
 	puts("  -e           Export configuration");
+	puts("  -L           Send locally even if a daemon control socket exists");
 	puts("  -f <path>    Configuration file");
 	puts("");
 	puts("  -g <name>    Destination gateway");
@@ -1900,12 +11183,15 @@ main(int argc,
 	printf("  -c <count>   Packet copies to send [%s]\n", DEFAULT_COPIES);
 	printf("  -H <hops>    Packet hops/TTL [%s]\n", DEFAULT_TTL ? DEFAULT_TTL : "default");
 	puts("  -s <secret>  Force WoL secret");
+	puts("  -w           Toggle verifying that hosts come up");
+	puts("  -o <path>    Write packets to a pcapng file instead of sending them");
 	puts("");
 	puts("  -D           Run as proxy daemon");
 	puts("  -F           Run proxy daemon in foreground");
 	printf("  -A <addr>    Proxy daemon listen address [%s]\n", DEFAULT_PROXY_ADDRESS);
 	printf("  -P <port>    Proxy daemon listen port [%s]\n", DEFAULT_PROXY_PORT);
 	puts("  -S <secret>  Proxy daemon secret");
+	printf("  -W <count>   Proxy daemon worker threads [%s]\n", DEFAULT_PROXY_WORKERS);
 	puts("");
 	puts("If no hosts/groups specified on the command line pwol will read them from stdin");
 	exit(0);
@@ -1923,27 +11209,73 @@ main(int argc,
   }
  EndArg:
 
+  if (group_resolve(&bad) < 0) {
+    fprintf(stderr, "%s: %s: Invalid group reference: %s\n", argv[0], bad,
+	    errno == ELOOP ? "Group includes itself" : errno == ENXIO ? "No such group" : strerror(errno));
+    exit(1);
+  }
+
+  /* Patterns need these, hosts added later are inserted as they come */
+  if (host_sort() < 0) {
+    fprintf(stderr, "%s: Unable to sort hosts: %s\n", argv[0], strerror(errno));
+    exit(1);
+  }
+
   if (f_verbose)
     header(stdout);
 
   if (f_daemon) {
-    proxy_gp = gw_create(NULL);
-    gw_add_address(proxy_gp, f_proxy_address ? f_proxy_address : DEFAULT_PROXY_ADDRESS);
-    gw_add_port(proxy_gp, f_proxy_port ? f_proxy_port : DEFAULT_PROXY_PORT);
-    if (f_proxy_secret)
-      gw_add_secret(proxy_gp, f_proxy_secret);
+    /* Command line listener replaces the configured ones */
+    if (!proxies || f_proxy_address || f_proxy_port) {
+      proxies = NULL;
+      gp = proxy_create(NULL);
+      if (f_proxy_address)
+	gw_add_address(gp, f_proxy_address);
+      if (f_proxy_port)
+	gw_add_port(gp, f_proxy_port);
+    }
+
+    for (gp = proxies; gp; gp = gp->next) {
+      if (f_proxy_secret)
+	gw_add_secret(gp, f_proxy_secret);
+
+      if (gw_resolve(gp, gp->address, gp->port, 1) < 0) {
+	fprintf(stderr, "%s: %s port %s: Invalid proxy address\n", argv[0], gp->address, gp->port);
+	exit(1);
+      }
+    }
+
+    if (f_proxy_workers &&
+	(sscanf(f_proxy_workers, "%u", &proxy_workers) != 1 ||
+	 proxy_workers < 1 || proxy_workers > MAX_PROXY_WORKERS)) {
+      fprintf(stderr, "%s: %s: Invalid number of workers\n", argv[0], f_proxy_workers);
+      exit(1);
+    }
+    if (!proxy_workers)
+      proxy_workers = atoi(DEFAULT_PROXY_WORKERS);
+    if (!proxy_queue)
+      proxy_queue = atoi(DEFAULT_PROXY_QUEUE);
   }
 
-  /* Open sockets for sending packets via the gateway targets */
-  for (gp = gateways; gp; gp = gp->next) {
-    struct addrinfo hints, *aip;
-    int rc;
-    char *addr, *port;
+  if (stats_path && stats_load(stats_path) < 0) {
+    fprintf(stderr, "%s: %s: Unable to load statistics: %s\n", argv[0], stats_path, strerror(errno));
+    exit(1);
+  }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = SOCK_DGRAM;
-    
-    aip = NULL;
+  /* Let a running daemon send them if it has a control socket, else do it here */
+  if (control_path && !f_daemon && !f_export && !f_local && !f_no && !f_address && !f_port && !f_capture &&
+      control_options(control_opts, sizeof(control_opts)) == 0 &&
+      (control_fd = control_connect(control_path)) >= 0) {
+    control_fp = fdopen(control_fd, "r");
+    if (!control_fp) {
+      fprintf(stderr, "%s: %s: fdopen: %s\n", argv[0], control_path, strerror(errno));
+      exit(1);
+    }
+  }
+
+  /* Open sockets for sending packets via the gateway targets (unless the daemon does it) */
+  for (gp = gateways; gp && !control_fp; gp = gp->next) {
+    char *addr, *port;
 
     addr = f_address;
     if (!addr)
@@ -1957,27 +11289,22 @@ main(int argc,
     if (!port)
       port = DEFAULT_PORT;
 
-    if ((rc = getaddrinfo(addr, port, &hints, &aip)) != 0) {
+    if (gw_resolve(gp, addr, port, 0) < 0) {
       fprintf(stderr, "%s: %s port %s: Invalid target\n", argv[0], addr, port);
       exit(1);
     }
 
-    for (; aip; aip = aip->ai_next) {
+    for (tp = gp->targets; tp; tp = tp->next) {
+      struct addrinfo *aip = tp->aip;
       int one = 1;
 
-      tp = target_add(&gp->targets, aip);
-      if (!tp) {
-	fprintf(stderr, "%s: %s port %s: Internal Error #3345921\n", argv[0], gp->address, gp->port);
-	exit(1);
-      }
-
-      tp->fd = socket((aip->ai_family == AF_INET ? PF_INET : PF_INET6), SOCK_DGRAM, IPPROTO_UDP);
+      tp->fd = transport->socket((aip->ai_family == AF_INET ? PF_INET : PF_INET6), SOCK_DGRAM, IPPROTO_UDP);
       if (tp->fd < 0) {
 	fprintf(stderr, "%s: %s port %s: socket: %s\n", argv[0], gp->address, gp->port, strerror(errno));
 	exit(1);
       }
 #ifdef SO_BROADCAST
-      (void) setsockopt(tp->fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+      (void) transport->setsockopt(tp->fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
 #endif
     }
   }
@@ -1992,11 +11319,33 @@ main(int argc,
     exit(0);
   }
 
-  if (f_daemon) {
-    if (!f_foreground)
-      become_daemon();
+  if (f_capture) {
+    if (f_daemon) {
+      fprintf(stderr, "%s: Capturing packets is not supported in daemon mode\n", argv[0]);
+      exit(1);
+    }
+    if (capture_open(f_capture) < 0) {
+      fprintf(stderr, "%s: %s: Unable to create capture file: %s\n", argv[0], f_capture, strerror(errno));
+      exit(1);
+    }
+  }
+
+  if (f_daemon && !f_foreground)
+    become_daemon();
+
+  if (!log_dest)
+    log_dest = (f_daemon && !f_foreground) ? "syslog" : "stderr";
+  if (!log_size)
+    log_size = atoi(DEFAULT_LOG_SIZE);
+
+  if (log_open(log_dest, log_size) < 0) {
+    fprintf(stderr, "%s: %s: Unable to start logging: %s\n", argv[0], log_dest, strerror(errno));
+    exit(1);
+  }
 
-    if (daemon_run(proxy_gp) < 0) {
+  if (f_daemon) {
+    if (daemon_run(proxies, proxy_workers) < 0) {
+      log_flush();
       fprintf(stderr, "%s: daemon_run: %s\n", argv[0], strerror(errno));
       exit(1);
     }
@@ -2006,14 +11355,20 @@ main(int argc,
 
   if (i < argc) {
     for (;i < argc; i++) {
-      if (send_wol(argv[i]) < 0 && !f_ignore) {
+      if (send_request(argv[i]) < 0 && !f_ignore) {
+	log_flush();
 	fprintf(stderr, "%s: %s: Sending WoL packet failed: %s\n",
 		argv[0], argv[i], strerror(errno));
 	exit(1);
       }
+
+      if (f_verify && !f_no && !capture && verify_add(argv[i]) < 0 && !f_ignore)
+	exit(1);
     }
   } else {
-    char lbuf[80], *lp, *lptr, *cp;
+    char lbuf[1024], *lp, *lptr, *cp;
+    int rc;
+    static INPUT in;
 
 	
     if (isatty(fileno(stdin))) {
@@ -2021,7 +11376,26 @@ main(int argc,
       fflush(stderr);
     }
 
-    while (fgets(lbuf, sizeof(lbuf), stdin)) {
+    in.fd = fileno(stdin);
+    for (;;) {
+      /* Full requests are sent by bulk_queue(), the rest once input pauses */
+      rc = input_line(&in, lbuf, sizeof(lbuf), bulk_pending() ? INPUT_IDLE : -1);
+      if (rc < 0 && errno == ETIMEDOUT) {
+	if (bulk_flush_all() < 0) {
+	  log_flush();
+	  fprintf(stderr, "%s: Sending bulk request failed: %s\n", argv[0], strerror(errno));
+	  if (!f_ignore)
+	    exit(1);
+	}
+	continue;
+      }
+      if (rc < 0) {
+	fprintf(stderr, "%s: Reading stdin: %s\n", argv[0], strerror(errno));
+	exit(1);
+      }
+      if (rc == 0)
+	break;
+
       trim(lbuf);
       if (!*lbuf)
 	continue;
@@ -2030,16 +11404,43 @@ main(int argc,
       while ((cp = strtok_r(lp, " \t", &lptr)) != NULL) {
 	lp = NULL;
 
-	if (send_wol(cp) < 0) {
+	if (send_request(cp) < 0) {
+	  log_flush();
 	  fprintf(stderr, "%s: %s: Sending WoL packet failed: %s\n",
 		  argv[0], cp, strerror(errno));
 	  
 	  if (!f_ignore)
 	    exit(1);
 	}
+
+	if (f_verify && !f_no && !capture && verify_add(cp) < 0 && !f_ignore)
+	  exit(1);
       }
     }
   }
 
+  if (bulk_flush_all() < 0 && !f_ignore) {
+    log_flush();
+    fprintf(stderr, "%s: Sending bulk request failed: %s\n", argv[0], strerror(errno));
+    exit(1);
+  }
+
+  if (capture_close() < 0) {
+    fprintf(stderr, "%s: %s: Writing capture file failed: %s\n", argv[0], f_capture, strerror(errno));
+    exit(1);
+  }
+  free(f_capture);
+  f_capture = NULL;
+
+  if (verifyc > 0) {
+    if (!verify_timeout.tv_sec && !verify_timeout.tv_nsec)
+      str2timespec(DEFAULT_VERIFY_TIMEOUT, &verify_timeout);
+    if (!verify_backoff.tv_sec && !verify_backoff.tv_nsec)
+      str2timespec(DEFAULT_VERIFY_BACKOFF, &verify_backoff);
+
+    if (verify_run() > 0 && !f_ignore)
+      exit(1);
+  }
+
   exit(0);
 }
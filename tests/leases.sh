@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Read the dhcpd, Kea and dnsmasq lease files in tests/leases into groups
+# and check the hosts found, that a MAC from the configuration wins over
+# a lease, and that an export keeps the leases lines instead of the hosts
+# read from them and reads back the same.
+#
+
+PWOL="${PWOL:-./pwol}"
+SRCDIR="${SRCDIR:-.}"
+LEASES="$SRCDIR/tests/leases"
+DIR="${TMPDIR:-/tmp}/pwol-check-leases.$$"
+
+mkdir "$DIR" || exit 1
+trap 'rm -fr "$DIR"' 0 1 2 15
+
+cat >"$DIR/leases.conf" <<END
+gateway sink address 127.0.0.1 port 19920
+host alpha mac 02:00:00:00:00:aa via sink
+host delta via sink
+[dhcpd]
+via sink
+leases $LEASES/dhcpd.leases
+[kea]
+via sink
+leases $LEASES/kea.csv
+[dnsmasq]
+via sink
+leases $LEASES/dnsmasq.leases
+END
+
+"$PWOL" -n -v -f "$DIR/leases.conf" dhcpd kea dnsmasq alpha delta 2>&1 | grep -v '^\[pwol' >"$DIR/leases.out"
+diff "$LEASES/expected" "$DIR/leases.out" || exit 1
+
+"$PWOL" -e -f "$DIR/leases.conf" >"$DIR/export.conf" 2>&1 || exit 1
+for f in dhcpd.leases kea.csv dnsmasq.leases; do
+  grep -q "^leases $LEASES/$f\$" "$DIR/export.conf" || exit 1
+done
+if grep -Eq '^host (bravo|charlie|echo)( |$)' "$DIR/export.conf"; then
+  exit 1
+fi
+
+"$PWOL" -n -v -f "$DIR/export.conf" dhcpd kea dnsmasq alpha delta 2>&1 | grep -v '^\[pwol' >"$DIR/export.out"
+diff "$LEASES/expected" "$DIR/export.out"
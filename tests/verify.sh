@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Check 'pwol -w' against local listeners: hosts whose TCP probe port
+# is closed are refused and so count as up, while hosts whose UDP probe
+# goes to a silent daemon never come up. There are more silent hosts
+# than probes that may be open at once.
+#
+
+PWOL="${PWOL:-./pwol}"
+PORT="${PORT:-19910}"
+DIR="${TMPDIR:-/tmp}/pwol-check-verify.$$"
+PID=""
+
+mkdir "$DIR" || exit 1
+trap 'test -n "$PID" && kill $PID 2>/dev/null; rm -fr "$DIR"' 0 1 2 15
+
+cat >"$DIR/silent.conf" <<END
+proxy silent address 127.0.0.1 port $PORT
+END
+
+"$PWOL" -D -F -f "$DIR/silent.conf" >"$DIR/silent.log" 2>&1 &
+PID=$!
+sleep 1
+
+{
+  echo "gateway sink address 127.0.0.1 port `expr $PORT + 1`"
+  echo "verify yes"
+  echo "verify-timeout 1500ms"
+  echo "verify-backoff 10s"
+  echo "[refused]"
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    echo "host r$i mac 02:00:00:00:00:`printf %02x $i` via sink address 127.0.0.1 probe tcp:`expr $PORT + 2`"
+  done
+  echo "[silent]"
+  i=1
+  while test $i -le 300; do
+    echo "host s$i mac 02:00:00:00:`printf '%02x:%02x' \`expr $i / 256\` \`expr $i % 256\``" \
+	 "via sink address 127.0.0.1 probe udp:$PORT"
+    i=`expr $i + 1`
+  done
+} >"$DIR/verify.conf"
+
+"$PWOL" -i -f "$DIR/verify.conf" refused silent >"$DIR/verify.out" 2>&1
+cat "$DIR/verify.out"
+
+grep -q '^310 hosts verified: 10 woken, 0 woken after resending, 300 failed' "$DIR/verify.out"